@@ -2,12 +2,336 @@
  * x86 or x64 ...
  *   cl -W4 -O2 j0.c
  *   cl -W4 -Zi j0.c
+ *
+ * elsewhere, replay sources only ...
+ *   cc -Wall -O2 -pthread j0.c -o j0
  */
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <winioctl.h>
+#if defined(_WIN32)
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+ #include <winioctl.h>
+ #include <io.h>
+#endif  /* _WIN32 */
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+/*++ sse2 is always there on x64, and on x86 when the compiler is told so ... */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+ #define _USN_SSE2
+ #include <emmintrin.h>
+#endif  /* __SSE2__ */
+
+/*++
+ * avx2 is not a given on either; what uses it is built for it alone and
+ * only called once the processor says it is there ...
+ */
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+ #define _USN_AVX2
+ #include <immintrin.h>
+ #if defined(_MSC_VER)
+  #include <intrin.h>
+  #define _USN_TARGET_AVX2
+ #else
+  #define _USN_TARGET_AVX2      __attribute__((target("avx2")))
+ #endif  /* _MSC_VER */
+#endif  /* _M_X64 */
+
+#if !defined(_WIN32)
+/*++
+ * everything below stands in for the parts of windows.h and winioctl.h this
+ * code uses, so the record pipeline builds off-windows against replay
+ * sources. layouts match the sdk (NTDDI_WIN8 and above) so captures move
+ * between systems unchanged ...
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define __in
+#define __out
+#define __inout
+#define __in_opt
+#define __out_opt
+#define __in_ecount(__n)
+#define __out_ecount(__n)
+#define __in_bcount(__n)
+#define __out_bcount(__n)
+
+#define DUMMYSTRUCTNAME
+#define UNREFERENCED_PARAMETER(__p)     ((void)(__p))
+#define RtlZeroMemory(__d, __n)         memset((__d), 0, (__n))
+#define RtlMoveMemory(__d, __s, __n)    memmove((__d), (__s), (__n))
+#define _snwprintf_s(__b, __cb, __cnt, ...) swprintf((__b), (__cb), __VA_ARGS__)
+#define _wcsicmp                        wcscasecmp
+#define _wcsnicmp                       wcsncasecmp
+#define _fseeki64                       fseeko
+#define _ftelli64                       ftello
+
+#define TRUE                            1
+#define FALSE                           0
+#define MAX_PATH                        260
+#define INVALID_HANDLE_VALUE            ((HANDLE)(intptr_t)-1)
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint16_t WCHAR;
+typedef long long LONGLONG;
+typedef unsigned long long DWORDLONG;
+typedef LONGLONG USN;
+typedef void* HANDLE;
+
+/*++ win32 error codes used by this code ... */
+#define ERROR_SUCCESS                   0L
+#define ERROR_FILE_NOT_FOUND            2L
+#define ERROR_ACCESS_DENIED             5L
+#define ERROR_NOT_ENOUGH_MEMORY         8L
+#define ERROR_BAD_FORMAT                11L
+#define ERROR_INVALID_DATA              13L
+#define ERROR_WRITE_FAULT               29L
+#define ERROR_READ_FAULT                30L
+#define ERROR_HANDLE_EOF                38L
+#define ERROR_NOT_SUPPORTED             50L
+#define ERROR_INVALID_PARAMETER         87L
+#define ERROR_CALL_NOT_IMPLEMENTED      120L
+#define ERROR_INSUFFICIENT_BUFFER       122L
+#define ERROR_NOT_FOUND                 1168L
+#define ERROR_JOURNAL_NOT_ACTIVE        1179L
+#define ERROR_JOURNAL_ENTRY_DELETED     1181L
+#define ERROR_IMPLEMENTATION_LIMIT      1292L
+
+/*++ per-thread last error, same contract as the win32 pair ... */
+static _Thread_local DWORD _usn_lasterror;
+#define GetLastError()                  (_usn_lasterror)
+#define SetLastError(__e)               (_usn_lasterror = (DWORD)(__e))
+
+typedef union _LARGE_INTEGER
+{
+    struct {
+        DWORD LowPart;
+        int32_t HighPart;
+    } DUMMYSTRUCTNAME;
+    struct {
+        DWORD LowPart;
+        int32_t HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _FILETIME
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME, *PFILETIME;
+
+typedef struct _SYSTEMTIME
+{
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME, *PSYSTEMTIME;
+
+typedef struct _FILE_ID_128
+{
+    BYTE Identifier[16];
+} FILE_ID_128, *PFILE_ID_128;
+
+#define USN_PAGE_SIZE                           0x1000
+
+#define USN_REASON_DATA_OVERWRITE               0x00000001
+#define USN_REASON_DATA_EXTEND                  0x00000002
+#define USN_REASON_DATA_TRUNCATION              0x00000004
+#define USN_REASON_NAMED_DATA_OVERWRITE         0x00000010
+#define USN_REASON_NAMED_DATA_EXTEND            0x00000020
+#define USN_REASON_NAMED_DATA_TRUNCATION        0x00000040
+#define USN_REASON_FILE_CREATE                  0x00000100
+#define USN_REASON_FILE_DELETE                  0x00000200
+#define USN_REASON_EA_CHANGE                    0x00000400
+#define USN_REASON_SECURITY_CHANGE              0x00000800
+#define USN_REASON_RENAME_OLD_NAME              0x00001000
+#define USN_REASON_RENAME_NEW_NAME              0x00002000
+#define USN_REASON_INDEXABLE_CHANGE             0x00004000
+#define USN_REASON_BASIC_INFO_CHANGE            0x00008000
+#define USN_REASON_HARD_LINK_CHANGE             0x00010000
+#define USN_REASON_COMPRESSION_CHANGE           0x00020000
+#define USN_REASON_ENCRYPTION_CHANGE            0x00040000
+#define USN_REASON_OBJECT_ID_CHANGE             0x00080000
+#define USN_REASON_REPARSE_POINT_CHANGE         0x00100000
+#define USN_REASON_STREAM_CHANGE                0x00200000
+#define USN_REASON_TRANSACTED_CHANGE            0x00400000
+#define USN_REASON_INTEGRITY_CHANGE             0x00800000
+#define USN_REASON_DESIRED_STORAGE_CLASS_CHANGE 0x01000000
+#define USN_REASON_CLOSE                        0x80000000
+
+#define FILE_ATTRIBUTE_READONLY                 0x00000001
+#define FILE_ATTRIBUTE_HIDDEN                   0x00000002
+#define FILE_ATTRIBUTE_SYSTEM                   0x00000004
+#define FILE_ATTRIBUTE_DIRECTORY                0x00000010
+#define FILE_ATTRIBUTE_ARCHIVE                  0x00000020
+#define FILE_ATTRIBUTE_NORMAL                   0x00000080
+#define FILE_ATTRIBUTE_TEMPORARY                0x00000100
+#define FILE_ATTRIBUTE_REPARSE_POINT            0x00000400
+#define FILE_ATTRIBUTE_COMPRESSED               0x00000800
+#define FILE_ATTRIBUTE_NOT_CONTENT_INDEXED      0x00002000
+#define FILE_ATTRIBUTE_ENCRYPTED                0x00004000
+
+typedef struct
+{
+    DWORDLONG UsnJournalID;
+    USN FirstUsn;
+    USN NextUsn;
+    USN LowestValidUsn;
+    USN MaxUsn;
+    DWORDLONG MaximumSize;
+    DWORDLONG AllocationDelta;
+    WORD MinSupportedMajorVersion;
+    WORD MaxSupportedMajorVersion;
+} USN_JOURNAL_DATA_V1, *PUSN_JOURNAL_DATA_V1;
+
+typedef USN_JOURNAL_DATA_V1 USN_JOURNAL_DATA, *PUSN_JOURNAL_DATA;
+
+typedef struct
+{
+    USN StartUsn;
+    DWORD ReasonMask;
+    DWORD ReturnOnlyOnClose;
+    DWORDLONG Timeout;
+    DWORDLONG BytesToWaitFor;
+    DWORDLONG UsnJournalID;
+    WORD MinMajorVersion;
+    WORD MaxMajorVersion;
+} READ_USN_JOURNAL_DATA_V1, *PREAD_USN_JOURNAL_DATA_V1;
+
+typedef READ_USN_JOURNAL_DATA_V1 READ_USN_JOURNAL_DATA, *PREAD_USN_JOURNAL_DATA;
+
+typedef struct
+{
+    DWORD RecordLength;
+    WORD MajorVersion;
+    WORD MinorVersion;
+} USN_RECORD_COMMON_HEADER, *PUSN_RECORD_COMMON_HEADER;
+
+typedef struct
+{
+    DWORD RecordLength;
+    WORD MajorVersion;
+    WORD MinorVersion;
+    DWORDLONG FileReferenceNumber;
+    DWORDLONG ParentFileReferenceNumber;
+    USN Usn;
+    LARGE_INTEGER TimeStamp;
+    DWORD Reason;
+    DWORD SourceInfo;
+    DWORD SecurityId;
+    DWORD FileAttributes;
+    WORD FileNameLength;
+    WORD FileNameOffset;
+    WCHAR FileName[1];
+} USN_RECORD_V2, *PUSN_RECORD_V2;
+
+typedef struct
+{
+    DWORD RecordLength;
+    WORD MajorVersion;
+    WORD MinorVersion;
+    FILE_ID_128 FileReferenceNumber;
+    FILE_ID_128 ParentFileReferenceNumber;
+    USN Usn;
+    LARGE_INTEGER TimeStamp;
+    DWORD Reason;
+    DWORD SourceInfo;
+    DWORD SecurityId;
+    DWORD FileAttributes;
+    WORD FileNameLength;
+    WORD FileNameOffset;
+    WCHAR FileName[1];
+} USN_RECORD_V3, *PUSN_RECORD_V3;
+
+typedef struct
+{
+    LONGLONG Offset;
+    LONGLONG Length;
+} USN_RECORD_EXTENT, *PUSN_RECORD_EXTENT;
+
+typedef struct
+{
+    USN_RECORD_COMMON_HEADER Header;
+    FILE_ID_128 FileReferenceNumber;
+    FILE_ID_128 ParentFileReferenceNumber;
+    USN Usn;
+    DWORD Reason;
+    DWORD SourceInfo;
+    DWORD RemainingExtents;
+    WORD NumberOfExtents;
+    WORD ExtentSize;
+    USN_RECORD_EXTENT Extents[1];
+} USN_RECORD_V4, *PUSN_RECORD_V4;
+
+typedef union
+{
+    USN_RECORD_COMMON_HEADER Header;
+    USN_RECORD_V2 V2;
+    USN_RECORD_V3 V3;
+    USN_RECORD_V4 V4;
+} USN_RECORD_UNION, *PUSN_RECORD_UNION;
+
+/*++
+ * nt time to calendar time. the c-runtime handles the calendar once the
+ * time is moved to the unix epoch (11644473600 seconds after 1601) ...
+ */
+static BOOL
+FileTimeToSystemTime (
+    const FILETIME* pFileTime,
+    SYSTEMTIME* pSystemTime )
+{
+    struct tm tm = {0};
+    LONGLONG ticks;
+    time_t seconds;
+
+    ticks = (LONGLONG)(((DWORDLONG)pFileTime->dwHighDateTime << 32) | pFileTime->dwLowDateTime);
+    if(ticks < 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    seconds = (time_t)((ticks / 10000000LL) - 11644473600LL);
+    if(gmtime_r(&seconds, &tm) == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pSystemTime->wYear         = (WORD)(tm.tm_year + 1900);
+    pSystemTime->wMonth        = (WORD)(tm.tm_mon + 1);
+    pSystemTime->wDayOfWeek    = (WORD)tm.tm_wday;
+    pSystemTime->wDay          = (WORD)tm.tm_mday;
+    pSystemTime->wHour         = (WORD)tm.tm_hour;
+    pSystemTime->wMinute       = (WORD)tm.tm_min;
+    pSystemTime->wSecond       = (WORD)tm.tm_sec;
+    pSystemTime->wMilliseconds = (WORD)((ticks / 10000LL) % 1000LL);
+    return TRUE;
+}
+#endif  /* !_WIN32 */
 
 /*++
  * dummystruct below resolves to 'nothing' and at -W4 produces:
@@ -48,9 +372,62 @@ typedef union _ULARGE_INTEGER128
  #define _countof(__arr)        (sizeof((__arr)) / sizeof((__arr)[0]))
 #endif  /* _countof */
 
-/*++ buffer size for usn records ... */
+/*++ thread-local storage, msvc spelling or c11 ... */
+#if defined(_MSC_VER)
+ #define _USN_THREAD_LOCAL      __declspec(thread)
+#else
+ #define _USN_THREAD_LOCAL      _Thread_local
+#endif  /* _MSC_VER */
+
+/*++ a body that is only there to be copied into its callers ... */
+#if defined(_MSC_VER)
+ #define _USN_FORCEINLINE       static __forceinline
+#else
+ #define _USN_FORCEINLINE       static inline __attribute__((always_inline))
+#endif  /* _MSC_VER */
+
+/*++ chunk size of synthetic replays, and of the benchmarks' reads ... */
 #define _USN_BUFFER_SIZE        (USN_PAGE_SIZE * 2)
 
+/*++ -buffer, bytes asked of the journal a read (default 64KB, 16MB at most) ... */
+#define _USN_READ_SIZE          (64 * 1024)
+#define _USN_READ_SIZE_MAX      (16 * 1024 * 1024)
+
+/*++ -pipeline; buffers in flight by default, given more than one processor ... */
+#define _USN_PIPELINE_AUTO      0xFFFFFFFF
+#define _USN_PIPELINE_DEPTH     8
+
+/*++ -volume, journals merged at most ... */
+#define _USN_VOLUME_MAX         32
+
+/*++ a v2 record widened to v3, with room for the longest ntfs name ... */
+#define _USN_RECORD_V3_STORAGE  ((sizeof(USN_RECORD_V3) + (256 * sizeof(WCHAR))) / sizeof(uint64_t))
+
+/*++ record output goes out a megabyte at a time ... */
+#define _USN_OUTPUT_SIZE        (1024 * 1024)
+
+/*++ -time, how timestamps are shown ... */
+#define _USN_TIME_NT            0       /* 2020-06-06 23:50:43.744 */
+#define _USN_TIME_ISO           1       /* 2020-06-06T23:50:43.7441234Z */
+#define _USN_TIME_UNIX          2       /* 1591487443.744 */
+
+/*++ -format, how records are shown ... */
+#define _USN_FORMAT_TEXT        0       /* the >>>>>>>> block */
+#define _USN_FORMAT_JSON        1       /* one json object a line */
+#define _USN_FORMAT_CSV         2       /* a header and then a row a record */
+#define _USN_FORMAT_QUIET       3       /* -q, to the walk routines */
+
+#define _USN_CSV_HEADER         "usn,timestamp,frn,parent_frn,parent_path,name,reason,attributes"
+#define _USN_CSV_MOVE_HEADER    ",old_usn,old_parent_frn,old_parent_path,old_name"
+
+/*++ what names and paths are escaped for ... */
+#define _USN_ESCAPE_NONE        0
+#define _USN_ESCAPE_JSON        1
+#define _USN_ESCAPE_CSV         2
+
+/*++ a string literal into an output buffer, its length known up front ... */
+#define _USN_EMIT(__out, __literal) _UsnpEmitText((__out), (__literal), sizeof(__literal) - 1)
+
 /*++ 
  * mask for 'all' change reasons. the current reasons mask is X'81FFFF77, but
  * existing examples use X'FFFFFFFF for 'all' ...
@@ -58,818 +435,17305 @@ typedef union _ULARGE_INTEGER128
 #define _USN_REASON_ALL         0xFFFFFFFF
 
 /*++
+ * nt root directory file-reference-number (mft index 5, sequence 5). the
+ * synthetic generator hangs its directory tree off of this ...
  */
-BOOL
-_UsnpReadJournalData (
-    __in wchar_t* pathname,
-    __in DWORD Reason
-    );
+#define _USN_ROOT_FRN           0x0005000000000005ULL
+
+/*++ replay file, 'USNR' then version ... */
+#define _USN_REPLAY_SIGNATURE   0x524E5355
+#define _USN_PATH_NONE          0xFFFFFFFF
+#define _USN_COALESCE_NONE      0xFFFFFFFF
+#define _USN_CHECKPOINT_SIGNATURE 0x434E5355   /* 'USNC' */
+#define _USN_CHECKPOINT_VERSION 1
+#define _USN_SNAPSHOT_SIGNATURE 0x544E5355     /* 'USNT' */
+#define _USN_SNAPSHOT_VERSION   1
+#define _USN_REPLAY_VERSION     1
+
+/*++ archive file, 'USNA' then version, and its blocks, 'USNB' ... */
+#define _USN_ARCHIVE_SIGNATURE  0x414E5355
+#define _USN_ARCHIVE_BLOCK_SIGNATURE 0x424E5355
+#define _USN_ARCHIVE_VERSION    1
+#define _USN_ARCHIVE_RECORDS    4096    /* records a block, at most */
+#define _USN_ARCHIVE_RAW        0x00    /* record kinds; raw, or the major version */
+#define _USN_ARCHIVE_EXTRA      0x80    /* minor version, source info, security id follow */
+
+/*++ the length of a v2 or v3 record whose name follows the fixed part ... */
+#define _USN_ARCHIVE_LENGTH(__offset, __cbname) ((DWORD)(((__offset) + (__cbname) + 7) & ~(size_t)7))
+
+/*++ signed deltas as varints; small either side of zero stays small ... */
+#define _USN_ZIGZAG(__v)        ((((uint64_t)(__v)) << 1) ^ (uint64_t)(((int64_t)(__v)) >> 63))
+#define _USN_UNZIGZAG(__u)      ((int64_t)(((__u) >> 1) ^ (0 - ((__u) & 1))))
+
+/*++ history index beside an archive, 'USNH' then version, and its two tables ... */
+#define _USN_HISTORY_SIGNATURE  0x484E5355
+#define _USN_HISTORY_VERSION    1
+#define _USN_HISTORY_FILES      0       /* by the record's frn */
+#define _USN_HISTORY_CHILDREN   1       /* by its parent's */
 
 /*++
+ * READ_USN_JOURNAL_DATA.Timeout is handed to the wait as a relative nt
+ * time, 100ns units, whatever the documentation says about seconds ...
  */
-BOOL
-_UsnpReadJournalRecords (
-    __in HANDLE osh,
-    __in USN_JOURNAL_DATA* pJournalData,
-    __in USN StartUsn,
-    __in DWORD Reason
-    );
+#define _USN_TIMEOUT_PER_MS     10000
+
+/*++ a follower saves its checkpoint at most once a second (microseconds) ... */
+#define _USN_CHECKPOINT_INTERVAL 1000000
 
 /*++
+ * a journal source answers the two questions the reader asks of a volume:
+ * what is the journal (FSCTL_QUERY_USN_JOURNAL) and what are the records
+ * starting at some usn (FSCTL_READ_USN_JOURNAL). Read fills the buffer the
+ * same way the ioctl does, the next usn followed by whole records ...
  */
-BOOL
-_UsnpFormatJournalData (
-    __in wchar_t* pathname,
-    __in PUSN_JOURNAL_DATA pJournalData
-    );
+typedef struct _USN_SOURCE USN_SOURCE, *PUSN_SOURCE;
 
 /*++
+ * a read that may still be going on. the read data and the buffer are
+ * the kernel's until the read is completed ...
  */
-BOOL
-_UsnpFormatRecord (
-    __in HANDLE osh,
-    __in USN_RECORD_UNION* pUsn 
+typedef struct _USN_READ
+{
+    READ_USN_JOURNAL_DATA ReadData;
+    uint64_t* Buffer;
+    DWORD Size;
+    DWORD Bytes;
+    DWORD Status;               /* a read done at submit, how it went */
+#if defined(_WIN32)
+    OVERLAPPED Overlapped;
+#endif  /* _WIN32 */
+} USN_READ, *PUSN_READ;
+
+typedef BOOL (*PUSN_SOURCE_QUERY) (
+    __in PUSN_SOURCE pSource,
+    __out PUSN_JOURNAL_DATA pJournalData
     );
 
-/*++
- */
-BOOL
-_UsnpFormatRecordV2 (
-    __in HANDLE osh,
-    __in USN_RECORD_V2* pRecord 
+typedef BOOL (*PUSN_SOURCE_READ) (
+    __in PUSN_SOURCE pSource,
+    __in PREAD_USN_JOURNAL_DATA pReadData,
+    __out_bcount(cbbuffer) void* buffer,
+    __in DWORD cbbuffer,
+    __out DWORD* pbytes
     );
 
-/*++
- */
-BOOL
-_UsnpFormatRecordV3 (
-    __in HANDLE osh,
-    __in USN_RECORD_V3* pRecord 
+typedef void (*PUSN_SOURCE_CLOSE) (
+    __in PUSN_SOURCE pSource
     );
 
-/*++
- */
-BOOL
-_UsnpFormatRecordV4 (
-    __in HANDLE osh,
-    __in USN_RECORD_V4* pRecord 
+/*++ start a read, and wait for it; sources without them read at submit ... */
+typedef BOOL (*PUSN_SOURCE_SUBMIT) (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead
     );
 
-/*++
- */
-BOOL
-_UsnpIsEqualFileReference (
-    FILE_ID_128* pfid1,
-    FILE_ID_128* pfid2
+typedef BOOL (*PUSN_SOURCE_COMPLETE) (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead
     );
 
+struct _USN_SOURCE
+{
+    wchar_t Name[MAX_PATH];     /* \\.\C: or the replay filename */
+    HANDLE Volume;              /* volume handle for by-id opens, or NULL */
+    HANDLE Async;               /* the volume again, for overlapped reads, or NULL */
+    PUSN_SOURCE_QUERY Query;
+    PUSN_SOURCE_READ Read;
+    PUSN_SOURCE_CLOSE Close;
+    PUSN_SOURCE_SUBMIT Submit;  /* optional */
+    PUSN_SOURCE_COMPLETE Complete;
+    void* Context;
+};
+
 /*++
+ * replay file layout; the header, then any number of chunks, each a DWORD
+ * length followed by exactly what FSCTL_READ_USN_JOURNAL returned (the next
+ * usn and then records) ...
  */
-BOOL
-_UsnpGetFileIdFromFilename (
-    __in wchar_t* filename,
-    __out FILE_ID_128* pFileId 
+typedef struct _USN_REPLAY_HEADER
+{
+    DWORD Signature;
+    DWORD Version;
+    DWORD HeaderSize;
+    DWORD Reserved;
+    USN_JOURNAL_DATA JournalData;
+} USN_REPLAY_HEADER, *PUSN_REPLAY_HEADER;
+
+typedef struct _USN_REPLAY_CHUNK
+{
+    LONGLONG Offset;            /* file offset of the chunk data */
+    DWORD Length;               /* bytes, including the leading usn */
+    USN FirstUsn;               /* usn of the first record, if any */
+    USN NextUsn;                /* the leading usn */
+} USN_REPLAY_CHUNK, *PUSN_REPLAY_CHUNK;
+
+typedef struct _USN_REPLAY
+{
+    FILE* fp;
+    USN_REPLAY_HEADER Header;
+    PUSN_REPLAY_CHUNK Chunks;
+    size_t ChunkCount;
+    size_t Loaded;              /* chunk in Buffer, or ChunkCount */
+    uint8_t* Buffer;
+    DWORD BufferSize;
+} USN_REPLAY, *PUSN_REPLAY;
+
+/*++ a -checkpoint file; where the last run left off ... */
+typedef struct _USN_CHECKPOINT
+{
+    DWORD Signature;
+    DWORD Version;
+    DWORDLONG UsnJournalID;
+    USN NextUsn;                /* the next usn to read */
+} USN_CHECKPOINT, *PUSN_CHECKPOINT;
+
+/*++ synthetic journal generator state ... */
+typedef BOOL (*PUSN_SYNTH_SINK) (
+    __in void* Context,
+    __in USN_RECORD_V3* pRecord
     );
 
+typedef struct _USN_SYNTH_FILE
+{
+    uint64_t Frn;
+    uint64_t Parent;
+    DWORD Name;
+} USN_SYNTH_FILE, *PUSN_SYNTH_FILE;
+
+typedef struct _USN_SYNTH
+{
+    uint64_t Seed;
+    USN Usn;
+    LONGLONG TimeStamp;
+    uint64_t NextIndex;
+    uint64_t* Directories;
+    DWORD DirectoryCount;
+    PUSN_SYNTH_FILE Files;
+    DWORD FileCount;
+    DWORD FileLimit;
+    PUSN_SYNTH_SINK Sink;
+    void* Context;
+} USN_SYNTH, *PUSN_SYNTH;
+
+/*++ synthetic records kept in memory, packed in usn order ... */
+typedef struct _USN_SYNTH_MEMORY
+{
+    uint8_t* Records;           /* packed v3 records */
+    size_t Length;
+    size_t Capacity;
+    size_t* Offsets;            /* where each record starts in Records */
+    uint64_t Count;
+    uint64_t OffsetCapacity;
+} USN_SYNTH_MEMORY, *PUSN_SYNTH_MEMORY;
+
 /*++
+ * a simulated live journal; synthetic records made up front and let out
+ * on a clock, Rate a second, the way a busy volume would write them ...
  */
-BOOL
-_UsnpGetFileIdFromHandle (
-    __in HANDLE osh,
-    __out FILE_ID_128* pFileId 
-    );
+typedef struct _USN_LIVE
+{
+    USN_SYNTH_MEMORY Memory;
+    USN EndUsn;                 /* usn past the last record */
+    uint64_t Rate;              /* records a second */
+    uint64_t Start;             /* _UsnpQueryClock at open */
+    LONGLONG StartTime;         /* the same moment, as nt time */
+} USN_LIVE, *PUSN_LIVE;
+
+/*++ counters for -stats ... */
+typedef struct _USN_STATS
+{
+    uint64_t Records;
+    uint64_t Bytes;
+    uint64_t Reads;
+    uint64_t Skipped;           /* zero-filled bytes passed over */
+    uint64_t Corrupt;           /* pages abandoned on a bad record */
+    uint64_t Unwatched;         /* records outside the watch list */
+    uint64_t Filtered;          /* records -filter turned away */
+    uint64_t Prefiltered;       /* records the batch stage passed over */
+    uint64_t Coalesced;         /* records folded into a later one */
+    uint64_t CoalesceEvicted;   /* files let out before their close */
+    uint64_t CoalescePending;   /* still open at the end */
+    uint64_t Moves;             /* renames shown as one move */
+    uint64_t MovesUnpaired;     /* old names with no new name after */
+    uint64_t PathHits;          /* parent paths answered by the cache */
+    uint64_t PathNegative;      /* of those, remembered failures */
+    uint64_t PathMisses;
+    uint64_t PathEvicted;
+    uint64_t TreeHits;          /* parent paths built from the journal */
+    uint64_t TreeMisses;
+    uint64_t TreeEntries;
+    uint64_t TreeBytes;
+    uint64_t LatencyRecords;    /* records timed from change to delivery */
+    uint64_t LatencyTotal;      /* microseconds */
+    uint64_t LatencyMax;
+    uint64_t PipeSlots;         /* -pipeline; buffers going round */
+    uint64_t PipeWaits[3];      /* the reader, walk and writer finding nothing to do */
+    USN FirstUsn;               /* first and last record seen */
+    USN LastUsn;
+    uint64_t Start;
+} USN_STATS, *PUSN_STATS;
+
+/*++ a view of a whole file, read-only or copy-on-write ... */
+typedef struct _USN_MAPPING
+{
+    uint8_t* Base;
+    uint64_t Size;
+#if defined(_WIN32)
+    HANDLE File;
+    HANDLE Section;
+#endif  /* _WIN32 */
+} USN_MAPPING, *PUSN_MAPPING;
 
 /*++
+ * path resolution for parent frns. a resolver answers one frn at a time;
+ * the volume resolver opens by id, and a cache or the journal's own tree
+ * can sit in front of another resolver. Observe sees every record before
+ * it is shown, and is NULL for a resolver that keeps nothing ...
  */
-BOOL
-_UsnpGetFilenameFromFileId (
-    __in HANDLE osh,
+typedef struct _USN_RESOLVER USN_RESOLVER, *PUSN_RESOLVER;
+
+typedef BOOL (*PUSN_RESOLVER_LOOKUP) (
+    __in PUSN_RESOLVER pResolver,
     __in FILE_ID_128* pFileId,
     __out_ecount(cchbuffer) wchar_t* buffer,
-    __in size_t cchbuffer 
+    __in size_t cchbuffer
     );
 
-/*++
- */
-BOOL
-_UsnpFormatTimestamp (
-    __in LARGE_INTEGER* pTimeStamp,
-    __out_ecount(cchbuffer) wchar_t* buffer,
-    __in size_t cchbuffer 
+typedef void (*PUSN_RESOLVER_OBSERVE) (
+    __in PUSN_RESOLVER pResolver,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+typedef void (*PUSN_RESOLVER_CLOSE) (
+    __in PUSN_RESOLVER pResolver
     );
 
+struct _USN_RESOLVER
+{
+    PUSN_RESOLVER_LOOKUP Lookup;
+    PUSN_RESOLVER_OBSERVE Observe;
+    PUSN_RESOLVER_CLOSE Close;
+    void* Context;
+};
+
 /*++
+ * a cached path, or a failed lookup remembered until Expires. entries are
+ * chained off the buckets by index ...
  */
-BOOL
-_UsnpDump (
-    __in_ecount(buffersize) uint8_t* buffer,
-    __in int buffersize 
-    );
+typedef struct _USN_PATH_ENTRY
+{
+    FILE_ID_128 FileId;
+    wchar_t* Path;
+    DWORD Next;                 /* next in the bucket, or _USN_PATH_NONE */
+    DWORD Error;                /* non-zero for a negative entry */
+    uint64_t Expires;           /* negative entries, in clock microseconds */
+    BOOL Used;
+    BOOL Referenced;            /* second chance for the clock hand */
+} USN_PATH_ENTRY, *PUSN_PATH_ENTRY;
+
+typedef struct _USN_PATH_CACHE
+{
+    PUSN_RESOLVER pLower;
+    PUSN_PATH_ENTRY Entries;
+    DWORD Capacity;
+    DWORD Count;                /* entries handed out so far */
+    DWORD Hand;
+    DWORD* Buckets;
+    DWORD BucketMask;
+    uint64_t NegativeTtl;       /* microseconds */
+    PUSN_STATS pStats;
+} USN_PATH_CACHE, *PUSN_PATH_CACHE;
 
 /*++
+ * the directory tree as the journal tells it; frn to (parent, name) for
+ * every directory the records mention, files being nobody's parent.
+ * entries live in an open-addressed table
+ * and names are interned in one arena, a length WCHAR and then the name,
+ * so the many "bin"s and "obj"s are kept once ...
  */
-int
-__wtoi (
-    __in const wchar_t* str 
-    );
+#define _USN_TREE_USED          0x0001
+#define _USN_TREE_DIRECTORY     0x0002
+#define _USN_TREE_DELETED       0x0004
+#define _USN_TREE_DEPTH         256
 
-/*++ ... */
-int g_dump = 0;
-int g_count = 23;
-wchar_t* argv0 = NULL;
+typedef struct _USN_TREE_ENTRY
+{
+    FILE_ID_128 FileId;
+    FILE_ID_128 Parent;
+    DWORD Name;                 /* arena offset of the interned name */
+    DWORD Flags;                /* _USN_TREE_* */
+} USN_TREE_ENTRY, *PUSN_TREE_ENTRY;
 
-wchar_t* monitor_dir = L"C:\\Temp\\ar\\bld\\nt-usn";
-FILE_ID_128 monitor_fid = {0};
+typedef struct _USN_TREE
+{
+    PUSN_RESOLVER pLower;       /* for what the journal never named */
+    PUSN_TREE_ENTRY Entries;
+    DWORD Capacity;             /* a power of two */
+    DWORD Count;
+    WCHAR* Names;
+    DWORD NamesLength;          /* in WCHARs */
+    DWORD NamesCapacity;
+    DWORD* Interned;            /* arena offsets, open-addressed */
+    DWORD InternedCapacity;     /* a power of two */
+    DWORD InternedCount;
+    DWORD Moves;                /* directories added or moved */
+    USN_MAPPING Snapshot;       /* tables still in a -snapshot mapping */
+    PUSN_STATS pStats;
+} USN_TREE, *PUSN_TREE;
 
 /*++
+ * a -snapshot file; the tree's three tables written out as they are in
+ * memory, page-aligned, so loading is a copy-on-write mapping and nothing
+ * more. it holds every record before ValidUsn in journal UsnJournalID ...
  */
-int 
-wmain ( 
-    int argc, 
-    wchar_t** argv )
+typedef struct _USN_TREE_SNAPSHOT
 {
-    DWORD reason;
-    wchar_t* pathname = NULL;
+    DWORD Signature;
+    DWORD Version;
+    DWORD HeaderSize;
+    DWORD Reserved;
+    DWORDLONG UsnJournalID;
+    USN ValidUsn;               /* the next usn to read */
+    DWORD Capacity;
+    DWORD Count;
+    DWORD NamesLength;
+    DWORD InternedCapacity;
+    DWORD InternedCount;
+    DWORD Reserved2;
+    uint64_t EntriesOffset;
+    uint64_t NamesOffset;
+    uint64_t InternedOffset;
+} USN_TREE_SNAPSHOT, *PUSN_TREE_SNAPSHOT;
 
-    UNREFERENCED_PARAMETER(argc);
+/*++
+ * -watch; the directories of interest, in an open-addressed set of frns.
+ * a subtree root answers for everything below it, worked out by walking
+ * up the tree, and the answers are remembered in Memo until a directory
+ * moves ...
+ */
+#define _USN_WATCH_USED         0x0001
+#define _USN_WATCH_CHILDREN     0x0002  /* records directly in it */
+#define _USN_WATCH_SUBTREE      0x0004  /* and everything below */
+#define _USN_WATCH_OUTSIDE      0x0008  /* memo; under no watched subtree */
+#define _USN_WATCH_MEMO         0x10000
 
-    /*++ ... */
-    pathname = L"C:\\";
-    reason = USN_REASON_CLOSE;
+typedef struct _USN_WATCH_ENTRY
+{
+    FILE_ID_128 FileId;
+    DWORD Flags;                /* _USN_WATCH_* */
+} USN_WATCH_ENTRY, *PUSN_WATCH_ENTRY;
 
-    argv0 = *argv++;
-    while(*argv)
-    {
-        wchar_t* arg = *argv++;
-        if(arg[0] == L'-')
-        {
-            if( (arg[1] == L'd') || (arg[1] == L'D'))
-            {
-                g_dump++;
-            }
-        }
-        else
-        {
-            g_count = __wtoi(arg);
-        }
-    }
+typedef struct _USN_WATCH
+{
+    PUSN_WATCH_ENTRY Entries;
+    DWORD Capacity;             /* a power of two */
+    DWORD Count;
+    DWORD Subtrees;
+    PUSN_WATCH_ENTRY Memo;
+    DWORD MemoCount;
+    DWORD Moves;                /* the tree's, as of the memo */
+    PUSN_TREE pTree;            /* for ancestors, when there are subtrees */
+} USN_WATCH, *PUSN_WATCH;
 
-    if( _UsnpGetFileIdFromFilename(monitor_dir, &monitor_fid) == FALSE)
-    {
-        fwprintf(stderr, L"get directory fid failed, status(%X)\n", GetLastError());
-    }
-    else
-    {
-        LARGE_INTEGER128 st_fid = {0};
-        RtlMoveMemory(&st_fid, &monitor_fid, sizeof(LARGE_INTEGER128));
-        fwprintf(stdout, L"monitor fid %016I64X - %s\n", st_fid.LowPart, monitor_dir);
-    }
+/*++
+ * -coalesce; an open file's reasons so far and its latest record, held
+ * until the close. a slot holds any v2 or v3 record with a name NTFS
+ * allows ...
+ */
+#define _USN_COALESCE_SLOT      ((sizeof(USN_RECORD_V3) + (255 * sizeof(WCHAR)) + 7) & ~7)
 
-    fwprintf(stdout, L"dump(%s), count(%d)\n", ((g_dump) ? L"on" : L"off"), g_count);
+typedef struct _USN_COALESCE_ENTRY
+{
+    FILE_ID_128 FileId;
+    DWORD Reasons;              /* every reason since the open */
+    DWORD Next;                 /* next in the bucket, or next free */
+    DWORD Older;                /* in the order files were opened */
+    DWORD Newer;
+    LONGLONG Opened;            /* nt time of the first record held */
+    USN FirstUsn;               /* of the first record held */
+    uint64_t Record[_USN_COALESCE_SLOT / sizeof(uint64_t)];
+} USN_COALESCE_ENTRY, *PUSN_COALESCE_ENTRY;
 
-    /*++
-     */
+typedef struct _USN_COALESCE
+{
+    PUSN_COALESCE_ENTRY Entries;
+    DWORD Capacity;
+    DWORD Count;                /* files open */
+    DWORD Free;
+    DWORD* Buckets;
+    DWORD BucketMask;
+    DWORD Oldest;               /* open longest, or _USN_COALESCE_NONE */
+    DWORD Newest;
+    LONGLONG MaxAge;            /* nt time, 0 for as long as it takes */
+    PUSN_STATS pStats;
+} USN_COALESCE, *PUSN_COALESCE;
 
-    if( _UsnpReadJournalData(pathname, reason) == FALSE)
-    {
-        long w32error = GetLastError();
-        if(w32error == ERROR_JOURNAL_NOT_ACTIVE)
-        {
-            fwprintf(stderr, L"journal has not been activated\n");
-        }
-        else
-        {
-            fwprintf(stderr, L"get journal data failed, status(%X)\n", w32error);
-        }
-    }
-    return 0;
-}
+/*++ -moves; an old name record waiting on its new name ... */
+typedef struct _USN_MOVES
+{
+    BOOL Held;
+    FILE_ID_128 FileId;
+    uint64_t Old[_USN_COALESCE_SLOT / sizeof(uint64_t)];
+    uint64_t New[_USN_COALESCE_SLOT / sizeof(uint64_t)];
+    PUSN_STATS pStats;
+} USN_MOVES, *PUSN_MOVES;
 
 /*++
+ * -filter; an expression compiled to a flat program of tests, each on one
+ * field and each saying where to go next when it holds and when not, so
+ * and, or and not are only jumps. the cheap fixed fields are tested ahead
+ * of frn sets, and names last ...
  */
-BOOL
-_UsnpReadJournalData (
-    __in wchar_t* pathname,
-    __in DWORD Reason )
+#define _USN_FILTER_ACCEPT      0xFFFFFFFF
+#define _USN_FILTER_REJECT      0xFFFFFFFE
+#define _USN_FILTER_NONE        0xFFFFFFFF
+#define _USN_FILTER_NODES       256
+
+#define _USN_FILTER_REASON      1       /* any of the bits in Low */
+#define _USN_FILTER_ATTRIBUTES  2
+#define _USN_FILTER_USN         3       /* Low <= usn <= High */
+#define _USN_FILTER_TIME        4
+#define _USN_FILTER_FRN         5       /* in set Index */
+#define _USN_FILTER_PARENT      6
+#define _USN_FILTER_NAME        7       /* matches pattern Index */
+#define _USN_FILTER_AND         8       /* the parse only */
+#define _USN_FILTER_OR          9
+#define _USN_FILTER_NOT         10
+
+typedef struct _USN_FILTER_OP
 {
-    BOOL status;
-    DWORD bytes = 0;
-    HANDLE osh;
-    wchar_t diskname[8] = L"\\\\.\\?:";
-    USN_JOURNAL_DATA JournalData = {0};
+    DWORD Code;                 /* _USN_FILTER_REASON ... _NAME */
+    DWORD True;                 /* the next test, or accept or reject */
+    DWORD False;
+    DWORD Index;                /* set or pattern */
+    LONGLONG Low;               /* a mask, or a range */
+    LONGLONG High;
+} USN_FILTER_OP, *PUSN_FILTER_OP;
 
-    if(pathname == NULL)
-    {
+typedef struct _USN_FILTER_SET
+{
+    FILE_ID_128* Ids;           /* sorted */
+    DWORD Count;
+} USN_FILTER_SET, *PUSN_FILTER_SET;
+
+/*++
+ * a name test's globs, matched in one pass over a name and folded as it
+ * goes, so the cost is the name's length and not the number of globs.
+ * exact names and *lit hang off a trie walked back from the end of the
+ * name, lit* off one walked from the start, and *lit* off an aho-corasick
+ * automaton. any other glob goes in the automaton by its longest literal
+ * run, and is only matched in full where that run turns up ...
+ */
+#define _USN_NAME_NONE          0xFFFFFFFF
+#define _USN_NAME_CONTAINS      0       /* the roots */
+#define _USN_NAME_PREFIX        1
+#define _USN_NAME_SUFFIX        2
+
+#define _USN_NAME_MATCH         0x0001  /* a glob ends here, nothing more to check */
+#define _USN_NAME_WHOLE         0x0002  /* an exact name ends here */
+
+typedef struct _USN_NAME_NODE
+{
+    DWORD Fail;                 /* the automaton only */
+    DWORD Output;               /* nearest on the fail chain with globs to check */
+    DWORD Verify;               /* first glob to check here */
+    DWORD Child;                /* the trie, for the build */
+    DWORD Sibling;
+    DWORD Flags;                /* _USN_NAME_* */
+    WCHAR Char;
+} USN_NAME_NODE, *PUSN_NAME_NODE;
+
+typedef struct _USN_NAME_EDGE
+{
+    DWORD From;                 /* _USN_NAME_NONE when free */
+    DWORD To;
+    WCHAR Char;
+} USN_NAME_EDGE, *PUSN_NAME_EDGE;
+
+typedef struct _USN_NAME_GLOB
+{
+    const WCHAR* Text;          /* in the pattern's text */
+    DWORD Length;
+    DWORD Next;                 /* the next to check at the same node */
+} USN_NAME_GLOB, *PUSN_NAME_GLOB;
+
+typedef struct _USN_NAMESET
+{
+    PUSN_NAME_NODE Nodes;
+    DWORD NodeCount;
+    PUSN_NAME_EDGE Edges;       /* (node, char) to node, open addressed */
+    DWORD EdgeMask;
+    PUSN_NAME_GLOB Globs;
+    DWORD GlobCount;
+    DWORD Anywhere;             /* globs with no literal run, checked on every name */
+    DWORD Roots;                /* 1 << each root in use */
+    BOOL All;                   /* a bare *; everything matches */
+} USN_NAMESET, *PUSN_NAMESET;
+
+typedef struct _USN_FILTER_PATTERN
+{
+    WCHAR* Text;                /* globs between |, folded to upper case */
+    DWORD Length;
+    USN_NAMESET Set;
+} USN_FILTER_PATTERN, *PUSN_FILTER_PATTERN;
+
+typedef struct _USN_FILTER
+{
+    PUSN_FILTER_OP Ops;
+    DWORD Count;
+    DWORD Start;                /* the first test */
+    PUSN_FILTER_SET Sets;
+    DWORD SetCount;
+    PUSN_FILTER_PATTERN Patterns;
+    DWORD PatternCount;
+    const wchar_t* Error;       /* where the expression stopped making sense */
+} USN_FILTER, *PUSN_FILTER;
+
+/*++ the expression as parsed, before its tests are put in order ... */
+typedef struct _USN_FILTER_NODE
+{
+    DWORD Child;                /* first operand, or _USN_FILTER_NONE */
+    DWORD Sibling;              /* the next operand of the same and or or */
+    DWORD Cost;                 /* fixed fields 1, frn sets 2, names 4 */
+    USN_FILTER_OP Test;         /* Code is the kind of node */
+} USN_FILTER_NODE, *PUSN_FILTER_NODE;
+
+typedef struct _USN_FILTER_PARSER
+{
+    const wchar_t* Next;
+    PUSN_FILTER pFilter;
+    USN_FILTER_NODE Nodes[_USN_FILTER_NODES];
+    DWORD NodeCount;
+} USN_FILTER_PARSER, *PUSN_FILTER_PARSER;
+
+/*++
+ * the batch stage ahead of the walk; what every record has to have to be
+ * worth walking, from the reason mask, the filter and the watch list. a
+ * buffer's records are indexed, their reason, attributes and parent read
+ * from fixed offsets a vector at a time, and each gets a bit. records
+ * without one are never looked at again, so directories are kept when the
+ * resolver follows the journal ...
+ */
+#define _USN_BATCH_RECORDS      256     /* indexed at a time */
+#define _USN_BATCH_PARENTS      8       /* compared in the batch; more is left to the walk */
+
+#define _USN_SIMD_AUTO          0
+#define _USN_SIMD_OFF           1
+#define _USN_SIMD_SCALAR        2
+#define _USN_SIMD_SSE2          3
+#define _USN_SIMD_AVX2          4
+
+typedef struct _USN_PREFILTER
+{
+    DWORD ReasonMask;           /* any of, or _USN_REASON_ALL */
+    DWORD AttributeMask;        /* any of, or 0 for no test */
+    DWORD KeepAttributes;       /* kept whatever else, for the resolver */
+    DWORD ParentCount;          /* 0 for no test */
+    FILE_ID_128 Parents[_USN_BATCH_PARENTS];
+} USN_PREFILTER, *PUSN_PREFILTER;
+
+/*++ records in the buffer as indexed; a 0 version is kept untested ... */
+typedef struct _USN_BATCH
+{
+    uint32_t Offsets[_USN_BATCH_RECORDS];
+    uint32_t Versions[_USN_BATCH_RECORDS];
+    uint8_t Selected[_USN_BATCH_RECORDS / 8];
+    DWORD Count;                /* a multiple of 8; the rest is padding */
+} USN_BATCH, *PUSN_BATCH;
+
+typedef void (*PUSN_SELECT_ROUTINE) (
+    __in PUSN_PREFILTER pPrefilter,
+    __in const uint8_t* buffer,
+    __inout PUSN_BATCH pBatch
+    );
+
+/*++
+ * -ranges; the byte ranges v4 records say changed, by file. a file's
+ * ranges are kept in order, none overlapping or touching another, so a
+ * backup can copy just those. the files are an open-addressed table on
+ * the frn hash, kept under half full; a slot with no Ranges is free ...
+ */
+typedef struct _USN_RANGE
+{
+    LONGLONG Start;
+    LONGLONG End;               /* past the last byte */
+} USN_RANGE, *PUSN_RANGE;
+
+typedef struct _USN_RANGE_FILE
+{
+    FILE_ID_128 FileId;
+    PUSN_RANGE Ranges;
+    DWORD Count;
+    DWORD Capacity;
+} USN_RANGE_FILE, *PUSN_RANGE_FILE;
+
+typedef struct _USN_RANGES
+{
+    PUSN_RANGE_FILE Files;
+    DWORD Capacity;             /* slots, a power of two */
+    DWORD Count;                /* files */
+    uint64_t Extents;           /* extents merged in */
+} USN_RANGES, *PUSN_RANGES;
+
+/*++
+ * state for one walk over record buffers. a volume or replay read has its
+ * records packed and already filtered by the ioctl; a $J page ends with
+ * zero fill and has not been filtered at all ...
+ */
+typedef struct _USN_WALK
+{
+    PUSN_RESOLVER pResolver;    /* parent paths, or NULL */
+    PUSN_WATCH pWatch;          /* directories of interest, or NULL */
+    PUSN_FILTER pFilter;        /* -filter, or NULL */
+    PUSN_COALESCE pCoalesce;    /* records held until their close, or NULL */
+    PUSN_MOVES pMoves;          /* renames paired into moves, or NULL */
+    PUSN_PREFILTER pPrefilter;  /* the batch stage, or NULL */
+    PUSN_RANGES pRanges;        /* v4 extents gathered by file, or NULL */
+    DWORD ReasonMask;           /* _USN_REASON_ALL when already filtered */
+    BOOL Padded;                /* a zero record length ends the buffer */
+    BOOL Generic;               /* no walk routines; each record on its own */
+    BOOL Done;                  /* the record count was reached */
+    BOOL Stopped;               /* NextUsn is set */
+    USN ShowUsn;                /* records before it only go to the resolver */
+    USN NextUsn;                /* once Done, where a later run resumes */
+    int Count;
+    int Limit;                  /* records to show, 0 for all */
+    LONGLONG Now;               /* nt time the buffer was read, or 0 */
+    PUSN_STATS pStats;
+} USN_WALK, *PUSN_WALK;
+
+/*++ a buffer's records of one version, walked for one output; the bytes walked ... */
+typedef size_t (*PUSN_WALK_ROUTINE) (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes
+    );
+
+/*++
+ * record output. text is built in a buffer as utf-8, hex and decimal
+ * fields straight from tables, and goes to the file in one write when the
+ * buffer fills or is flushed. a worker's buffer has no file and grows
+ * until its slice is merged, in order, into the console's ...
+ */
+typedef struct _USN_OUTPUT
+{
+    uint8_t* Buffer;
+    size_t Length;
+    size_t Capacity;
+    int File;                   /* descriptor written on flush, or -1 */
+    BOOL Failed;                /* an allocation or a write failed */
+} USN_OUTPUT, *PUSN_OUTPUT;
+
+/*++ the last timestamp's text down to the second, kept per thread ... */
+typedef struct _USN_TIME_CACHE
+{
+    LONGLONG Second;            /* the second Prefix is for, or -1 */
+    DWORD Format;
+    size_t Length;
+    uint8_t Prefix[32];
+} USN_TIME_CACHE, *PUSN_TIME_CACHE;
+
+/*++
+ * archive file layout; a header, then blocks of up to _USN_ARCHIVE_RECORDS
+ * records. each block stands alone: its reason and attribute words and its
+ * names are kept once in dictionaries up front, and the records after them
+ * are varints, each field against the record before it. the block header
+ * carries the usn and time range, so a reader can pass a block over without
+ * decoding it ...
+ */
+typedef struct _USN_ARCHIVE_HEADER
+{
+    DWORD Signature;
+    DWORD Version;
+    DWORD HeaderSize;
+    DWORD BlockSize;            /* sizeof(USN_ARCHIVE_BLOCK) */
+    USN_JOURNAL_DATA JournalData;
+} USN_ARCHIVE_HEADER, *PUSN_ARCHIVE_HEADER;
+
+typedef struct _USN_ARCHIVE_BLOCK
+{
+    DWORD Signature;
+    DWORD Length;               /* bytes after this header */
+    DWORD Records;
+    DWORD Words;                /* reason and attribute dictionary entries */
+    DWORD Names;                /* name dictionary entries */
+    DWORD Reasons;              /* every reason in the block, or'ed */
+    USN FirstUsn;
+    USN LastUsn;
+    USN NextUsn;                /* where a read past this block starts */
+    LONGLONG FirstTime;         /* earliest and latest timestamps, 0 for none */
+    LONGLONG LastTime;
+} USN_ARCHIVE_BLOCK, *PUSN_ARCHIVE_BLOCK;
+
+/*++ the fields each record is coded against; reset at each block ... */
+typedef struct _USN_ARCHIVE_STATE
+{
+    USN Usn;
+    DWORD Length;
+    LONGLONG TimeStamp;
+    ULARGE_INTEGER128 Frn;
+    ULARGE_INTEGER128 Parent;
+} USN_ARCHIVE_STATE, *PUSN_ARCHIVE_STATE;
+
+/*++ -archive; records as they are read, coded a block at a time ... */
+typedef struct _USN_ARCHIVE_WRITER
+{
+    FILE* fp;
+    wchar_t Name[MAX_PATH];
+    USN_JOURNAL_DATA JournalData;
+    USN_ARCHIVE_BLOCK Block;    /* the block being filled */
+    USN_ARCHIVE_STATE State;
+    USN_OUTPUT Records;         /* its records, coded */
+    USN_OUTPUT Names;           /* its names, utf-16 as in the records */
+    USN_OUTPUT Dictionary;      /* both dictionaries, coded as it goes out */
+    DWORD Words[_USN_ARCHIVE_RECORDS * 2];
+    DWORD WordSlots[_USN_ARCHIVE_RECORDS * 4];   /* index + 1, or 0 */
+    DWORD NameOffsets[_USN_ARCHIVE_RECORDS];     /* in WCHARs */
+    WORD NameLengths[_USN_ARCHIVE_RECORDS];
+    DWORD NameSlots[_USN_ARCHIVE_RECORDS * 2];   /* index + 1, or 0 */
+    USN NextUsn;                /* leading usn of the last buffer */
+    USN LastUsn;                /* the last record in the file */
+    BOOL Archived;              /* LastUsn is good */
+    uint64_t TotalRecords;
+    uint64_t TotalBlocks;
+    uint64_t RecordBytes;       /* the records as read */
+    uint64_t BlockBytes;        /* and as written */
+} USN_ARCHIVE_WRITER, *PUSN_ARCHIVE_WRITER;
+
+/*++ a block as the reader found it ... */
+typedef struct _USN_ARCHIVE_INDEX
+{
+    LONGLONG Offset;            /* file offset of what follows the header */
+    USN_ARCHIVE_BLOCK Block;
+} USN_ARCHIVE_INDEX, *PUSN_ARCHIVE_INDEX;
+
+/*++
+ * -history index, beside the archive as <archive>.idx. a table of frns
+ * and one of parent frns, each sorted, each key pointing at a run of the
+ * offsets of the blocks holding it. the file is mapped and searched where
+ * it lies; it is good for the archive as it was when built ...
+ */
+typedef struct _USN_HISTORY_TABLE
+{
+    uint64_t Keys;
+    uint64_t KeysOffset;
+    uint64_t Postings;
+    uint64_t PostingsOffset;
+} USN_HISTORY_TABLE, *PUSN_HISTORY_TABLE;
+
+typedef struct _USN_HISTORY_HEADER
+{
+    DWORD Signature;
+    DWORD Version;
+    DWORD HeaderSize;
+    DWORD Reserved;
+    DWORDLONG UsnJournalID;
+    uint64_t ArchiveSize;       /* the archive as it was indexed */
+    uint64_t Blocks;
+    USN_HISTORY_TABLE Tables[2];    /* _USN_HISTORY_FILES, _USN_HISTORY_CHILDREN */
+} USN_HISTORY_HEADER, *PUSN_HISTORY_HEADER;
+
+typedef struct _USN_HISTORY_KEY
+{
+    ULARGE_INTEGER128 Frn;
+    DWORD First;                /* its postings; block header offsets */
+    DWORD Count;
+} USN_HISTORY_KEY, *PUSN_HISTORY_KEY;
+
+/*++ a frn and a block it is in, while the index is built ... */
+typedef struct _USN_HISTORY_PAIR
+{
+    ULARGE_INTEGER128 Frn;
+    uint64_t Offset;
+} USN_HISTORY_PAIR, *PUSN_HISTORY_PAIR;
+
+/*++ -history and -children; the records of one file, of one directory's files ... */
+typedef struct _USN_HISTORY_QUERY
+{
+    DWORD Match;                /* (1 << table) for each asked */
+    FILE_ID_128 File;
+    FILE_ID_128 Parent;
+} USN_HISTORY_QUERY, *PUSN_HISTORY_QUERY;
+
+/*++ -fromarchive; one block decoded at a time, back into records ... */
+typedef struct _USN_ARCHIVE
+{
+    FILE* fp;
+    USN_ARCHIVE_HEADER Header;
+    PUSN_ARCHIVE_INDEX Blocks;
+    size_t BlockCount;
+    size_t Loaded;              /* block in Memory, or BlockCount */
+    uint8_t* Payload;
+    DWORD PayloadSize;
+    DWORD* Words;
+    DWORD WordCapacity;
+    WCHAR* NameText;
+    DWORD* NameOffsets;
+    WORD* NameLengths;
+    DWORD NameCapacity;
+    size_t TextCapacity;        /* WCHARs */
+    USN_SYNTH_MEMORY Memory;    /* the block's records */
+    USN_HISTORY_QUERY Query;    /* only these records, from only these blocks */
+    LONGLONG Size;              /* of the file */
+    uint64_t Decoded;           /* blocks decoded */
+    uint64_t Record[(sizeof(USN_RECORD_V3) + 0x10000) / sizeof(uint64_t)];
+} USN_ARCHIVE, *PUSN_ARCHIVE;
+
+/*++ threads, locks and condition variables; just what the workers need ... */
+typedef DWORD (*PUSN_THREAD_ROUTINE) (
+    __in void* Context
+    );
+
+typedef struct _USN_THREAD
+{
+#if defined(_WIN32)
+    HANDLE Handle;
+#else
+    pthread_t Thread;
+#endif  /* _WIN32 */
+    PUSN_THREAD_ROUTINE Routine;
+    void* Context;
+} USN_THREAD, *PUSN_THREAD;
+
+#if defined(_WIN32)
+typedef SRWLOCK USN_LOCK, *PUSN_LOCK;
+typedef CONDITION_VARIABLE USN_COND, *PUSN_COND;
+#else
+typedef pthread_mutex_t USN_LOCK, *PUSN_LOCK;
+typedef pthread_cond_t USN_COND, *PUSN_COND;
+#endif  /* _WIN32 */
+
+/*++
+ * a page-aligned slice of a mapped journal. records never straddle a page
+ * so slices decode independently; output and counters stay with the slice
+ * until it is merged back in usn order ...
+ */
+typedef struct _USN_SCAN_CHUNK
+{
+    uint64_t Begin;
+    uint64_t End;
+    USN_OUTPUT Output;
+    USN_STATS Stats;
+    BOOL Done;
+} USN_SCAN_CHUNK, *PUSN_SCAN_CHUNK;
+
+typedef struct _USN_SCAN
+{
+    PUSN_MAPPING pMapping;
+    DWORD ReasonMask;
+    PUSN_SCAN_CHUNK Chunks;
+    size_t ChunkCount;
+    size_t Next;                /* next chunk to hand out */
+    size_t Merged;              /* chunks written out so far */
+    size_t Window;              /* chunks allowed ahead of the merge */
+    BOOL Stop;                  /* the count was reached, or a write failed */
+    USN_STATS Totals;           /* counters kept per worker, not per chunk */
+    USN_LOCK Lock;
+    USN_COND Changed;
+} USN_SCAN, *PUSN_SCAN;
+
+/*++
+ * -pipeline; a journal buffer and the text made from it, owned by one
+ * stage at a time and handed on whole ...
+ */
+typedef struct _USN_PIPE_SLOT
+{
+    uint64_t* Buffer;
+    DWORD Bytes;                /* read into Buffer, next usn first */
+    DWORD Status;               /* why the reader stopped, or ERROR_SUCCESS */
+    BOOL Last;                  /* nothing follows this one */
+    USN_OUTPUT Output;          /* the walk's text, for the writer */
+} USN_PIPE_SLOT, *PUSN_PIPE_SLOT;
+
+/*++
+ * a single-producer single-consumer ring of slots. only the producer moves
+ * Tail and only the consumer moves Head, so neither takes a lock; they sit
+ * on their own cache lines. a ring has room for every slot there is, so a
+ * put never waits ...
+ */
+typedef struct _USN_RING
+{
+    volatile int64_t Tail;      /* slots put; the producer's */
+    uint8_t Spacer0[64 - sizeof(int64_t)];
+    int64_t Head;               /* slots taken; the consumer's */
+    uint8_t Spacer1[64 - sizeof(int64_t)];
+    PUSN_PIPE_SLOT* Entries;
+    size_t Mask;
+} USN_RING, *PUSN_RING;
+
+/*++
+ * slots go round from the reader to the walk to the writer and back to
+ * the reader. once a stage falls behind, the slots pile up in front of it
+ * and the others wait; Depth is how far ahead they can get ...
+ */
+typedef struct _USN_PIPELINE
+{
+    PUSN_SOURCE pSource;
+    READ_USN_JOURNAL_DATA ReadData;     /* the reader's */
+    PUSN_PIPE_SLOT Slots;
+    DWORD Depth;
+    DWORD BufferSize;
+    USN_RING Free;              /* writer to reader */
+    USN_RING Filled;            /* reader to walk */
+    USN_RING Written;           /* walk to writer */
+    volatile int64_t Stop;      /* the walk is done with the journal */
+    volatile int64_t Failed;    /* the writer could not write */
+    PUSN_STATS pStats;          /* the reader's counters */
+} USN_PIPELINE, *PUSN_PIPELINE;
+
+/*++
+ * -volume; one of several journals read at once and merged on time. each
+ * has its own reader thread, filling slots as a pipeline's does, and its
+ * own walk, resolver and checkpoint; Record is the next one to merge ...
+ */
+typedef struct _USN_VOLUME
+{
+    wchar_t* Name;              /* as given; X: or a replay file */
+    wchar_t Tag[MAX_PATH];      /* shown with each record */
+    wchar_t Checkpoint[MAX_PATH];
+    USN_SOURCE Source;
+    USN_JOURNAL_DATA JournalData;
+    USN StartUsn;               /* where a later run would resume */
+    USN_PIPELINE Pipe;
+    USN_THREAD Reader;
+    USN_STATS Stats;            /* the reader's */
+    USN_WALK Walk;
+    USN_RESOLVER Resolver;
+    USN_COALESCE Coalesce;
+    USN_MOVES Moves;
+    PUSN_PIPE_SLOT pSlot;       /* being merged */
+    DWORD Offset;               /* of Record in it */
+    PUSN_RECORD_COMMON_HEADER pRecord;
+    LONGLONG TimeStamp;         /* Record's, or the last before it for v4 */
+    DWORD Status;               /* why it stopped, or ERROR_SUCCESS */
+    BOOL Started;               /* its reader is running */
+    BOOL Ended;                 /* its reader has sent the last slot */
+} USN_VOLUME, *PUSN_VOLUME;
+
+/*++
+ */
+BOOL
+_UsnpReadJournalData (
+    __in wchar_t* pathname,
+    __in DWORD Reason
+    );
+
+/*++
+ */
+BOOL
+_UsnpReadVolumes (
+    __in wchar_t** Names,
+    __in DWORD Count,
+    __in DWORD Reason
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenVolume (
+    __inout PUSN_VOLUME pVolume,
+    __in DWORD Reason
+    );
+
+/*++
+ */
+void
+_UsnpCloseVolume (
+    __inout PUSN_VOLUME pVolume,
+    __in BOOL Save
+    );
+
+/*++
+ */
+BOOL
+_UsnpNextVolumeRecord (
+    __inout PUSN_VOLUME pVolume
+    );
+
+/*++
+ */
+void
+_UsnpSiftVolumes (
+    __in PUSN_VOLUME pVolumes,
+    __inout DWORD* heap,
+    __in DWORD count,
+    __in DWORD index
+    );
+
+/*++
+ */
+BOOL
+_UsnpReadJournalRecords (
+    __in PUSN_SOURCE pSource,
+    __in USN_JOURNAL_DATA* pJournalData,
+    __in USN StartUsn,
+    __in DWORD Reason,
+    __out_opt USN* pNextUsn
+    );
+
+/*++
+ */
+BOOL
+_UsnpWalkRecords (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes
+    );
+
+/*++
+ */
+void
+_UsnpWalkRecord (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+BOOL
+_UsnpWalkBatch (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes
+    );
+
+/*++
+ */
+PUSN_WALK_ROUTINE
+_UsnpGetWalkRoutine (
+    __in DWORD version
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenPrefilter (
+    __inout PUSN_WALK pWalk,
+    __out PUSN_PREFILTER pPrefilter
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsPreselected (
+    __in PUSN_PREFILTER pPrefilter,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+PUSN_SELECT_ROUTINE
+_UsnpGetSelectRoutine (
+    __in DWORD simd
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsAvx2Present (
+    void
+    );
+
+/*++
+ */
+void
+_UsnpSelectScalar (
+    __in PUSN_PREFILTER pPrefilter,
+    __in const uint8_t* buffer,
+    __inout PUSN_BATCH pBatch
+    );
+
+#if defined(_USN_SSE2)
+/*++
+ */
+void
+_UsnpSelectSse2 (
+    __in PUSN_PREFILTER pPrefilter,
+    __in const uint8_t* buffer,
+    __inout PUSN_BATCH pBatch
+    );
+
+/*++
+ */
+__m128i
+_UsnpGatherSse2 (
+    __in const uint8_t* buffer,
+    __in __m128i at,
+    __in __m128i valid
+    );
+#endif  /* _USN_SSE2 */
+
+#if defined(_USN_AVX2)
+/*++
+ */
+_USN_TARGET_AVX2
+void
+_UsnpSelectAvx2 (
+    __in PUSN_PREFILTER pPrefilter,
+    __in const uint8_t* buffer,
+    __inout PUSN_BATCH pBatch
+    );
+#endif  /* _USN_AVX2 */
+
+/*++
+ */
+BOOL
+_UsnpPairRename (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+void
+_UsnpWalkFlush (
+    __in PUSN_WALK pWalk
+    );
+
+/*++
+ */
+void
+_UsnpStopWalk (
+    __inout PUSN_WALK pWalk,
+    __in USN Usn
+    );
+
+/*++
+ */
+void
+_UsnpWalkEmit (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __in_opt PUSN_RECORD_COMMON_HEADER pOld
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenCoalesce (
+    __out PUSN_COALESCE pCoalesce,
+    __in DWORD Capacity,
+    __in DWORD MaxAge,
+    __in PUSN_STATS pStats
+    );
+
+/*++
+ */
+void
+_UsnpCloseCoalesce (
+    __in PUSN_COALESCE pCoalesce
+    );
+
+/*++
+ */
+DWORD
+_UsnpCoalesceFind (
+    __in PUSN_COALESCE pCoalesce,
+    __in FILE_ID_128* pFileId,
+    __out DWORD* pBucket
+    );
+
+/*++
+ */
+void
+_UsnpCoalesceEmit (
+    __in PUSN_WALK pWalk,
+    __in DWORD Index
+    );
+
+/*++
+ */
+void
+_UsnpCoalesceRecord (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+void
+_UsnpCoalesceFlush (
+    __in PUSN_WALK pWalk
+    );
+
+/*++
+ */
+BOOL
+_UsnpReadJournalFile (
+    __in wchar_t* filename,
+    __in DWORD Reason
+    );
+
+/*++
+ */
+BOOL
+_UsnpWalkJournalStream (
+    __in PUSN_WALK pWalk,
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Begin,
+    __in uint64_t End
+    );
+
+/*++
+ */
+BOOL
+_UsnpScanJournalParallel (
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Begin,
+    __in uint64_t End,
+    __in DWORD Reason,
+    __in DWORD Threads
+    );
+
+/*++
+ */
+DWORD
+_UsnpScanWorker (
+    __in void* Context
+    );
+
+/*++
+ */
+BOOL
+_UsnpRunPipeline (
+    __in PUSN_SOURCE pSource,
+    __inout PREAD_USN_JOURNAL_DATA pReadData,
+    __in PUSN_WALK pWalk,
+    __in DWORD Depth
+    );
+
+/*++
+ */
+BOOL
+_UsnpReadOverlapped (
+    __in PUSN_SOURCE pSource,
+    __inout PREAD_USN_JOURNAL_DATA pReadData,
+    __in PUSN_WALK pWalk
+    );
+
+/*++
+ */
+BOOL
+_UsnpSubmitRead (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead
+    );
+
+/*++
+ */
+BOOL
+_UsnpCompleteRead (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenPipeline (
+    __out PUSN_PIPELINE pPipe,
+    __in PUSN_SOURCE pSource,
+    __in PREAD_USN_JOURNAL_DATA pReadData,
+    __in DWORD Depth
+    );
+
+/*++
+ */
+void
+_UsnpClosePipeline (
+    __inout PUSN_PIPELINE pPipe
+    );
+
+/*++
+ */
+BOOL
+_UsnpPipeWalk (
+    __in PUSN_WALK pWalk,
+    __in PUSN_PIPE_SLOT pSlot
+    );
+
+/*++
+ */
+DWORD
+_UsnpPipeReader (
+    __in void* Context
+    );
+
+/*++
+ */
+DWORD
+_UsnpPipeWriter (
+    __in void* Context
+    );
+
+/*++
+ */
+void
+_UsnpPutRing (
+    __inout PUSN_RING pRing,
+    __in PUSN_PIPE_SLOT pSlot
+    );
+
+/*++
+ */
+PUSN_PIPE_SLOT
+_UsnpTakeRing (
+    __inout PUSN_RING pRing,
+    __inout uint64_t* pWaits
+    );
+
+/*++
+ */
+void
+_UsnpMergeStats (
+    __inout PUSN_STATS pTotal,
+    __in PUSN_STATS pStats
+    );
+
+/*++
+ */
+PUSN_OUTPUT
+_UsnpGetOutput (
+    void
+    );
+
+/*++
+ */
+uint8_t*
+_UsnpReserveOutput (
+    __inout PUSN_OUTPUT pOut,
+    __in size_t bytes
+    );
+
+/*++
+ */
+BOOL
+_UsnpFlushOutput (
+    __inout PUSN_OUTPUT pOut
+    );
+
+/*++
+ */
+void
+_UsnpFreeOutput (
+    __inout PUSN_OUTPUT pOut
+    );
+
+/*++
+ */
+BOOL
+_UsnpWriteFile (
+    __in int file,
+    __in_bcount(bytes) const uint8_t* data,
+    __in size_t bytes
+    );
+
+/*++
+ */
+void
+_UsnpEmitText (
+    __inout PUSN_OUTPUT pOut,
+    __in_bcount(length) const char* text,
+    __in size_t length
+    );
+
+/*++
+ */
+uint8_t*
+_UsnpPutHex (
+    __out_bcount(digits) uint8_t* p,
+    __in uint64_t value,
+    __in DWORD digits
+    );
+
+/*++
+ */
+uint8_t*
+_UsnpPutDecimal (
+    __out_bcount(20) uint8_t* p,
+    __in uint64_t value,
+    __in DWORD width
+    );
+
+/*++
+ */
+uint8_t*
+_UsnpPutUtf8 (
+    __out_bcount(4) uint8_t* p,
+    __in uint32_t ch
+    );
+
+/*++
+ */
+void
+_UsnpEmitHex (
+    __inout PUSN_OUTPUT pOut,
+    __in uint64_t value,
+    __in DWORD digits
+    );
+
+/*++
+ */
+void
+_UsnpEmitDecimal (
+    __inout PUSN_OUTPUT pOut,
+    __in uint64_t value,
+    __in DWORD width
+    );
+
+/*++
+ */
+size_t
+_UsnpPutAsciiRun (
+    __out_ecount(cchname) uint8_t* p,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname,
+    __in DWORD escape
+    );
+
+/*++
+ */
+uint8_t*
+_UsnpPutEscaped (
+    __out_bcount(6) uint8_t* p,
+    __in uint32_t ch,
+    __in DWORD escape
+    );
+
+/*++
+ */
+void
+_UsnpEmitName (
+    __inout PUSN_OUTPUT pOut,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname,
+    __in DWORD escape
+    );
+
+/*++
+ */
+void
+_UsnpEmitWide (
+    __inout PUSN_OUTPUT pOut,
+    __in_ecount(cchtext) const wchar_t* text,
+    __in size_t cchtext,
+    __in DWORD escape
+    );
+
+/*++
+ */
+void
+_UsnpCivilFromDays (
+    __in int64_t days,
+    __out int64_t* pYear,
+    __out DWORD* pMonth,
+    __out DWORD* pDay
+    );
+
+/*++
+ */
+size_t
+_UsnpPutTimestamp (
+    __out_bcount(40) uint8_t* buffer,
+    __in LONGLONG ticks,
+    __in DWORD format
+    );
+
+/*++
+ */
+BOOL
+_UsnpEmitTimestamp (
+    __inout PUSN_OUTPUT pOut,
+    __in LONGLONG ticks,
+    __in DWORD format
+    );
+
+/*++
+ */
+void
+_UsnpEmitError (
+    __inout PUSN_OUTPUT pOut,
+    __in DWORD error
+    );
+
+/*++
+ */
+BOOL
+_UsnpCreateThread (
+    __in PUSN_THREAD_ROUTINE Routine,
+    __in void* Context,
+    __out PUSN_THREAD pThread
+    );
+
+/*++
+ */
+DWORD
+_UsnpJoinThread (
+    __in PUSN_THREAD pThread
+    );
+
+/*++
+ */
+void
+_UsnpInitLock (
+    __out PUSN_LOCK pLock,
+    __out_opt PUSN_COND pCond
+    );
+
+/*++
+ */
+void
+_UsnpDeleteLock (
+    __in PUSN_LOCK pLock,
+    __in_opt PUSN_COND pCond
+    );
+
+/*++
+ */
+void
+_UsnpAcquireLock (
+    __in PUSN_LOCK pLock
+    );
+
+/*++
+ */
+void
+_UsnpReleaseLock (
+    __in PUSN_LOCK pLock
+    );
+
+/*++
+ */
+void
+_UsnpWaitCond (
+    __in PUSN_COND pCond,
+    __in PUSN_LOCK pLock
+    );
+
+/*++
+ */
+void
+_UsnpWakeCond (
+    __in PUSN_COND pCond
+    );
+
+/*++
+ */
+int64_t
+_UsnpLoadAcquire (
+    __in volatile int64_t* pValue
+    );
+
+/*++
+ */
+void
+_UsnpStoreRelease (
+    __out volatile int64_t* pValue,
+    __in int64_t Value
+    );
+
+/*++
+ */
+DWORD
+_UsnpGetProcessorCount (
+    void
+    );
+
+/*++
+ */
+uint64_t
+_UsnpSkipZeroPages (
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Offset,
+    __in uint64_t End
+    );
+
+/*++
+ */
+uint64_t
+_UsnpSeekJournalStream (
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Begin,
+    __in uint64_t End,
+    __in LONGLONG Since,
+    __out_opt DWORD* pProbes
+    );
+
+/*++
+ */
+size_t
+_UsnpSeekPage (
+    __in_bcount(bytes) const uint8_t* page,
+    __in size_t bytes,
+    __in LONGLONG Since
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsZeroPage (
+    __in_bcount(bytes) const uint8_t* page,
+    __in size_t bytes
+    );
+
+/*++
+ */
+BOOL
+_UsnpMapFile (
+    __in wchar_t* filename,
+    __in BOOL CopyOnWrite,
+    __out PUSN_MAPPING pMapping
+    );
+
+/*++
+ */
+void
+_UsnpUnmapFile (
+    __in PUSN_MAPPING pMapping
+    );
+
+/*++
+ */
+BOOL
+_UsnpSynthesizeStream (
+    __in wchar_t* filename,
+    __in uint64_t count
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenVolumeSource (
+    __in wchar_t* pathname,
+    __out PUSN_SOURCE pSource
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenReplaySource (
+    __in wchar_t* filename,
+    __out PUSN_SOURCE pSource
+    );
+
+/*++
+ */
+void
+_UsnpFreeSynthMemory (
+    __inout PUSN_SYNTH_MEMORY pMemory
+    );
+
+/*++
+ */
+BOOL
+_UsnpBenchmark (
+    __in const wchar_t* name,
+    __in uint64_t count
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenLiveSource (
+    __in uint64_t count,
+    __in uint64_t rate,
+    __out PUSN_SOURCE pSource
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenArchiveSource (
+    __in wchar_t* filename,
+    __in_opt PUSN_HISTORY_QUERY pQuery,
+    __out PUSN_SOURCE pSource
+    );
+
+/*++
+ */
+BOOL
+_UsnpReadArchiveBlock (
+    __in FILE* fp,
+    __in LONGLONG offset,
+    __in LONGLONG size,
+    __out PUSN_ARCHIVE_BLOCK pBlock
+    );
+
+/*++
+ */
+BOOL
+_UsnpBuildHistoryIndex (
+    __in wchar_t* archivename,
+    __in wchar_t* filename
+    );
+
+/*++
+ */
+BOOL
+_UsnpLoadHistoryIndex (
+    __in wchar_t* filename,
+    __in PUSN_ARCHIVE pArchive,
+    __out PUSN_MAPPING pMapping
+    );
+
+/*++
+ */
+DWORD
+_UsnpHistoryLookup (
+    __in PUSN_MAPPING pMapping,
+    __in DWORD table,
+    __in FILE_ID_128* pKey,
+    __out const uint64_t** ppPostings
+    );
+
+/*++
+ */
+BOOL
+_UsnpQueryHistoryIndex (
+    __inout PUSN_ARCHIVE pArchive,
+    __in wchar_t* filename
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsHistoryMatch (
+    __in PUSN_HISTORY_QUERY pQuery,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenArchiveWriter (
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out PUSN_ARCHIVE_WRITER* ppWriter
+    );
+
+/*++
+ */
+BOOL
+_UsnpArchiveChunk (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in_bcount(bytes) void* buffer,
+    __in DWORD bytes
+    );
+
+/*++
+ */
+BOOL
+_UsnpArchiveRecord (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+BOOL
+_UsnpFlushArchive (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in USN NextUsn
+    );
+
+/*++
+ */
+BOOL
+_UsnpCloseArchiveWriter (
+    __in PUSN_ARCHIVE_WRITER pWriter
+    );
+
+/*++
+ */
+uint8_t*
+_UsnpPutVarint (
+    __out_bcount(10) uint8_t* p,
+    __in uint64_t value
+    );
+
+/*++
+ */
+BOOL
+_UsnpGetVarint (
+    __inout const uint8_t** pp,
+    __in const uint8_t* end,
+    __out uint64_t* pValue
+    );
+
+/*++
+ */
+BOOL
+_UsnpCreateReplayFile (
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out FILE** pfp
+    );
+
+/*++
+ */
+BOOL
+_UsnpWriteReplayChunk (
+    __in FILE* fp,
+    __in_bcount(bytes) void* buffer,
+    __in DWORD bytes
+    );
+
+/*++
+ */
+BOOL
+_UsnpCloseReplayFile (
+    __in FILE* fp,
+    __in_opt PUSN_JOURNAL_DATA pJournalData
+    );
+
+/*++
+ */
+BOOL
+_UsnpSynthesize (
+    __in PUSN_SYNTH pSynth,
+    __in uint64_t count
+    );
+
+/*++
+ */
+BOOL
+_UsnpSynthesizeReplay (
+    __in wchar_t* filename,
+    __in uint64_t count
+    );
+
+/*++
+ */
+USN
+_UsnpGetRecordUsn (
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+DWORD
+_UsnpGetRecordReason (
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+LONGLONG
+_UsnpGetRecordTimeStamp (
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+void
+_UsnpSetRecordReason (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __in DWORD Reason
+    );
+
+/*++
+ */
+DWORD
+_UsnpGetRecordAttributes (
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+BOOL
+_UsnpGetRecordFileIds (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __out FILE_ID_128* pFileId,
+    __out FILE_ID_128* pParent
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsRecordRequested (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __in PREAD_USN_JOURNAL_DATA pReadData
+    );
+
+/*++
+ */
+BOOL
+_UsnpSeekJournalTime (
+    __in PUSN_SOURCE pSource,
+    __in USN_JOURNAL_DATA* pJournalData,
+    __in LONGLONG Since,
+    __out USN* pUsn,
+    __out_opt DWORD* pProbes
+    );
+
+/*++
+ */
+size_t
+_UsnpNameToWide (
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer
+    );
+
+/*++
+ */
+FILE*
+_UsnpOpenStream (
+    __in const wchar_t* filename,
+    __in const wchar_t* mode
+    );
+
+#if !defined(_WIN32)
+/*++
+ */
+BOOL
+_UsnpNarrowPath (
+    __in const wchar_t* filename,
+    __out_ecount(cchbuffer) char* buffer,
+    __in size_t cchbuffer
+    );
+
+/*++
+ */
+DWORD
+_UsnpErrnoToError (
+    __in int error
+    );
+#endif  /* !_WIN32 */
+
+/*++
+ */
+void*
+_UsnpAlloc (
+    __in size_t size
+    );
+
+/*++
+ */
+void
+_UsnpFree (
+    __in void* p
+    );
+
+/*++
+ */
+uint64_t
+_UsnpQueryClock (
+    void
+    );
+
+/*++
+ */
+LONGLONG
+_UsnpQuerySystemTime (
+    void
+    );
+
+/*++
+ */
+void
+_UsnpSleep (
+    __in uint64_t microseconds
+    );
+
+/*++
+ */
+void
+_UsnpYield (
+    void
+    );
+
+/*++
+ */
+void
+_UsnpStopSignal (
+    __in int number
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatStats (
+    __in PUSN_STATS pStats
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatJournalData (
+    __in wchar_t* pathname,
+    __in PUSN_JOURNAL_DATA pJournalData
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatRecord (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_UNION* pUsn 
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatRecordV2 (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_V2* pRecord 
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatMove (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_UNION* pOld,
+    __in USN_RECORD_UNION* pNew
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatRecordV3 (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_V3* pRecord,
+    __in_opt USN_RECORD_V3* pOld
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatRecordV4 (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_V4* pRecord 
+    );
+
+/*++
+ */
+BOOL
+_UsnpUpconvertRecordV2 (
+    __in const USN_RECORD_V2* pRecord,
+    __out_bcount(cbrecord) USN_RECORD_V3* pV3,
+    __in DWORD cbrecord
+    );
+
+/*++
+ */
+BOOL
+_UsnpCheckRecordV4 (
+    __in const USN_RECORD_V4* pRecord
+    );
+
+/*++
+ */
+void
+_UsnpGetRecordExtent (
+    __in const USN_RECORD_V4* pRecord,
+    __in DWORD index,
+    __out PUSN_RECORD_EXTENT pExtent
+    );
+
+/*++
+ */
+void
+_UsnpEmitRecordJsonV4 (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V4* pRecord,
+    __in_opt const wchar_t* path
+    );
+
+/*++
+ */
+void
+_UsnpEmitRecordCsvV4 (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V4* pRecord,
+    __in_opt const wchar_t* path
+    );
+
+/*++
+ */
+BOOL
+_UsnpAddRecordRanges (
+    __inout PUSN_RANGES pRanges,
+    __in const USN_RECORD_V4* pRecord
+    );
+
+/*++
+ */
+PUSN_RANGE_FILE
+_UsnpFindRangeFile (
+    __inout PUSN_RANGES pRanges,
+    __in FILE_ID_128* pFileId,
+    __in BOOL Insert
+    );
+
+/*++
+ */
+BOOL
+_UsnpAddRange (
+    __inout PUSN_RANGE_FILE pFile,
+    __in LONGLONG Start,
+    __in LONGLONG End
+    );
+
+/*++
+ */
+BOOL
+_UsnpSaveRanges (
+    __in PUSN_RANGES pRanges,
+    __in wchar_t* filename
+    );
+
+/*++
+ */
+void
+_UsnpFreeRanges (
+    __inout PUSN_RANGES pRanges
+    );
+
+/*++
+ */
+void
+_UsnpEmitRecordText (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V3* pRecord,
+    __in const wchar_t* path,
+    __in_opt USN_RECORD_V3* pOld,
+    __in_opt const wchar_t* oldpath
+    );
+
+/*++
+ */
+void
+_UsnpEmitRecordJson (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V3* pRecord,
+    __in_opt const wchar_t* path,
+    __in_opt USN_RECORD_V3* pOld,
+    __in_opt const wchar_t* oldpath
+    );
+
+/*++
+ */
+void
+_UsnpEmitRecordCsv (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V3* pRecord,
+    __in_opt const wchar_t* path,
+    __in_opt USN_RECORD_V3* pOld,
+    __in_opt const wchar_t* oldpath
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsEqualFileReference (
+    FILE_ID_128* pfid1,
+    FILE_ID_128* pfid2
+    );
+
+/*++
+ */
+BOOL
+_UsnpGetFileIdFromFilename (
+    __in wchar_t* filename,
+    __out FILE_ID_128* pFileId 
+    );
+
+/*++
+ */
+BOOL
+_UsnpGetFileIdFromHandle (
+    __in HANDLE osh,
+    __out FILE_ID_128* pFileId 
+    );
+
+/*++
+ */
+BOOL
+_UsnpGetFilenameFromFileId (
+    __in HANDLE osh,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer 
+    );
+
+/*++
+ */
+BOOL
+_UsnpResolvePath (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer
+    );
+
+/*++
+ */
+void
+_UsnpObserveRecord (
+    __in PUSN_RESOLVER pResolver,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+BOOL
+_UsnpGetRecordNaming (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __out FILE_ID_128* pFileId,
+    __out FILE_ID_128* pParent,
+    __out DWORD* pAttributes,
+    __out DWORD* pReason,
+    __out WCHAR** pName,
+    __out size_t* pcchName
+    );
+
+/*++
+ */
+BOOL
+_UsnpSeedResolver (
+    __in HANDLE Volume,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __in PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+uint64_t
+_UsnpHashFileId (
+    __in FILE_ID_128* pFileId
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenTree (
+    __in PUSN_RESOLVER pLower,
+    __in PUSN_STATS pStats,
+    __out PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+BOOL
+_UsnpTreeLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer
+    );
+
+/*++
+ */
+void
+_UsnpTreeObserve (
+    __in PUSN_RESOLVER pResolver,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+void
+_UsnpTreeClose (
+    __in PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+PUSN_TREE_ENTRY
+_UsnpTreeFind (
+    __in PUSN_TREE pTree,
+    __in FILE_ID_128* pFileId,
+    __in BOOL Insert
+    );
+
+/*++
+ */
+BOOL
+_UsnpTreeGrow (
+    __in PUSN_TREE pTree
+    );
+
+/*++
+ */
+DWORD
+_UsnpTreeIntern (
+    __in PUSN_TREE pTree,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname
+    );
+
+/*++
+ */
+uint32_t
+_UsnpHashName (
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname
+    );
+
+/*++
+ */
+BOOL
+_UsnpLoadTreeSnapshot (
+    __in PUSN_RESOLVER pResolver,
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out USN* pValidUsn
+    );
+
+/*++
+ */
+BOOL
+_UsnpSaveTreeSnapshot (
+    __in PUSN_RESOLVER pResolver,
+    __in wchar_t* filename,
+    __in DWORDLONG UsnJournalID,
+    __in USN ValidUsn
+    );
+
+/*++
+ */
+BOOL
+_UsnpWritePadding (
+    __in FILE* fp,
+    __in uint64_t offset
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsMapped (
+    __in PUSN_MAPPING pMapping,
+    __in void* p
+    );
+
+/*++
+ */
+BOOL
+_UsnpReplaceFile (
+    __in wchar_t* from,
+    __in wchar_t* to
+    );
+
+/*++
+ */
+BOOL
+_UsnpLoadWatchList (
+    __in wchar_t* filename,
+    __out PUSN_WATCH pWatch
+    );
+
+/*++
+ */
+void
+_UsnpFreeWatchList (
+    __in PUSN_WATCH pWatch
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsWatched (
+    __in PUSN_WATCH pWatch,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsUnderSubtree (
+    __in PUSN_WATCH pWatch,
+    __in FILE_ID_128* pFileId
+    );
+
+/*++
+ */
+PUSN_WATCH_ENTRY
+_UsnpWatchFind (
+    __in PUSN_WATCH_ENTRY Entries,
+    __in DWORD Capacity,
+    __in FILE_ID_128* pFileId,
+    __in BOOL Insert
+    );
+
+/*++
+ */
+BOOL
+_UsnpParseFileId (
+    __in const wchar_t* str,
+    __out FILE_ID_128* pFileId
+    );
+
+/*++
+ */
+BOOL
+_UsnpCompileFilter (
+    __in const wchar_t* text,
+    __out PUSN_FILTER pFilter
+    );
+
+/*++
+ */
+void
+_UsnpFreeFilter (
+    __in PUSN_FILTER pFilter
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsFilterMatch (
+    __in PUSN_FILTER pFilter,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+WCHAR
+_UsnpFoldChar (
+    __in WCHAR ch
+    );
+
+/*++
+ */
+BOOL
+_UsnpMatchGlob (
+    __in_ecount(cchpattern) const WCHAR* pattern,
+    __in size_t cchpattern,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname
+    );
+
+/*++
+ */
+BOOL
+_UsnpBuildNameSet (
+    __out PUSN_NAMESET pSet,
+    __in_ecount(length) const WCHAR* text,
+    __in DWORD length
+    );
+
+/*++
+ */
+void
+_UsnpFreeNameSet (
+    __in PUSN_NAMESET pSet
+    );
+
+/*++
+ */
+DWORD
+_UsnpNameStep (
+    __in PUSN_NAMESET pSet,
+    __in DWORD node,
+    __in WCHAR ch
+    );
+
+/*++
+ */
+DWORD
+_UsnpNameInsert (
+    __inout PUSN_NAMESET pSet,
+    __in DWORD root,
+    __in_ecount(length) const WCHAR* text,
+    __in DWORD length,
+    __in BOOL Reverse
+    );
+
+/*++
+ */
+BOOL
+_UsnpMatchNameSet (
+    __in PUSN_NAMESET pSet,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname
+    );
+
+/*++
+ */
+BOOL
+_UsnpLoadNameList (
+    __in_ecount(cchfilename) const wchar_t* filename,
+    __in size_t cchfilename,
+    __out WCHAR** pText,
+    __out DWORD* pLength
+    );
+
+/*++
+ */
+void
+_UsnpFilterMergeNames (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD node
+    );
+
+/*++
+ */
+int
+_UsnpCompareFileId (
+    __in const void* p1,
+    __in const void* p2
+    );
+
+/*++
+ */
+BOOL
+_UsnpIsInFilterSet (
+    __in PUSN_FILTER_SET pSet,
+    __in FILE_ID_128* pFileId
+    );
+
+/*++
+ */
+void
+_UsnpFilterSkip (
+    __in PUSN_FILTER_PARSER pParser
+    );
+
+/*++
+ */
+BOOL
+_UsnpFilterToken (
+    __in PUSN_FILTER_PARSER pParser,
+    __in const wchar_t* token
+    );
+
+/*++
+ */
+BOOL
+_UsnpFilterValue (
+    __in PUSN_FILTER_PARSER pParser,
+    __out const wchar_t** pValue,
+    __out size_t* pcchValue
+    );
+
+/*++
+ */
+BOOL
+_UsnpFilterNumber (
+    __in_ecount(cchvalue) const wchar_t* value,
+    __in size_t cchvalue,
+    __out uint64_t* pNumber
+    );
+
+/*++
+ */
+BOOL
+_UsnpFilterTime (
+    __in_ecount(cchvalue) const wchar_t* value,
+    __in size_t cchvalue,
+    __out LONGLONG* pTime
+    );
+
+/*++
+ */
+BOOL
+_UsnpFilterMask (
+    __in_ecount(cchvalue) const wchar_t* value,
+    __in size_t cchvalue,
+    __in BOOL Attributes,
+    __out DWORD* pMask
+    );
+
+/*++
+ */
+DWORD
+_UsnpFilterNode (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD Code
+    );
+
+/*++
+ */
+DWORD
+_UsnpFilterParseOr (
+    __in PUSN_FILTER_PARSER pParser
+    );
+
+/*++
+ */
+DWORD
+_UsnpFilterParseAnd (
+    __in PUSN_FILTER_PARSER pParser
+    );
+
+/*++
+ */
+DWORD
+_UsnpFilterParseNot (
+    __in PUSN_FILTER_PARSER pParser
+    );
+
+/*++
+ */
+DWORD
+_UsnpFilterParseTest (
+    __in PUSN_FILTER_PARSER pParser
+    );
+
+/*++
+ */
+DWORD
+_UsnpFilterOrder (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD node
+    );
+
+/*++
+ */
+DWORD
+_UsnpFilterEmit (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD node,
+    __in DWORD True,
+    __in DWORD False
+    );
+
+/*++
+ */
+PUSN_TREE
+_UsnpGetTree (
+    __in PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+BOOL
+_UsnpLoadCheckpoint (
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out USN* pStartUsn
+    );
+
+/*++
+ */
+BOOL
+_UsnpSaveCheckpoint (
+    __in wchar_t* filename,
+    __in DWORDLONG UsnJournalID,
+    __in USN NextUsn
+    );
+
+/*++
+ */
+BOOL
+_UsnpFlushStream (
+    __in FILE* fp
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenResolver (
+    __in HANDLE Volume,
+    __in PUSN_STATS pStats,
+    __out PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+void
+_UsnpCloseResolver (
+    __in PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+BOOL
+_UsnpVolumeLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer
+    );
+
+/*++
+ */
+BOOL
+_UsnpSynthLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer
+    );
+
+/*++
+ */
+BOOL
+_UsnpOpenPathCache (
+    __in PUSN_RESOLVER pLower,
+    __in DWORD Capacity,
+    __in DWORD NegativeTtl,
+    __in PUSN_STATS pStats,
+    __out PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+BOOL
+_UsnpPathCacheLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer
+    );
+
+/*++
+ */
+void
+_UsnpPathCacheObserve (
+    __in PUSN_RESOLVER pResolver,
+    __in PUSN_RECORD_COMMON_HEADER pRecord
+    );
+
+/*++
+ */
+void
+_UsnpPathCacheInvalidate (
+    __in PUSN_PATH_CACHE pCache,
+    __in_opt FILE_ID_128* pFileId
+    );
+
+/*++
+ */
+void
+_UsnpPathCacheClose (
+    __in PUSN_RESOLVER pResolver
+    );
+
+/*++
+ */
+DWORD
+_UsnpPathCacheFind (
+    __in PUSN_PATH_CACHE pCache,
+    __in FILE_ID_128* pFileId,
+    __out DWORD* pBucket
+    );
+
+/*++
+ */
+void
+_UsnpPathCacheRemove (
+    __in PUSN_PATH_CACHE pCache,
+    __in DWORD Index
+    );
+
+/*++
+ */
+void
+_UsnpPathCacheInsert (
+    __in PUSN_PATH_CACHE pCache,
+    __in FILE_ID_128* pFileId,
+    __in_opt const wchar_t* path,
+    __in DWORD Error
+    );
+
+/*++
+ */
+BOOL
+_UsnpFormatTimestamp (
+    __in LARGE_INTEGER* pTimeStamp,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer 
+    );
+
+/*++
+ */
+BOOL
+_UsnpDump (
+    __in_ecount(buffersize) uint8_t* buffer,
+    __in int buffersize 
+    );
+
+/*++
+ */
+int
+__wtoi (
+    __in const wchar_t* str 
+    );
+
+/*++
+ */
+int64_t
+__wtoi64 (
+    __in const wchar_t* str 
+    );
+
+/*++
+ */
+void
+_UsnpUsage (
+    void
+    );
+
+/*++ ... */
+int g_dump = 0;
+int g_count = 23;
+int g_quiet = 0;
+int g_showstats = 0;
+wchar_t* argv0 = NULL;
+
+DWORD g_threads = 1;
+DWORD g_pipeline = _USN_PIPELINE_AUTO;
+DWORD g_readsize = _USN_READ_SIZE;
+int g_overlapped = 0;
+wchar_t* g_rangesfile = NULL;
+USN_RANGES g_ranges = {0};
+wchar_t* g_volumes[_USN_VOLUME_MAX] = {0};
+DWORD g_volumecount = 0;
+const wchar_t* g_volumetag = NULL;
+DWORD g_cachesize = 4096;
+DWORD g_negttl = 2000;
+int g_synthpaths = 0;
+int g_tree = 0;
+int g_seed = 0;
+wchar_t* g_snapshot = NULL;
+wchar_t* g_checkpoint = NULL;
+LONGLONG g_since = 0;
+wchar_t* g_replay = NULL;
+wchar_t* g_usnjrnl = NULL;
+_USN_THREAD_LOCAL PUSN_OUTPUT g_output = NULL;
+USN_OUTPUT g_stdout = { NULL, 0, 0, 1, FALSE };
+DWORD g_timeformat = _USN_TIME_NT;
+DWORD g_format = _USN_FORMAT_TEXT;
+FILE* g_info = NULL;
+_USN_THREAD_LOCAL USN_TIME_CACHE g_timecache = { -1, 0, 0, {0} };
+wchar_t* g_capture = NULL;
+FILE* g_capturefp = NULL;
+wchar_t* g_archive = NULL;
+wchar_t* g_fromarchive = NULL;
+PUSN_ARCHIVE_WRITER g_archivewriter = NULL;
+USN_HISTORY_QUERY g_history = {0};
+USN_STATS g_stats = {0};
+
+wchar_t* g_watchlist = NULL;
+USN_WATCH g_watch = {0};
+USN_FILTER g_filter = {0};
+PUSN_SELECT_ROUTINE g_select = NULL;
+
+DWORD g_coalesce = 0;
+DWORD g_coalesceage = 600;
+int g_moves = 0;
+
+int g_follow = 0;
+DWORD g_minbytes = 1;
+DWORD g_maxlatency = 100;
+DWORD g_maxwait = 0;
+uint64_t g_simlive = 0;
+uint64_t g_simrate = 0;
+volatile sig_atomic_t g_stop = 0;
+
+wchar_t* g_bench = NULL;
+uint64_t g_benchcount = 0;
+
+/*++
+ */
+int 
+wmain ( 
+    int argc, 
+    wchar_t** argv )
+{
+    DWORD reason;
+    DWORD simd = _USN_SIMD_AUTO;
+    wchar_t* pathname = NULL;
+
+    UNREFERENCED_PARAMETER(argc);
+
+    /*++ ... */
+    pathname = L"C:\\";
+    reason = USN_REASON_CLOSE;
+
+    argv0 = *argv++;
+    while(*argv)
+    {
+        wchar_t* arg = *argv++;
+        if(arg[0] == L'-')
+        {
+            if(_wcsicmp(arg, L"-replay") == 0)
+            {
+                if((g_replay = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-volume") == 0)
+            {
+                if((*argv == NULL) || (g_volumecount >= _USN_VOLUME_MAX))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_volumes[g_volumecount++] = *argv++;
+            }
+            else if(_wcsicmp(arg, L"-usnjrnl") == 0)
+            {
+                if((g_usnjrnl = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-capture") == 0)
+            {
+                if((g_capture = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-archive") == 0)
+            {
+                if((g_archive = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-fromarchive") == 0)
+            {
+                if((g_fromarchive = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if((_wcsicmp(arg, L"-history") == 0) || (_wcsicmp(arg, L"-children") == 0))
+            {
+                /*++ -history <frn>, -children <frn>; 0x and hex, as records show it ... */
+                BOOL children = (_wcsicmp(arg, L"-children") == 0);
+                wchar_t* frn = *argv++;
+
+                if(frn == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                if((frn[0] == L'0') && ((frn[1] == L'x') || (frn[1] == L'X')))
+                {
+                    frn += 2;
+                }
+                if( _UsnpParseFileId(frn, (children ? &(g_history.Parent) : &(g_history.File))) == FALSE)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_history.Match |= (1 << (children ? _USN_HISTORY_CHILDREN : _USN_HISTORY_FILES));
+            }
+            else if(_wcsicmp(arg, L"-synth") == 0)
+            {
+                /*++ -synth <file> <count> writes a replay file and exits ... */
+                if((argv[0] == NULL) || (argv[1] == NULL))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                if( _UsnpSynthesizeReplay(argv[0], (uint64_t)__wtoi64(argv[1])) == FALSE)
+                {
+                    fwprintf(stderr, L"synthesize failed, status(%X)\n", GetLastError());
+                    return 1;
+                }
+                return 0;
+            }
+            else if(_wcsicmp(arg, L"-synthj") == 0)
+            {
+                /*++ -synthj <file> <count> writes a raw $J stream and exits ... */
+                if((argv[0] == NULL) || (argv[1] == NULL))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                if( _UsnpSynthesizeStream(argv[0], (uint64_t)__wtoi64(argv[1])) == FALSE)
+                {
+                    fwprintf(stderr, L"synthesize failed, status(%X)\n", GetLastError());
+                    return 1;
+                }
+                return 0;
+            }
+            else if(_wcsicmp(arg, L"-threads") == 0)
+            {
+                /*++ 0 for one per processor ... */
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_threads = (DWORD)__wtoi(*argv++);
+                if(g_threads == 0)
+                {
+                    g_threads = _UsnpGetProcessorCount();
+                }
+            }
+            else if(_wcsicmp(arg, L"-cache") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_cachesize = (DWORD)__wtoi(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-filter") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                _UsnpFreeFilter(&g_filter);
+                if( _UsnpCompileFilter(*argv++, &g_filter) == FALSE)
+                {
+                    fwprintf(stderr, L"bad filter at (%ls)\n", (((g_filter.Error != NULL) && (*g_filter.Error != L'\0')) ? g_filter.Error : L"the end"));
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-reason") == 0)
+            {
+                /*++ -reason <hex mask|all> ... */
+                wchar_t* mask = *argv++;
+                wchar_t* end = NULL;
+
+                if(mask == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                if(_wcsicmp(mask, L"all") == 0)
+                {
+                    reason = _USN_REASON_ALL;
+                }
+                else
+                {
+                    reason = (DWORD)wcstoul(mask, &end, 16);
+                    if((reason == 0) || (end == mask) || (*end != L'\0'))
+                    {
+                        _UsnpUsage();
+                        return 1;
+                    }
+                }
+            }
+            else if(_wcsicmp(arg, L"-coalesce") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_coalesce = (DWORD)__wtoi(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-moves") == 0)
+            {
+                g_moves++;
+            }
+            else if(_wcsicmp(arg, L"-ranges") == 0)
+            {
+                if((g_rangesfile = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-simd") == 0)
+            {
+                /*++ -simd <auto|avx2|sse2|scalar|off> ... */
+                wchar_t* name = *argv++;
+
+                if(name == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                if(_wcsicmp(name, L"auto") == 0)
+                {
+                    simd = _USN_SIMD_AUTO;
+                }
+                else if(_wcsicmp(name, L"off") == 0)
+                {
+                    simd = _USN_SIMD_OFF;
+                }
+                else if(_wcsicmp(name, L"scalar") == 0)
+                {
+                    simd = _USN_SIMD_SCALAR;
+                }
+                else if(_wcsicmp(name, L"sse2") == 0)
+                {
+                    simd = _USN_SIMD_SSE2;
+                }
+                else if(_wcsicmp(name, L"avx2") == 0)
+                {
+                    simd = _USN_SIMD_AVX2;
+                }
+                else
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-coalesceage") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_coalesceage = (DWORD)__wtoi(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-negttl") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_negttl = (DWORD)__wtoi(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-watch") == 0)
+            {
+                if((g_watchlist = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-pipeline") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_pipeline = (DWORD)__wtoi(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-buffer") == 0)
+            {
+                int kb;
+
+                if((*argv == NULL) || ((kb = __wtoi(*argv++)) < (USN_PAGE_SIZE / 1024)) || (kb > (_USN_READ_SIZE_MAX / 1024)))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_readsize = (DWORD)kb * 1024;
+            }
+            else if(_wcsicmp(arg, L"-overlapped") == 0)
+            {
+                g_overlapped++;
+            }
+            else if(_wcsicmp(arg, L"-tree") == 0)
+            {
+                g_tree++;
+            }
+            else if(_wcsicmp(arg, L"-seed") == 0)
+            {
+                g_tree++;
+                g_seed++;
+            }
+            else if(_wcsicmp(arg, L"-checkpoint") == 0)
+            {
+                if((g_checkpoint = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-since") == 0)
+            {
+                if((argv[0] == NULL) || (_UsnpFilterTime(argv[0], wcslen(argv[0]), &g_since) == FALSE) || (g_since <= 0))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                argv++;
+            }
+            else if(_wcsicmp(arg, L"-snapshot") == 0)
+            {
+                if((g_snapshot = *argv++) == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_tree++;
+            }
+            else if(_wcsicmp(arg, L"-synthpaths") == 0)
+            {
+                g_synthpaths++;
+            }
+            else if(_wcsicmp(arg, L"-stats") == 0)
+            {
+                g_showstats++;
+            }
+            else if(_wcsicmp(arg, L"-bench") == 0)
+            {
+                /*++ -bench <name> <count>; run once the options are in ... */
+                if((argv[0] == NULL) || (argv[1] == NULL))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_bench = *argv++;
+                g_benchcount = (uint64_t)__wtoi64(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-format") == 0)
+            {
+                wchar_t* format = *argv++;
+                if(format == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                if(_wcsicmp(format, L"text") == 0)
+                {
+                    g_format = _USN_FORMAT_TEXT;
+                }
+                else if(_wcsicmp(format, L"json") == 0)
+                {
+                    g_format = _USN_FORMAT_JSON;
+                }
+                else if(_wcsicmp(format, L"csv") == 0)
+                {
+                    g_format = _USN_FORMAT_CSV;
+                }
+                else
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-time") == 0)
+            {
+                wchar_t* format = *argv++;
+                if(format == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                if(_wcsicmp(format, L"nt") == 0)
+                {
+                    g_timeformat = _USN_TIME_NT;
+                }
+                else if(_wcsicmp(format, L"iso") == 0)
+                {
+                    g_timeformat = _USN_TIME_ISO;
+                }
+                else if(_wcsicmp(format, L"unix") == 0)
+                {
+                    g_timeformat = _USN_TIME_UNIX;
+                }
+                else
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-follow") == 0)
+            {
+                g_follow++;
+            }
+            else if(_wcsicmp(arg, L"-minbytes") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                /*++ a read that waits for nothing is a busy poll ... */
+                g_minbytes = (DWORD)__wtoi(*argv++);
+                if(g_minbytes == 0)
+                {
+                    g_minbytes = 1;
+                }
+            }
+            else if(_wcsicmp(arg, L"-maxlatency") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_maxlatency = (DWORD)__wtoi(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-maxwait") == 0)
+            {
+                if(*argv == NULL)
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_maxwait = (DWORD)__wtoi(*argv++);
+            }
+            else if(_wcsicmp(arg, L"-simlive") == 0)
+            {
+                /*++ -simlive <count> <rate>; a made-up journal, growing ... */
+                if((argv[0] == NULL) || (argv[1] == NULL))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+                g_simlive = (uint64_t)__wtoi64(*argv++);
+                g_simrate = (uint64_t)__wtoi64(*argv++);
+                if((g_simlive == 0) || (g_simrate == 0))
+                {
+                    _UsnpUsage();
+                    return 1;
+                }
+            }
+            else if( (arg[1] == L'q') || (arg[1] == L'Q'))
+            {
+                g_quiet++;
+            }
+            else if( (arg[1] == L'd') || (arg[1] == L'D'))
+            {
+                g_dump++;
+            }
+            else
+            {
+                _UsnpUsage();
+                return 1;
+            }
+        }
+        else
+        {
+            g_count = __wtoi(arg);
+        }
+    }
+
+    /*++ the history index is an archive's ... */
+    if((g_history.Match != 0) && (g_fromarchive == NULL))
+    {
+        _UsnpUsage();
+        return 1;
+    }
+
+    /*++ merged volumes are their own sources, and read to their ends ... */
+    if((g_volumecount > 0) &&
+       ((g_replay != NULL) || (g_usnjrnl != NULL) || (g_fromarchive != NULL) || (g_simlive != 0) ||
+        (g_capture != NULL) || (g_archive != NULL) || (g_snapshot != NULL) || (g_watchlist != NULL) ||
+        (g_rangesfile != NULL) || g_follow))
+    {
+        _UsnpUsage();
+        return 1;
+    }
+
+    /*++ json and csv own stdout; what the run is doing goes to stderr ... */
+    g_info = ((g_format == _USN_FORMAT_TEXT) ? stdout : stderr);
+
+    /*++ on one processor the stages would only take turns ... */
+    if(g_pipeline == _USN_PIPELINE_AUTO)
+    {
+        g_pipeline = ((_UsnpGetProcessorCount() > 1) ? _USN_PIPELINE_DEPTH : 0);
+    }
+
+    g_select = _UsnpGetSelectRoutine(simd);
+    if((g_select == NULL) && (simd != _USN_SIMD_OFF))
+    {
+        fwprintf(stderr, L"-simd: not on this processor or build\n");
+        return 1;
+    }
+
+    if(g_bench != NULL)
+    {
+        if( _UsnpBenchmark(g_bench, g_benchcount) == FALSE)
+        {
+            fwprintf(stderr, L"benchmark %ls failed, status(%X)\n", g_bench, GetLastError());
+            return 1;
+        }
+        return 0;
+    }
+
+    if(g_watchlist != NULL)
+    {
+        if( _UsnpLoadWatchList(g_watchlist, &g_watch) == FALSE)
+        {
+            fwprintf(stderr, L"load watch list failed, status(%X)\n", GetLastError());
+            return 1;
+        }
+        fwprintf(g_info, L"watch(%ls), %u directories, %u subtrees\n", g_watchlist, g_watch.Count, g_watch.Subtrees);
+
+        /*++ subtrees are worked out on the journal's own tree ... */
+        if(g_watch.Subtrees > 0)
+        {
+            g_tree++;
+        }
+    }
+
+    fwprintf(g_info, L"dump(%ls), count(%d)\n", ((g_dump) ? L"on" : L"off"), g_count);
+
+    /*++ pairing needs both halves of a rename read ... */
+    if(g_moves && (reason != _USN_REASON_ALL))
+    {
+        reason |= (USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME);
+    }
+
+    if(reason != USN_REASON_CLOSE)
+    {
+        fwprintf(g_info, L"reason(%08X)\n", reason);
+    }
+
+    if(g_coalesce != 0)
+    {
+        fwprintf(g_info, L"coalesce, %u open files, maxage(%u s)\n", g_coalesce, g_coalesceage);
+    }
+
+    if(g_follow)
+    {
+        /*++ ctrl-c ends the follow at the next read, so state gets saved ... */
+        signal(SIGINT, _UsnpStopSignal);
+        fwprintf(g_info, L"follow, minbytes(%u), maxlatency(%u ms), maxwait(%u ms)\n", g_minbytes, g_maxlatency, g_maxwait);
+    }
+
+    /*++
+     */
+
+    g_stats.Start = _UsnpQueryClock();
+
+    if(g_format == _USN_FORMAT_CSV)
+    {
+        if(g_volumecount > 0)
+        {
+            _USN_EMIT(&g_stdout, "volume,");
+        }
+        _USN_EMIT(&g_stdout, _USN_CSV_HEADER);
+        if(g_moves)
+        {
+            _USN_EMIT(&g_stdout, _USN_CSV_MOVE_HEADER);
+        }
+        _USN_EMIT(&g_stdout, "\n");
+    }
+
+    if(g_usnjrnl != NULL)
+    {
+        if( _UsnpReadJournalFile(g_usnjrnl, reason) == FALSE)
+        {
+            fwprintf(stderr, L"read journal file failed, status(%X)\n", GetLastError());
+        }
+    }
+    else if(g_volumecount > 0)
+    {
+        if( _UsnpReadVolumes(g_volumes, g_volumecount, reason) == FALSE)
+        {
+            fwprintf(stderr, L"read volumes failed, status(%X)\n", GetLastError());
+        }
+    }
+    else if( _UsnpReadJournalData(pathname, reason) == FALSE)
+    {
+        long w32error = GetLastError();
+        if(w32error == ERROR_JOURNAL_NOT_ACTIVE)
+        {
+            fwprintf(stderr, L"journal has not been activated\n");
+        }
+        else
+        {
+            fwprintf(stderr, L"get journal data failed, status(%X)\n", w32error);
+        }
+    }
+
+    _UsnpFlushOutput(&g_stdout);
+    _UsnpFreeOutput(&g_stdout);
+
+    if(g_showstats)
+    {
+        _UsnpFormatStats(&g_stats);
+    }
+    _UsnpFreeWatchList(&g_watch);
+    _UsnpFreeRanges(&g_ranges);
+    return 0;
+}
+
+/*++
+ */
+void
+_UsnpUsage (
+    void )
+{
+    fwprintf(stderr,
+     L"usage: %ls [options] [count]\n"
+     L"  count                 records to show, 0 for all (default 23)\n"
+     L"  -d                    hex-dump each record\n"
+     L"  -q                    decode records but do not print them\n"
+     L"  -stats                print record and read counters at exit\n"
+     L"  -reason <mask|all>    the reasons to read, as hex (default 80000000,\n"
+     L"                        closes only)\n"
+     L"  -filter <expr>        only records the expression holds for; tests\n"
+     L"                        reason:<mask> attr:<mask> name:<globs|@file>\n"
+     L"                        usn<op><n> time<op><utc> frn:<frns>\n"
+     L"                        parent:<frns>, with and, or, not and ( )\n"
+     L"  -coalesce <n>         hold records until their file closes and show one\n"
+     L"                        with every reason since the open; n open files\n"
+     L"                        held at most, about 600 bytes each\n"
+     L"  -coalesceage <s>      -coalesce, let a file out after s seconds open\n"
+     L"                        without a close (default 600, 0 for never)\n"
+     L"  -moves                show a rename's old and new name records as one\n"
+     L"                        move; renames are read whatever -reason says\n"
+     L"  -ranges <file>        merge the extents of v4 records into each file's\n"
+     L"                        changed byte ranges, and write them to file as\n"
+     L"                        frn offset length, in hex; not with -volume\n"
+     L"  -simd <auto|avx2|sse2|scalar|off> how a buffer's records are tested\n"
+     L"                        against the reason mask, -filter and -watch\n"
+     L"                        before the walk (default auto, the widest\n"
+     L"                        there is); off tests each in the walk\n"
+     L"  -format <text|json|csv> records as text blocks (default), json lines\n"
+     L"                        or csv rows; -d applies to text only\n"
+     L"  -time <nt|iso|unix>   timestamps as 2020-06-06 23:50:43.744 (nt),\n"
+     L"                        2020-06-06T23:50:43.7441234Z or 1591487443.744\n"
+     L"  -replay <file>        read a replay file instead of the volume\n"
+     L"  -capture <file>       save the buffers read to a replay file\n"
+     L"  -archive <file>       add the records read to a compact archive\n"
+     L"  -fromarchive <file>   read an archive instead of the volume\n"
+     L"  -history <frn>        -fromarchive, only records of the file frn,\n"
+     L"                        found through the index beside the archive\n"
+     L"  -children <frn>       -fromarchive, only records in the directory frn\n"
+     L"  -checkpoint <file>    resume from the usn saved in file by the last\n"
+     L"                        run, and save where this one stops\n"
+     L"  -volume <X:|file>     read this volume, or replay file, with any other\n"
+     L"                        -volume at the same time, merged on time and\n"
+     L"                        tagged; -checkpoint is file.X per volume\n"
+     L"  -since <time>         start at the first record at or after time, utc\n"
+     L"                        as 2020-06-06T23:50:43 or nt time as 0x<hex>,\n"
+     L"                        found by bisecting the journal\n"
+     L"  -usnjrnl <file>       walk a raw $UsnJrnl:$J stream in place\n"
+     L"  -threads <n>          decode a $J stream on n threads, 0 for all\n"
+     L"                        processors; the whole stream is read, and\n"
+     L"                        not with -tree, which needs records in order\n"
+     L"  -pipeline <n>         read, walk and write on three threads with n\n"
+     L"                        buffers between them, 0 for one thread\n"
+     L"                        (default 8 given two processors or more);\n"
+     L"                        not when following\n"
+     L"  -buffer <kb>          ask the journal for kb a read (default 64, at\n"
+     L"                        most 16384)\n"
+     L"  -overlapped           one thread, two buffers; the next read is in\n"
+     L"                        the kernel while the last is walked, in place\n"
+     L"                        of -pipeline; not when following\n"
+     L"  -cache <n>            parent paths to cache, 0 for none (default 4096)\n"
+     L"  -negttl <ms>          keep failed path lookups this long (default 2000)\n"
+     L"  -synthpaths           made-up parent paths, for replays elsewhere\n"
+     L"  -watch <file>         only records in the directories listed in file,\n"
+     L"                        a path or 0x<frn> a line; \\... for a subtree\n"
+     L"  -tree                 build parent paths from the journal itself\n"
+     L"  -seed                 -tree, seeded from the volume's mft first\n"
+     L"  -snapshot <file>      -tree, kept in file between runs and brought\n"
+     L"                        up to date from there; -checkpoint and -since\n"
+     L"                        still say where records are shown from\n"
+     L"  -follow               keep reading as records arrive, from the end of\n"
+     L"                        the journal or the checkpoint; the count does\n"
+     L"                        not apply and ctrl-c stops\n"
+     L"  -minbytes <n>         following, wait for n bytes of journal (default 1)\n"
+     L"  -maxlatency <ms>      following, give up a wait after ms even short of\n"
+     L"                        -minbytes, 0 never (default 100)\n"
+     L"  -maxwait <ms>         following, stop after ms with nothing new\n"
+     L"  -simlive <n> <rate>   a simulated live journal of n records, let out\n"
+     L"                        rate a second, instead of the volume\n"
+     L"  -bench format <n>     time the record view on n synthetic records\n"
+     L"  -bench time <n>       time and check the timestamp formatter\n"
+     L"  -bench history <n>    n -history lookups on -fromarchive, indexed and\n"
+     L"                        by a full scan\n"
+     L"  -bench prefilter <n>  walk n synthetic records for closes, and\n"
+     L"                        -filter, a record at a time and batched\n"
+     L"  -bench names <n>      match n synthetic names against 8 and 512 globs,\n"
+     L"                        as one set and a glob at a time\n"
+     L"  -bench reads <n>      read n synthetic records with buffers of 8KB to\n"
+     L"                        16MB, reads a million records and MB/s\n"
+     L"  -bench decode <n>     n synthetic records as v2 records and v4\n"
+     L"                        extents, decoded, merged and checked, then\n"
+     L"                        decoded again with bytes changed at random\n"
+     L"  -bench walk <n>       walk n synthetic records with the routines for\n"
+     L"                        one version and output, and a record at a time\n"
+     L"  -synth <file> <n>     write a synthetic replay file of n records\n"
+     L"  -synthj <file> <n>    write a synthetic $J stream of n records\n",
+     ((argv0 != NULL) ? argv0 : L"j0")
+     );
+}
+
+/*++
+ */
+BOOL
+_UsnpReadJournalData (
+    __in wchar_t* pathname,
+    __in DWORD Reason )
+{
+    BOOL status;
+    USN_SOURCE Source = {0};
+    USN_JOURNAL_DATA JournalData = {0};
+    USN StartUsn = 0;
+    USN NextUsn = 0;
+    BOOL resumed = FALSE;
+
+    if(pathname == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if(g_replay != NULL)
+    {
+        status = _UsnpOpenReplaySource(g_replay, &Source);
+    }
+    else if(g_fromarchive != NULL)
+    {
+        status = _UsnpOpenArchiveSource(g_fromarchive, &g_history, &Source);
+    }
+    else if(g_simlive != 0)
+    {
+        status = _UsnpOpenLiveSource(g_simlive, g_simrate, &Source);
+    }
+    else
+    {
+        status = _UsnpOpenVolumeSource(pathname, &Source);
+    }
+
+    if(status == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"open failed, status(%X)\n", GetLastError());
+        return FALSE;
+    }
+
+    status = Source.Query(&Source, &JournalData);
+    if(status == FALSE)
+    {
+        /*++ last error set by call. might be ERROR_JOURNAL_NOT_ACTIVE ... */
+        fwprintf(stderr, L"ioctl failed, status(%X)\n", GetLastError());
+        Source.Close(&Source);
+        return FALSE;
+    }
+
+    status = _UsnpFormatJournalData(Source.Name, &JournalData);
+    if(status == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"format journal data failed, status(%X)\n", GetLastError());
+        Source.Close(&Source);
+        return FALSE;
+    }
+
+    if(g_capture != NULL)
+    {
+        if( _UsnpCreateReplayFile(g_capture, &JournalData, &g_capturefp) == FALSE)
+        {
+            fwprintf(stderr, L"create capture failed, status(%X)\n", GetLastError());
+            Source.Close(&Source);
+            return FALSE;
+        }
+    }
+
+    if(g_archive != NULL)
+    {
+        if( _UsnpOpenArchiveWriter(g_archive, &JournalData, &g_archivewriter) == FALSE)
+        {
+            fwprintf(stderr, L"open archive %ls failed, status(%X); an archive holds one journal\n", g_archive, GetLastError());
+            if(g_capturefp != NULL)
+            {
+                _UsnpCloseReplayFile(g_capturefp, NULL);
+                g_capturefp = NULL;
+            }
+            Source.Close(&Source);
+            return FALSE;
+        }
+    }
+
+    /*++ 
+     * start at the beginning, or where the last run with this checkpoint
+     * left off, and save where this one does ...
+     */
+    if(g_checkpoint != NULL)
+    {
+        if( _UsnpLoadCheckpoint(g_checkpoint, &JournalData, &StartUsn) == FALSE)
+        {
+            fwprintf(stderr, L"no usable checkpoint in %ls, status(%X); reading it all\n", g_checkpoint, GetLastError());
+        }
+        else
+        {
+            fwprintf(g_info, L"checkpoint(%ls), from usn %016llX\n", g_checkpoint, StartUsn);
+            resumed = TRUE;
+        }
+    }
+
+    /*++ with nothing to resume from, a follower starts with what comes next ... */
+    if(g_follow && (resumed == FALSE))
+    {
+        StartUsn = JournalData.NextUsn;
+    }
+
+    /*++ a time only moves the start forward; a checkpoint past it stands ... */
+    if(g_since != 0)
+    {
+        USN SinceUsn = 0;
+        DWORD probes = 0;
+
+        if( _UsnpSeekJournalTime(&Source, &JournalData, g_since, &SinceUsn, &probes) == FALSE)
+        {
+            fwprintf(stderr, L"seek to time failed, status(%X); reading it all\n", GetLastError());
+        }
+        else
+        {
+            fwprintf(g_info, L"since(%016llX), from usn %016llX after %u reads\n", g_since, SinceUsn, probes);
+            if(SinceUsn > StartUsn)
+            {
+                StartUsn = SinceUsn;
+            }
+        }
+    }
+
+    status = _UsnpReadJournalRecords(&Source, &JournalData, StartUsn, Reason, &NextUsn);
+    if(status == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"read journal records failed, status(%X)\n", GetLastError());
+    }
+
+    /*++ the archive is written out before the checkpoint can pass it ... */
+    if(g_archivewriter != NULL)
+    {
+        if( _UsnpCloseArchiveWriter(g_archivewriter) == FALSE)
+        {
+            fwprintf(stderr, L"write archive failed, status(%X)\n", GetLastError());
+            status = FALSE;
+        }
+        g_archivewriter = NULL;
+    }
+
+    /*++ and the ranges; a run resumed past them would not see them again ... */
+    if((status != FALSE) && (g_rangesfile != NULL))
+    {
+        status = _UsnpSaveRanges(&g_ranges, g_rangesfile);
+        if(status == FALSE)
+        {
+            fwprintf(stderr, L"save ranges failed, status(%X)\n", GetLastError());
+        }
+    }
+
+    if((status != FALSE) && (g_checkpoint != NULL))
+    {
+        status = _UsnpSaveCheckpoint(g_checkpoint, JournalData.UsnJournalID, NextUsn);
+        if(status == FALSE)
+        {
+            fwprintf(stderr, L"save checkpoint failed, status(%X)\n", GetLastError());
+        }
+    }
+
+    if(g_capturefp != NULL)
+    {
+        _UsnpCloseReplayFile(g_capturefp, NULL);
+        g_capturefp = NULL;
+    }
+
+    Source.Close(&Source);
+    return status;
+}
+
+/*++
+ * read several journals at once, one reader thread each, and merge their
+ * records into one stream in time order. each volume's next record sits
+ * in a heap keyed on its time, ties going to the volume given first; the
+ * earliest is walked, shown with its volume, and replaced by the one after
+ * it. a volume that fails is reported and the rest carry on. the count is
+ * over all of them; each checkpoint is saved as its own journal's ...
+ */
+BOOL
+_UsnpReadVolumes (
+    __in wchar_t** Names,
+    __in DWORD Count,
+    __in DWORD Reason )
+{
+    PUSN_VOLUME pVolumes = NULL;
+    DWORD* heap = NULL;
+    DWORD heapcount = 0;
+    DWORD error = ERROR_SUCCESS;
+    int count = 0;
+
+    if((Names == NULL) || (Count == 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pVolumes = (PUSN_VOLUME)_UsnpAlloc(Count * sizeof(USN_VOLUME));
+    heap = (DWORD*)_UsnpAlloc(Count * sizeof(DWORD));
+    if((pVolumes == NULL) || (heap == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(pVolumes);
+        _UsnpFree(heap);
+        return FALSE;
+    }
+
+    for(DWORD index=0; index<Count; index++)
+    {
+        pVolumes[index].Name = Names[index];
+        if( _UsnpOpenVolume(&pVolumes[index], Reason) == FALSE)
+        {
+            /*++ reported by the call; the others are read without it ... */
+            pVolumes[index].Status = GetLastError();
+        }
+        else if( _UsnpNextVolumeRecord(&pVolumes[index]))
+        {
+            heap[heapcount++] = index;
+        }
+    }
+
+    for(DWORD index=(heapcount / 2); index>0; index--)
+    {
+        _UsnpSiftVolumes(pVolumes, heap, heapcount, index - 1);
+    }
+
+    while(heapcount > 0)
+    {
+        PUSN_VOLUME pVolume = &pVolumes[heap[0]];
+        PUSN_RECORD_COMMON_HEADER pRecord = pVolume->pRecord;
+
+        /*++ the count is shared; each walk takes it up where the last left it ... */
+        g_volumetag = pVolume->Tag;
+        pVolume->Walk.Count = count;
+        if( _UsnpWalkRecords(&(pVolume->Walk), (uint8_t*)pRecord, pRecord->RecordLength) == FALSE)
+        {
+            pVolume->Status = GetLastError();
+        }
+        count = pVolume->Walk.Count;
+        g_volumetag = NULL;
+
+        /*++ a volume resumes past the last record it walked, or where its walk stopped ... */
+        if(pVolume->Walk.Done && pVolume->Walk.Stopped)
+        {
+            pVolume->StartUsn = pVolume->Walk.NextUsn;
+        }
+        else if(pVolume->Status == ERROR_SUCCESS)
+        {
+            pVolume->StartUsn = _UsnpGetRecordUsn(pRecord) + pRecord->RecordLength;
+        }
+
+        if(pVolume->Walk.Done)
+        {
+            error = ERROR_IMPLEMENTATION_LIMIT;
+            break;
+        }
+
+        pVolume->Offset += pRecord->RecordLength;
+        if((pVolume->Status != ERROR_SUCCESS) || (_UsnpNextVolumeRecord(pVolume) == FALSE))
+        {
+            heap[0] = heap[--heapcount];
+        }
+        _UsnpSiftVolumes(pVolumes, heap, heapcount, 0);
+    }
+
+    for(DWORD index=0; index<Count; index++)
+    {
+        _UsnpCloseVolume(&pVolumes[index], (pVolumes[index].Status == ERROR_SUCCESS));
+        if(pVolumes[index].Status != ERROR_SUCCESS)
+        {
+            fwprintf(stderr, L"volume %ls failed, status(%X)\n", pVolumes[index].Name, pVolumes[index].Status);
+            error = pVolumes[index].Status;
+        }
+    }
+
+    _UsnpFree(pVolumes);
+    _UsnpFree(heap);
+
+    if(error != ERROR_SUCCESS)
+    {
+        SetLastError(error);
+    }
+    return ((error == ERROR_SUCCESS) || (error == ERROR_IMPLEMENTATION_LIMIT));
+}
+
+/*++
+ * a volume, X:, or else a replay file, made ready to merge; its journal
+ * described, its checkpoint and -since applied, and its reader started.
+ * it is shown as X: or the replay's file name, and its checkpoint is the
+ * -checkpoint name with .X or .name added ...
+ */
+BOOL
+_UsnpOpenVolume (
+    __inout PUSN_VOLUME pVolume,
+    __in DWORD Reason )
+{
+    READ_USN_JOURNAL_DATA ReadData = {0};
+    const wchar_t* name = pVolume->Name;
+    const wchar_t* base = name + wcslen(name);
+    DWORD depth = ((g_pipeline != 0) ? g_pipeline : 2);
+    BOOL drive;
+    BOOL status;
+
+    pVolume->Status = ERROR_SUCCESS;
+
+    drive = ( iswalpha(name[0]) && (name[1] == L':') &&
+              ((name[2] == L'\0') || (((name[2] == L'\\') || (name[2] == L'/')) && (name[3] == L'\0'))) );
+    if(drive)
+    {
+        _snwprintf_s(pVolume->Tag, _countof(pVolume->Tag), _countof(pVolume->Tag), L"%lc:", (wint_t)towupper(name[0]));
+        status = _UsnpOpenVolumeSource((wchar_t*)name, &(pVolume->Source));
+    }
+    else
+    {
+        while((base > name) && (base[-1] != L'\\') && (base[-1] != L'/'))
+        {
+            base--;
+        }
+        _snwprintf_s(pVolume->Tag, _countof(pVolume->Tag), _countof(pVolume->Tag), L"%ls", base);
+        status = _UsnpOpenReplaySource((wchar_t*)name, &(pVolume->Source));
+    }
+
+    if(status == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"open %ls failed, status(%X)\n", name, GetLastError());
+        return FALSE;
+    }
+
+    if( pVolume->Source.Query(&(pVolume->Source), &(pVolume->JournalData)) == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"ioctl on %ls failed, status(%X)\n", name, GetLastError());
+        return FALSE;
+    }
+    _UsnpFormatJournalData(pVolume->Source.Name, &(pVolume->JournalData));
+
+    if(g_checkpoint != NULL)
+    {
+        /*++ the tag, less the colon of a drive ... */
+        _snwprintf_s(pVolume->Checkpoint, _countof(pVolume->Checkpoint), _countof(pVolume->Checkpoint), L"%ls.%.*ls",
+                     g_checkpoint, (int)(wcslen(pVolume->Tag) - ((drive) ? 1 : 0)), pVolume->Tag);
+        if( _UsnpLoadCheckpoint(pVolume->Checkpoint, &(pVolume->JournalData), &(pVolume->StartUsn)) == FALSE)
+        {
+            fwprintf(stderr, L"no usable checkpoint in %ls, status(%X); reading it all\n", pVolume->Checkpoint, GetLastError());
+        }
+        else
+        {
+            fwprintf(g_info, L"checkpoint(%ls), from usn %016llX\n", pVolume->Checkpoint, pVolume->StartUsn);
+        }
+    }
+
+    if(g_since != 0)
+    {
+        USN SinceUsn = 0;
+        DWORD probes = 0;
+
+        if( _UsnpSeekJournalTime(&(pVolume->Source), &(pVolume->JournalData), g_since, &SinceUsn, &probes) == FALSE)
+        {
+            fwprintf(stderr, L"seek %ls to time failed, status(%X); reading it all\n", name, GetLastError());
+        }
+        else
+        {
+            fwprintf(g_info, L"since(%016llX), from usn %016llX after %u reads\n", g_since, SinceUsn, probes);
+            if(SinceUsn > pVolume->StartUsn)
+            {
+                pVolume->StartUsn = SinceUsn;
+            }
+        }
+    }
+
+    if( _UsnpOpenResolver(pVolume->Source.Volume, &g_stats, &(pVolume->Resolver)) == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"open resolver for %ls failed, status(%X)\n", name, GetLastError());
+        return FALSE;
+    }
+
+    if(g_seed && (pVolume->Source.Volume != NULL))
+    {
+        if( _UsnpSeedResolver(pVolume->Source.Volume, &(pVolume->JournalData), &(pVolume->Resolver)) == FALSE)
+        {
+            fwprintf(stderr, L"seed %ls from mft failed, status(%X)\n", name, GetLastError());
+        }
+    }
+
+    if((g_coalesce != 0) && (_UsnpOpenCoalesce(&(pVolume->Coalesce), g_coalesce, g_coalesceage, &g_stats) == FALSE))
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"open coalesce for %ls failed, status(%X)\n", name, GetLastError());
+        return FALSE;
+    }
+
+    /*++ records are merged one at a time, so there are no batches to prefilter ... */
+    pVolume->Walk.pResolver  = &(pVolume->Resolver);
+    pVolume->Walk.pFilter    = ((g_filter.Ops != NULL) ? &g_filter : NULL);
+    pVolume->Walk.pCoalesce  = ((g_coalesce != 0) ? &(pVolume->Coalesce) : NULL);
+    pVolume->Walk.pMoves     = ((g_moves) ? &(pVolume->Moves) : NULL);
+    pVolume->Moves.pStats    = &g_stats;
+    pVolume->Walk.ReasonMask = _USN_REASON_ALL;
+    pVolume->Walk.Limit      = g_count;
+    pVolume->Walk.pStats     = &g_stats;
+
+    ReadData.UsnJournalID    = pVolume->JournalData.UsnJournalID;
+    ReadData.StartUsn        = pVolume->StartUsn;
+    ReadData.ReasonMask      = Reason;
+    ReadData.MinMajorVersion = pVolume->JournalData.MinSupportedMajorVersion;
+    ReadData.MaxMajorVersion = pVolume->JournalData.MaxSupportedMajorVersion;
+
+    if( _UsnpOpenPipeline(&(pVolume->Pipe), &(pVolume->Source), &ReadData, depth) == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"open pipeline for %ls failed, status(%X)\n", name, GetLastError());
+        return FALSE;
+    }
+    pVolume->Pipe.pStats = &(pVolume->Stats);
+    g_stats.PipeSlots = depth;
+
+    if( _UsnpCreateThread(_UsnpPipeReader, &(pVolume->Pipe), &(pVolume->Reader)) == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"create reader for %ls failed, status(%X)\n", name, GetLastError());
+        return FALSE;
+    }
+    pVolume->Started = TRUE;
+    return TRUE;
+}
+
+/*++
+ * stop a volume's reader, taking whatever it still sends, and close the
+ * rest. with Save, records held by the walk go out and the checkpoint is
+ * written; the volume was read without error ...
+ */
+void
+_UsnpCloseVolume (
+    __inout PUSN_VOLUME pVolume,
+    __in BOOL Save )
+{
+    if(pVolume->Started)
+    {
+        _UsnpStoreRelease(&(pVolume->Pipe.Stop), 1);
+        if(pVolume->pSlot != NULL)
+        {
+            _UsnpPutRing(&(pVolume->Pipe.Free), pVolume->pSlot);
+            pVolume->pSlot = NULL;
+        }
+
+        while(pVolume->Ended == FALSE)
+        {
+            PUSN_PIPE_SLOT pSlot = _UsnpTakeRing(&(pVolume->Pipe.Filled), &(g_stats.PipeWaits[1]));
+            pVolume->Ended = pSlot->Last;
+            _UsnpPutRing(&(pVolume->Pipe.Free), pSlot);
+        }
+
+        _UsnpJoinThread(&(pVolume->Reader));
+        pVolume->Started = FALSE;
+
+        g_stats.Reads += pVolume->Stats.Reads;
+        g_stats.PipeWaits[0] += pVolume->Stats.PipeWaits[0];
+    }
+
+    if(Save)
+    {
+        g_volumetag = pVolume->Tag;
+        _UsnpWalkFlush(&(pVolume->Walk));
+        g_volumetag = NULL;
+
+        if((g_checkpoint != NULL) && (_UsnpSaveCheckpoint(pVolume->Checkpoint, pVolume->JournalData.UsnJournalID, pVolume->StartUsn) == FALSE))
+        {
+            fwprintf(stderr, L"save checkpoint %ls failed, status(%X)\n", pVolume->Checkpoint, GetLastError());
+        }
+    }
+
+    _UsnpCloseCoalesce(&(pVolume->Coalesce));
+    _UsnpCloseResolver(&(pVolume->Resolver));
+    _UsnpClosePipeline(&(pVolume->Pipe));
+    if(pVolume->Source.Close != NULL)
+    {
+        pVolume->Source.Close(&(pVolume->Source));
+        pVolume->Source.Close = NULL;
+    }
+}
+
+/*++
+ * move a volume on to its next record, taking the next slot from its
+ * reader once a slot is used up; a used-up slot moves where the volume
+ * would resume. FALSE once the reader has no more, or on a bad record,
+ * with Status set for a failure ...
+ */
+BOOL
+_UsnpNextVolumeRecord (
+    __inout PUSN_VOLUME pVolume )
+{
+    while(1)
+    {
+        PUSN_PIPE_SLOT pSlot = pVolume->pSlot;
+
+        if(pSlot != NULL)
+        {
+            if(pVolume->Offset < pSlot->Bytes)
+            {
+                PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(((uint8_t*)pSlot->Buffer) + pVolume->Offset);
+                LONGLONG stamp;
+
+                if( ((pSlot->Bytes - pVolume->Offset) < sizeof(USN_RECORD_COMMON_HEADER)) ||
+                    (pRecord->RecordLength < sizeof(USN_RECORD_COMMON_HEADER)) ||
+                    (pRecord->RecordLength > (pSlot->Bytes - pVolume->Offset)))
+                {
+                    pVolume->Status = ERROR_INVALID_DATA;
+                    return FALSE;
+                }
+
+                /*++ a v4 record has no time; it goes with the record before ... */
+                stamp = _UsnpGetRecordTimeStamp(pRecord);
+                if(stamp != 0)
+                {
+                    pVolume->TimeStamp = stamp;
+                }
+                pVolume->pRecord = pRecord;
+                return TRUE;
+            }
+
+            pVolume->StartUsn = *(USN*)pSlot->Buffer;
+            _UsnpPutRing(&(pVolume->Pipe.Free), pSlot);
+            pVolume->pSlot = NULL;
+        }
+
+        pSlot = _UsnpTakeRing(&(pVolume->Pipe.Filled), &(g_stats.PipeWaits[1]));
+        if(pSlot->Last)
+        {
+            pVolume->Status = pSlot->Status;
+            pVolume->Ended = TRUE;
+            _UsnpPutRing(&(pVolume->Pipe.Free), pSlot);
+            return FALSE;
+        }
+
+        pVolume->pSlot = pSlot;
+        pVolume->Offset = sizeof(USN);
+    }
+}
+
+/*++ sift heap[index] down to its place; earliest time on top, then the volume given first ... */
+void
+_UsnpSiftVolumes (
+    __in PUSN_VOLUME pVolumes,
+    __inout DWORD* heap,
+    __in DWORD count,
+    __in DWORD index )
+{
+    DWORD item = heap[index];
+
+    while(1)
+    {
+        DWORD child = (index * 2) + 1;
+
+        if(child >= count)
+        {
+            break;
+        }
+
+        if( ((child + 1) < count) &&
+            ((pVolumes[heap[child + 1]].TimeStamp < pVolumes[heap[child]].TimeStamp) ||
+             ((pVolumes[heap[child + 1]].TimeStamp == pVolumes[heap[child]].TimeStamp) && (heap[child + 1] < heap[child]))))
+        {
+            child++;
+        }
+
+        if( (pVolumes[item].TimeStamp < pVolumes[heap[child]].TimeStamp) ||
+            ((pVolumes[item].TimeStamp == pVolumes[heap[child]].TimeStamp) && (item < heap[child])))
+        {
+            break;
+        }
+
+        heap[index] = heap[child];
+        index = child;
+    }
+
+    if(count > 0)
+    {
+        heap[index] = item;
+    }
+}
+
+/*++
+ */
+BOOL
+_UsnpReadJournalRecords (
+    __in PUSN_SOURCE pSource,
+    __in USN_JOURNAL_DATA* pJournalData,
+    __in USN StartUsn,
+    __in DWORD Reason,
+    __out_opt USN* pNextUsn )
+{
+    BOOL status = TRUE;
+    uint64_t* buffer = NULL;
+    DWORD bytes = 0;
+    USN_WALK Walk = {0};
+    USN_RESOLVER Resolver = {0};
+    USN_COALESCE Coalesce = {0};
+    USN_MOVES Moves = {0};
+    USN_PREFILTER Prefilter;
+    READ_USN_JOURNAL_DATA ReadData = {0};
+    wchar_t temp[MAX_PATH] = {0};
+    uint64_t idle = 0;
+    uint64_t saved = 0;
+    USN ValidUsn = 0;
+    BOOL loaded = FALSE;
+
+    /*++ check ptr ... */
+    if((pSource == NULL) || (pJournalData == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    ReadData.UsnJournalID    = pJournalData->UsnJournalID;
+    ReadData.StartUsn        = StartUsn;
+    ReadData.ReasonMask      = Reason;
+
+    /*++ these values require NTDDI_WIN8 and above ... */
+    ReadData.MinMajorVersion = pJournalData->MinSupportedMajorVersion;
+    ReadData.MaxMajorVersion = pJournalData->MaxSupportedMajorVersion;
+
+    if( _UsnpOpenResolver(pSource->Volume, &g_stats, &Resolver) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    g_watch.pTree = _UsnpGetTree(&Resolver);
+
+    if((g_coalesce != 0) && (_UsnpOpenCoalesce(&Coalesce, g_coalesce, g_coalesceage, &g_stats) == FALSE))
+    {
+        /*++ last error set by call ... */
+        _UsnpCloseResolver(&Resolver);
+        return FALSE;
+    }
+
+    /*++
+     * the tree is brought up to date from where the snapshot was saved. a
+     * start past that, from -checkpoint or -since, is read from the
+     * snapshot's usn with the records before the start given to the
+     * resolver only; a start before it is read from there as asked ...
+     */
+    if(g_snapshot != NULL)
+    {
+        if( _UsnpLoadTreeSnapshot(&Resolver, g_snapshot, pJournalData, &ValidUsn) == FALSE)
+        {
+            fwprintf(stderr, L"no usable snapshot in %ls, status(%X); reading it all\n", g_snapshot, GetLastError());
+        }
+        else
+        {
+            fwprintf(g_info, L"snapshot(%ls), tree at usn %016llX\n", g_snapshot, ValidUsn);
+            loaded = TRUE;
+            if(ValidUsn < ReadData.StartUsn)
+            {
+                Walk.ShowUsn = ReadData.StartUsn;
+                ReadData.StartUsn = ValidUsn;
+            }
+        }
+    }
+
+    if(g_seed && (pSource->Volume != NULL) && (loaded == FALSE))
+    {
+        if( _UsnpSeedResolver(pSource->Volume, pJournalData, &Resolver) == FALSE)
+        {
+            fwprintf(stderr, L"seed from mft failed, status(%X)\n", GetLastError());
+        }
+    }
+
+    /*++ the ioctl does the reason filtering ... */
+    Walk.pResolver  = &Resolver;
+    Walk.pWatch     = ((g_watchlist != NULL) ? &g_watch : NULL);
+    Walk.pFilter    = ((g_filter.Ops != NULL) ? &g_filter : NULL);
+    Walk.pCoalesce  = ((g_coalesce != 0) ? &Coalesce : NULL);
+    Walk.pMoves     = ((g_moves) ? &Moves : NULL);
+    Walk.pRanges    = ((g_rangesfile != NULL) ? &g_ranges : NULL);
+    Moves.pStats    = &g_stats;
+    Walk.ReasonMask = _USN_REASON_ALL;
+    Walk.Limit      = g_count;
+    Walk.pStats     = &g_stats;
+    _UsnpOpenPrefilter(&Walk, &Prefilter);
+
+    /*++
+     * following, each read waits in the kernel until minbytes of journal
+     * are past the start usn, or maxlatency runs out, rather than coming
+     * back empty at once ...
+     */
+    if(g_follow)
+    {
+        ReadData.BytesToWaitFor = g_minbytes;
+        ReadData.Timeout        = (DWORDLONG)g_maxlatency * _USN_TIMEOUT_PER_MS;
+        Walk.Limit              = 0;
+        idle = saved = _UsnpQueryClock();
+    }
+
+    /*++ read to the end, the read, the walk and the write can overlap ... */
+    if(g_overlapped && (g_follow == 0))
+    {
+        status = _UsnpReadOverlapped(pSource, &ReadData, &Walk);
+        goto walked;
+    }
+    if((g_pipeline != 0) && (g_follow == 0))
+    {
+        status = _UsnpRunPipeline(pSource, &ReadData, &Walk, g_pipeline);
+        goto walked;
+    }
+
+    /*++ not zeroed; the read says how much of it is good ... */
+    buffer = (uint64_t*)_UsnpAlloc(g_readsize);
+    status = (buffer != NULL);
+
+    while(status != FALSE)
+    {
+        status = pSource->Read(pSource, &ReadData, buffer, g_readsize, &bytes);
+        if(status == FALSE)
+        {
+            /*++ last error set by call ... */
+            break;
+        }
+
+        g_stats.Reads++;
+
+        if(g_capturefp != NULL)
+        {
+            status = _UsnpWriteReplayChunk(g_capturefp, buffer, bytes);
+            if(status == FALSE)
+            {
+                /*++ last error set by call ... */
+                break;
+            }
+        }
+
+        if(g_archivewriter != NULL)
+        {
+            status = _UsnpArchiveChunk(g_archivewriter, buffer, bytes);
+            if(status == FALSE)
+            {
+                /*++ last error set by call ... */
+                break;
+            }
+        }
+
+        /*++
+         * nothing past the leading usn means the reader has caught up with
+         * the journal ...
+         */
+        if(bytes <= sizeof(USN))
+        {
+            if((g_follow == 0) || g_stop)
+            {
+                break;
+            }
+
+            /*++ the wait ran out; records the mask passed over still move the usn ... */
+            if(bytes == sizeof(USN))
+            {
+                ReadData.StartUsn = *(USN*)buffer;
+            }
+            if((g_maxwait != 0) && ((_UsnpQueryClock() - idle) >= ((uint64_t)g_maxwait * 1000)))
+            {
+                break;
+            }
+            continue;
+        }
+
+        Walk.Now = ((g_follow) ? _UsnpQuerySystemTime() : 0);
+
+        /*++ 
+         * the returned buffer starts with the next usn after those in
+         * the buffer. after looping on this buffer, set the startusn
+         * to the value at the beginning of this buffer and ask more ...
+         */
+        status = _UsnpWalkRecords(&Walk, ((uint8_t*)buffer) + sizeof(USN), bytes - sizeof(USN));
+        if(status == FALSE)
+        {
+            /*++ last error set by call ... */
+            break;
+        }
+
+        if(Walk.Done)
+        {
+            SetLastError(ERROR_IMPLEMENTATION_LIMIT);
+            break;
+        }
+
+        /*++ get the next starting usn ... */
+        ReadData.StartUsn = *(USN*)buffer;
+
+        if(g_follow)
+        {
+            uint64_t now = _UsnpQueryClock();
+
+            /*++ a batch goes out as soon as it is read ... */
+            _UsnpFlushOutput(&g_stdout);
+            idle = now;
+
+            /*++
+             * a follower may never exit cleanly; keep the checkpoint current,
+             * and the archive written out at least as far ...
+             */
+            if((g_checkpoint != NULL) && ((now - saved) >= _USN_CHECKPOINT_INTERVAL))
+            {
+                if((g_archivewriter != NULL) && (_UsnpFlushArchive(g_archivewriter, ReadData.StartUsn) == FALSE))
+                {
+                    fwprintf(stderr, L"write archive failed, status(%X)\n", GetLastError());
+                }
+                else if( _UsnpSaveCheckpoint(g_checkpoint, pJournalData->UsnJournalID, ReadData.StartUsn) == FALSE)
+                {
+                    fwprintf(stderr, L"save checkpoint failed, status(%X)\n", GetLastError());
+                }
+                saved = now;
+            }
+
+            if(g_stop)
+            {
+                break;
+            }
+        }
+    }
+
+walked:
+    _UsnpFree(buffer);
+    if(status != FALSE)
+    {
+        _UsnpWalkFlush(&Walk);
+    }
+    _UsnpCloseCoalesce(&Coalesce);
+
+    /*++
+     * where to resume. a run read to the end resumes at the last buffer's
+     * next usn, past what the reason mask passed over; one stopped by the
+     * count resumes past the last record it took ...
+     */
+    if(Walk.Done && Walk.Stopped)
+    {
+        ReadData.StartUsn = Walk.NextUsn;
+    }
+
+    if((g_snapshot != NULL) && (status != FALSE))
+    {
+        _snwprintf_s(temp, _countof(temp), _countof(temp), L"%ls.tmp", g_snapshot);
+        status = _UsnpSaveTreeSnapshot(&Resolver, temp, pJournalData->UsnJournalID, ReadData.StartUsn);
+    }
+
+    _UsnpCloseResolver(&Resolver);
+
+    /*++ a run that read nothing new still resumes no earlier than it started ... */
+    if(pNextUsn != NULL)
+    {
+        *pNextUsn = ((ReadData.StartUsn > StartUsn) ? ReadData.StartUsn : StartUsn);
+    }
+
+    if((g_snapshot != NULL) && (status != FALSE))
+    {
+        /*++ the old snapshot is unmapped now and can be replaced ... */
+        status = _UsnpReplaceFile(temp, g_snapshot);
+    }
+    return status;
+}
+
+/*++
+ * read to the end of the journal in three stages. this thread walks; a
+ * reader thread fills buffers ahead of it and a writer thread puts out
+ * the text made from them, so each waits on the kernel, the walk or the
+ * console only when the slots run out. captures and archives are made
+ * here, in journal order, and the start usn is left where the one-thread
+ * loop would leave it ...
+ */
+BOOL
+_UsnpRunPipeline (
+    __in PUSN_SOURCE pSource,
+    __inout PREAD_USN_JOURNAL_DATA pReadData,
+    __in PUSN_WALK pWalk,
+    __in DWORD Depth )
+{
+    USN_PIPELINE Pipe;
+    USN_THREAD Reader = {0};
+    USN_THREAD Writer = {0};
+    PUSN_PIPE_SLOT pSlot;
+    DWORD error = ERROR_SUCCESS;
+    BOOL stopped = FALSE;
+    BOOL status = TRUE;
+    BOOL last;
+
+    if((pSource == NULL) || (pReadData == NULL) || (pWalk == NULL) || (Depth == 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if( _UsnpOpenPipeline(&Pipe, pSource, pReadData, Depth) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    /*++ anything already printed goes out ahead of the writer ... */
+    _UsnpFlushOutput(&g_stdout);
+    g_stats.PipeSlots = Depth;
+
+    if( _UsnpCreateThread(_UsnpPipeWriter, &Pipe, &Writer) == FALSE)
+    {
+        /*++ last error set by call ... */
+        _UsnpClosePipeline(&Pipe);
+        return FALSE;
+    }
+
+    if( _UsnpCreateThread(_UsnpPipeReader, &Pipe, &Reader) == FALSE)
+    {
+        /*++ there is no reader to take a free slot; end the writer with one here ... */
+        error = GetLastError();
+        pSlot = _UsnpTakeRing(&Pipe.Free, &(g_stats.PipeWaits[1]));
+        pSlot->Last = TRUE;
+        _UsnpPutRing(&Pipe.Written, pSlot);
+        _UsnpJoinThread(&Writer);
+        _UsnpClosePipeline(&Pipe);
+        SetLastError(error);
+        return FALSE;
+    }
+
+    do
+    {
+        pSlot = _UsnpTakeRing(&Pipe.Filled, &(g_stats.PipeWaits[1]));
+        last = pSlot->Last;
+        pSlot->Output.Length = 0;
+
+        /*++ once stopped, slots still in flight go round empty until the last ... */
+        if(stopped == FALSE)
+        {
+            if( _UsnpLoadAcquire(&Pipe.Failed))
+            {
+                error = ERROR_WRITE_FAULT;
+                status = FALSE;
+            }
+            else if(pSlot->Status != ERROR_SUCCESS)
+            {
+                error = pSlot->Status;
+                status = FALSE;
+            }
+            else if( _UsnpPipeWalk(pWalk, pSlot) == FALSE)
+            {
+                error = GetLastError();
+                status = FALSE;
+            }
+            else if(pWalk->Done)
+            {
+                error = ERROR_IMPLEMENTATION_LIMIT;
+            }
+            else if(last == FALSE)
+            {
+                pReadData->StartUsn = *(USN*)pSlot->Buffer;
+            }
+
+            if((error != ERROR_SUCCESS) && (last == FALSE))
+            {
+                stopped = TRUE;
+                _UsnpStoreRelease(&Pipe.Stop, 1);
+            }
+        }
+
+        _UsnpPutRing(&Pipe.Written, pSlot);
+    }
+    while(last == FALSE);
+
+    _UsnpJoinThread(&Reader);
+    _UsnpJoinThread(&Writer);
+
+    if((status != FALSE) && _UsnpLoadAcquire(&Pipe.Failed))
+    {
+        error = ERROR_WRITE_FAULT;
+        status = FALSE;
+    }
+    _UsnpClosePipeline(&Pipe);
+
+    if(error != ERROR_SUCCESS)
+    {
+        SetLastError(error);
+    }
+    return status;
+}
+
+/*++
+ * read to the end of the journal on one thread with two buffers. once a
+ * read is done its next usn is known, so the read after it is started
+ * before it is walked, and the kernel fills one buffer while the walk is
+ * on the other. captures and archives, the count and the start usn come
+ * out as in the one-buffer loop ...
+ */
+BOOL
+_UsnpReadOverlapped (
+    __in PUSN_SOURCE pSource,
+    __inout PREAD_USN_JOURNAL_DATA pReadData,
+    __in PUSN_WALK pWalk )
+{
+    USN_READ Reads[2];
+    PUSN_READ pRead;
+    PUSN_READ pNext;
+    DWORD current = 0;
+    DWORD error = ERROR_SUCCESS;
+    BOOL pending = FALSE;
+    BOOL status = TRUE;
+
+    if((pSource == NULL) || (pReadData == NULL) || (pWalk == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(Reads, sizeof(Reads));
+    for(DWORD index=0; index<_countof(Reads); index++)
+    {
+        Reads[index].Size = g_readsize;
+        Reads[index].Buffer = (uint64_t*)_UsnpAlloc(g_readsize);
+        if(Reads[index].Buffer == NULL)
+        {
+            /*++ last error set by call ... */
+            status = FALSE;
+        }
+    }
+
+    if(status != FALSE)
+    {
+        Reads[0].ReadData = *pReadData;
+        status = pending = _UsnpSubmitRead(pSource, &(Reads[0]));
+    }
+
+    while(status != FALSE)
+    {
+        pRead = &(Reads[current]);
+        pNext = &(Reads[current ^ 1]);
+
+        pending = FALSE;
+        status = _UsnpCompleteRead(pSource, pRead);
+        if(status == FALSE)
+        {
+            /*++ last error set by call ... */
+            break;
+        }
+
+        g_stats.Reads++;
+
+        if((g_capturefp != NULL) && (_UsnpWriteReplayChunk(g_capturefp, pRead->Buffer, pRead->Bytes) == FALSE))
+        {
+            /*++ last error set by call ... */
+            status = FALSE;
+            break;
+        }
+
+        if((g_archivewriter != NULL) && (_UsnpArchiveChunk(g_archivewriter, pRead->Buffer, pRead->Bytes) == FALSE))
+        {
+            /*++ last error set by call ... */
+            status = FALSE;
+            break;
+        }
+
+        /*++ nothing past the leading usn, the end of the journal ... */
+        if(pRead->Bytes <= sizeof(USN))
+        {
+            break;
+        }
+
+        pNext->ReadData = pRead->ReadData;
+        pNext->ReadData.StartUsn = *(USN*)pRead->Buffer;
+        status = pending = _UsnpSubmitRead(pSource, pNext);
+        if(status == FALSE)
+        {
+            /*++ last error set by call ... */
+            break;
+        }
+
+        status = _UsnpWalkRecords(pWalk, ((uint8_t*)pRead->Buffer) + sizeof(USN), pRead->Bytes - sizeof(USN));
+        if(status == FALSE)
+        {
+            /*++ last error set by call ... */
+            break;
+        }
+
+        if(pWalk->Done)
+        {
+            SetLastError(ERROR_IMPLEMENTATION_LIMIT);
+            break;
+        }
+
+        pReadData->StartUsn = pNext->ReadData.StartUsn;
+        current ^= 1;
+    }
+
+    /*++ a read still out has to be done with before its buffer goes ... */
+    error = GetLastError();
+    if(pending)
+    {
+        _UsnpCompleteRead(pSource, &(Reads[current ^ 1]));
+    }
+
+    for(DWORD index=0; index<_countof(Reads); index++)
+    {
+#if defined(_WIN32)
+        if(Reads[index].Overlapped.hEvent != NULL)
+        {
+            CloseHandle(Reads[index].Overlapped.hEvent);
+        }
+#endif  /* _WIN32 */
+        _UsnpFree(Reads[index].Buffer);
+    }
+
+    SetLastError(error);
+    return status;
+}
+
+/*++ start a read; a source that cannot overlap reads does it here and now ... */
+BOOL
+_UsnpSubmitRead (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead )
+{
+    if(pSource->Submit != NULL)
+    {
+        return pSource->Submit(pSource, pRead);
+    }
+
+    pRead->Bytes = 0;
+    pRead->Status = ERROR_SUCCESS;
+    if( pSource->Read(pSource, &(pRead->ReadData), pRead->Buffer, pRead->Size, &(pRead->Bytes)) == FALSE)
+    {
+        pRead->Status = GetLastError();
+    }
+    return TRUE;
+}
+
+/*++ wait for a read started by _UsnpSubmitRead ... */
+BOOL
+_UsnpCompleteRead (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead )
+{
+    if(pSource->Complete != NULL)
+    {
+        return pSource->Complete(pSource, pRead);
+    }
+
+    if(pRead->Status != ERROR_SUCCESS)
+    {
+        SetLastError(pRead->Status);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++ Depth slots, all free, and rings with room for every one of them ... */
+BOOL
+_UsnpOpenPipeline (
+    __out PUSN_PIPELINE pPipe,
+    __in PUSN_SOURCE pSource,
+    __in PREAD_USN_JOURNAL_DATA pReadData,
+    __in DWORD Depth )
+{
+    size_t capacity = 1;
+
+    RtlZeroMemory(pPipe, sizeof(USN_PIPELINE));
+
+    while(capacity < Depth)
+    {
+        capacity <<= 1;
+    }
+
+    pPipe->pSource    = pSource;
+    pPipe->ReadData   = *pReadData;
+    pPipe->pStats     = &g_stats;
+    pPipe->Depth      = Depth;
+    pPipe->BufferSize = g_readsize;
+    pPipe->Slots            = (PUSN_PIPE_SLOT)_UsnpAlloc(Depth * sizeof(USN_PIPE_SLOT));
+    pPipe->Free.Entries     = (PUSN_PIPE_SLOT*)_UsnpAlloc(capacity * sizeof(PUSN_PIPE_SLOT));
+    pPipe->Filled.Entries   = (PUSN_PIPE_SLOT*)_UsnpAlloc(capacity * sizeof(PUSN_PIPE_SLOT));
+    pPipe->Written.Entries  = (PUSN_PIPE_SLOT*)_UsnpAlloc(capacity * sizeof(PUSN_PIPE_SLOT));
+    pPipe->Free.Mask = pPipe->Filled.Mask = pPipe->Written.Mask = capacity - 1;
+
+    if((pPipe->Slots == NULL) || (pPipe->Free.Entries == NULL) || (pPipe->Filled.Entries == NULL) || (pPipe->Written.Entries == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpClosePipeline(pPipe);
+        return FALSE;
+    }
+
+    for(DWORD index=0; index<Depth; index++)
+    {
+        PUSN_PIPE_SLOT pSlot = &(pPipe->Slots[index]);
+
+        pSlot->Output.File = -1;
+        pSlot->Buffer = (uint64_t*)_UsnpAlloc(pPipe->BufferSize);
+        if(pSlot->Buffer == NULL)
+        {
+            /*++ last error set by call ... */
+            _UsnpClosePipeline(pPipe);
+            return FALSE;
+        }
+        _UsnpPutRing(&(pPipe->Free), pSlot);
+    }
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpClosePipeline (
+    __inout PUSN_PIPELINE pPipe )
+{
+    if(pPipe->Slots != NULL)
+    {
+        for(DWORD index=0; index<pPipe->Depth; index++)
+        {
+            _UsnpFree(pPipe->Slots[index].Buffer);
+            _UsnpFreeOutput(&(pPipe->Slots[index].Output));
+        }
+    }
+    _UsnpFree(pPipe->Slots);
+    _UsnpFree(pPipe->Free.Entries);
+    _UsnpFree(pPipe->Filled.Entries);
+    _UsnpFree(pPipe->Written.Entries);
+    RtlZeroMemory(pPipe, sizeof(USN_PIPELINE));
+}
+
+/*++
+ * what the one-thread loop does with a buffer once it is read; saved to
+ * the capture and the archive, even the last, empty one, then walked
+ * with the text going to the slot ...
+ */
+BOOL
+_UsnpPipeWalk (
+    __in PUSN_WALK pWalk,
+    __in PUSN_PIPE_SLOT pSlot )
+{
+    BOOL status;
+
+    if(pSlot->Bytes == 0)
+    {
+        return TRUE;
+    }
+
+    if((g_capturefp != NULL) && (_UsnpWriteReplayChunk(g_capturefp, pSlot->Buffer, pSlot->Bytes) == FALSE))
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    if((g_archivewriter != NULL) && (_UsnpArchiveChunk(g_archivewriter, pSlot->Buffer, pSlot->Bytes) == FALSE))
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    if(pSlot->Bytes <= sizeof(USN))
+    {
+        return TRUE;
+    }
+
+    g_output = &(pSlot->Output);
+    status = _UsnpWalkRecords(pWalk, ((uint8_t*)pSlot->Buffer) + sizeof(USN), pSlot->Bytes - sizeof(USN));
+    g_output = NULL;
+
+    if((status != FALSE) && pSlot->Output.Failed)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        status = FALSE;
+    }
+    return status;
+}
+
+/*++
+ * the reader stage; reads into free slots until the journal has nothing
+ * past the start usn, a read fails or the walk says stop. the slot that
+ * says so is marked last ...
+ */
+DWORD
+_UsnpPipeReader (
+    __in void* Context )
+{
+    PUSN_PIPELINE pPipe = (PUSN_PIPELINE)Context;
+    PUSN_PIPE_SLOT pSlot;
+
+    do
+    {
+        DWORD bytes = 0;
+
+        pSlot = _UsnpTakeRing(&(pPipe->Free), &(pPipe->pStats->PipeWaits[0]));
+        pSlot->Bytes  = 0;
+        pSlot->Status = ERROR_SUCCESS;
+        pSlot->Last   = FALSE;
+
+        if( _UsnpLoadAcquire(&(pPipe->Stop)))
+        {
+            pSlot->Last = TRUE;
+        }
+        else if( pPipe->pSource->Read(pPipe->pSource, &(pPipe->ReadData), pSlot->Buffer, pPipe->BufferSize, &bytes) == FALSE)
+        {
+            pSlot->Status = GetLastError();
+            pSlot->Last = TRUE;
+        }
+        else
+        {
+            pPipe->pStats->Reads++;
+            pSlot->Bytes = bytes;
+
+            /*++ nothing past the leading usn; caught up ... */
+            if(bytes <= sizeof(USN))
+            {
+                pSlot->Last = TRUE;
+            }
+            else
+            {
+                pPipe->ReadData.StartUsn = *(USN*)pSlot->Buffer;
+            }
+        }
+
+        _UsnpPutRing(&(pPipe->Filled), pSlot);
+    }
+    while(pSlot->Last == FALSE);
+
+    return 0;
+}
+
+/*++ the writer stage; each slot's text in one write, then back to the reader ... */
+DWORD
+_UsnpPipeWriter (
+    __in void* Context )
+{
+    PUSN_PIPELINE pPipe = (PUSN_PIPELINE)Context;
+    PUSN_PIPE_SLOT pSlot;
+    BOOL last;
+
+    do
+    {
+        pSlot = _UsnpTakeRing(&(pPipe->Written), &(g_stats.PipeWaits[2]));
+        last = pSlot->Last;
+
+        if((pSlot->Output.Length > 0) && (_UsnpLoadAcquire(&(pPipe->Failed)) == 0))
+        {
+            if( _UsnpWriteFile(g_stdout.File, pSlot->Output.Buffer, pSlot->Output.Length) == FALSE)
+            {
+                _UsnpStoreRelease(&(pPipe->Failed), 1);
+            }
+        }
+        pSlot->Output.Length = 0;
+
+        _UsnpPutRing(&(pPipe->Free), pSlot);
+    }
+    while(last == FALSE);
+
+    return 0;
+}
+
+/*++ the producer's side; the slot is seen by the consumer once Tail moves ... */
+void
+_UsnpPutRing (
+    __inout PUSN_RING pRing,
+    __in PUSN_PIPE_SLOT pSlot )
+{
+    int64_t tail = pRing->Tail;
+
+    pRing->Entries[(size_t)tail & pRing->Mask] = pSlot;
+    _UsnpStoreRelease(&(pRing->Tail), tail + 1);
+}
+
+/*++
+ * the consumer's side; waits for a slot, first by yielding the processor
+ * and then, if the producer is slow, by sleeping. pWaits counts the takes
+ * that had to wait ...
+ */
+PUSN_PIPE_SLOT
+_UsnpTakeRing (
+    __inout PUSN_RING pRing,
+    __inout uint64_t* pWaits )
+{
+    PUSN_PIPE_SLOT pSlot;
+    DWORD round = 0;
+
+    while(_UsnpLoadAcquire(&(pRing->Tail)) == pRing->Head)
+    {
+        if(round == 0)
+        {
+            (*pWaits)++;
+        }
+        if(round < 64)
+        {
+            _UsnpYield();
+        }
+        else
+        {
+            _UsnpSleep(50);
+        }
+        round++;
+    }
+
+    pSlot = pRing->Entries[(size_t)pRing->Head & pRing->Mask];
+    pRing->Head++;
+    return pSlot;
+}
+
+/*++
+ * walk the records in a buffer. Done is set, and the walk stops, once the
+ * record count is reached ...
+ */
+BOOL
+_UsnpWalkRecords (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)buffer;
+
+    if((pWalk == NULL) || (buffer == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++
+     * records before ShowUsn bring the resolver's tree up to date and are
+     * not walked. records come in usn order, so once one is past it the
+     * rest are; a bad record is left to the walk below ...
+     */
+    while((pWalk->ShowUsn != 0) && (bytes >= sizeof(USN_RECORD_COMMON_HEADER)))
+    {
+        if( (pRecord->RecordLength < sizeof(USN_RECORD_COMMON_HEADER)) || (pRecord->RecordLength > bytes) ||
+            ((pRecord->RecordLength & 7) != 0) || (_UsnpGetRecordUsn(pRecord) >= pWalk->ShowUsn))
+        {
+            pWalk->ShowUsn = 0;
+            break;
+        }
+
+        _UsnpObserveRecord(pWalk->pResolver, pRecord);
+        bytes -= pRecord->RecordLength;
+        buffer += pRecord->RecordLength;
+        pRecord = (PUSN_RECORD_COMMON_HEADER)buffer;
+    }
+
+    if(pWalk->pPrefilter != NULL)
+    {
+        return _UsnpWalkBatch(pWalk, buffer, bytes);
+    }
+
+    /*++
+     * the routine for the first record's version and the output, chosen
+     * here once a buffer, walks as far as the records are all of it and
+     * whole; the rest of a mixed or bad buffer, and all of one with a
+     * filter, watch list, -coalesce or -moves, is walked below a record at
+     * a time ...
+     */
+    if( (pWalk->Generic == FALSE) && (pWalk->pFilter == NULL) && (pWalk->pWatch == NULL) &&
+        (pWalk->pCoalesce == NULL) && (pWalk->pMoves == NULL) && (bytes >= sizeof(USN_RECORD_COMMON_HEADER)))
+    {
+        PUSN_WALK_ROUTINE routine = _UsnpGetWalkRoutine(pRecord->MajorVersion);
+        size_t walked;
+
+        if(routine != NULL)
+        {
+            walked = routine(pWalk, buffer, bytes);
+            if(pWalk->Done)
+            {
+                return TRUE;
+            }
+            bytes -= walked;
+            pRecord = (PUSN_RECORD_COMMON_HEADER)(buffer + walked);
+        }
+    }
+
+    while(bytes >= sizeof(USN_RECORD_COMMON_HEADER))
+    {
+        if((pRecord->RecordLength == 0) && pWalk->Padded)
+        {
+            /*++ the rest of a $J page is zero fill ... */
+            return TRUE;
+        }
+
+        /*++ a zero or overlong length would walk off the buffer, and an unaligned one off the records ... */
+        if( (pRecord->RecordLength < sizeof(USN_RECORD_COMMON_HEADER)) || (pRecord->RecordLength > bytes) ||
+            ((pRecord->RecordLength & 7) != 0))
+        {
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+        }
+
+        /*++ the resolver sees every record, in journal order, held or not ... */
+        _UsnpObserveRecord(pWalk->pResolver, pRecord);
+
+        if((pWalk->pMoves == NULL) || (_UsnpPairRename(pWalk, pRecord) == FALSE))
+        {
+            _UsnpWalkRecord(pWalk, pRecord);
+        }
+
+        if(pWalk->Done)
+        {
+            _UsnpStopWalk(pWalk, _UsnpGetRecordUsn(pRecord) + pRecord->RecordLength);
+            return TRUE;
+        }
+
+        bytes -= pRecord->RecordLength;
+
+        pRecord = (PUSN_RECORD_COMMON_HEADER)(((uint8_t*)pRecord) + pRecord->RecordLength);
+    }
+
+    if((bytes != 0) && (pWalk->Padded == FALSE))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ * the walk of a buffer's records of one version, for a walk with nothing
+ * between the reason mask and the output; what it does with a record is
+ * what _UsnpWalkRecord and _UsnpWalkEmit would. version and format are
+ * constants in each routine made from it, so each is a loop of its own
+ * testing neither. it stops before the first record that is of another
+ * version, does not hold its fields and name, or has a length that is
+ * not 8-aligned, and gives the bytes up to there for the walk to go on
+ * from a record at a time; a bad length fails the buffer there ...
+ */
+_USN_FORCEINLINE size_t
+_UsnpWalkRecordsAs (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes,
+    __in DWORD version,
+    __in DWORD format )
+{
+    PUSN_OUTPUT pOut = _UsnpGetOutput();
+    PUSN_STATS pStats = pWalk->pStats;
+    DWORD fixed = (DWORD)((version == 2) ? offsetof(USN_RECORD_V2, FileName) : offsetof(USN_RECORD_V3, FileName));
+    uint64_t storage[_USN_RECORD_V3_STORAGE];
+    wchar_t path[MAX_PATH];
+    size_t offset;
+    DWORD length;
+
+    for(offset=0; (bytes - offset) >= sizeof(USN_RECORD_COMMON_HEADER); offset+=length)
+    {
+        USN_RECORD_UNION* pRecord = (USN_RECORD_UNION*)(buffer + offset);
+        USN_RECORD_V3* pV3 = &(pRecord->V3);
+        DWORD name;
+        USN usn;
+        LONGLONG stamp;
+        DWORD reason;
+
+        length = pRecord->Header.RecordLength;
+        if((pRecord->Header.MajorVersion != version) || (length < fixed) || ((length & 7) != 0) || (length > (bytes - offset)))
+        {
+            break;
+        }
+
+        /*++ the name is only looked at when it is shown ... */
+        name = ((version == 2) ? ((DWORD)pRecord->V2.FileNameOffset + pRecord->V2.FileNameLength) : ((DWORD)pRecord->V3.FileNameOffset + pRecord->V3.FileNameLength));
+        if( (format != _USN_FORMAT_QUIET) &&
+            ((((version == 2) ? pRecord->V2.FileNameOffset : pRecord->V3.FileNameOffset) < fixed) || (name > length)))
+        {
+            break;
+        }
+
+        usn    = ((version == 2) ? pRecord->V2.Usn : pRecord->V3.Usn);
+        stamp  = ((version == 2) ? pRecord->V2.TimeStamp.QuadPart : pRecord->V3.TimeStamp.QuadPart);
+        reason = ((version == 2) ? pRecord->V2.Reason : pRecord->V3.Reason);
+
+        /*++ the resolver sees every record, in journal order ... */
+        _UsnpObserveRecord(pWalk->pResolver, &(pRecord->Header));
+
+        if((pWalk->ReasonMask != _USN_REASON_ALL) && ((reason & pWalk->ReasonMask) == 0))
+        {
+            continue;
+        }
+
+        if(pStats != NULL)
+        {
+            if(pStats->Records++ == 0)
+            {
+                pStats->FirstUsn = usn;
+            }
+            pStats->LastUsn = usn;
+            pStats->Bytes += length;
+
+            if((pWalk->Now != 0) && (stamp != 0))
+            {
+                uint64_t latency = ((pWalk->Now > stamp) ? ((uint64_t)(pWalk->Now - stamp) / 10) : 0);
+                pStats->LatencyRecords++;
+                pStats->LatencyTotal += latency;
+                if(latency > pStats->LatencyMax)
+                {
+                    pStats->LatencyMax = latency;
+                }
+            }
+        }
+
+        if(format != _USN_FORMAT_QUIET)
+        {
+            /*++ v2 is shown as the v3 record it would have been; too long a name fails as it does there ... */
+            if((version == 2) && (_UsnpUpconvertRecordV2(&(pRecord->V2), (USN_RECORD_V3*)storage, sizeof(storage)) == FALSE))
+            {
+                fwprintf(stderr, L"format usn record failed, status(%X)\n", GetLastError());
+                pV3 = NULL;
+            }
+            else if(version == 2)
+            {
+                pV3 = (USN_RECORD_V3*)storage;
+            }
+
+            if(pV3 != NULL)
+            {
+                path[0] = L'\0';
+                if( _UsnpResolvePath(pWalk->pResolver, &(pV3->ParentFileReferenceNumber), path, _countof(path)) == FALSE)
+                {
+                    if(format != _USN_FORMAT_TEXT)
+                    {
+                        path[0] = L'\0';
+                    }
+                    else
+                    {
+                        _snwprintf_s(path, _countof(path), _countof(path), L"[error(%X)]", GetLastError());
+                    }
+                }
+
+                switch(format)
+                {
+                case _USN_FORMAT_JSON: _UsnpEmitRecordJson(pOut, pV3, ((path[0] != L'\0') ? path : NULL), NULL, NULL); break;
+                case _USN_FORMAT_CSV:  _UsnpEmitRecordCsv(pOut, pV3, ((path[0] != L'\0') ? path : NULL), NULL, NULL); break;
+                default:               _UsnpEmitRecordText(pOut, pV3, path, NULL, NULL); break;
+                }
+
+                if(pOut->Failed)
+                {
+                    fwprintf(stderr, L"format usn record failed, status(%X)\n", ERROR_NOT_ENOUGH_MEMORY);
+                }
+                else if((format == _USN_FORMAT_TEXT) && g_dump)
+                {
+                    /*++ hex-dump record, as read, if desired ... */
+                    _UsnpDump((uint8_t*)pRecord, length);
+                }
+            }
+        }
+
+        if((pWalk->Limit > 0) && (pWalk->Count++ > pWalk->Limit))
+        {
+            pWalk->Done = TRUE;
+            _UsnpStopWalk(pWalk, usn + length);
+            return (offset + length);
+        }
+    }
+    return offset;
+}
+
+/*++ the walk routines, a version and an output each ... */
+size_t
+_UsnpWalkV2Quiet (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 2, _USN_FORMAT_QUIET);
+}
+
+size_t
+_UsnpWalkV2Text (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 2, _USN_FORMAT_TEXT);
+}
+
+size_t
+_UsnpWalkV2Json (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 2, _USN_FORMAT_JSON);
+}
+
+size_t
+_UsnpWalkV2Csv (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 2, _USN_FORMAT_CSV);
+}
+
+size_t
+_UsnpWalkV3Quiet (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 3, _USN_FORMAT_QUIET);
+}
+
+size_t
+_UsnpWalkV3Text (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 3, _USN_FORMAT_TEXT);
+}
+
+size_t
+_UsnpWalkV3Json (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 3, _USN_FORMAT_JSON);
+}
+
+size_t
+_UsnpWalkV3Csv (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    return _UsnpWalkRecordsAs(pWalk, buffer, bytes, 3, _USN_FORMAT_CSV);
+}
+
+/*++
+ * the walk routine for records of one version and the output asked for;
+ * NULL for a version without one ...
+ */
+PUSN_WALK_ROUTINE
+_UsnpGetWalkRoutine (
+    __in DWORD version )
+{
+    static const PUSN_WALK_ROUTINE routines[2][4] =
+    {
+        { _UsnpWalkV2Text, _UsnpWalkV2Json, _UsnpWalkV2Csv, _UsnpWalkV2Quiet },
+        { _UsnpWalkV3Text, _UsnpWalkV3Json, _UsnpWalkV3Csv, _UsnpWalkV3Quiet },
+    };
+
+    if((version < 2) || (version > 3) || (g_format > _USN_FORMAT_CSV))
+    {
+        return NULL;
+    }
+    return routines[version - 2][((g_quiet != 0) ? _USN_FORMAT_QUIET : g_format)];
+}
+
+/*++
+ * what the walk does with a record once the resolver has seen it; the
+ * filter, the watch list and the reason mask, then held until its close or
+ * shown. a record the filter turns away has no path looked up and is
+ * never formatted ...
+ */
+void
+_UsnpWalkRecord (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    if((pWalk->pFilter != NULL) && (_UsnpIsFilterMatch(pWalk->pFilter, pRecord) == FALSE))
+    {
+        if(pWalk->pStats != NULL)
+        {
+            pWalk->pStats->Filtered++;
+        }
+    }
+    else if((pWalk->pWatch != NULL) && (_UsnpIsWatched(pWalk->pWatch, pRecord) == FALSE))
+    {
+        /*++ not of interest; nothing more is done with it ... */
+        if(pWalk->pStats != NULL)
+        {
+            pWalk->pStats->Unwatched++;
+        }
+    }
+    else if((pWalk->ReasonMask == _USN_REASON_ALL) || ((_UsnpGetRecordReason(pRecord) & pWalk->ReasonMask) != 0))
+    {
+        if(pWalk->pCoalesce != NULL)
+        {
+            _UsnpCoalesceRecord(pWalk, pRecord);
+        }
+        else
+        {
+            _UsnpWalkEmit(pWalk, pRecord, NULL);
+        }
+    }
+}
+
+/*++
+ * _UsnpWalkRecords with the batch stage. up to _USN_BATCH_RECORDS records
+ * are indexed, lengths checked as the walk checks them, and only those the
+ * prefilter keeps are observed and walked. a bad record ends the buffer
+ * after the ones before it, as it does there ...
+ */
+BOOL
+_UsnpWalkBatch (
+    __in PUSN_WALK pWalk,
+    __in_bcount(bytes) uint8_t* buffer,
+    __in size_t bytes )
+{
+    USN_BATCH Batch;
+    size_t offset = 0;
+    BOOL ended = FALSE;
+    BOOL bad = FALSE;
+
+    while((ended == FALSE) && (bad == FALSE) && ((bytes - offset) >= sizeof(USN_RECORD_COMMON_HEADER)))
+    {
+        DWORD count = 0;
+
+        while((count < _USN_BATCH_RECORDS) && ((bytes - offset) >= sizeof(USN_RECORD_COMMON_HEADER)))
+        {
+            PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(buffer + offset);
+            DWORD fixed;
+
+            if((pRecord->RecordLength == 0) && pWalk->Padded)
+            {
+                /*++ the rest of a $J page is zero fill ... */
+                ended = TRUE;
+                break;
+            }
+            if( (pRecord->RecordLength < sizeof(USN_RECORD_COMMON_HEADER)) || (pRecord->RecordLength > (bytes - offset)) ||
+                ((pRecord->RecordLength & 7) != 0))
+            {
+                bad = TRUE;
+                break;
+            }
+
+            /*++ a record too short for its fields, or of no version known, is kept for the walk to judge ... */
+            switch(pRecord->MajorVersion)
+            {
+            case 2:  fixed = offsetof(USN_RECORD_V2, FileNameLength); break;
+            case 3:  fixed = offsetof(USN_RECORD_V3, FileNameLength); break;
+            case 4:  fixed = offsetof(USN_RECORD_V4, RemainingExtents); break;
+            default: fixed = 0xFFFFFFFF; break;
+            }
+
+            Batch.Offsets[count] = (uint32_t)offset;
+            Batch.Versions[count] = ((pRecord->RecordLength >= fixed) ? pRecord->MajorVersion : 0);
+            count++;
+            offset += pRecord->RecordLength;
+        }
+
+        for(Batch.Count=count; (Batch.Count & 7) != 0; Batch.Count++)
+        {
+            Batch.Offsets[Batch.Count] = 0;
+            Batch.Versions[Batch.Count] = 0;
+        }
+        g_select(pWalk->pPrefilter, buffer, &Batch);
+
+        for(DWORD index=0; index<count; index++)
+        {
+            PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(buffer + Batch.Offsets[index]);
+
+            if((Batch.Selected[index >> 3] & (1 << (index & 7))) == 0)
+            {
+                if(pWalk->pStats != NULL)
+                {
+                    pWalk->pStats->Prefiltered++;
+                }
+                continue;
+            }
+
+            _UsnpObserveRecord(pWalk->pResolver, pRecord);
+            _UsnpWalkRecord(pWalk, pRecord);
+            if(pWalk->Done)
+            {
+                _UsnpStopWalk(pWalk, _UsnpGetRecordUsn(pRecord) + pRecord->RecordLength);
+                return TRUE;
+            }
+        }
+    }
+
+    if(bad || ((ended == FALSE) && (offset != bytes) && (pWalk->Padded == FALSE)))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ * the batch stage for a walk, when there is a routine for it and the
+ * filter or watch list has something for it. every record the filter
+ * accepts passes the tests it opens with that reject outright, so those on
+ * the reason, attributes or parent go in the prefilter; a watch list of
+ * children alone is a parent test too. the reason mask on its own is left
+ * to the walk, which tests it with the one load the batch would make. not
+ * with -moves, where a rename's halves pair before any test ...
+ */
+BOOL
+_UsnpOpenPrefilter (
+    __inout PUSN_WALK pWalk,
+    __out PUSN_PREFILTER pPrefilter )
+{
+    PUSN_FILTER pFilter = pWalk->pFilter;
+    PUSN_WATCH pWatch = pWalk->pWatch;
+    DWORD next;
+
+    RtlZeroMemory(pPrefilter, sizeof(USN_PREFILTER));
+    pPrefilter->ReasonMask = pWalk->ReasonMask;
+    pWalk->pPrefilter = NULL;
+
+    if((g_select == NULL) || (pWalk->pMoves != NULL))
+    {
+        return FALSE;
+    }
+
+    for(next=((pFilter != NULL) ? pFilter->Start : _USN_FILTER_ACCEPT); next < _USN_FILTER_REJECT; next=pFilter->Ops[next].True)
+    {
+        PUSN_FILTER_OP pOp = &(pFilter->Ops[next]);
+
+        if(pOp->False != _USN_FILTER_REJECT)
+        {
+            break;
+        }
+
+        if((pOp->Code == _USN_FILTER_REASON) && (pPrefilter->ReasonMask == _USN_REASON_ALL))
+        {
+            pPrefilter->ReasonMask = (DWORD)pOp->Low;
+        }
+        else if((pOp->Code == _USN_FILTER_ATTRIBUTES) && (pPrefilter->AttributeMask == 0))
+        {
+            pPrefilter->AttributeMask = (DWORD)pOp->Low;
+        }
+        else if( (pOp->Code == _USN_FILTER_PARENT) && (pPrefilter->ParentCount == 0) &&
+                 (pFilter->Sets[pOp->Index].Count <= _USN_BATCH_PARENTS))
+        {
+            pPrefilter->ParentCount = pFilter->Sets[pOp->Index].Count;
+            RtlMoveMemory(pPrefilter->Parents, pFilter->Sets[pOp->Index].Ids, pPrefilter->ParentCount * sizeof(FILE_ID_128));
+        }
+    }
+
+    if( (pPrefilter->ParentCount == 0) && (pWatch != NULL) && (pWatch->Subtrees == 0) &&
+        (pWatch->Count <= _USN_BATCH_PARENTS))
+    {
+        for(DWORD index=0; index<pWatch->Capacity; index++)
+        {
+            if(pWatch->Entries[index].Flags & _USN_WATCH_CHILDREN)
+            {
+                pPrefilter->Parents[pPrefilter->ParentCount++] = pWatch->Entries[index].FileId;
+            }
+        }
+    }
+
+    if((pPrefilter->ReasonMask == pWalk->ReasonMask) && (pPrefilter->AttributeMask == 0) && (pPrefilter->ParentCount == 0))
+    {
+        return FALSE;
+    }
+
+    /*++ what the path cache and the tree learn from the journal is all in directory records ... */
+    if((pWalk->pResolver != NULL) && (pWalk->pResolver->Observe != NULL))
+    {
+        pPrefilter->KeepAttributes = FILE_ATTRIBUTE_DIRECTORY;
+    }
+
+    pWalk->pPrefilter = pPrefilter;
+    return TRUE;
+}
+
+/*++
+ * the prefilter on one record; the yardstick the vector routines are held
+ * to, and the whole of the scalar one ...
+ */
+BOOL
+_UsnpIsPreselected (
+    __in PUSN_PREFILTER pPrefilter,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    DWORD attributes = _UsnpGetRecordAttributes(pRecord);
+    FILE_ID_128 FileId;
+    FILE_ID_128 Parent;
+    BOOL hit = FALSE;
+
+    if(attributes & pPrefilter->KeepAttributes)
+    {
+        return TRUE;
+    }
+    if((pPrefilter->ReasonMask != _USN_REASON_ALL) && ((_UsnpGetRecordReason(pRecord) & pPrefilter->ReasonMask) == 0))
+    {
+        return FALSE;
+    }
+    if((pPrefilter->AttributeMask != 0) && ((attributes & pPrefilter->AttributeMask) == 0))
+    {
+        return FALSE;
+    }
+    if(pPrefilter->ParentCount == 0)
+    {
+        return TRUE;
+    }
+
+    _UsnpGetRecordFileIds(pRecord, &FileId, &Parent);
+    for(DWORD index=0; (index<pPrefilter->ParentCount) && (hit == FALSE); index++)
+    {
+        hit = _UsnpIsEqualFileReference(&Parent, &(pPrefilter->Parents[index]));
+    }
+    return hit;
+}
+
+/*++
+ * -simd; auto is avx2 where the processor and the system have it, then
+ * sse2 where the build has it. NULL for off, or for one asked for that
+ * is not there ...
+ */
+PUSN_SELECT_ROUTINE
+_UsnpGetSelectRoutine (
+    __in DWORD simd )
+{
+#if defined(_USN_AVX2)
+    if(((simd == _USN_SIMD_AUTO) || (simd == _USN_SIMD_AVX2)) && _UsnpIsAvx2Present())
+    {
+        return _UsnpSelectAvx2;
+    }
+#endif  /* _USN_AVX2 */
+#if defined(_USN_SSE2)
+    if((simd == _USN_SIMD_AUTO) || (simd == _USN_SIMD_SSE2))
+    {
+        return _UsnpSelectSse2;
+    }
+#endif  /* _USN_SSE2 */
+    if((simd == _USN_SIMD_AUTO) || (simd == _USN_SIMD_SCALAR))
+    {
+        return _UsnpSelectScalar;
+    }
+    return NULL;
+}
+
+/*++ the avx2 bit alone is not enough; the system has to save the ymm registers ... */
+BOOL
+_UsnpIsAvx2Present (
+    void )
+{
+#if defined(_USN_AVX2) && defined(_MSC_VER)
+    int info[4] = {0};
+
+    __cpuid(info, 0);
+    if(info[0] < 7)
+    {
+        return FALSE;
+    }
+    __cpuid(info, 1);
+    if(((info[2] & (1 << 27)) == 0) || ((info[2] & (1 << 28)) == 0) || ((_xgetbv(0) & 6) != 6))
+    {
+        return FALSE;
+    }
+    __cpuidex(info, 7, 0);
+    return ((info[1] & (1 << 5)) != 0);
+#elif defined(_USN_AVX2)
+    __builtin_cpu_init();
+    return (__builtin_cpu_supports("avx2") != 0);
+#else
+    return FALSE;
+#endif  /* _USN_AVX2 */
+}
+
+/*++
+ */
+void
+_UsnpSelectScalar (
+    __in PUSN_PREFILTER pPrefilter,
+    __in const uint8_t* buffer,
+    __inout PUSN_BATCH pBatch )
+{
+    RtlZeroMemory(pBatch->Selected, pBatch->Count / 8);
+
+    for(DWORD index=0; index<pBatch->Count; index++)
+    {
+        if( (pBatch->Versions[index] == 0) ||
+            _UsnpIsPreselected(pPrefilter, (PUSN_RECORD_COMMON_HEADER)(buffer + pBatch->Offsets[index])))
+        {
+            pBatch->Selected[index >> 3] |= (uint8_t)(1 << (index & 7));
+        }
+    }
+}
+
+#if defined(_USN_SSE2)
+/*++
+ * four records at a time. sse2 has no gather, so the lanes are loaded one
+ * by one from offsets worked out in the vector; the tests are all vector.
+ * a field's offset is picked by version with masks, v2 then v3 then v4,
+ * and lanes of no version are never read ...
+ */
+void
+_UsnpSelectSse2 (
+    __in PUSN_PREFILTER pPrefilter,
+    __in const uint8_t* buffer,
+    __inout PUSN_BATCH pBatch )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_cmpeq_epi32(zero, zero);
+    const __m128i reasonmask = _mm_set1_epi32((int)pPrefilter->ReasonMask);
+    const __m128i attributemask = _mm_set1_epi32((int)pPrefilter->AttributeMask);
+    const __m128i keep = _mm_set1_epi32((int)pPrefilter->KeepAttributes);
+
+    for(DWORD index=0; index<pBatch->Count; index+=4)
+    {
+        __m128i offsets = _mm_loadu_si128((const __m128i*)(pBatch->Offsets + index));
+        __m128i versions = _mm_loadu_si128((const __m128i*)(pBatch->Versions + index));
+        __m128i v2 = _mm_cmpeq_epi32(versions, _mm_set1_epi32(2));
+        __m128i v3 = _mm_cmpeq_epi32(versions, _mm_set1_epi32(3));
+        __m128i v4 = _mm_cmpeq_epi32(versions, _mm_set1_epi32(4));
+        __m128i known = _mm_or_si128(_mm_or_si128(v2, v3), v4);
+        __m128i at;
+        __m128i attributes;
+        __m128i hit = ones;
+
+        at = _mm_add_epi32(offsets, _mm_or_si128(_mm_and_si128(v2, _mm_set1_epi32((int)offsetof(USN_RECORD_V2, FileAttributes))),
+                                                 _mm_and_si128(v3, _mm_set1_epi32((int)offsetof(USN_RECORD_V3, FileAttributes)))));
+        attributes = _UsnpGatherSse2(buffer, at, _mm_or_si128(v2, v3));
+
+        if(pPrefilter->ReasonMask != _USN_REASON_ALL)
+        {
+            __m128i reason;
+
+            at = _mm_add_epi32(offsets, _mm_or_si128(_mm_or_si128(_mm_and_si128(v2, _mm_set1_epi32((int)offsetof(USN_RECORD_V2, Reason))),
+                                                                  _mm_and_si128(v3, _mm_set1_epi32((int)offsetof(USN_RECORD_V3, Reason)))),
+                                                     _mm_and_si128(v4, _mm_set1_epi32((int)offsetof(USN_RECORD_V4, Reason)))));
+            reason = _UsnpGatherSse2(buffer, at, known);
+            hit = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(reason, reasonmask), zero), hit);
+        }
+
+        if(pPrefilter->AttributeMask != 0)
+        {
+            hit = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(attributes, attributemask), zero), hit);
+        }
+
+        if(pPrefilter->ParentCount != 0)
+        {
+            __m128i parent[4];
+            __m128i any = zero;
+
+            /*++ a v2 parent is 64 bits; the high half is taken as zero, as it is widened elsewhere ... */
+            at = _mm_add_epi32(offsets, _mm_or_si128(_mm_and_si128(v2, _mm_set1_epi32((int)offsetof(USN_RECORD_V2, ParentFileReferenceNumber))),
+                                                     _mm_andnot_si128(v2, _mm_set1_epi32((int)offsetof(USN_RECORD_V3, ParentFileReferenceNumber)))));
+            parent[0] = _UsnpGatherSse2(buffer, at, known);
+            parent[1] = _UsnpGatherSse2(buffer, _mm_add_epi32(at, _mm_set1_epi32(4)), known);
+            parent[2] = _UsnpGatherSse2(buffer, _mm_add_epi32(at, _mm_set1_epi32(8)), _mm_andnot_si128(v2, known));
+            parent[3] = _UsnpGatherSse2(buffer, _mm_add_epi32(at, _mm_set1_epi32(12)), _mm_andnot_si128(v2, known));
+
+            for(DWORD candidate=0; candidate<pPrefilter->ParentCount; candidate++)
+            {
+                const uint32_t* id = (const uint32_t*)&(pPrefilter->Parents[candidate]);
+                __m128i match = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi32(parent[0], _mm_set1_epi32((int)id[0])),
+                                                            _mm_cmpeq_epi32(parent[1], _mm_set1_epi32((int)id[1]))),
+                                              _mm_and_si128(_mm_cmpeq_epi32(parent[2], _mm_set1_epi32((int)id[2])),
+                                                            _mm_cmpeq_epi32(parent[3], _mm_set1_epi32((int)id[3]))));
+                any = _mm_or_si128(any, match);
+            }
+            hit = _mm_and_si128(hit, any);
+        }
+
+        hit = _mm_or_si128(hit, _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(attributes, keep), zero), ones));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi32(versions, zero));
+
+        if(index & 4)
+        {
+            pBatch->Selected[index >> 3] |= (uint8_t)(_mm_movemask_ps(_mm_castsi128_ps(hit)) << 4);
+        }
+        else
+        {
+            pBatch->Selected[index >> 3] = (uint8_t)_mm_movemask_ps(_mm_castsi128_ps(hit));
+        }
+    }
+}
+
+/*++
+ * a dword from each lane's offset, or zero where the lane is not valid.
+ * those read the start of the buffer instead, which is always there, and
+ * the offsets come out of the register without a trip through memory ...
+ */
+__m128i
+_UsnpGatherSse2 (
+    __in const uint8_t* buffer,
+    __in __m128i at,
+    __in __m128i valid )
+{
+    __m128i a;
+    __m128i b;
+    __m128i c;
+    __m128i d;
+
+    at = _mm_and_si128(at, valid);
+    a = _mm_cvtsi32_si128(*(const int*)(buffer + (uint32_t)_mm_cvtsi128_si32(at)));
+    b = _mm_cvtsi32_si128(*(const int*)(buffer + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(at, 4))));
+    c = _mm_cvtsi32_si128(*(const int*)(buffer + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(at, 8))));
+    d = _mm_cvtsi32_si128(*(const int*)(buffer + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(at, 12))));
+    return _mm_and_si128(_mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b), _mm_unpacklo_epi32(c, d)), valid);
+}
+#endif  /* _USN_SSE2 */
+
+#if defined(_USN_AVX2)
+/*++
+ * eight records at a time, as _UsnpSelectSse2, with the fields gathered.
+ * the gathers are masked, so a lane of no version reads nothing ...
+ */
+_USN_TARGET_AVX2
+void
+_UsnpSelectAvx2 (
+    __in PUSN_PREFILTER pPrefilter,
+    __in const uint8_t* buffer,
+    __inout PUSN_BATCH pBatch )
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_cmpeq_epi32(zero, zero);
+    const __m256i reasonmask = _mm256_set1_epi32((int)pPrefilter->ReasonMask);
+    const __m256i attributemask = _mm256_set1_epi32((int)pPrefilter->AttributeMask);
+    const __m256i keep = _mm256_set1_epi32((int)pPrefilter->KeepAttributes);
+    const int* base = (const int*)buffer;
+
+    for(DWORD index=0; index<pBatch->Count; index+=8)
+    {
+        __m256i offsets = _mm256_loadu_si256((const __m256i*)(pBatch->Offsets + index));
+        __m256i versions = _mm256_loadu_si256((const __m256i*)(pBatch->Versions + index));
+        __m256i v2 = _mm256_cmpeq_epi32(versions, _mm256_set1_epi32(2));
+        __m256i v3 = _mm256_cmpeq_epi32(versions, _mm256_set1_epi32(3));
+        __m256i v4 = _mm256_cmpeq_epi32(versions, _mm256_set1_epi32(4));
+        __m256i known = _mm256_or_si256(_mm256_or_si256(v2, v3), v4);
+        __m256i at;
+        __m256i attributes;
+        __m256i hit = ones;
+
+        at = _mm256_add_epi32(offsets, _mm256_or_si256(_mm256_and_si256(v2, _mm256_set1_epi32((int)offsetof(USN_RECORD_V2, FileAttributes))),
+                                                       _mm256_and_si256(v3, _mm256_set1_epi32((int)offsetof(USN_RECORD_V3, FileAttributes)))));
+        attributes = _mm256_mask_i32gather_epi32(zero, base, at, _mm256_or_si256(v2, v3), 1);
+
+        if(pPrefilter->ReasonMask != _USN_REASON_ALL)
+        {
+            __m256i reason;
+
+            at = _mm256_add_epi32(offsets, _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(v2, _mm256_set1_epi32((int)offsetof(USN_RECORD_V2, Reason))),
+                                                                           _mm256_and_si256(v3, _mm256_set1_epi32((int)offsetof(USN_RECORD_V3, Reason)))),
+                                                           _mm256_and_si256(v4, _mm256_set1_epi32((int)offsetof(USN_RECORD_V4, Reason)))));
+            reason = _mm256_mask_i32gather_epi32(zero, base, at, known, 1);
+            hit = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(reason, reasonmask), zero), hit);
+        }
+
+        if(pPrefilter->AttributeMask != 0)
+        {
+            hit = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(attributes, attributemask), zero), hit);
+        }
+
+        if(pPrefilter->ParentCount != 0)
+        {
+            __m256i parent[4];
+            __m256i any = zero;
+
+            at = _mm256_add_epi32(offsets, _mm256_or_si256(_mm256_and_si256(v2, _mm256_set1_epi32((int)offsetof(USN_RECORD_V2, ParentFileReferenceNumber))),
+                                                           _mm256_andnot_si256(v2, _mm256_set1_epi32((int)offsetof(USN_RECORD_V3, ParentFileReferenceNumber)))));
+            parent[0] = _mm256_mask_i32gather_epi32(zero, base, at, known, 1);
+            parent[1] = _mm256_mask_i32gather_epi32(zero, base, _mm256_add_epi32(at, _mm256_set1_epi32(4)), known, 1);
+            parent[2] = _mm256_mask_i32gather_epi32(zero, base, _mm256_add_epi32(at, _mm256_set1_epi32(8)), _mm256_andnot_si256(v2, known), 1);
+            parent[3] = _mm256_mask_i32gather_epi32(zero, base, _mm256_add_epi32(at, _mm256_set1_epi32(12)), _mm256_andnot_si256(v2, known), 1);
+
+            for(DWORD candidate=0; candidate<pPrefilter->ParentCount; candidate++)
+            {
+                const uint32_t* id = (const uint32_t*)&(pPrefilter->Parents[candidate]);
+                __m256i match = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi32(parent[0], _mm256_set1_epi32((int)id[0])),
+                                                                  _mm256_cmpeq_epi32(parent[1], _mm256_set1_epi32((int)id[1]))),
+                                                 _mm256_and_si256(_mm256_cmpeq_epi32(parent[2], _mm256_set1_epi32((int)id[2])),
+                                                                  _mm256_cmpeq_epi32(parent[3], _mm256_set1_epi32((int)id[3]))));
+                any = _mm256_or_si256(any, match);
+            }
+            hit = _mm256_and_si256(hit, any);
+        }
+
+        hit = _mm256_or_si256(hit, _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(attributes, keep), zero), ones));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(versions, zero));
+
+        pBatch->Selected[index >> 3] = (uint8_t)_mm256_movemask_ps(_mm256_castsi256_ps(hit));
+    }
+}
+#endif  /* _USN_AVX2 */
+
+/*++
+ * -moves; a rename is an old name record and then, next for the same frn,
+ * a new name record. the old one is held, across buffers if need be, and
+ * when its new one comes the two go out as one move. either half on its
+ * own goes on as any other record. the pair is of interest when either
+ * half passes the filter and either parent is watched, so a move into or
+ * out of a watched directory shows ...
+ */
+BOOL
+_UsnpPairRename (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    PUSN_MOVES pMoves = pWalk->pMoves;
+    PUSN_RECORD_COMMON_HEADER pOld = (PUSN_RECORD_COMMON_HEADER)pMoves->Old;
+    PUSN_RECORD_COMMON_HEADER pNew = (PUSN_RECORD_COMMON_HEADER)pMoves->New;
+    FILE_ID_128 FileId;
+    FILE_ID_128 Parent;
+    DWORD reason = _UsnpGetRecordReason(pRecord);
+    DWORD both;
+
+    if( (pRecord->MajorVersion > 3) || (pRecord->RecordLength > _USN_COALESCE_SLOT) ||
+        (_UsnpGetRecordFileIds(pRecord, &FileId, &Parent) == FALSE))
+    {
+        /*++ not a half of anything; a held old name waits on ... */
+        return FALSE;
+    }
+
+    if(pMoves->Held)
+    {
+        pMoves->Held = FALSE;
+
+        if( ((reason & USN_REASON_RENAME_NEW_NAME) != 0) &&
+            (_UsnpIsEqualFileReference(&FileId, &(pMoves->FileId)) != FALSE))
+        {
+            both = (_UsnpGetRecordReason(pOld) | reason);
+
+            if( (pWalk->pFilter != NULL) &&
+                (_UsnpIsFilterMatch(pWalk->pFilter, pOld) == FALSE) &&
+                (_UsnpIsFilterMatch(pWalk->pFilter, pRecord) == FALSE))
+            {
+                if(pWalk->pStats != NULL)
+                {
+                    pWalk->pStats->Filtered += 2;
+                }
+            }
+            else if( (pWalk->pWatch != NULL) &&
+                (_UsnpIsWatched(pWalk->pWatch, pOld) == FALSE) &&
+                (_UsnpIsWatched(pWalk->pWatch, pRecord) == FALSE))
+            {
+                if(pWalk->pStats != NULL)
+                {
+                    pWalk->pStats->Unwatched += 2;
+                }
+            }
+            else if((pWalk->ReasonMask == _USN_REASON_ALL) || ((both & pWalk->ReasonMask) != 0))
+            {
+                /*++ the buffer may be a read-only mapping; the move is shown from a copy ... */
+                RtlMoveMemory(pNew, pRecord, pRecord->RecordLength);
+                _UsnpSetRecordReason(pNew, both);
+                pMoves->pStats->Moves++;
+                _UsnpWalkEmit(pWalk, pNew, pOld);
+            }
+            return TRUE;
+        }
+
+        /*++ an old name with no new one after it; the count may end the walk before this record ... */
+        pMoves->pStats->MovesUnpaired++;
+        _UsnpWalkRecord(pWalk, pOld);
+        if(pWalk->Done)
+        {
+            _UsnpStopWalk(pWalk, _UsnpGetRecordUsn(pRecord));
+            return TRUE;
+        }
+    }
+
+    if(((reason & USN_REASON_RENAME_OLD_NAME) != 0) && ((reason & USN_REASON_RENAME_NEW_NAME) == 0))
+    {
+        RtlMoveMemory(pOld, pRecord, pRecord->RecordLength);
+        RtlMoveMemory(&(pMoves->FileId), &FileId, sizeof(FILE_ID_128));
+        pMoves->Held = TRUE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*++
+ * the end of a run; an old name still held goes out on its own, and then
+ * the files still open ...
+ */
+void
+_UsnpWalkFlush (
+    __in PUSN_WALK pWalk )
+{
+    if((pWalk->pMoves != NULL) && pWalk->pMoves->Held && (pWalk->Done == FALSE))
+    {
+        pWalk->pMoves->Held = FALSE;
+        pWalk->pMoves->pStats->MovesUnpaired++;
+        _UsnpWalkRecord(pWalk, (PUSN_RECORD_COMMON_HEADER)pWalk->pMoves->Old);
+    }
+
+    _UsnpCoalesceFlush(pWalk);
+}
+
+/*++
+ * where a walk stopped by the count resumes. Usn is past the last record
+ * taken, or at one the count was reached before taking; a held old name,
+ * or a file still open, was never shown, so the resume is no later than
+ * its first record. the first call, nearest the record, sets it ...
+ */
+void
+_UsnpStopWalk (
+    __inout PUSN_WALK pWalk,
+    __in USN Usn )
+{
+    if(pWalk->Stopped)
+    {
+        return;
+    }
+
+    if((pWalk->pMoves != NULL) && pWalk->pMoves->Held)
+    {
+        USN held = _UsnpGetRecordUsn((PUSN_RECORD_COMMON_HEADER)pWalk->pMoves->Old);
+        if(held < Usn)
+        {
+            Usn = held;
+        }
+    }
+
+    /*++ files are linked in the order they were opened; the oldest has the first record ... */
+    if((pWalk->pCoalesce != NULL) && (pWalk->pCoalesce->Oldest != _USN_COALESCE_NONE))
+    {
+        USN held = pWalk->pCoalesce->Entries[pWalk->pCoalesce->Oldest].FirstUsn;
+        if(held < Usn)
+        {
+            Usn = held;
+        }
+    }
+
+    pWalk->NextUsn = Usn;
+    pWalk->Stopped = TRUE;
+}
+
+/*++
+ * a record that made it through the walk's filters, or a move and the old
+ * name it was paired with; counted, timed and shown. Done is set once the
+ * record count is reached ...
+ */
+void
+_UsnpWalkEmit (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __in_opt PUSN_RECORD_COMMON_HEADER pOld )
+{
+    if(pWalk->pStats != NULL)
+    {
+        USN usn = _UsnpGetRecordUsn(pRecord);
+        if(pWalk->pStats->Records++ == 0)
+        {
+            pWalk->pStats->FirstUsn = usn;
+        }
+        pWalk->pStats->LastUsn = usn;
+        pWalk->pStats->Bytes += pRecord->RecordLength;
+
+        /*++ how long from the change to here; v4 records carry no time ... */
+        if(pWalk->Now != 0)
+        {
+            LONGLONG stamp = _UsnpGetRecordTimeStamp(pRecord);
+            if(stamp != 0)
+            {
+                uint64_t latency = ((pWalk->Now > stamp) ? ((uint64_t)(pWalk->Now - stamp) / 10) : 0);
+                pWalk->pStats->LatencyRecords++;
+                pWalk->pStats->LatencyTotal += latency;
+                if(latency > pWalk->pStats->LatencyMax)
+                {
+                    pWalk->pStats->LatencyMax = latency;
+                }
+            }
+        }
+    }
+
+    /*++ a v4 record's extents go in the range set, shown or not ... */
+    if( (pWalk->pRanges != NULL) && (pRecord->MajorVersion == 4) &&
+        (_UsnpAddRecordRanges(pWalk->pRanges, (USN_RECORD_V4*)pRecord) == FALSE))
+    {
+        fwprintf(stderr, L"add ranges failed, status(%X)\n", GetLastError());
+    }
+
+    if(g_quiet == 0)
+    {
+        if( ((pOld != NULL) ?
+              _UsnpFormatMove(pWalk->pResolver, (USN_RECORD_UNION*)pOld, (USN_RECORD_UNION*)pRecord) :
+              _UsnpFormatRecord(pWalk->pResolver, (USN_RECORD_UNION*)pRecord)) == FALSE)
+        {
+            fwprintf(stderr, L"format usn record failed, status(%X)\n", GetLastError());
+            /*++return FALSE;*/
+        }
+    }
+
+    /*++LIMITLIMIT: ... */
+    if((pWalk->Limit > 0) && (pWalk->Count++ > pWalk->Limit))
+    {
+        pWalk->Done = TRUE;
+    }
+    /*++LIMITLIMIT: ... */
+}
+
+/*++
+ * a checked v4 record's extents into its file's ranges; an empty extent
+ * changes nothing and makes no entry ...
+ */
+BOOL
+_UsnpAddRecordRanges (
+    __inout PUSN_RANGES pRanges,
+    __in const USN_RECORD_V4* pRecord )
+{
+    PUSN_RANGE_FILE pFile = NULL;
+    USN_RECORD_EXTENT Extent;
+
+    if( _UsnpCheckRecordV4(pRecord) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    for(DWORD index=0; index<pRecord->NumberOfExtents; index++)
+    {
+        _UsnpGetRecordExtent(pRecord, index, &Extent);
+        if(Extent.Length == 0)
+        {
+            continue;
+        }
+
+        if(pFile == NULL)
+        {
+            pFile = _UsnpFindRangeFile(pRanges, (FILE_ID_128*)&(pRecord->FileReferenceNumber), TRUE);
+            if(pFile == NULL)
+            {
+                /*++ last error set by call ... */
+                return FALSE;
+            }
+        }
+
+        if( _UsnpAddRange(pFile, Extent.Offset, Extent.Offset + Extent.Length) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        pRanges->Extents++;
+    }
+    return TRUE;
+}
+
+/*++
+ * the file's entry in the range set, or NULL; with Insert one is made if
+ * there is none, the table doubling first when it would be half full ...
+ */
+PUSN_RANGE_FILE
+_UsnpFindRangeFile (
+    __inout PUSN_RANGES pRanges,
+    __in FILE_ID_128* pFileId,
+    __in BOOL Insert )
+{
+    PUSN_RANGE_FILE pFile;
+    DWORD mask;
+    DWORD index;
+
+    if(Insert && (((pRanges->Count + 1) * 2) > pRanges->Capacity))
+    {
+        DWORD capacity = ((pRanges->Capacity != 0) ? (pRanges->Capacity * 2) : 64);
+        PUSN_RANGE_FILE Files = (PUSN_RANGE_FILE)_UsnpAlloc((size_t)capacity * sizeof(USN_RANGE_FILE));
+
+        if(Files == NULL)
+        {
+            /*++ last error set by call ... */
+            return NULL;
+        }
+
+        for(DWORD slot=0; slot<pRanges->Capacity; slot++)
+        {
+            if(pRanges->Files[slot].Ranges == NULL)
+            {
+                continue;
+            }
+            index = (DWORD)(_UsnpHashFileId(&(pRanges->Files[slot].FileId)) >> 32) & (capacity - 1);
+            while(Files[index].Ranges != NULL)
+            {
+                index = (index + 1) & (capacity - 1);
+            }
+            Files[index] = pRanges->Files[slot];
+        }
+
+        _UsnpFree(pRanges->Files);
+        pRanges->Files = Files;
+        pRanges->Capacity = capacity;
+    }
+
+    if(pRanges->Capacity == 0)
+    {
+        return NULL;
+    }
+
+    mask = pRanges->Capacity - 1;
+    index = (DWORD)(_UsnpHashFileId(pFileId) >> 32) & mask;
+    for(pFile = &(pRanges->Files[index]); pFile->Ranges != NULL; pFile = &(pRanges->Files[index]))
+    {
+        if(memcmp(&(pFile->FileId), pFileId, sizeof(FILE_ID_128)) == 0)
+        {
+            return pFile;
+        }
+        index = (index + 1) & mask;
+    }
+
+    if(Insert == FALSE)
+    {
+        return NULL;
+    }
+
+    pFile->Ranges = (PUSN_RANGE)_UsnpAlloc(4 * sizeof(USN_RANGE));
+    if(pFile->Ranges == NULL)
+    {
+        /*++ last error set by call ... */
+        return NULL;
+    }
+    RtlMoveMemory(&(pFile->FileId), pFileId, sizeof(FILE_ID_128));
+    pFile->Count = 0;
+    pFile->Capacity = 4;
+    pRanges->Count++;
+    return pFile;
+}
+
+/*++
+ * [Start, End) into a file's ranges. those it overlaps or touches are a
+ * run found by bisecting on their ends, and become one; otherwise it goes
+ * in on its own, in order ...
+ */
+BOOL
+_UsnpAddRange (
+    __inout PUSN_RANGE_FILE pFile,
+    __in LONGLONG Start,
+    __in LONGLONG End )
+{
+    PUSN_RANGE Ranges = pFile->Ranges;
+    DWORD lo = 0;
+    DWORD hi = pFile->Count;
+    DWORD last;
+
+    /*++ the first range that ends at or past Start ... */
+    while(lo < hi)
+    {
+        DWORD mid = lo + ((hi - lo) / 2);
+        if(Ranges[mid].End < Start)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    /*++ and the first after it that starts past End ... */
+    for(last=lo; (last < pFile->Count) && (Ranges[last].Start <= End); last++)
+    {
+    }
+
+    if(last == lo)
+    {
+        if(pFile->Count == pFile->Capacity)
+        {
+            Ranges = (PUSN_RANGE)_UsnpAlloc((size_t)pFile->Capacity * 2 * sizeof(USN_RANGE));
+            if(Ranges == NULL)
+            {
+                /*++ last error set by call ... */
+                return FALSE;
+            }
+            RtlMoveMemory(Ranges, pFile->Ranges, (size_t)pFile->Count * sizeof(USN_RANGE));
+            _UsnpFree(pFile->Ranges);
+            pFile->Ranges = Ranges;
+            pFile->Capacity *= 2;
+        }
+
+        memmove(&(Ranges[lo + 1]), &(Ranges[lo]), (size_t)(pFile->Count - lo) * sizeof(USN_RANGE));
+        Ranges[lo].Start = Start;
+        Ranges[lo].End = End;
+        pFile->Count++;
+        return TRUE;
+    }
+
+    if(Ranges[lo].Start < Start)
+    {
+        Start = Ranges[lo].Start;
+    }
+    if(Ranges[last - 1].End > End)
+    {
+        End = Ranges[last - 1].End;
+    }
+    Ranges[lo].Start = Start;
+    Ranges[lo].End = End;
+
+    memmove(&(Ranges[lo + 1]), &(Ranges[last]), (size_t)(pFile->Count - last) * sizeof(USN_RANGE));
+    pFile->Count -= (last - lo - 1);
+    return TRUE;
+}
+
+/*++ qsort order for the files of a range set, by frn ... */
+int
+_UsnpCompareRangeFile (
+    __in const void* p1,
+    __in const void* p2 )
+{
+    return _UsnpCompareFileId(&((*(const USN_RANGE_FILE* const*)p1)->FileId), &((*(const USN_RANGE_FILE* const*)p2)->FileId));
+}
+
+/*++
+ * -ranges; a line for each range, the frn, offset and length in hex, in
+ * frn order. written beside the old file and renamed over it, as a
+ * checkpoint is ...
+ */
+BOOL
+_UsnpSaveRanges (
+    __in PUSN_RANGES pRanges,
+    __in wchar_t* filename )
+{
+    PUSN_RANGE_FILE* files;
+    wchar_t temp[MAX_PATH] = {0};
+    uint64_t ranges = 0;
+    DWORD count = 0;
+    FILE* fp;
+    BOOL status = TRUE;
+
+    if((pRanges == NULL) || (filename == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    files = (PUSN_RANGE_FILE*)_UsnpAlloc(((size_t)pRanges->Count + 1) * sizeof(PUSN_RANGE_FILE));
+    if(files == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    for(DWORD slot=0; slot<pRanges->Capacity; slot++)
+    {
+        if(pRanges->Files[slot].Ranges != NULL)
+        {
+            files[count++] = &(pRanges->Files[slot]);
+        }
+    }
+    qsort(files, count, sizeof(PUSN_RANGE_FILE), _UsnpCompareRangeFile);
+
+    _snwprintf_s(temp, _countof(temp), _countof(temp), L"%ls.tmp", filename);
+
+    fp = _UsnpOpenStream(temp, L"w");
+    if(fp == NULL)
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(files);
+        return FALSE;
+    }
+
+    for(DWORD index=0; (index<count) && (status != FALSE); index++)
+    {
+        ULARGE_INTEGER128* frn = (ULARGE_INTEGER128*)&(files[index]->FileId);
+
+        for(DWORD range=0; range<files[index]->Count; range++)
+        {
+            if(fprintf(fp, "%016llX%016llX %016llX %016llX\n",
+                       (unsigned long long)frn->HighPart, (unsigned long long)frn->LowPart,
+                       (unsigned long long)files[index]->Ranges[range].Start,
+                       (unsigned long long)(files[index]->Ranges[range].End - files[index]->Ranges[range].Start)) < 0)
+            {
+                status = FALSE;
+                break;
+            }
+        }
+        ranges += files[index]->Count;
+    }
+    _UsnpFree(files);
+
+    status = status && _UsnpFlushStream(fp);
+    if(fclose(fp) != 0)
+    {
+        status = FALSE;
+    }
+    if(status == FALSE)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+
+    /*++ after the records already made ... */
+    _UsnpFlushOutput(&g_stdout);
+    fwprintf(g_info, L"ranges(%ls), %llu extents in %llu ranges of %u files\n",
+             filename, (unsigned long long)pRanges->Extents, (unsigned long long)ranges, count);
+    return _UsnpReplaceFile(temp, filename);
+}
+
+/*++
+ */
+void
+_UsnpFreeRanges (
+    __inout PUSN_RANGES pRanges )
+{
+    for(DWORD slot=0; slot<pRanges->Capacity; slot++)
+    {
+        _UsnpFree(pRanges->Files[slot].Ranges);
+    }
+    _UsnpFree(pRanges->Files);
+    RtlZeroMemory(pRanges, sizeof(USN_RANGES));
+}
+
+/*++
+ * -coalesce; a table of at most Capacity open files. entries are chained
+ * off the buckets by index and kept on a list in the order the files were
+ * opened, the unused ones chained off Free ...
+ */
+BOOL
+_UsnpOpenCoalesce (
+    __out PUSN_COALESCE pCoalesce,
+    __in DWORD Capacity,
+    __in DWORD MaxAge,
+    __in PUSN_STATS pStats )
+{
+    DWORD buckets = 1;
+
+    if((pCoalesce == NULL) || (Capacity == 0) || (Capacity == _USN_COALESCE_NONE) || (pStats == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pCoalesce, sizeof(USN_COALESCE));
+
+    while((buckets < Capacity) && (buckets < 0x80000000))
+    {
+        buckets <<= 1;
+    }
+
+    pCoalesce->Entries = (PUSN_COALESCE_ENTRY)_UsnpAlloc((size_t)Capacity * sizeof(USN_COALESCE_ENTRY));
+    pCoalesce->Buckets = (DWORD*)_UsnpAlloc((size_t)buckets * sizeof(DWORD));
+    if((pCoalesce->Entries == NULL) || (pCoalesce->Buckets == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpCloseCoalesce(pCoalesce);
+        return FALSE;
+    }
+
+    memset(pCoalesce->Buckets, 0xFF, (size_t)buckets * sizeof(DWORD));
+
+    for(DWORD index=0; index<Capacity; index++)
+    {
+        pCoalesce->Entries[index].Next = (((index + 1) < Capacity) ? (index + 1) : _USN_COALESCE_NONE);
+    }
+
+    pCoalesce->Capacity   = Capacity;
+    pCoalesce->Free       = 0;
+    pCoalesce->BucketMask = buckets - 1;
+    pCoalesce->Oldest     = _USN_COALESCE_NONE;
+    pCoalesce->Newest     = _USN_COALESCE_NONE;
+    pCoalesce->MaxAge     = (LONGLONG)MaxAge * 10000000;
+    pCoalesce->pStats     = pStats;
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpCloseCoalesce (
+    __in PUSN_COALESCE pCoalesce )
+{
+    if(pCoalesce == NULL)
+    {
+        return;
+    }
+
+    _UsnpFree(pCoalesce->Entries);
+    _UsnpFree(pCoalesce->Buckets);
+    RtlZeroMemory(pCoalesce, sizeof(USN_COALESCE));
+}
+
+/*++ the entry for pFileId, or _USN_COALESCE_NONE; pBucket gets its chain ... */
+DWORD
+_UsnpCoalesceFind (
+    __in PUSN_COALESCE pCoalesce,
+    __in FILE_ID_128* pFileId,
+    __out DWORD* pBucket )
+{
+    DWORD index;
+
+    *pBucket = (DWORD)(_UsnpHashFileId(pFileId) >> 32) & pCoalesce->BucketMask;
+
+    for(index=pCoalesce->Buckets[*pBucket]; index!=_USN_COALESCE_NONE; index=pCoalesce->Entries[index].Next)
+    {
+        if(memcmp(&(pCoalesce->Entries[index].FileId), pFileId, sizeof(FILE_ID_128)) == 0)
+        {
+            return index;
+        }
+    }
+    return _USN_COALESCE_NONE;
+}
+
+/*++
+ * show what an open file has held, its latest record with every reason
+ * since it was opened, and give its entry back ...
+ */
+void
+_UsnpCoalesceEmit (
+    __in PUSN_WALK pWalk,
+    __in DWORD Index )
+{
+    PUSN_COALESCE pCoalesce = pWalk->pCoalesce;
+    PUSN_COALESCE_ENTRY pEntry = &(pCoalesce->Entries[Index]);
+    PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)pEntry->Record;
+    DWORD bucket;
+    DWORD* pLink;
+
+    _UsnpSetRecordReason(pRecord, pEntry->Reasons);
+    _UsnpWalkEmit(pWalk, pRecord, NULL);
+
+    _UsnpCoalesceFind(pCoalesce, &(pEntry->FileId), &bucket);
+    for(pLink=&(pCoalesce->Buckets[bucket]); *pLink!=_USN_COALESCE_NONE; pLink=&(pCoalesce->Entries[*pLink].Next))
+    {
+        if(*pLink == Index)
+        {
+            *pLink = pEntry->Next;
+            break;
+        }
+    }
+
+    if(pEntry->Older != _USN_COALESCE_NONE)
+    {
+        pCoalesce->Entries[pEntry->Older].Newer = pEntry->Newer;
+    }
+    else
+    {
+        pCoalesce->Oldest = pEntry->Newer;
+    }
+    if(pEntry->Newer != _USN_COALESCE_NONE)
+    {
+        pCoalesce->Entries[pEntry->Newer].Older = pEntry->Older;
+    }
+    else
+    {
+        pCoalesce->Newest = pEntry->Older;
+    }
+
+    pEntry->Next    = pCoalesce->Free;
+    pCoalesce->Free = Index;
+    pCoalesce->Count--;
+}
+
+/*++
+ * hold a record until its file is closed. the close goes out carrying
+ * every reason since the open, and what came before it is dropped. a file
+ * open longer than MaxAge in journal time, or the one open longest when
+ * the table is full, goes out without waiting for its close ...
+ */
+void
+_UsnpCoalesceRecord (
+    __in PUSN_WALK pWalk,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    PUSN_COALESCE pCoalesce = pWalk->pCoalesce;
+    PUSN_COALESCE_ENTRY pEntry;
+    FILE_ID_128 FileId;
+    FILE_ID_128 Parent;
+    LONGLONG stamp = _UsnpGetRecordTimeStamp(pRecord);
+    DWORD reason = _UsnpGetRecordReason(pRecord);
+    DWORD bucket;
+    DWORD index;
+
+    if((pCoalesce->MaxAge != 0) && (stamp != 0))
+    {
+        while( (pCoalesce->Oldest != _USN_COALESCE_NONE) &&
+               ((stamp - pCoalesce->Entries[pCoalesce->Oldest].Opened) > pCoalesce->MaxAge))
+        {
+            pCoalesce->pStats->CoalesceEvicted++;
+            _UsnpCoalesceEmit(pWalk, pCoalesce->Oldest);
+            if(pWalk->Done)
+            {
+                /*++ the count was reached before this record was taken ... */
+                _UsnpStopWalk(pWalk, _UsnpGetRecordUsn(pRecord));
+                return;
+            }
+        }
+    }
+
+    /*++ v4 range records, and anything too long to hold, go straight out ... */
+    if( (pRecord->MajorVersion > 3) || (pRecord->RecordLength > _USN_COALESCE_SLOT) ||
+        (_UsnpGetRecordFileIds(pRecord, &FileId, &Parent) == FALSE))
+    {
+        _UsnpWalkEmit(pWalk, pRecord, NULL);
+        return;
+    }
+
+    index = _UsnpCoalesceFind(pCoalesce, &FileId, &bucket);
+    if(index != _USN_COALESCE_NONE)
+    {
+        /*++ the record held so far is folded into this one ... */
+        pEntry = &(pCoalesce->Entries[index]);
+        pEntry->Reasons |= reason;
+        RtlMoveMemory(pEntry->Record, pRecord, pRecord->RecordLength);
+        pCoalesce->pStats->Coalesced++;
+
+        if((reason & USN_REASON_CLOSE) != 0)
+        {
+            _UsnpCoalesceEmit(pWalk, index);
+        }
+        return;
+    }
+
+    if((reason & USN_REASON_CLOSE) != 0)
+    {
+        /*++ opened and closed within the one record ... */
+        _UsnpWalkEmit(pWalk, pRecord, NULL);
+        return;
+    }
+
+    if(pCoalesce->Free == _USN_COALESCE_NONE)
+    {
+        pCoalesce->pStats->CoalesceEvicted++;
+        _UsnpCoalesceEmit(pWalk, pCoalesce->Oldest);
+        if(pWalk->Done)
+        {
+            _UsnpStopWalk(pWalk, _UsnpGetRecordUsn(pRecord));
+            return;
+        }
+    }
+
+    index = pCoalesce->Free;
+    pEntry = &(pCoalesce->Entries[index]);
+    pCoalesce->Free = pEntry->Next;
+    pCoalesce->Count++;
+
+    RtlMoveMemory(&(pEntry->FileId), &FileId, sizeof(FILE_ID_128));
+    RtlMoveMemory(pEntry->Record, pRecord, pRecord->RecordLength);
+    pEntry->Reasons = reason;
+    pEntry->Opened  = stamp;
+    pEntry->FirstUsn = _UsnpGetRecordUsn(pRecord);
+    pEntry->Next    = pCoalesce->Buckets[bucket];
+    pCoalesce->Buckets[bucket] = index;
+
+    pEntry->Older = pCoalesce->Newest;
+    pEntry->Newer = _USN_COALESCE_NONE;
+    if(pCoalesce->Newest != _USN_COALESCE_NONE)
+    {
+        pCoalesce->Entries[pCoalesce->Newest].Newer = index;
+    }
+    else
+    {
+        pCoalesce->Oldest = index;
+    }
+    pCoalesce->Newest = index;
+}
+
+/*++
+ * the end of a run; files still open go out with what they have so far,
+ * oldest first. their closes come in a later run ...
+ */
+void
+_UsnpCoalesceFlush (
+    __in PUSN_WALK pWalk )
+{
+    PUSN_COALESCE pCoalesce = pWalk->pCoalesce;
+
+    if(pCoalesce == NULL)
+    {
+        return;
+    }
+
+    while((pCoalesce->Oldest != _USN_COALESCE_NONE) && (pWalk->Done == FALSE))
+    {
+        pCoalesce->pStats->CoalescePending++;
+        _UsnpCoalesceEmit(pWalk, pCoalesce->Oldest);
+    }
+}
+
+/*++
+ * walk a raw $UsnJrnl:$J stream, pulled off an image, in place. the file
+ * offset of a record is its usn, records never straddle a page, and the
+ * leading part of the stream (deallocated as the journal wraps) reads as
+ * zeroes ...
+ */
+BOOL
+_UsnpReadJournalFile (
+    __in wchar_t* filename,
+    __in DWORD Reason )
+{
+    BOOL status;
+    USN_MAPPING Mapping = {0};
+    USN_JOURNAL_DATA JournalData = {0};
+    USN_WALK Walk = {0};
+    USN_RESOLVER Resolver = {0};
+    USN_COALESCE Coalesce = {0};
+    USN_MOVES Moves = {0};
+    USN_PREFILTER Prefilter;
+    uint64_t first;
+
+    if(filename == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if( _UsnpMapFile(filename, FALSE, &Mapping) == FALSE)
+    {
+        /*++ last error set by call ... */
+        fwprintf(stderr, L"map failed, status(%X)\n", GetLastError());
+        return FALSE;
+    }
+
+    first = _UsnpSkipZeroPages(&Mapping, 0, Mapping.Size);
+    g_stats.Skipped += first;
+
+    /*++ there is no journal to ask; describe the stream instead ... */
+    JournalData.FirstUsn                 = (USN)first;
+    JournalData.NextUsn                  = (USN)Mapping.Size;
+    JournalData.LowestValidUsn           = (USN)first;
+    JournalData.MaximumSize              = Mapping.Size - first;
+    JournalData.MinSupportedMajorVersion = 2;
+    JournalData.MaxSupportedMajorVersion = 4;
+
+    _UsnpFormatJournalData(filename, &JournalData);
+
+    if(g_since != 0)
+    {
+        DWORD probes = 0;
+
+        first = _UsnpSeekJournalStream(&Mapping, first, Mapping.Size, g_since, &probes);
+        fwprintf(g_info, L"since(%016llX), from offset %016llX after %u pages\n", g_since, first, probes);
+    }
+
+    /*++ held records go out in journal order, so coalescing and moves are one thread, as are ranges ... */
+    if((g_threads > 1) && (g_tree == 0) && (g_coalesce == 0) && (g_moves == 0) && (g_rangesfile == NULL))
+    {
+        status = _UsnpScanJournalParallel(&Mapping, first, Mapping.Size, Reason, g_threads);
+        _UsnpUnmapFile(&Mapping);
+        return status;
+    }
+
+    if( _UsnpOpenResolver(NULL, &g_stats, &Resolver) == FALSE)
+    {
+        /*++ last error set by call ... */
+        _UsnpUnmapFile(&Mapping);
+        return FALSE;
+    }
+    g_watch.pTree = _UsnpGetTree(&Resolver);
+
+    if((g_coalesce != 0) && (_UsnpOpenCoalesce(&Coalesce, g_coalesce, g_coalesceage, &g_stats) == FALSE))
+    {
+        /*++ last error set by call ... */
+        _UsnpCloseResolver(&Resolver);
+        _UsnpUnmapFile(&Mapping);
+        return FALSE;
+    }
+
+    Walk.pResolver  = &Resolver;
+    Walk.pWatch     = ((g_watchlist != NULL) ? &g_watch : NULL);
+    Walk.pFilter    = ((g_filter.Ops != NULL) ? &g_filter : NULL);
+    Walk.pCoalesce  = ((g_coalesce != 0) ? &Coalesce : NULL);
+    Walk.pMoves     = ((g_moves) ? &Moves : NULL);
+    Walk.pRanges    = ((g_rangesfile != NULL) ? &g_ranges : NULL);
+    Moves.pStats    = &g_stats;
+    Walk.ReasonMask = Reason;
+    Walk.Padded     = TRUE;
+    Walk.Limit      = g_count;
+    Walk.pStats     = &g_stats;
+    _UsnpOpenPrefilter(&Walk, &Prefilter);
+
+    status = _UsnpWalkJournalStream(&Walk, &Mapping, first, Mapping.Size);
+    if(status != FALSE)
+    {
+        _UsnpWalkFlush(&Walk);
+    }
+
+    if((status != FALSE) && (g_rangesfile != NULL) && (_UsnpSaveRanges(&g_ranges, g_rangesfile) == FALSE))
+    {
+        fwprintf(stderr, L"save ranges failed, status(%X)\n", GetLastError());
+    }
+
+    _UsnpCloseCoalesce(&Coalesce);
+    _UsnpCloseResolver(&Resolver);
+    _UsnpUnmapFile(&Mapping);
+    return status;
+}
+
+/*++
+ * walk the pages in [Begin, End), Begin on a record if not a page. zero
+ * pages are passed over, and a page
+ * holding a bad record is counted and abandoned rather than ending the
+ * walk; an image can carry torn pages ...
+ */
+BOOL
+_UsnpWalkJournalStream (
+    __in PUSN_WALK pWalk,
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Begin,
+    __in uint64_t End )
+{
+    uint64_t offset = Begin;
+
+    if((pWalk == NULL) || (pMapping == NULL) || (End > pMapping->Size))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    while((offset < End) && (pWalk->Done == FALSE))
+    {
+        uint8_t* page = pMapping->Base + offset;
+        size_t bytes = USN_PAGE_SIZE - (size_t)(offset & (USN_PAGE_SIZE - 1));
+
+        /*++ a walk can start part way into a page; it still stops at the page end ... */
+        if((End - offset) < bytes)
+        {
+            bytes = (size_t)(End - offset);
+        }
+
+        if( _UsnpIsZeroPage(page, bytes))
+        {
+            if(pWalk->pStats != NULL)
+            {
+                pWalk->pStats->Skipped += bytes;
+            }
+        }
+        else if( _UsnpWalkRecords(pWalk, page, bytes) == FALSE)
+        {
+            if(pWalk->pStats != NULL)
+            {
+                pWalk->pStats->Corrupt++;
+            }
+        }
+        offset += bytes;
+    }
+
+    if(pWalk->Done)
+    {
+        SetLastError(ERROR_IMPLEMENTATION_LIMIT);
+    }
+    return TRUE;
+}
+
+/*++
+ * decode [Begin, End) of a mapped journal on a pool of workers. the span is
+ * cut into page-aligned chunks handed out in order; each worker runs the
+ * usual record walk over its chunk with output going to the chunk's text.
+ * this thread writes chunks out as they complete, in usn order, and folds
+ * their counters into the totals. workers stay at most Window chunks ahead
+ * of the merge so memory stays bounded on a very large journal. the chunk
+ * the record count ends in is walked again here, carrying on the count
+ * from the chunks before it, and the workers are stopped; a failed write
+ * stops them too ...
+ */
+BOOL
+_UsnpScanJournalParallel (
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Begin,
+    __in uint64_t End,
+    __in DWORD Reason,
+    __in DWORD Threads )
+{
+    USN_SCAN Scan = {0};
+    PUSN_THREAD pThreads = NULL;
+    USN_STATS Totals = {0};
+    USN_RESOLVER Resolver = {0};
+    DWORD started = 0;
+    DWORD error = ERROR_SUCCESS;
+    uint64_t count = 0;
+    uint64_t chunksize;
+    uint64_t base;
+    BOOL stopped = FALSE;
+    BOOL status = TRUE;
+
+    if((pMapping == NULL) || (Begin > End) || (End > pMapping->Size) || (Threads == 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++ several chunks per worker to even out the load, 1 MB at least ... */
+    chunksize = (End - Begin) / ((uint64_t)Threads * 8);
+    if(chunksize < (1024 * 1024))
+    {
+        chunksize = 1024 * 1024;
+    }
+    chunksize = (chunksize + USN_PAGE_SIZE - 1) & ~(uint64_t)(USN_PAGE_SIZE - 1);
+
+    /*++ chunks are cut on pages, the first starting wherever Begin is ... */
+    base = Begin & ~(uint64_t)(USN_PAGE_SIZE - 1);
+
+    Scan.pMapping   = pMapping;
+    Scan.ReasonMask = Reason;
+    Scan.ChunkCount = (size_t)(((End - base) + chunksize - 1) / chunksize);
+    Scan.Window     = (size_t)Threads * 4;
+
+    if(Scan.ChunkCount == 0)
+    {
+        return TRUE;
+    }
+
+    Scan.Chunks = (PUSN_SCAN_CHUNK)_UsnpAlloc(Scan.ChunkCount * sizeof(USN_SCAN_CHUNK));
+    pThreads = (PUSN_THREAD)_UsnpAlloc(Threads * sizeof(USN_THREAD));
+    if((Scan.Chunks == NULL) || (pThreads == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(Scan.Chunks);
+        _UsnpFree(pThreads);
+        return FALSE;
+    }
+
+    for(size_t index=0; index<Scan.ChunkCount; index++)
+    {
+        Scan.Chunks[index].Output.File = -1;
+        Scan.Chunks[index].Begin = ((index == 0) ? Begin : (base + (index * chunksize)));
+        Scan.Chunks[index].End = base + ((index + 1) * chunksize);
+        if(Scan.Chunks[index].End > End)
+        {
+            Scan.Chunks[index].End = End;
+        }
+    }
+
+    _UsnpInitLock(&Scan.Lock, &Scan.Changed);
+
+    /*++ a resolver like the workers', for what is walked here ... */
+    if( _UsnpOpenResolver(NULL, &Totals, &Resolver) == FALSE)
+    {
+        fwprintf(stderr, L"open resolver failed, status(%X)\n", GetLastError());
+    }
+
+    for(; started<Threads; started++)
+    {
+        if( _UsnpCreateThread(_UsnpScanWorker, &Scan, &pThreads[started]) == FALSE)
+        {
+            /*++ carry on with the ones that did start ... */
+            fwprintf(stderr, L"create thread failed, status(%X)\n", GetLastError());
+            break;
+        }
+    }
+
+    if(started == 0)
+    {
+        /*++ nobody to do the work; do it here ... */
+        USN_WALK Walk = {0};
+        USN_PREFILTER Prefilter;
+        Walk.pResolver  = &Resolver;
+        Walk.pWatch     = ((g_watchlist != NULL) ? &g_watch : NULL);
+        Walk.pFilter    = ((g_filter.Ops != NULL) ? &g_filter : NULL);
+        Walk.ReasonMask = Reason;
+        Walk.Padded     = TRUE;
+        Walk.Limit      = g_count;
+        Walk.pStats     = &g_stats;
+        _UsnpOpenPrefilter(&Walk, &Prefilter);
+        status = _UsnpWalkJournalStream(&Walk, pMapping, Begin, End);
+        Scan.Merged = Scan.ChunkCount;
+    }
+
+    for(; (Scan.Merged<Scan.ChunkCount) && (stopped == FALSE); )
+    {
+        PUSN_SCAN_CHUNK pChunk = &(Scan.Chunks[Scan.Merged]);
+
+        _UsnpAcquireLock(&Scan.Lock);
+        while(pChunk->Done == FALSE)
+        {
+            _UsnpWaitCond(&Scan.Changed, &Scan.Lock);
+        }
+        _UsnpReleaseLock(&Scan.Lock);
+
+        /*++ _UsnpWalkEmit ends a walk on the record that takes the count past Limit + 1 ... */
+        if((g_count > 0) && ((count + pChunk->Stats.Records) > ((uint64_t)g_count + 1)))
+        {
+            USN_WALK Walk = {0};
+            USN_PREFILTER Prefilter;
+            Walk.pResolver  = &Resolver;
+            Walk.pWatch     = ((g_watchlist != NULL) ? &g_watch : NULL);
+            Walk.pFilter    = ((g_filter.Ops != NULL) ? &g_filter : NULL);
+            Walk.ReasonMask = Scan.ReasonMask;
+            Walk.Padded     = TRUE;
+            Walk.Limit      = g_count;
+            Walk.Count      = (int)count;
+            Walk.pStats     = &g_stats;
+            _UsnpOpenPrefilter(&Walk, &Prefilter);
+            if( _UsnpWalkJournalStream(&Walk, pMapping, pChunk->Begin, pChunk->End) == FALSE)
+            {
+                error = GetLastError();
+                status = FALSE;
+            }
+            stopped = TRUE;
+        }
+        else
+        {
+            if( (pChunk->Output.Length > 0) &&
+                ((_UsnpFlushOutput(&g_stdout) == FALSE) ||
+                 (_UsnpWriteFile(g_stdout.File, pChunk->Output.Buffer, pChunk->Output.Length) == FALSE)))
+            {
+                error = GetLastError();
+                status = FALSE;
+                stopped = TRUE;
+            }
+            _UsnpMergeStats(&g_stats, &(pChunk->Stats));
+            count += pChunk->Stats.Records;
+        }
+        _UsnpFreeOutput(&(pChunk->Output));
+
+        _UsnpAcquireLock(&Scan.Lock);
+        Scan.Merged++;
+        Scan.Stop = stopped;
+        _UsnpWakeCond(&Scan.Changed);
+        _UsnpReleaseLock(&Scan.Lock);
+    }
+
+    for(DWORD index=0; index<started; index++)
+    {
+        _UsnpJoinThread(&pThreads[index]);
+    }
+    _UsnpMergeStats(&g_stats, &Scan.Totals);
+
+    /*++ chunks walked past where the merge stopped are not written ... */
+    for(size_t index=Scan.Merged; index<Scan.ChunkCount; index++)
+    {
+        _UsnpFreeOutput(&(Scan.Chunks[index].Output));
+    }
+
+    _UsnpCloseResolver(&Resolver);
+    _UsnpMergeStats(&g_stats, &Totals);
+    _UsnpDeleteLock(&Scan.Lock, &Scan.Changed);
+    _UsnpFree(pThreads);
+    _UsnpFree(Scan.Chunks);
+
+    if(error != ERROR_SUCCESS)
+    {
+        SetLastError(error);
+    }
+    return status;
+}
+
+/*++
+ */
+DWORD
+_UsnpScanWorker (
+    __in void* Context )
+{
+    PUSN_SCAN pScan = (PUSN_SCAN)Context;
+    USN_STATS Totals = {0};
+    USN_RESOLVER Resolver = {0};
+
+    /*++ a cache per worker; nothing is shared but the mapping ... */
+    if( _UsnpOpenResolver(NULL, &Totals, &Resolver) == FALSE)
+    {
+        fwprintf(stderr, L"open resolver failed, status(%X)\n", GetLastError());
+    }
+
+    while(1)
+    {
+        PUSN_SCAN_CHUNK pChunk;
+        USN_WALK Walk = {0};
+        USN_PREFILTER Prefilter;
+
+        _UsnpAcquireLock(&pScan->Lock);
+        while((pScan->Stop == FALSE) && (pScan->Next < pScan->ChunkCount) && ((pScan->Next - pScan->Merged) >= pScan->Window))
+        {
+            _UsnpWaitCond(&pScan->Changed, &pScan->Lock);
+        }
+        if(pScan->Stop || (pScan->Next >= pScan->ChunkCount))
+        {
+            _UsnpReleaseLock(&pScan->Lock);
+            break;
+        }
+        pChunk = &(pScan->Chunks[pScan->Next++]);
+        _UsnpReleaseLock(&pScan->Lock);
+
+        /*++ no chunk needs more records than the count; where the count ends is up to the merge ... */
+        Walk.pResolver  = &Resolver;
+        Walk.pWatch     = ((g_watchlist != NULL) ? &g_watch : NULL);
+        Walk.pFilter    = ((g_filter.Ops != NULL) ? &g_filter : NULL);
+        Walk.ReasonMask = pScan->ReasonMask;
+        Walk.Padded     = TRUE;
+        Walk.Limit      = g_count;
+        Walk.pStats     = &(pChunk->Stats);
+        _UsnpOpenPrefilter(&Walk, &Prefilter);
+
+        g_output = &(pChunk->Output);
+        _UsnpWalkJournalStream(&Walk, pScan->pMapping, pChunk->Begin, pChunk->End);
+        g_output = NULL;
+
+        _UsnpAcquireLock(&pScan->Lock);
+        pChunk->Done = TRUE;
+        _UsnpWakeCond(&pScan->Changed);
+        _UsnpReleaseLock(&pScan->Lock);
+    }
+
+    _UsnpCloseResolver(&Resolver);
+
+    _UsnpAcquireLock(&pScan->Lock);
+    _UsnpMergeStats(&pScan->Totals, &Totals);
+    _UsnpReleaseLock(&pScan->Lock);
+    return 0;
+}
+
+/*++ fold counters from a later stretch of the journal into the totals ... */
+void
+_UsnpMergeStats (
+    __inout PUSN_STATS pTotal,
+    __in PUSN_STATS pStats )
+{
+    if(pStats->Records > 0)
+    {
+        if(pTotal->Records == 0)
+        {
+            pTotal->FirstUsn = pStats->FirstUsn;
+        }
+        pTotal->LastUsn = pStats->LastUsn;
+    }
+    pTotal->Records += pStats->Records;
+    pTotal->Bytes   += pStats->Bytes;
+    pTotal->Reads   += pStats->Reads;
+    pTotal->Skipped += pStats->Skipped;
+    pTotal->Corrupt += pStats->Corrupt;
+    pTotal->Unwatched += pStats->Unwatched;
+    pTotal->Filtered  += pStats->Filtered;
+    pTotal->Prefiltered += pStats->Prefiltered;
+    pTotal->PathHits     += pStats->PathHits;
+    pTotal->PathNegative += pStats->PathNegative;
+    pTotal->PathMisses   += pStats->PathMisses;
+    pTotal->PathEvicted  += pStats->PathEvicted;
+    pTotal->TreeHits     += pStats->TreeHits;
+    pTotal->TreeMisses   += pStats->TreeMisses;
+    pTotal->TreeEntries  += pStats->TreeEntries;
+    pTotal->TreeBytes    += pStats->TreeBytes;
+    pTotal->LatencyRecords += pStats->LatencyRecords;
+    pTotal->LatencyTotal   += pStats->LatencyTotal;
+    if(pStats->LatencyMax > pTotal->LatencyMax)
+    {
+        pTotal->LatencyMax = pStats->LatencyMax;
+    }
+}
+
+/*++ offset of the first page at or past Offset that is not all zero ... */
+uint64_t
+_UsnpSkipZeroPages (
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Offset,
+    __in uint64_t End )
+{
+    Offset &= ~(uint64_t)(USN_PAGE_SIZE - 1);
+
+    while(Offset < End)
+    {
+        size_t bytes = (size_t)(((End - Offset) < USN_PAGE_SIZE) ? (End - Offset) : USN_PAGE_SIZE);
+        if( _UsnpIsZeroPage(pMapping->Base + Offset, bytes) == FALSE)
+        {
+            break;
+        }
+        Offset += bytes;
+    }
+    return ((Offset < End) ? Offset : End);
+}
+
+/*++
+ * the offset of the first record at or after Since in a $J stream, by
+ * bisecting its pages on the time of each page's first record. zero pages
+ * met by a probe are stepped over to the next page in use. the page
+ * before the answer can hold the crossing, so it is searched record by
+ * record. pProbes counts the pages looked at ...
+ */
+uint64_t
+_UsnpSeekJournalStream (
+    __in PUSN_MAPPING pMapping,
+    __in uint64_t Begin,
+    __in uint64_t End,
+    __in LONGLONG Since,
+    __out_opt DWORD* pProbes )
+{
+    uint64_t lo = Begin & ~(uint64_t)(USN_PAGE_SIZE - 1);
+    uint64_t hi = End;
+    DWORD probes = 0;
+
+    while(lo < hi)
+    {
+        uint64_t mid = lo + (((hi - lo) / 2) & ~(uint64_t)(USN_PAGE_SIZE - 1));
+        uint64_t page = _UsnpSkipZeroPages(pMapping, mid, hi);
+        size_t bytes;
+
+        if(page >= hi)
+        {
+            hi = mid;
+            continue;
+        }
+
+        bytes = (size_t)(((hi - page) < USN_PAGE_SIZE) ? (hi - page) : USN_PAGE_SIZE);
+        probes++;
+
+        if( _UsnpSeekPage(pMapping->Base + page, bytes, Since) == 0)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = page + USN_PAGE_SIZE;
+        }
+    }
+
+    if(pProbes != NULL)
+    {
+        *pProbes = probes;
+    }
+
+    /*++ lo follows a page whose first record was early ... */
+    if(lo > Begin)
+    {
+        uint64_t page = lo - USN_PAGE_SIZE;
+        size_t bytes = (size_t)(((End - page) < USN_PAGE_SIZE) ? (End - page) : USN_PAGE_SIZE);
+        size_t offset = _UsnpSeekPage(pMapping->Base + page, bytes, Since);
+
+        if(offset < bytes)
+        {
+            return page + offset;
+        }
+    }
+    return ((lo < End) ? lo : End);
+}
+
+/*++
+ * the offset in a $J page of its first record at or after Since, or bytes
+ * if there is none. v4 records have no time of their own and are passed
+ * over. a bad record gives 0, so a torn page is read rather than
+ * skipped ...
+ */
+size_t
+_UsnpSeekPage (
+    __in_bcount(bytes) const uint8_t* page,
+    __in size_t bytes,
+    __in LONGLONG Since )
+{
+    size_t offset = 0;
+
+    while((bytes - offset) >= sizeof(USN_RECORD_COMMON_HEADER))
+    {
+        PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(page + offset);
+
+        if(pRecord->RecordLength == 0)
+        {
+            /*++ zero fill to the page end ... */
+            break;
+        }
+
+        if( (pRecord->RecordLength < sizeof(USN_RECORD_COMMON_HEADER)) || (pRecord->RecordLength > (bytes - offset)) ||
+            ((pRecord->RecordLength & 7) != 0))
+        {
+            return 0;
+        }
+
+        if((pRecord->MajorVersion <= 3) && (_UsnpGetRecordTimeStamp(pRecord) >= Since))
+        {
+            return offset;
+        }
+        offset += pRecord->RecordLength;
+    }
+    return bytes;
+}
+
+/*++
+ * a page that holds records starts with one, so the first word settles
+ * most pages. the rest is or'ed together a cache line at a time ...
+ */
+BOOL
+_UsnpIsZeroPage (
+    __in_bcount(bytes) const uint8_t* page,
+    __in size_t bytes )
+{
+    const uint64_t* words = (const uint64_t*)page;
+    size_t count = bytes / sizeof(uint64_t);
+    size_t index = 0;
+
+    if((count > 0) && (words[0] != 0))
+    {
+        return FALSE;
+    }
+
+    for(; (index + 8) <= count; index += 8)
+    {
+        if((words[index + 0] | words[index + 1] | words[index + 2] | words[index + 3] |
+            words[index + 4] | words[index + 5] | words[index + 6] | words[index + 7]) != 0)
+        {
+            return FALSE;
+        }
+    }
+    for(; index < count; index++)
+    {
+        if(words[index] != 0)
+        {
+            return FALSE;
+        }
+    }
+    for(index *= sizeof(uint64_t); index < bytes; index++)
+    {
+        if(page[index] != 0)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpFormatJournalData (
+    __in wchar_t* pathname,
+    __in PUSN_JOURNAL_DATA pJournalData )
+{
+    if((pathname == NULL) || (pJournalData == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    fwprintf(g_info,
+     L"JOURNAL DATA PATH(%ls)\n"
+     L"  UsnJournalID        %016llX\n"
+     L"  FirstUsn            %016llX\n"
+     L"  NextUsn             %016llX\n"
+     L"  LowestValidUsn      %016llX\n"
+     L"  MaxUsn              %016llX\n"
+     L"  MaximumSize         %016llX\n"
+     L"  AllocationDelta     %016llX\n"
+     L"  Supported Versions  %u.x - %u.x\n",
+     pathname,
+     pJournalData->UsnJournalID,
+     pJournalData->FirstUsn,
+     pJournalData->NextUsn,
+     pJournalData->LowestValidUsn,
+     pJournalData->MaxUsn,
+     pJournalData->MaximumSize,
+     pJournalData->AllocationDelta,
+     pJournalData->MinSupportedMajorVersion,
+     pJournalData->MaxSupportedMajorVersion
+     );
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpFormatRecord (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_UNION* pRecord )
+{
+    BOOL status;
+
+    /*++ check ptr ... */
+    if(pRecord == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    switch(pRecord->Header.MajorVersion)
+    {
+    case 2: status = _UsnpFormatRecordV2(pResolver, &(pRecord->V2)); break;
+    case 3: status = _UsnpFormatRecordV3(pResolver, &(pRecord->V3), NULL); break;
+    case 4: status = _UsnpFormatRecordV4(pResolver, &(pRecord->V4)); break;
+    default:
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    if((status != FALSE) && g_dump && (g_format == _USN_FORMAT_TEXT))
+    {
+        /*++ hex-dump record, as read, if desired ... */
+        _UsnpDump((uint8_t*)pRecord, pRecord->Header.RecordLength);
+    }
+    return status;
+}
+
+/*++
+ * a rename as one move; the new name record, and the old parent and name
+ * from the record before it ...
+ */
+BOOL
+_UsnpFormatMove (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_UNION* pOld,
+    __in USN_RECORD_UNION* pNew )
+{
+    uint64_t storage[_USN_RECORD_V3_STORAGE];
+    uint64_t oldstorage[_USN_RECORD_V3_STORAGE];
+    USN_RECORD_UNION* pRaw = pNew;
+    BOOL status;
+
+    /*++ check ptr ... */
+    if((pOld == NULL) || (pNew == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++ v2 halves are widened first, as on their own ... */
+    if(pOld->Header.MajorVersion == 2)
+    {
+        if( _UsnpUpconvertRecordV2(&(pOld->V2), (USN_RECORD_V3*)oldstorage, sizeof(oldstorage)) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        pOld = (USN_RECORD_UNION*)oldstorage;
+    }
+    if(pNew->Header.MajorVersion == 2)
+    {
+        if( _UsnpUpconvertRecordV2(&(pNew->V2), (USN_RECORD_V3*)storage, sizeof(storage)) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        pNew = (USN_RECORD_UNION*)storage;
+    }
+
+    if((pOld->Header.MajorVersion != 3) || (pNew->Header.MajorVersion != 3))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    status = _UsnpFormatRecordV3(pResolver, &(pNew->V3), &(pOld->V3));
+    if((status != FALSE) && g_dump && (g_format == _USN_FORMAT_TEXT))
+    {
+        /*++ the new name record, as read ... */
+        _UsnpDump((uint8_t*)pRaw, pRaw->Header.RecordLength);
+    }
+    return status;
+}
+
+/*++
+ */
+BOOL
+_UsnpFormatRecordV2 (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_V2* pRecord )
+{
+    uint64_t storage[_USN_RECORD_V3_STORAGE];
+
+    /*++ check ptr ... */
+    if(pRecord == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++ shown as the v3 record it would have been ... */
+    if( _UsnpUpconvertRecordV2(pRecord, (USN_RECORD_V3*)storage, sizeof(storage)) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    return _UsnpFormatRecordV3(pResolver, (USN_RECORD_V3*)storage, NULL);
+}
+
+/*++
+ */
+BOOL
+_UsnpFormatRecordV3 (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_V3* pRecord,
+    __in_opt USN_RECORD_V3* pOld )
+{
+    PUSN_OUTPUT pOut = _UsnpGetOutput();
+    wchar_t buffer[MAX_PATH] = {0};
+    wchar_t oldbuffer[MAX_PATH] = {0};
+    size_t cchbuffer;
+
+    /*++ check ptr ... */
+    if(pRecord == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    cchbuffer = _countof(buffer);
+    if( _UsnpResolvePath(pResolver, &(pRecord->ParentFileReferenceNumber), buffer, cchbuffer) == FALSE)
+    {
+        if(g_format != _USN_FORMAT_TEXT)
+        {
+            /*++ the machine formats show a path they could not get as missing ... */
+            buffer[0] = L'\0';
+        }
+        else
+        {
+            _snwprintf_s(buffer, cchbuffer, cchbuffer, L"[error(%X)]", GetLastError());
+        }
+    }
+
+    if((pOld != NULL) && (_UsnpResolvePath(pResolver, &(pOld->ParentFileReferenceNumber), oldbuffer, _countof(oldbuffer)) == FALSE))
+    {
+        if(g_format != _USN_FORMAT_TEXT)
+        {
+            oldbuffer[0] = L'\0';
+        }
+        else
+        {
+            _snwprintf_s(oldbuffer, _countof(oldbuffer), _countof(oldbuffer), L"[error(%X)]", GetLastError());
+        }
+    }
+
+    switch(g_format)
+    {
+    case _USN_FORMAT_JSON:
+        _UsnpEmitRecordJson(pOut, pRecord, ((buffer[0] != L'\0') ? buffer : NULL), pOld, ((oldbuffer[0] != L'\0') ? oldbuffer : NULL));
+        break;
+    case _USN_FORMAT_CSV:
+        _UsnpEmitRecordCsv(pOut, pRecord, ((buffer[0] != L'\0') ? buffer : NULL), pOld, ((oldbuffer[0] != L'\0') ? oldbuffer : NULL));
+        break;
+    default:
+        _UsnpEmitRecordText(pOut, pRecord, buffer, pOld, oldbuffer);
+        break;
+    }
+
+    if(pOut->Failed)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpFormatRecordV4 (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_V4* pRecord )
+{
+    PUSN_OUTPUT pOut = _UsnpGetOutput();
+    wchar_t buffer[MAX_PATH] = {0};
+    size_t cchbuffer = _countof(buffer);
+    ULARGE_INTEGER128* refnum = NULL;
+    ULARGE_INTEGER128* parent = NULL;
+    USN_RECORD_EXTENT Extent;
+
+    /*++ check ptr ... */
+    if(pRecord == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if( _UsnpCheckRecordV4(pRecord) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
+    parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+
+    if( _UsnpResolvePath(pResolver, &(pRecord->ParentFileReferenceNumber), buffer, cchbuffer) == FALSE)
+    {
+        if(g_format != _USN_FORMAT_TEXT)
+        {
+            buffer[0] = L'\0';
+        }
+        else
+        {
+            _snwprintf_s(buffer, cchbuffer, cchbuffer, L"[error(%X)]", GetLastError());
+        }
+    }
+
+    switch(g_format)
+    {
+    case _USN_FORMAT_JSON:
+        _UsnpEmitRecordJsonV4(pOut, pRecord, ((buffer[0] != L'\0') ? buffer : NULL));
+        return (pOut->Failed == FALSE);
+    case _USN_FORMAT_CSV:
+        _UsnpEmitRecordCsvV4(pOut, pRecord, ((buffer[0] != L'\0') ? buffer : NULL));
+        return (pOut->Failed == FALSE);
+    }
+
+    /*++ no name, time or attributes; the extents that changed instead ... */
+    _USN_EMIT(pOut, ">>>>>>>>\n");
+    if(g_volumetag != NULL)
+    {
+        _USN_EMIT(pOut, "  Volume              ");
+        _UsnpEmitWide(pOut, g_volumetag, wcslen(g_volumetag), _USN_ESCAPE_NONE);
+        _USN_EMIT(pOut, "\n");
+    }
+    _USN_EMIT(pOut, "  FRN                 ");
+    _UsnpEmitHex(pOut, refnum->HighPart, 16);
+    _UsnpEmitHex(pOut, refnum->LowPart, 16);
+    _USN_EMIT(pOut, "\n  Parent FRN          ");
+    _UsnpEmitHex(pOut, parent->HighPart, 16);
+    _UsnpEmitHex(pOut, parent->LowPart, 16);
+    _USN_EMIT(pOut, " - ");
+    _UsnpEmitWide(pOut, buffer, wcslen(buffer), _USN_ESCAPE_NONE);
+    _USN_EMIT(pOut, "\n  USN                 ");
+    _UsnpEmitHex(pOut, (uint64_t)pRecord->Usn, 16);
+    _USN_EMIT(pOut, "\n  Reason              ");
+    _UsnpEmitHex(pOut, pRecord->Reason, 8);
+    _USN_EMIT(pOut, "\n  Extents             ");
+    _UsnpEmitDecimal(pOut, pRecord->NumberOfExtents, 1);
+    _USN_EMIT(pOut, ", ");
+    _UsnpEmitDecimal(pOut, pRecord->RemainingExtents, 1);
+    _USN_EMIT(pOut, " to follow\n");
+    for(DWORD index=0; index<pRecord->NumberOfExtents; index++)
+    {
+        _UsnpGetRecordExtent(pRecord, index, &Extent);
+        _USN_EMIT(pOut, "  Extent              ");
+        _UsnpEmitHex(pOut, (uint64_t)Extent.Offset, 16);
+        _USN_EMIT(pOut, " +");
+        _UsnpEmitHex(pOut, (uint64_t)Extent.Length, 16);
+        _USN_EMIT(pOut, "\n");
+    }
+
+    if(pOut->Failed)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ * a v2 record as v3, the frns widened and the rest as it was, so the one
+ * formatter shows both. the name is checked against the record's length
+ * first; FALSE for what cannot be a v2 record, or a name longer than
+ * cbrecord has room for ...
+ */
+BOOL
+_UsnpUpconvertRecordV2 (
+    __in const USN_RECORD_V2* pRecord,
+    __out_bcount(cbrecord) USN_RECORD_V3* pV3,
+    __in DWORD cbrecord )
+{
+    ULARGE_INTEGER128 fid = {0};
+    DWORD length;
+
+    if( (pRecord->MajorVersion != 2) ||
+        (pRecord->RecordLength < offsetof(USN_RECORD_V2, FileName)) ||
+        (pRecord->FileNameOffset < offsetof(USN_RECORD_V2, FileName)) ||
+        (((DWORD)pRecord->FileNameOffset + pRecord->FileNameLength) > pRecord->RecordLength))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    length = (DWORD)((offsetof(USN_RECORD_V3, FileName) + pRecord->FileNameLength + 7) & ~(size_t)7);
+    if(length > cbrecord)
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+
+    pV3->RecordLength   = length;
+    pV3->MajorVersion   = 3;
+    pV3->MinorVersion   = 0;
+    fid.LowPart = pRecord->FileReferenceNumber;
+    RtlMoveMemory(&(pV3->FileReferenceNumber), &fid, sizeof(FILE_ID_128));
+    fid.LowPart = pRecord->ParentFileReferenceNumber;
+    RtlMoveMemory(&(pV3->ParentFileReferenceNumber), &fid, sizeof(FILE_ID_128));
+    pV3->Usn            = pRecord->Usn;
+    pV3->TimeStamp      = pRecord->TimeStamp;
+    pV3->Reason         = pRecord->Reason;
+    pV3->SourceInfo     = pRecord->SourceInfo;
+    pV3->SecurityId     = pRecord->SecurityId;
+    pV3->FileAttributes = pRecord->FileAttributes;
+    pV3->FileNameLength = pRecord->FileNameLength;
+    pV3->FileNameOffset = (WORD)offsetof(USN_RECORD_V3, FileName);
+
+    /*++ the name, and zero up to the next record as the journal leaves it ... */
+    RtlZeroMemory(((uint8_t*)pV3) + offsetof(USN_RECORD_V3, FileName), length - offsetof(USN_RECORD_V3, FileName));
+    RtlMoveMemory(((uint8_t*)pV3) + offsetof(USN_RECORD_V3, FileName), ((const uint8_t*)pRecord) + pRecord->FileNameOffset, pRecord->FileNameLength);
+    return TRUE;
+}
+
+/*++
+ * whether a v4 record holds the extents it says it has, ExtentSize apart
+ * and each at least an offset and a length, with neither negative nor
+ * their sum past the largest file offset. the walk has checked its
+ * length against the buffer ...
+ */
+BOOL
+_UsnpCheckRecordV4 (
+    __in const USN_RECORD_V4* pRecord )
+{
+    USN_RECORD_EXTENT Extent;
+
+    if( (pRecord->Header.MajorVersion != 4) ||
+        (pRecord->Header.RecordLength < offsetof(USN_RECORD_V4, Extents)) ||
+        ((pRecord->NumberOfExtents != 0) && (pRecord->ExtentSize < sizeof(USN_RECORD_EXTENT))) ||
+        (((uint64_t)pRecord->NumberOfExtents * pRecord->ExtentSize) > (pRecord->Header.RecordLength - offsetof(USN_RECORD_V4, Extents))))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    for(DWORD index=0; index<pRecord->NumberOfExtents; index++)
+    {
+        _UsnpGetRecordExtent(pRecord, index, &Extent);
+        if((Extent.Offset < 0) || (Extent.Length < 0) || (Extent.Length > (0x7FFFFFFFFFFFFFFFLL - Extent.Offset)))
+        {
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*++ extent index of a checked v4 record; copied, it need not be aligned ... */
+void
+_UsnpGetRecordExtent (
+    __in const USN_RECORD_V4* pRecord,
+    __in DWORD index,
+    __out PUSN_RECORD_EXTENT pExtent )
+{
+    RtlMoveMemory(pExtent, ((const uint8_t*)pRecord->Extents) + ((size_t)index * pRecord->ExtentSize), sizeof(USN_RECORD_EXTENT));
+}
+
+/*++
+ * a v4 record as a json line, with the keys of the others; timestamp,
+ * name and attributes are null, and the extents follow as [offset,length]
+ * pairs ...
+ */
+void
+_UsnpEmitRecordJsonV4 (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V4* pRecord,
+    __in_opt const wchar_t* path )
+{
+    ULARGE_INTEGER128* refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
+    ULARGE_INTEGER128* parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+    USN_RECORD_EXTENT Extent;
+
+    _USN_EMIT(pOut, "{");
+    if(g_volumetag != NULL)
+    {
+        _USN_EMIT(pOut, "\"volume\":\"");
+        _UsnpEmitWide(pOut, g_volumetag, wcslen(g_volumetag), _USN_ESCAPE_JSON);
+        _USN_EMIT(pOut, "\",");
+    }
+    _USN_EMIT(pOut, "\"usn\":");
+    _UsnpEmitDecimal(pOut, (uint64_t)pRecord->Usn, 1);
+    _USN_EMIT(pOut, ",\"timestamp\":null,\"frn\":\"");
+    _UsnpEmitHex(pOut, refnum->HighPart, 16);
+    _UsnpEmitHex(pOut, refnum->LowPart, 16);
+    _USN_EMIT(pOut, "\",\"parent_frn\":\"");
+    _UsnpEmitHex(pOut, parent->HighPart, 16);
+    _UsnpEmitHex(pOut, parent->LowPart, 16);
+    _USN_EMIT(pOut, "\",\"parent_path\":");
+    if(path != NULL)
+    {
+        _USN_EMIT(pOut, "\"");
+        _UsnpEmitWide(pOut, path, wcslen(path), _USN_ESCAPE_JSON);
+        _USN_EMIT(pOut, "\"");
+    }
+    else
+    {
+        _USN_EMIT(pOut, "null");
+    }
+    _USN_EMIT(pOut, ",\"name\":null,\"reason\":");
+    _UsnpEmitDecimal(pOut, pRecord->Reason, 1);
+    _USN_EMIT(pOut, ",\"attributes\":null,\"remaining_extents\":");
+    _UsnpEmitDecimal(pOut, pRecord->RemainingExtents, 1);
+    _USN_EMIT(pOut, ",\"extents\":[");
+    for(DWORD index=0; index<pRecord->NumberOfExtents; index++)
+    {
+        _UsnpGetRecordExtent(pRecord, index, &Extent);
+        if(index != 0)
+        {
+            _USN_EMIT(pOut, ",");
+        }
+        _USN_EMIT(pOut, "[");
+        _UsnpEmitDecimal(pOut, (uint64_t)Extent.Offset, 1);
+        _USN_EMIT(pOut, ",");
+        _UsnpEmitDecimal(pOut, (uint64_t)Extent.Length, 1);
+        _USN_EMIT(pOut, "]");
+    }
+    _USN_EMIT(pOut, "]}\n");
+}
+
+/*++
+ * a v4 record as a csv row; the timestamp, name and attributes columns
+ * are empty. the extents have no column, -ranges has them ...
+ */
+void
+_UsnpEmitRecordCsvV4 (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V4* pRecord,
+    __in_opt const wchar_t* path )
+{
+    ULARGE_INTEGER128* refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
+    ULARGE_INTEGER128* parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+
+    if(g_volumetag != NULL)
+    {
+        _USN_EMIT(pOut, "\"");
+        _UsnpEmitWide(pOut, g_volumetag, wcslen(g_volumetag), _USN_ESCAPE_CSV);
+        _USN_EMIT(pOut, "\",");
+    }
+    _UsnpEmitDecimal(pOut, (uint64_t)pRecord->Usn, 1);
+    _USN_EMIT(pOut, ",,");
+    _UsnpEmitHex(pOut, refnum->HighPart, 16);
+    _UsnpEmitHex(pOut, refnum->LowPart, 16);
+    _USN_EMIT(pOut, ",");
+    _UsnpEmitHex(pOut, parent->HighPart, 16);
+    _UsnpEmitHex(pOut, parent->LowPart, 16);
+    _USN_EMIT(pOut, ",");
+    if(path != NULL)
+    {
+        _USN_EMIT(pOut, "\"");
+        _UsnpEmitWide(pOut, path, wcslen(path), _USN_ESCAPE_CSV);
+        _USN_EMIT(pOut, "\"");
+    }
+    _USN_EMIT(pOut, ",,");
+    _UsnpEmitDecimal(pOut, pRecord->Reason, 1);
+    _USN_EMIT(pOut, ",");
+    if(g_moves)
+    {
+        _USN_EMIT(pOut, ",,,,");
+    }
+    _USN_EMIT(pOut, "\n");
+}
+
+/*++
+ * the >>>>>>>> block for a v3 record, or a move with the record it was
+ * paired with; path is the parent's, or the error looking it up ...
+ */
+void
+_UsnpEmitRecordText (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V3* pRecord,
+    __in const wchar_t* path,
+    __in_opt USN_RECORD_V3* pOld,
+    __in_opt const wchar_t* oldpath )
+{
+    ULARGE_INTEGER128* refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
+    ULARGE_INTEGER128* parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+
+    /*++ the name goes out as utf-8 straight from the record ... */
+    _USN_EMIT(pOut, ">>>>>>>>\n");
+    if(g_volumetag != NULL)
+    {
+        _USN_EMIT(pOut, "  Volume              ");
+        _UsnpEmitWide(pOut, g_volumetag, wcslen(g_volumetag), _USN_ESCAPE_NONE);
+        _USN_EMIT(pOut, "\n");
+    }
+    _USN_EMIT(pOut, "  FRN                 ");
+    _UsnpEmitHex(pOut, refnum->HighPart, 16);
+    _UsnpEmitHex(pOut, refnum->LowPart, 16);
+    _USN_EMIT(pOut, "\n  Parent FRN          ");
+    _UsnpEmitHex(pOut, parent->HighPart, 16);
+    _UsnpEmitHex(pOut, parent->LowPart, 16);
+    _USN_EMIT(pOut, " - ");
+    _UsnpEmitWide(pOut, path, wcslen(path), _USN_ESCAPE_NONE);
+    _USN_EMIT(pOut, "\n  USN                 ");
+    _UsnpEmitHex(pOut, (uint64_t)pRecord->Usn, 16);
+    _USN_EMIT(pOut, "\n  Reason              ");
+    _UsnpEmitHex(pOut, pRecord->Reason, 8);
+    _USN_EMIT(pOut, "\n  Attributes          ");
+    _UsnpEmitHex(pOut, pRecord->FileAttributes, 8);
+    _USN_EMIT(pOut, "\n  FileName            ");
+    _UsnpEmitName(pOut, (WCHAR*)((char*)pRecord + pRecord->FileNameOffset), (pRecord->FileNameLength / sizeof(WCHAR)), _USN_ESCAPE_NONE);
+    _USN_EMIT(pOut, "\n  TimeStamp           ");
+    _UsnpEmitHex(pOut, (uint64_t)pRecord->TimeStamp.QuadPart, 16);
+    _USN_EMIT(pOut, " - ");
+    if( _UsnpEmitTimestamp(pOut, pRecord->TimeStamp.QuadPart, g_timeformat) == FALSE)
+    {
+        _UsnpEmitError(pOut, GetLastError());
+    }
+    _USN_EMIT(pOut, "\n");
+
+    if(pOld != NULL)
+    {
+        /*++ a move; where it was, after where it is ... */
+        parent = (ULARGE_INTEGER128*)&(pOld->ParentFileReferenceNumber);
+        _USN_EMIT(pOut, "  Old Parent FRN      ");
+        _UsnpEmitHex(pOut, parent->HighPart, 16);
+        _UsnpEmitHex(pOut, parent->LowPart, 16);
+        _USN_EMIT(pOut, " - ");
+        _UsnpEmitWide(pOut, oldpath, wcslen(oldpath), _USN_ESCAPE_NONE);
+        _USN_EMIT(pOut, "\n  Old USN             ");
+        _UsnpEmitHex(pOut, (uint64_t)pOld->Usn, 16);
+        _USN_EMIT(pOut, "\n  Old FileName        ");
+        _UsnpEmitName(pOut, (WCHAR*)((char*)pOld + pOld->FileNameOffset), (pOld->FileNameLength / sizeof(WCHAR)), _USN_ESCAPE_NONE);
+        _USN_EMIT(pOut, "\n");
+    }
+}
+
+/*++
+ * one record as a json line. frns are 32 hex digits in a string, since a
+ * json number cannot hold 128 bits; a parent path that could not be had,
+ * or a timestamp before 1601, is null. unix timestamps are numbers. a move
+ * has the old usn, parent and name as well, and a merged volume's record
+ * its volume first ...
+ */
+void
+_UsnpEmitRecordJson (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V3* pRecord,
+    __in_opt const wchar_t* path,
+    __in_opt USN_RECORD_V3* pOld,
+    __in_opt const wchar_t* oldpath )
+{
+    ULARGE_INTEGER128* refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
+    ULARGE_INTEGER128* parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+
+    _USN_EMIT(pOut, "{");
+    if(g_volumetag != NULL)
+    {
+        _USN_EMIT(pOut, "\"volume\":\"");
+        _UsnpEmitWide(pOut, g_volumetag, wcslen(g_volumetag), _USN_ESCAPE_JSON);
+        _USN_EMIT(pOut, "\",");
+    }
+    _USN_EMIT(pOut, "\"usn\":");
+    _UsnpEmitDecimal(pOut, (uint64_t)pRecord->Usn, 1);
+    _USN_EMIT(pOut, ",\"timestamp\":");
+    if(pRecord->TimeStamp.QuadPart < 0)
+    {
+        _USN_EMIT(pOut, "null");
+    }
+    else if(g_timeformat == _USN_TIME_UNIX)
+    {
+        _UsnpEmitTimestamp(pOut, pRecord->TimeStamp.QuadPart, g_timeformat);
+    }
+    else
+    {
+        _USN_EMIT(pOut, "\"");
+        _UsnpEmitTimestamp(pOut, pRecord->TimeStamp.QuadPart, g_timeformat);
+        _USN_EMIT(pOut, "\"");
+    }
+    _USN_EMIT(pOut, ",\"frn\":\"");
+    _UsnpEmitHex(pOut, refnum->HighPart, 16);
+    _UsnpEmitHex(pOut, refnum->LowPart, 16);
+    _USN_EMIT(pOut, "\",\"parent_frn\":\"");
+    _UsnpEmitHex(pOut, parent->HighPart, 16);
+    _UsnpEmitHex(pOut, parent->LowPart, 16);
+    _USN_EMIT(pOut, "\",\"parent_path\":");
+    if(path != NULL)
+    {
+        _USN_EMIT(pOut, "\"");
+        _UsnpEmitWide(pOut, path, wcslen(path), _USN_ESCAPE_JSON);
+        _USN_EMIT(pOut, "\"");
+    }
+    else
+    {
+        _USN_EMIT(pOut, "null");
+    }
+    _USN_EMIT(pOut, ",\"name\":\"");
+    _UsnpEmitName(pOut, (WCHAR*)((char*)pRecord + pRecord->FileNameOffset), (pRecord->FileNameLength / sizeof(WCHAR)), _USN_ESCAPE_JSON);
+    _USN_EMIT(pOut, "\",\"reason\":");
+    _UsnpEmitDecimal(pOut, pRecord->Reason, 1);
+    _USN_EMIT(pOut, ",\"attributes\":");
+    _UsnpEmitDecimal(pOut, pRecord->FileAttributes, 1);
+    if(pOld != NULL)
+    {
+        parent = (ULARGE_INTEGER128*)&(pOld->ParentFileReferenceNumber);
+        _USN_EMIT(pOut, ",\"old_usn\":");
+        _UsnpEmitDecimal(pOut, (uint64_t)pOld->Usn, 1);
+        _USN_EMIT(pOut, ",\"old_parent_frn\":\"");
+        _UsnpEmitHex(pOut, parent->HighPart, 16);
+        _UsnpEmitHex(pOut, parent->LowPart, 16);
+        _USN_EMIT(pOut, "\",\"old_parent_path\":");
+        if(oldpath != NULL)
+        {
+            _USN_EMIT(pOut, "\"");
+            _UsnpEmitWide(pOut, oldpath, wcslen(oldpath), _USN_ESCAPE_JSON);
+            _USN_EMIT(pOut, "\"");
+        }
+        else
+        {
+            _USN_EMIT(pOut, "null");
+        }
+        _USN_EMIT(pOut, ",\"old_name\":\"");
+        _UsnpEmitName(pOut, (WCHAR*)((char*)pOld + pOld->FileNameOffset), (pOld->FileNameLength / sizeof(WCHAR)), _USN_ESCAPE_JSON);
+        _USN_EMIT(pOut, "\"");
+    }
+    _USN_EMIT(pOut, "}\n");
+}
+
+/*++
+ * one record as a csv row, in the order of _USN_CSV_HEADER. the path and
+ * name are always quoted, with their quotes doubled; a path that could not
+ * be had is left empty. with -moves every row has the old columns too,
+ * empty but for a move. merged volumes put a quoted volume column first ...
+ */
+void
+_UsnpEmitRecordCsv (
+    __inout PUSN_OUTPUT pOut,
+    __in USN_RECORD_V3* pRecord,
+    __in_opt const wchar_t* path,
+    __in_opt USN_RECORD_V3* pOld,
+    __in_opt const wchar_t* oldpath )
+{
+    ULARGE_INTEGER128* refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
+    ULARGE_INTEGER128* parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+
+    if(g_volumetag != NULL)
+    {
+        _USN_EMIT(pOut, "\"");
+        _UsnpEmitWide(pOut, g_volumetag, wcslen(g_volumetag), _USN_ESCAPE_CSV);
+        _USN_EMIT(pOut, "\",");
+    }
+    _UsnpEmitDecimal(pOut, (uint64_t)pRecord->Usn, 1);
+    _USN_EMIT(pOut, ",");
+    _UsnpEmitTimestamp(pOut, pRecord->TimeStamp.QuadPart, g_timeformat);
+    _USN_EMIT(pOut, ",");
+    _UsnpEmitHex(pOut, refnum->HighPart, 16);
+    _UsnpEmitHex(pOut, refnum->LowPart, 16);
+    _USN_EMIT(pOut, ",");
+    _UsnpEmitHex(pOut, parent->HighPart, 16);
+    _UsnpEmitHex(pOut, parent->LowPart, 16);
+    _USN_EMIT(pOut, ",");
+    if(path != NULL)
+    {
+        _USN_EMIT(pOut, "\"");
+        _UsnpEmitWide(pOut, path, wcslen(path), _USN_ESCAPE_CSV);
+        _USN_EMIT(pOut, "\"");
+    }
+    _USN_EMIT(pOut, ",\"");
+    _UsnpEmitName(pOut, (WCHAR*)((char*)pRecord + pRecord->FileNameOffset), (pRecord->FileNameLength / sizeof(WCHAR)), _USN_ESCAPE_CSV);
+    _USN_EMIT(pOut, "\",");
+    _UsnpEmitDecimal(pOut, pRecord->Reason, 1);
+    _USN_EMIT(pOut, ",");
+    _UsnpEmitDecimal(pOut, pRecord->FileAttributes, 1);
+    if(pOld != NULL)
+    {
+        parent = (ULARGE_INTEGER128*)&(pOld->ParentFileReferenceNumber);
+        _USN_EMIT(pOut, ",");
+        _UsnpEmitDecimal(pOut, (uint64_t)pOld->Usn, 1);
+        _USN_EMIT(pOut, ",");
+        _UsnpEmitHex(pOut, parent->HighPart, 16);
+        _UsnpEmitHex(pOut, parent->LowPart, 16);
+        _USN_EMIT(pOut, ",");
+        if(oldpath != NULL)
+        {
+            _USN_EMIT(pOut, "\"");
+            _UsnpEmitWide(pOut, oldpath, wcslen(oldpath), _USN_ESCAPE_CSV);
+            _USN_EMIT(pOut, "\"");
+        }
+        _USN_EMIT(pOut, ",\"");
+        _UsnpEmitName(pOut, (WCHAR*)((char*)pOld + pOld->FileNameOffset), (pOld->FileNameLength / sizeof(WCHAR)), _USN_ESCAPE_CSV);
+        _USN_EMIT(pOut, "\"");
+    }
+    else if(g_moves)
+    {
+        _USN_EMIT(pOut, ",,,,");
+    }
+    _USN_EMIT(pOut, "\n");
+}
+
+/*++
+ */
+BOOL
+_UsnpIsEqualFileReference (
+    FILE_ID_128* pfid1,
+    FILE_ID_128* pfid2 )
+{
+    if((pfid1 == NULL) || (pfid2 == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if(memcmp((void*)pfid1, (void*)pfid2, sizeof(FILE_ID_128)) == 0)
+    {
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*++
+ */
+BOOL
+_UsnpGetFileIdFromFilename (
+    __in wchar_t* filename,
+    __out FILE_ID_128* pFileId )
+{
+    BOOL status = FALSE;
+    HANDLE osfh = NULL;
+
+    if((filename == NULL) || (pFileId == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+#if defined(_WIN32)
+    osfh = CreateFileW(
+     filename, 
+     (GENERIC_READ | SYNCHRONIZE | FILE_READ_ATTRIBUTES),
+     (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE),
+     NULL, 
+     OPEN_EXISTING, 
+     (FILE_FLAG_NO_BUFFERING | FILE_FLAG_BACKUP_SEMANTICS),
+     NULL
+     );
+
+    if(osfh != NULL)
+    {
+        status = _UsnpGetFileIdFromHandle(osfh, pFileId);
+        CloseHandle(osfh);
+    }
+#else
+    UNREFERENCED_PARAMETER(osfh);
+    SetLastError(ERROR_NOT_SUPPORTED);
+#endif  /* _WIN32 */
+    return status;
+}
+
+/*++
+ */
+BOOL
+_UsnpGetFileIdFromHandle (
+    __in HANDLE osfh,
+    __out FILE_ID_128* pFileId )
+{
+#if defined(_WIN32)
+    BY_HANDLE_FILE_INFORMATION FileInfo = {0};
+#endif  /* _WIN32 */
+
+    if((osfh == NULL) || (pFileId == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+#if defined(_WIN32)
+    if( GetFileInformationByHandle(osfh, &FileInfo) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    LARGE_INTEGER st_index = {0};
+    st_index.LowPart = FileInfo.nFileIndexLow;
+    st_index.HighPart = FileInfo.nFileIndexHigh;
+
+    LARGE_INTEGER128 st_fid = {0};
+    st_fid.LowPart = st_index.QuadPart;
+
+    RtlMoveMemory(pFileId, &st_fid, sizeof(LARGE_INTEGER128));
+
+    return TRUE;
+#else
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++
+ */
+BOOL
+_UsnpGetFilenameFromFileId (
+    __in HANDLE osh,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+#if defined(_WIN32)
+    DWORD length;
+    HANDLE osfh;
+    FILE_ID_DESCRIPTOR id = {0};
+#endif  /* _WIN32 */
+
+    /*++ check ptr and buffer ... */
+    if((pFileId == NULL) || (buffer == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+#if defined(_WIN32)
+    id.dwSize = sizeof(id);
+    id.Type = ExtendedFileIdType;
+    RtlMoveMemory(&(id.ExtendedFileId), pFileId, sizeof(FILE_ID_128));
+
+    osfh = OpenFileById (
+     osh,
+     &id,
+     0,
+     (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE),
+     NULL,
+     (FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT)
+     );
+
+    if(osfh == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    length = GetFinalPathNameByHandleW(osfh, buffer, (DWORD)cchbuffer, (FILE_NAME_NORMALIZED | VOLUME_NAME_DOS));
+
+    CloseHandle(osfh);
+    
+    if((length == 0) || (length > cchbuffer))
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    return TRUE;
+#else
+    /*++ no by-id opens off-windows ... */
+    UNREFERENCED_PARAMETER(osh);
+    UNREFERENCED_PARAMETER(cchbuffer);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++
+ */
+BOOL
+_UsnpResolvePath (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    if((pResolver == NULL) || (pResolver->Lookup == NULL))
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+    return pResolver->Lookup(pResolver, pFileId, buffer, cchbuffer);
+}
+
+/*++ let a resolver that keeps state see a record go by ... */
+void
+_UsnpObserveRecord (
+    __in PUSN_RESOLVER pResolver,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    if((pResolver != NULL) && (pResolver->Observe != NULL))
+    {
+        pResolver->Observe(pResolver, pRecord);
+    }
+}
+
+/*++
+ * the naming fields of a v2 or v3 record, with a v2 frn widened to 128
+ * bits. FALSE for a record that carries no name ...
+ */
+BOOL
+_UsnpGetRecordNaming (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __out FILE_ID_128* pFileId,
+    __out FILE_ID_128* pParent,
+    __out DWORD* pAttributes,
+    __out DWORD* pReason,
+    __out WCHAR** pName,
+    __out size_t* pcchName )
+{
+    USN_RECORD_UNION* pUnion = (USN_RECORD_UNION*)pRecord;
+
+    RtlZeroMemory(pFileId, sizeof(FILE_ID_128));
+    RtlZeroMemory(pParent, sizeof(FILE_ID_128));
+
+    switch(pRecord->MajorVersion)
+    {
+    case 2:
+        RtlMoveMemory(pFileId, &(pUnion->V2.FileReferenceNumber), sizeof(DWORDLONG));
+        RtlMoveMemory(pParent, &(pUnion->V2.ParentFileReferenceNumber), sizeof(DWORDLONG));
+        *pAttributes = pUnion->V2.FileAttributes;
+        *pReason     = pUnion->V2.Reason;
+        *pName       = (WCHAR*)((uint8_t*)pRecord + pUnion->V2.FileNameOffset);
+        *pcchName    = pUnion->V2.FileNameLength / sizeof(WCHAR);
+        break;
+    case 3:
+        RtlMoveMemory(pFileId, &(pUnion->V3.FileReferenceNumber), sizeof(FILE_ID_128));
+        RtlMoveMemory(pParent, &(pUnion->V3.ParentFileReferenceNumber), sizeof(FILE_ID_128));
+        *pAttributes = pUnion->V3.FileAttributes;
+        *pReason     = pUnion->V3.Reason;
+        *pName       = (WCHAR*)((uint8_t*)pRecord + pUnion->V3.FileNameOffset);
+        *pcchName    = pUnion->V3.FileNameLength / sizeof(WCHAR);
+        break;
+    default:
+        /*++ v4 carries ranges, not names ... */
+        return FALSE;
+    }
+
+    /*++ a name running off the record is not one ... */
+    if(((uint8_t*)(*pName) + (*pcchName * sizeof(WCHAR))) > ((uint8_t*)pRecord + pRecord->RecordLength))
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ * read a watch list; one directory a line, as a path or as a frn written
+ * 0x and hex the way records show it. a trailing \... takes the whole
+ * subtree. blank lines and lines starting # are skipped, and a line that
+ * does not resolve is reported and passed over ...
+ */
+BOOL
+_UsnpLoadWatchList (
+    __in wchar_t* filename,
+    __out PUSN_WATCH pWatch )
+{
+    FILE* fp;
+    wchar_t line[MAX_PATH + 16];
+    DWORD lines = 0;
+    DWORD capacity = 16;
+
+    if((filename == NULL) || (pWatch == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pWatch, sizeof(USN_WATCH));
+
+    fp = _UsnpOpenStream(filename, L"r");
+    if(fp == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    /*++ size the set from the line count, at most half full ... */
+    while(fgetws(line, _countof(line), fp) != NULL)
+    {
+        lines++;
+    }
+    while((capacity < (lines * 2)) && (capacity < 0x40000000))
+    {
+        capacity <<= 1;
+    }
+
+    pWatch->Capacity = capacity;
+    pWatch->Entries  = (PUSN_WATCH_ENTRY)_UsnpAlloc((size_t)capacity * sizeof(USN_WATCH_ENTRY));
+    pWatch->Memo     = (PUSN_WATCH_ENTRY)_UsnpAlloc((size_t)_USN_WATCH_MEMO * sizeof(USN_WATCH_ENTRY));
+    if((pWatch->Entries == NULL) || (pWatch->Memo == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpFreeWatchList(pWatch);
+        fclose(fp);
+        return FALSE;
+    }
+
+    rewind(fp);
+    while(fgetws(line, _countof(line), fp) != NULL)
+    {
+        PUSN_WATCH_ENTRY pEntry;
+        FILE_ID_128 fid = {0};
+        DWORD flags = _USN_WATCH_CHILDREN;
+        size_t length = wcslen(line);
+
+        while((length > 0) && ((line[length - 1] == L'\n') || (line[length - 1] == L'\r') || (line[length - 1] == L' ')))
+        {
+            line[--length] = L'\0';
+        }
+        if((length == 0) || (line[0] == L'#'))
+        {
+            continue;
+        }
+
+        if((length >= 4) && (wcscmp(&line[length - 3], L"...") == 0) && ((line[length - 4] == L'\\') || (line[length - 4] == L'/')))
+        {
+            flags |= _USN_WATCH_SUBTREE;
+            length -= 4;
+            if((length == 0) || (line[length - 1] == L':'))
+            {
+                /*++ keep the separator on a root, c:\ ... */
+                length++;
+            }
+            line[length] = L'\0';
+        }
+
+        if((line[0] == L'0') && ((line[1] == L'x') || (line[1] == L'X')))
+        {
+            if( _UsnpParseFileId(line + 2, &fid) == FALSE)
+            {
+                fwprintf(stderr, L"watch %ls: not a frn\n", line);
+                continue;
+            }
+        }
+        else if( _UsnpGetFileIdFromFilename(line, &fid) == FALSE)
+        {
+            fwprintf(stderr, L"watch %ls: get directory fid failed, status(%X)\n", line, GetLastError());
+            continue;
+        }
+
+        pEntry = _UsnpWatchFind(pWatch->Entries, pWatch->Capacity, &fid, TRUE);
+        if((pEntry->Flags & _USN_WATCH_CHILDREN) == 0)
+        {
+            pWatch->Count++;
+        }
+        if((flags & _USN_WATCH_SUBTREE) && ((pEntry->Flags & _USN_WATCH_SUBTREE) == 0))
+        {
+            pWatch->Subtrees++;
+        }
+        pEntry->Flags |= flags;
+    }
+
+    fclose(fp);
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpFreeWatchList (
+    __in PUSN_WATCH pWatch )
+{
+    if(pWatch != NULL)
+    {
+        _UsnpFree(pWatch->Entries);
+        _UsnpFree(pWatch->Memo);
+        RtlZeroMemory(pWatch, sizeof(USN_WATCH));
+    }
+}
+
+/*++
+ * TRUE for a record in a watched directory. only the parent frn is read,
+ * at its fixed offset, so a rejected record costs a probe or two and never
+ * has its name decoded or its path resolved ...
+ */
+BOOL
+_UsnpIsWatched (
+    __in PUSN_WATCH pWatch,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    FILE_ID_128 parent = {0};
+
+    switch(pRecord->MajorVersion)
+    {
+    case 2:
+        RtlMoveMemory(&parent, &(((USN_RECORD_UNION*)pRecord)->V2.ParentFileReferenceNumber), sizeof(DWORDLONG));
+        break;
+    case 3:
+        RtlMoveMemory(&parent, &(((USN_RECORD_UNION*)pRecord)->V3.ParentFileReferenceNumber), sizeof(FILE_ID_128));
+        break;
+    case 4:
+        /*++ v4 has no parent; it rides along with its file ... */
+        return FALSE;
+    default:
+        return FALSE;
+    }
+
+    if(_UsnpWatchFind(pWatch->Entries, pWatch->Capacity, &parent, FALSE) != NULL)
+    {
+        return TRUE;
+    }
+    if((pWatch->Subtrees == 0) || (pWatch->pTree == NULL))
+    {
+        return FALSE;
+    }
+    return _UsnpIsUnderSubtree(pWatch, &parent);
+}
+
+/*++
+ * walk up from a directory until a watched subtree root, a remembered
+ * answer, or a frn the tree does not know. every directory passed on the
+ * way gets the same answer in the memo, so a busy directory deep in the
+ * tree costs one probe after its first record ...
+ */
+BOOL
+_UsnpIsUnderSubtree (
+    __in PUSN_WATCH pWatch,
+    __in FILE_ID_128* pFileId )
+{
+    FILE_ID_128 chain[_USN_TREE_DEPTH];
+    DWORD depth = 0;
+    FILE_ID_128 fid = *pFileId;
+    BOOL inside = FALSE;
+
+    /*++ a directory moved; what is under what may have changed ... */
+    if((pWatch->Moves != pWatch->pTree->Moves) || (pWatch->MemoCount >= (_USN_WATCH_MEMO / 2)))
+    {
+        RtlZeroMemory(pWatch->Memo, (size_t)_USN_WATCH_MEMO * sizeof(USN_WATCH_ENTRY));
+        pWatch->MemoCount = 0;
+        pWatch->Moves = pWatch->pTree->Moves;
+    }
+
+    while(depth < _USN_TREE_DEPTH)
+    {
+        PUSN_WATCH_ENTRY pEntry;
+        PUSN_TREE_ENTRY pNode;
+
+        pEntry = _UsnpWatchFind(pWatch->Memo, _USN_WATCH_MEMO, &fid, FALSE);
+        if(pEntry != NULL)
+        {
+            inside = ((pEntry->Flags & _USN_WATCH_OUTSIDE) == 0);
+            break;
+        }
+
+        pEntry = _UsnpWatchFind(pWatch->Entries, pWatch->Capacity, &fid, FALSE);
+        if((pEntry != NULL) && (pEntry->Flags & _USN_WATCH_SUBTREE))
+        {
+            inside = TRUE;
+            break;
+        }
+
+        pNode = _UsnpTreeFind(pWatch->pTree, &fid, FALSE);
+        chain[depth++] = fid;
+        if(pNode == NULL)
+        {
+            break;
+        }
+        fid = pNode->Parent;
+    }
+
+    while(depth > 0)
+    {
+        PUSN_WATCH_ENTRY pEntry = _UsnpWatchFind(pWatch->Memo, _USN_WATCH_MEMO, &chain[--depth], TRUE);
+        pEntry->Flags |= ((inside) ? 0 : _USN_WATCH_OUTSIDE);
+        pWatch->MemoCount++;
+    }
+    return inside;
+}
+
+/*++
+ * the slot for pFileId in a set, or NULL; with Insert, a free slot takes
+ * it. callers keep the set well under full ...
+ */
+PUSN_WATCH_ENTRY
+_UsnpWatchFind (
+    __in PUSN_WATCH_ENTRY Entries,
+    __in DWORD Capacity,
+    __in FILE_ID_128* pFileId,
+    __in BOOL Insert )
+{
+    DWORD mask = Capacity - 1;
+    DWORD index = (DWORD)(_UsnpHashFileId(pFileId) >> 32) & mask;
+
+    while(Entries[index].Flags & _USN_WATCH_USED)
+    {
+        if(memcmp(&(Entries[index].FileId), pFileId, sizeof(FILE_ID_128)) == 0)
+        {
+            return &(Entries[index]);
+        }
+        index = (index + 1) & mask;
+    }
+
+    if(Insert == FALSE)
+    {
+        return NULL;
+    }
+
+    RtlMoveMemory(&(Entries[index].FileId), pFileId, sizeof(FILE_ID_128));
+    Entries[index].Flags = _USN_WATCH_USED;
+    return &(Entries[index]);
+}
+
+/*++ up to 32 hex digits, as records print a frn ... */
+BOOL
+_UsnpParseFileId (
+    __in const wchar_t* str,
+    __out FILE_ID_128* pFileId )
+{
+    ULARGE_INTEGER128 fid = {0};
+    size_t length = 0;
+
+    for(; str[length]; length++)
+    {
+        wchar_t ch = str[length];
+        uint64_t digit;
+
+        if((ch >= L'0') && (ch <= L'9'))      digit = ch - L'0';
+        else if((ch >= L'a') && (ch <= L'f')) digit = ch - L'a' + 10;
+        else if((ch >= L'A') && (ch <= L'F')) digit = ch - L'A' + 10;
+        else return FALSE;
+
+        if(length == 32)
+        {
+            return FALSE;
+        }
+        fid.HighPart = (fid.HighPart << 4) | (fid.LowPart >> 60);
+        fid.LowPart = (fid.LowPart << 4) | digit;
+    }
+    if(length == 0)
+    {
+        return FALSE;
+    }
+
+    RtlMoveMemory(pFileId, &fid, sizeof(FILE_ID_128));
+    return TRUE;
+}
+
+/*++
+ * -filter; compile an expression such as
+ *
+ *   reason:create|delete and not attr:directory and name:*.tmp
+ *   (usn>=0x1000 and usn<0x2000) or parent:0x000d0000000a0cd9
+ *   time>=2020-06-06T23:50 and frn:0x0024000000098d75,0x0024000000098d76
+ *
+ * into a program of tests. and, or and not, && || and ! the same, with
+ * parentheses; reason and attr take hex or names joined by | and hold for
+ * any of them, usn and time take < <= > >= and =, name a glob of * and ?
+ * without regard to case, and frn and parent a list of frns ...
+ */
+BOOL
+_UsnpCompileFilter (
+    __in const wchar_t* text,
+    __out PUSN_FILTER pFilter )
+{
+    PUSN_FILTER_PARSER pParser;
+    DWORD root;
+
+    if((text == NULL) || (pFilter == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pFilter, sizeof(USN_FILTER));
+    pFilter->Error = text;
+
+    pParser = (PUSN_FILTER_PARSER)_UsnpAlloc(sizeof(USN_FILTER_PARSER));
+    pFilter->Ops = (PUSN_FILTER_OP)_UsnpAlloc(_USN_FILTER_NODES * sizeof(USN_FILTER_OP));
+    pFilter->Sets = (PUSN_FILTER_SET)_UsnpAlloc(_USN_FILTER_NODES * sizeof(USN_FILTER_SET));
+    pFilter->Patterns = (PUSN_FILTER_PATTERN)_UsnpAlloc(_USN_FILTER_NODES * sizeof(USN_FILTER_PATTERN));
+    if((pParser == NULL) || (pFilter->Ops == NULL) || (pFilter->Sets == NULL) || (pFilter->Patterns == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(pParser);
+        _UsnpFreeFilter(pFilter);
+        return FALSE;
+    }
+
+    pParser->Next    = text;
+    pParser->pFilter = pFilter;
+
+    root = _UsnpFilterParseOr(pParser);
+    _UsnpFilterSkip(pParser);
+    if((root == _USN_FILTER_NONE) || (*(pParser->Next) != L'\0'))
+    {
+        pFilter->Error = pParser->Next;
+        _UsnpFree(pParser);
+        _UsnpFreeFilter(pFilter);
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    _UsnpFilterOrder(pParser, root);
+    pFilter->Start = _UsnpFilterEmit(pParser, root, _USN_FILTER_ACCEPT, _USN_FILTER_REJECT);
+    _UsnpFree(pParser);
+
+    for(DWORD index=0; index<pFilter->PatternCount; index++)
+    {
+        if( _UsnpBuildNameSet(&(pFilter->Patterns[index].Set), pFilter->Patterns[index].Text, pFilter->Patterns[index].Length) == FALSE)
+        {
+            /*++ last error set by call ... */
+            _UsnpFreeFilter(pFilter);
+            return FALSE;
+        }
+    }
+
+    pFilter->Error = NULL;
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpFreeFilter (
+    __in PUSN_FILTER pFilter )
+{
+    const wchar_t* error;
+
+    if(pFilter == NULL)
+    {
+        return;
+    }
+
+    for(DWORD index=0; (pFilter->Sets != NULL) && (index<pFilter->SetCount); index++)
+    {
+        _UsnpFree(pFilter->Sets[index].Ids);
+    }
+    for(DWORD index=0; (pFilter->Patterns != NULL) && (index<pFilter->PatternCount); index++)
+    {
+        _UsnpFreeNameSet(&(pFilter->Patterns[index].Set));
+        _UsnpFree(pFilter->Patterns[index].Text);
+    }
+
+    _UsnpFree(pFilter->Ops);
+    _UsnpFree(pFilter->Sets);
+    _UsnpFree(pFilter->Patterns);
+
+    error = pFilter->Error;
+    RtlZeroMemory(pFilter, sizeof(USN_FILTER));
+    pFilter->Error = error;
+}
+
+/*++
+ * run the program on a record. nothing is decoded but the fields tested,
+ * and the name only once the tests ahead of it have passed ...
+ */
+BOOL
+_UsnpIsFilterMatch (
+    __in PUSN_FILTER pFilter,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    DWORD next = pFilter->Start;
+
+    while(next < _USN_FILTER_REJECT)
+    {
+        PUSN_FILTER_OP pOp = &(pFilter->Ops[next]);
+        BOOL hit = FALSE;
+        LONGLONG value;
+        FILE_ID_128 FileId;
+        FILE_ID_128 Parent;
+        DWORD attributes;
+        DWORD reason;
+        WCHAR* name;
+        size_t cchname;
+
+        switch(pOp->Code)
+        {
+        case _USN_FILTER_REASON:
+            hit = ((_UsnpGetRecordReason(pRecord) & (DWORD)pOp->Low) != 0);
+            break;
+        case _USN_FILTER_ATTRIBUTES:
+            hit = ((_UsnpGetRecordAttributes(pRecord) & (DWORD)pOp->Low) != 0);
+            break;
+        case _USN_FILTER_USN:
+            value = _UsnpGetRecordUsn(pRecord);
+            hit = ((value >= pOp->Low) && (value <= pOp->High));
+            break;
+        case _USN_FILTER_TIME:
+            value = _UsnpGetRecordTimeStamp(pRecord);
+            hit = ((value != 0) && (value >= pOp->Low) && (value <= pOp->High));
+            break;
+        case _USN_FILTER_FRN:
+        case _USN_FILTER_PARENT:
+            if( _UsnpGetRecordFileIds(pRecord, &FileId, &Parent) != FALSE)
+            {
+                hit = _UsnpIsInFilterSet(&(pFilter->Sets[pOp->Index]), ((pOp->Code == _USN_FILTER_FRN) ? &FileId : &Parent));
+            }
+            break;
+        case _USN_FILTER_NAME:
+            /*++ the name where it lies in the record, as utf-16 ... */
+            if( _UsnpGetRecordNaming(pRecord, &FileId, &Parent, &attributes, &reason, &name, &cchname) != FALSE)
+            {
+                hit = _UsnpMatchNameSet(&(pFilter->Patterns[pOp->Index].Set), name, cchname);
+            }
+            break;
+        }
+
+        next = (hit ? pOp->True : pOp->False);
+    }
+    return (next == _USN_FILTER_ACCEPT);
+}
+
+/*++ upper case, ascii by hand and the rest as the c library has it ... */
+WCHAR
+_UsnpFoldChar (
+    __in WCHAR ch )
+{
+    if(ch < 0x80)
+    {
+        return (((ch >= L'a') && (ch <= L'z')) ? (WCHAR)(ch - 0x20) : ch);
+    }
+    return (WCHAR)towupper(ch);
+}
+
+/*++
+ * a glob of * and ? against a name, folding the name as it goes; the
+ * pattern is folded already. a * is retried one character further on
+ * each mismatch after it, so there is no recursion ...
+ */
+BOOL
+_UsnpMatchGlob (
+    __in_ecount(cchpattern) const WCHAR* pattern,
+    __in size_t cchpattern,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname )
+{
+    size_t p = 0;
+    size_t n = 0;
+    size_t star = (size_t)-1;
+    size_t mark = 0;
+
+    while(n < cchname)
+    {
+        if((p < cchpattern) && (pattern[p] == L'*'))
+        {
+            star = p++;
+            mark = n;
+        }
+        else if((p < cchpattern) && ((pattern[p] == L'?') || (pattern[p] == _UsnpFoldChar(name[n]))))
+        {
+            p++;
+            n++;
+        }
+        else if(star != (size_t)-1)
+        {
+            p = star + 1;
+            n = ++mark;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+
+    while((p < cchpattern) && (pattern[p] == L'*'))
+    {
+        p++;
+    }
+    return (p == cchpattern);
+}
+
+/*++
+ * the matcher for text, folded globs between |. the tries and automaton
+ * share one pool of nodes and one table of edges, sized from the text, so
+ * nothing grows; then the automaton's fail links, breadth first, with a
+ * glob that needs nothing more matching wherever its end is a suffix ...
+ */
+BOOL
+_UsnpBuildNameSet (
+    __out PUSN_NAMESET pSet,
+    __in_ecount(length) const WCHAR* text,
+    __in DWORD length )
+{
+    DWORD* queue = NULL;
+    DWORD head = 0;
+    DWORD tail = 0;
+    DWORD edges = 16;
+    DWORD start = 0;
+
+    RtlZeroMemory(pSet, sizeof(USN_NAMESET));
+    pSet->Anywhere = _USN_NAME_NONE;
+
+    while(edges < ((length + 1) * 2))
+    {
+        edges <<= 1;
+    }
+
+    pSet->Nodes = (PUSN_NAME_NODE)_UsnpAlloc(((size_t)length + 3) * sizeof(USN_NAME_NODE));
+    pSet->Edges = (PUSN_NAME_EDGE)_UsnpAlloc((size_t)edges * sizeof(USN_NAME_EDGE));
+    pSet->Globs = (PUSN_NAME_GLOB)_UsnpAlloc(((size_t)length + 1) * sizeof(USN_NAME_GLOB));
+    queue = (DWORD*)_UsnpAlloc(((size_t)length + 3) * sizeof(DWORD));
+    if((pSet->Nodes == NULL) || (pSet->Edges == NULL) || (pSet->Globs == NULL) || (queue == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(queue);
+        _UsnpFreeNameSet(pSet);
+        return FALSE;
+    }
+
+    memset(pSet->Edges, 0xFF, (size_t)edges * sizeof(USN_NAME_EDGE));
+    pSet->EdgeMask = edges - 1;
+    for(pSet->NodeCount=0; pSet->NodeCount<3; pSet->NodeCount++)
+    {
+        PUSN_NAME_NODE pRoot = &(pSet->Nodes[pSet->NodeCount]);
+        pRoot->Output = pRoot->Verify = pRoot->Child = pRoot->Sibling = _USN_NAME_NONE;
+    }
+
+    while(start <= length)
+    {
+        const WCHAR* glob = text + start;
+        DWORD cch = 0;
+        DWORD stars = 0;
+        DWORD marks = 0;
+        DWORD run = 0;
+        DWORD runlength = 0;
+        DWORD node;
+
+        for(; ((start + cch) < length) && (glob[cch] != L'|'); cch++)
+        {
+            stars += (glob[cch] == L'*');
+            marks += (glob[cch] == L'?');
+        }
+        start += cch + 1;
+
+        if(cch == 0)
+        {
+            continue;
+        }
+
+        if((stars == 0) && (marks == 0))
+        {
+            node = _UsnpNameInsert(pSet, _USN_NAME_SUFFIX, glob, cch, TRUE);
+            pSet->Nodes[node].Flags |= _USN_NAME_WHOLE;
+            continue;
+        }
+        if((marks == 0) && (stars == cch))
+        {
+            pSet->All = TRUE;
+            continue;
+        }
+        if((marks == 0) && (stars == 1) && (glob[0] == L'*'))
+        {
+            node = _UsnpNameInsert(pSet, _USN_NAME_SUFFIX, glob + 1, cch - 1, TRUE);
+            pSet->Nodes[node].Flags |= _USN_NAME_MATCH;
+            continue;
+        }
+        if((marks == 0) && (stars == 1) && (glob[cch - 1] == L'*'))
+        {
+            node = _UsnpNameInsert(pSet, _USN_NAME_PREFIX, glob, cch - 1, FALSE);
+            pSet->Nodes[node].Flags |= _USN_NAME_MATCH;
+            continue;
+        }
+        if((marks == 0) && (stars == 2) && (glob[0] == L'*') && (glob[cch - 1] == L'*'))
+        {
+            node = _UsnpNameInsert(pSet, _USN_NAME_CONTAINS, glob + 1, cch - 2, FALSE);
+            pSet->Nodes[node].Flags |= _USN_NAME_MATCH;
+            continue;
+        }
+
+        /*++ anything else is found by its longest run without a wildcard, then matched in full ... */
+        for(DWORD index=0, literal=0; index<=cch; index++)
+        {
+            if((index < cch) && (glob[index] != L'*') && (glob[index] != L'?'))
+            {
+                literal++;
+            }
+            else
+            {
+                if(literal > runlength)
+                {
+                    run = index - literal;
+                    runlength = literal;
+                }
+                literal = 0;
+            }
+        }
+
+        pSet->Globs[pSet->GlobCount].Text = glob;
+        pSet->Globs[pSet->GlobCount].Length = cch;
+        if(runlength == 0)
+        {
+            pSet->Globs[pSet->GlobCount].Next = pSet->Anywhere;
+            pSet->Anywhere = pSet->GlobCount++;
+            continue;
+        }
+        node = _UsnpNameInsert(pSet, _USN_NAME_CONTAINS, glob + run, runlength, FALSE);
+        pSet->Globs[pSet->GlobCount].Next = pSet->Nodes[node].Verify;
+        pSet->Nodes[node].Verify = pSet->GlobCount++;
+    }
+
+    /*++ a child of the root fails to the root; any other to where its parent's fail goes on its char ... */
+    for(DWORD child=pSet->Nodes[_USN_NAME_CONTAINS].Child; child!=_USN_NAME_NONE; child=pSet->Nodes[child].Sibling)
+    {
+        pSet->Nodes[child].Fail = _USN_NAME_CONTAINS;
+        queue[tail++] = child;
+    }
+    while(head < tail)
+    {
+        DWORD parent = queue[head++];
+
+        for(DWORD child=pSet->Nodes[parent].Child; child!=_USN_NAME_NONE; child=pSet->Nodes[child].Sibling)
+        {
+            PUSN_NAME_NODE pChild = &(pSet->Nodes[child]);
+            DWORD fail = pSet->Nodes[parent].Fail;
+            DWORD next;
+
+            while(((next = _UsnpNameStep(pSet, fail, pChild->Char)) == _USN_NAME_NONE) && (fail != _USN_NAME_CONTAINS))
+            {
+                fail = pSet->Nodes[fail].Fail;
+            }
+            pChild->Fail = ((next != _USN_NAME_NONE) ? next : _USN_NAME_CONTAINS);
+            pChild->Flags |= (pSet->Nodes[pChild->Fail].Flags & _USN_NAME_MATCH);
+            pChild->Output = ((pSet->Nodes[pChild->Fail].Verify != _USN_NAME_NONE) ? pChild->Fail : pSet->Nodes[pChild->Fail].Output);
+            queue[tail++] = child;
+        }
+    }
+
+    _UsnpFree(queue);
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpFreeNameSet (
+    __in PUSN_NAMESET pSet )
+{
+    _UsnpFree(pSet->Nodes);
+    _UsnpFree(pSet->Edges);
+    _UsnpFree(pSet->Globs);
+    RtlZeroMemory(pSet, sizeof(USN_NAMESET));
+}
+
+/*++ the node from node on ch, or _USN_NAME_NONE ... */
+DWORD
+_UsnpNameStep (
+    __in PUSN_NAMESET pSet,
+    __in DWORD node,
+    __in WCHAR ch )
+{
+    DWORD hash = ((node << 16) ^ (DWORD)ch) * 0x9E3779B1;
+    DWORD slot = (hash ^ (hash >> 15)) & pSet->EdgeMask;
+
+    while(pSet->Edges[slot].From != _USN_NAME_NONE)
+    {
+        if((pSet->Edges[slot].From == node) && (pSet->Edges[slot].Char == ch))
+        {
+            return pSet->Edges[slot].To;
+        }
+        slot = (slot + 1) & pSet->EdgeMask;
+    }
+    return _USN_NAME_NONE;
+}
+
+/*++ text into the trie at root, last char first with Reverse; the node it ends on ... */
+DWORD
+_UsnpNameInsert (
+    __inout PUSN_NAMESET pSet,
+    __in DWORD root,
+    __in_ecount(length) const WCHAR* text,
+    __in DWORD length,
+    __in BOOL Reverse )
+{
+    DWORD node = root;
+
+    pSet->Roots |= (1 << root);
+
+    for(DWORD index=0; index<length; index++)
+    {
+        WCHAR ch = text[Reverse ? (length - 1 - index) : index];
+        DWORD next = _UsnpNameStep(pSet, node, ch);
+
+        if(next == _USN_NAME_NONE)
+        {
+            PUSN_NAME_NODE pNext;
+            DWORD hash = ((node << 16) ^ (DWORD)ch) * 0x9E3779B1;
+            DWORD slot = (hash ^ (hash >> 15)) & pSet->EdgeMask;
+
+            next = pSet->NodeCount++;
+            pNext = &(pSet->Nodes[next]);
+            pNext->Output  = _USN_NAME_NONE;
+            pNext->Verify  = _USN_NAME_NONE;
+            pNext->Child   = _USN_NAME_NONE;
+            pNext->Sibling = pSet->Nodes[node].Child;
+            pNext->Char    = ch;
+            pSet->Nodes[node].Child = next;
+
+            while(pSet->Edges[slot].From != _USN_NAME_NONE)
+            {
+                slot = (slot + 1) & pSet->EdgeMask;
+            }
+            pSet->Edges[slot].From = node;
+            pSet->Edges[slot].To   = next;
+            pSet->Edges[slot].Char = ch;
+        }
+        node = next;
+    }
+    return node;
+}
+
+/*++
+ * TRUE when any glob in the set matches the name. the tries are walked
+ * from each end only as far as the name follows them, and the automaton
+ * once along it; name chars are folded as they are read ...
+ */
+BOOL
+_UsnpMatchNameSet (
+    __in PUSN_NAMESET pSet,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname )
+{
+    DWORD node;
+
+    if(pSet->All)
+    {
+        return TRUE;
+    }
+
+    if(pSet->Roots & (1 << _USN_NAME_SUFFIX))
+    {
+        node = _USN_NAME_SUFFIX;
+        for(size_t index=cchname; index>0; index--)
+        {
+            node = _UsnpNameStep(pSet, node, _UsnpFoldChar(name[index - 1]));
+            if(node == _USN_NAME_NONE)
+            {
+                break;
+            }
+            if((pSet->Nodes[node].Flags & _USN_NAME_MATCH) || ((index == 1) && (pSet->Nodes[node].Flags & _USN_NAME_WHOLE)))
+            {
+                return TRUE;
+            }
+        }
+    }
+
+    if(pSet->Roots & (1 << _USN_NAME_PREFIX))
+    {
+        node = _USN_NAME_PREFIX;
+        for(size_t index=0; index<cchname; index++)
+        {
+            node = _UsnpNameStep(pSet, node, _UsnpFoldChar(name[index]));
+            if(node == _USN_NAME_NONE)
+            {
+                break;
+            }
+            if(pSet->Nodes[node].Flags & _USN_NAME_MATCH)
+            {
+                return TRUE;
+            }
+        }
+    }
+
+    if(pSet->Roots & (1 << _USN_NAME_CONTAINS))
+    {
+        node = _USN_NAME_CONTAINS;
+        for(size_t index=0; index<cchname; index++)
+        {
+            WCHAR ch = _UsnpFoldChar(name[index]);
+            DWORD next;
+
+            while(((next = _UsnpNameStep(pSet, node, ch)) == _USN_NAME_NONE) && (node != _USN_NAME_CONTAINS))
+            {
+                node = pSet->Nodes[node].Fail;
+            }
+            node = ((next != _USN_NAME_NONE) ? next : _USN_NAME_CONTAINS);
+
+            if(pSet->Nodes[node].Flags & _USN_NAME_MATCH)
+            {
+                return TRUE;
+            }
+            for(DWORD found=((pSet->Nodes[node].Verify != _USN_NAME_NONE) ? node : pSet->Nodes[node].Output); found!=_USN_NAME_NONE; found=pSet->Nodes[found].Output)
+            {
+                for(DWORD glob=pSet->Nodes[found].Verify; glob!=_USN_NAME_NONE; glob=pSet->Globs[glob].Next)
+                {
+                    if( _UsnpMatchGlob(pSet->Globs[glob].Text, pSet->Globs[glob].Length, name, cchname))
+                    {
+                        return TRUE;
+                    }
+                }
+            }
+        }
+    }
+
+    for(DWORD glob=pSet->Anywhere; glob!=_USN_NAME_NONE; glob=pSet->Globs[glob].Next)
+    {
+        if( _UsnpMatchGlob(pSet->Globs[glob].Text, pSet->Globs[glob].Length, name, cchname))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*++
+ * name:@file; the globs in file, one a line, joined with | as though
+ * given inline. blank lines and # comments are passed over ...
+ */
+BOOL
+_UsnpLoadNameList (
+    __in_ecount(cchfilename) const wchar_t* filename,
+    __in size_t cchfilename,
+    __out WCHAR** pText,
+    __out DWORD* pLength )
+{
+    wchar_t path[MAX_PATH] = {0};
+    wchar_t line[MAX_PATH];
+    FILE* fp;
+    size_t capacity = 256;
+    size_t length = 0;
+    WCHAR* text;
+
+    *pText = NULL;
+    *pLength = 0;
+
+    if((cchfilename == 0) || (cchfilename >= _countof(path)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    RtlMoveMemory(path, filename, cchfilename * sizeof(wchar_t));
+
+    fp = _UsnpOpenStream(path, L"r");
+    if(fp == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    text = (WCHAR*)_UsnpAlloc(capacity * sizeof(WCHAR));
+    while((text != NULL) && (fgetws(line, _countof(line), fp) != NULL))
+    {
+        size_t cch = wcslen(line);
+
+        while((cch > 0) && ((line[cch - 1] == L'\n') || (line[cch - 1] == L'\r') || (line[cch - 1] == L' ')))
+        {
+            line[--cch] = L'\0';
+        }
+        if((cch == 0) || (line[0] == L'#'))
+        {
+            continue;
+        }
+
+        if((length + cch + 1) > capacity)
+        {
+            WCHAR* larger;
+
+            while((length + cch + 1) > capacity)
+            {
+                capacity *= 2;
+            }
+            larger = (WCHAR*)_UsnpAlloc(capacity * sizeof(WCHAR));
+            if(larger != NULL)
+            {
+                RtlMoveMemory(larger, text, length * sizeof(WCHAR));
+            }
+            _UsnpFree(text);
+            text = larger;
+            if(text == NULL)
+            {
+                break;
+            }
+        }
+
+        if(length > 0)
+        {
+            text[length++] = L'|';
+        }
+        for(size_t index=0; index<cch; index++)
+        {
+            text[length++] = _UsnpFoldChar((WCHAR)line[index]);
+        }
+    }
+    fclose(fp);
+
+    if((text == NULL) || (length == 0))
+    {
+        _UsnpFree(text);
+        SetLastError((text == NULL) ? ERROR_NOT_ENOUGH_MEMORY : ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    *pText = text;
+    *pLength = (DWORD)length;
+    return TRUE;
+}
+
+/*++
+ * the name tests right under an or go into the first of them, as one set
+ * of globs, so name:*.dll or name:*.exe costs one pass and not two ...
+ */
+void
+_UsnpFilterMergeNames (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD node )
+{
+    PUSN_FILTER pFilter = pParser->pFilter;
+    PUSN_FILTER_PATTERN pFirst = NULL;
+    DWORD* pLink = &(pParser->Nodes[node].Child);
+
+    while(*pLink != _USN_FILTER_NONE)
+    {
+        PUSN_FILTER_NODE pChild = &(pParser->Nodes[*pLink]);
+        PUSN_FILTER_PATTERN pPattern;
+        WCHAR* text;
+
+        if(pChild->Test.Code != _USN_FILTER_NAME)
+        {
+            pLink = &(pChild->Sibling);
+            continue;
+        }
+
+        pPattern = &(pFilter->Patterns[pChild->Test.Index]);
+        if(pFirst == NULL)
+        {
+            pFirst = pPattern;
+            pLink = &(pChild->Sibling);
+            continue;
+        }
+
+        text = (WCHAR*)_UsnpAlloc(((size_t)pFirst->Length + 1 + pPattern->Length) * sizeof(WCHAR));
+        if(text == NULL)
+        {
+            /*++ left as two tests; the answer is the same ... */
+            return;
+        }
+        RtlMoveMemory(text, pFirst->Text, (size_t)pFirst->Length * sizeof(WCHAR));
+        text[pFirst->Length] = L'|';
+        RtlMoveMemory(text + pFirst->Length + 1, pPattern->Text, (size_t)pPattern->Length * sizeof(WCHAR));
+        _UsnpFree(pFirst->Text);
+        pFirst->Text = text;
+        pFirst->Length += 1 + pPattern->Length;
+
+        /*++ its pattern stays, empty, never tested ... */
+        _UsnpFree(pPattern->Text);
+        pPattern->Text = NULL;
+        pPattern->Length = 0;
+        *pLink = pChild->Sibling;
+    }
+}
+
+/*++
+ */
+int
+_UsnpCompareFileId (
+    __in const void* p1,
+    __in const void* p2 )
+{
+    const ULARGE_INTEGER128* a = (const ULARGE_INTEGER128*)p1;
+    const ULARGE_INTEGER128* b = (const ULARGE_INTEGER128*)p2;
+
+    if(a->HighPart != b->HighPart)
+    {
+        return ((a->HighPart < b->HighPart) ? -1 : 1);
+    }
+    if(a->LowPart != b->LowPart)
+    {
+        return ((a->LowPart < b->LowPart) ? -1 : 1);
+    }
+    return 0;
+}
+
+/*++
+ */
+BOOL
+_UsnpIsInFilterSet (
+    __in PUSN_FILTER_SET pSet,
+    __in FILE_ID_128* pFileId )
+{
+    return (bsearch(pFileId, pSet->Ids, pSet->Count, sizeof(FILE_ID_128), _UsnpCompareFileId) != NULL);
+}
+
+/*++
+ */
+void
+_UsnpFilterSkip (
+    __in PUSN_FILTER_PARSER pParser )
+{
+    while(iswspace(*(pParser->Next)))
+    {
+        pParser->Next++;
+    }
+}
+
+/*++ take token if it is next; a word must end there, not run on ... */
+BOOL
+_UsnpFilterToken (
+    __in PUSN_FILTER_PARSER pParser,
+    __in const wchar_t* token )
+{
+    size_t length = wcslen(token);
+    const wchar_t* next;
+
+    _UsnpFilterSkip(pParser);
+    next = pParser->Next;
+
+    for(size_t index=0; index<length; index++)
+    {
+        if(towlower(next[index]) != (wint_t)token[index])
+        {
+            return FALSE;
+        }
+    }
+    if(iswalpha(token[0]) && (iswalnum(next[length]) || (next[length] == L'_')))
+    {
+        return FALSE;
+    }
+
+    pParser->Next += length;
+    return TRUE;
+}
+
+/*++ a value; "quoted", or up to a space or a closing parenthesis ... */
+BOOL
+_UsnpFilterValue (
+    __in PUSN_FILTER_PARSER pParser,
+    __out const wchar_t** pValue,
+    __out size_t* pcchValue )
+{
+    const wchar_t* next = pParser->Next;
+    size_t length = 0;
+
+    if(*next == L'"')
+    {
+        for(next++; (next[length] != L'\0') && (next[length] != L'"'); length++);
+        if(next[length] != L'"')
+        {
+            return FALSE;
+        }
+        pParser->Next = next + length + 1;
+    }
+    else
+    {
+        for(; (next[length] != L'\0') && (iswspace(next[length]) == 0) && (next[length] != L')'); length++);
+        pParser->Next = next + length;
+    }
+
+    *pValue = next;
+    *pcchValue = length;
+    return (length > 0);
+}
+
+/*++ decimal, or hex after 0x ... */
+BOOL
+_UsnpFilterNumber (
+    __in_ecount(cchvalue) const wchar_t* value,
+    __in size_t cchvalue,
+    __out uint64_t* pNumber )
+{
+    uint64_t number = 0;
+    size_t index = 0;
+    BOOL hex = ((cchvalue > 2) && (value[0] == L'0') && ((value[1] == L'x') || (value[1] == L'X')));
+
+    for(index=(hex ? 2 : 0); index<cchvalue; index++)
+    {
+        wchar_t ch = value[index];
+        uint64_t digit;
+
+        if((ch >= L'0') && (ch <= L'9'))              digit = ch - L'0';
+        else if(hex && (ch >= L'a') && (ch <= L'f'))  digit = ch - L'a' + 10;
+        else if(hex && (ch >= L'A') && (ch <= L'F'))  digit = ch - L'A' + 10;
+        else return FALSE;
+
+        number = (number * (hex ? 16 : 10)) + digit;
+    }
+
+    *pNumber = number;
+    return (cchvalue > 0);
+}
+
+/*++
+ * a time as nt time; 0x and hex as records show it, or utc as
+ * 2020-06-06, 2020-06-06T23:50, 2020-06-06T23:50:43 or with a fraction
+ * of up to seven digits, a trailing Z allowed ...
+ */
+BOOL
+_UsnpFilterTime (
+    __in_ecount(cchvalue) const wchar_t* value,
+    __in size_t cchvalue,
+    __out LONGLONG* pTime )
+{
+    DWORD field[6] = {0};
+    DWORD widths[6] = {4, 2, 2, 2, 2, 2};
+    const wchar_t separators[6] = {L'-', L'-', L'T', L':', L':', L'.'};
+    int64_t y, era, yoe, doy, doe, days;
+    LONGLONG fraction = 0;
+    DWORD scale = 1000000;
+    size_t index = 0;
+    DWORD count;
+
+    if((cchvalue > 2) && (value[0] == L'0') && ((value[1] == L'x') || (value[1] == L'X')))
+    {
+        return _UsnpFilterNumber(value, cchvalue, (uint64_t*)pTime);
+    }
+
+    if((cchvalue > 0) && (value[cchvalue - 1] == L'Z'))
+    {
+        cchvalue--;
+    }
+
+    for(count=0; count<6; count++)
+    {
+        for(DWORD digits=0; digits<widths[count]; digits++, index++)
+        {
+            if((index >= cchvalue) || (value[index] < L'0') || (value[index] > L'9'))
+            {
+                return FALSE;
+            }
+            field[count] = (field[count] * 10) + (value[index] - L'0');
+        }
+        if((index >= cchvalue) || ((value[index] != separators[count]) && ((count != 2) || (value[index] != L' '))))
+        {
+            count++;
+            break;
+        }
+        index++;
+        if(count == 5)
+        {
+            /*++ the fraction, in 100ns units ... */
+            for(; (index < cchvalue) && (value[index] >= L'0') && (value[index] <= L'9') && (scale > 0); index++, scale /= 10)
+            {
+                fraction += (value[index] - L'0') * (LONGLONG)scale;
+            }
+            count++;
+            break;
+        }
+    }
+
+    if((index != cchvalue) || (count < 3) || (count == 4) ||
+       (field[1] < 1) || (field[1] > 12) || (field[2] < 1) || (field[2] > 31) ||
+       (field[3] > 23) || (field[4] > 59) || (field[5] > 60))
+    {
+        return FALSE;
+    }
+
+    /*++ days since 1970 from the civil date, then on to 1601 ... */
+    y   = (int64_t)field[0] - ((field[1] <= 2) ? 1 : 0);
+    era = ((y >= 0) ? y : (y - 399)) / 400;
+    yoe = y - (era * 400);
+    doy = ((153 * (int64_t)((field[1] > 2) ? (field[1] - 3) : (field[1] + 9))) + 2) / 5 + (int64_t)field[2] - 1;
+    doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+    days = (era * 146097) + doe - 719468;
+
+    *pTime = ((((days * 86400) + ((int64_t)field[3] * 3600) + ((int64_t)field[4] * 60) + field[5]) + 11644473600LL) * 10000000LL) + fraction;
+    return TRUE;
+}
+
+/*++ hex, or names joined by | ... */
+BOOL
+_UsnpFilterMask (
+    __in_ecount(cchvalue) const wchar_t* value,
+    __in size_t cchvalue,
+    __in BOOL Attributes,
+    __out DWORD* pMask )
+{
+    static const struct { const wchar_t* Name; DWORD Mask; } reasons[] = {
+        { L"overwrite",   USN_REASON_DATA_OVERWRITE },
+        { L"extend",      USN_REASON_DATA_EXTEND },
+        { L"truncation",  USN_REASON_DATA_TRUNCATION },
+        { L"named_data",  USN_REASON_NAMED_DATA_OVERWRITE | USN_REASON_NAMED_DATA_EXTEND | USN_REASON_NAMED_DATA_TRUNCATION },
+        { L"create",      USN_REASON_FILE_CREATE },
+        { L"delete",      USN_REASON_FILE_DELETE },
+        { L"ea",          USN_REASON_EA_CHANGE },
+        { L"security",    USN_REASON_SECURITY_CHANGE },
+        { L"rename_old",  USN_REASON_RENAME_OLD_NAME },
+        { L"rename_new",  USN_REASON_RENAME_NEW_NAME },
+        { L"rename",      USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME },
+        { L"indexable",   USN_REASON_INDEXABLE_CHANGE },
+        { L"basic_info",  USN_REASON_BASIC_INFO_CHANGE },
+        { L"hard_link",   USN_REASON_HARD_LINK_CHANGE },
+        { L"compression", USN_REASON_COMPRESSION_CHANGE },
+        { L"encryption",  USN_REASON_ENCRYPTION_CHANGE },
+        { L"object_id",   USN_REASON_OBJECT_ID_CHANGE },
+        { L"reparse",     USN_REASON_REPARSE_POINT_CHANGE },
+        { L"stream",      USN_REASON_STREAM_CHANGE },
+        { L"close",       USN_REASON_CLOSE },
+        { NULL, 0 }
+    };
+    static const struct { const wchar_t* Name; DWORD Mask; } attributes[] = {
+        { L"readonly",    FILE_ATTRIBUTE_READONLY },
+        { L"hidden",      FILE_ATTRIBUTE_HIDDEN },
+        { L"system",      FILE_ATTRIBUTE_SYSTEM },
+        { L"directory",   FILE_ATTRIBUTE_DIRECTORY },
+        { L"archive",     FILE_ATTRIBUTE_ARCHIVE },
+        { L"normal",      FILE_ATTRIBUTE_NORMAL },
+        { L"temporary",   FILE_ATTRIBUTE_TEMPORARY },
+        { L"reparse",     FILE_ATTRIBUTE_REPARSE_POINT },
+        { L"compressed",  FILE_ATTRIBUTE_COMPRESSED },
+        { L"not_indexed", FILE_ATTRIBUTE_NOT_CONTENT_INDEXED },
+        { L"encrypted",   FILE_ATTRIBUTE_ENCRYPTED },
+        { NULL, 0 }
+    };
+    uint64_t number;
+    DWORD mask = 0;
+    size_t start = 0;
+
+    if( _UsnpFilterNumber(value, cchvalue, &number) != FALSE)
+    {
+        *pMask = (DWORD)number;
+        return (number != 0);
+    }
+
+    while(start < cchvalue)
+    {
+        size_t length = 0;
+        DWORD index;
+
+        for(; ((start + length) < cchvalue) && (value[start + length] != L'|'); length++);
+
+        for(index=0; (Attributes ? attributes[index].Name : reasons[index].Name) != NULL; index++)
+        {
+            const wchar_t* name = (Attributes ? attributes[index].Name : reasons[index].Name);
+            if((wcslen(name) == length) && (_wcsnicmp(name, value + start, length) == 0))
+            {
+                mask |= (Attributes ? attributes[index].Mask : reasons[index].Mask);
+                break;
+            }
+        }
+        if((Attributes ? attributes[index].Name : reasons[index].Name) == NULL)
+        {
+            return FALSE;
+        }
+        start += length + 1;
+    }
+
+    *pMask = mask;
+    return (mask != 0);
+}
+
+/*++
+ */
+DWORD
+_UsnpFilterNode (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD Code )
+{
+    PUSN_FILTER_NODE pNode;
+
+    if(pParser->NodeCount == _USN_FILTER_NODES)
+    {
+        return _USN_FILTER_NONE;
+    }
+
+    pNode = &(pParser->Nodes[pParser->NodeCount]);
+    pNode->Child     = _USN_FILTER_NONE;
+    pNode->Sibling   = _USN_FILTER_NONE;
+    pNode->Cost      = 1;
+    pNode->Test.Code = Code;
+    return pParser->NodeCount++;
+}
+
+/*++ or := and { or and } ... */
+DWORD
+_UsnpFilterParseOr (
+    __in PUSN_FILTER_PARSER pParser )
+{
+    DWORD left = _UsnpFilterParseAnd(pParser);
+    DWORD node;
+    DWORD last;
+
+    if((left == _USN_FILTER_NONE) || ((_UsnpFilterToken(pParser, L"or") == FALSE) && (_UsnpFilterToken(pParser, L"||") == FALSE)))
+    {
+        return left;
+    }
+
+    if((node = _UsnpFilterNode(pParser, _USN_FILTER_OR)) == _USN_FILTER_NONE)
+    {
+        return _USN_FILTER_NONE;
+    }
+    pParser->Nodes[node].Child = last = left;
+
+    do
+    {
+        DWORD right = _UsnpFilterParseAnd(pParser);
+        if(right == _USN_FILTER_NONE)
+        {
+            return _USN_FILTER_NONE;
+        }
+        pParser->Nodes[last].Sibling = right;
+        last = right;
+    }
+    while(_UsnpFilterToken(pParser, L"or") || _UsnpFilterToken(pParser, L"||"));
+
+    return node;
+}
+
+/*++ and := not { and not } ... */
+DWORD
+_UsnpFilterParseAnd (
+    __in PUSN_FILTER_PARSER pParser )
+{
+    DWORD left = _UsnpFilterParseNot(pParser);
+    DWORD node;
+    DWORD last;
+
+    if((left == _USN_FILTER_NONE) || ((_UsnpFilterToken(pParser, L"and") == FALSE) && (_UsnpFilterToken(pParser, L"&&") == FALSE)))
+    {
+        return left;
+    }
+
+    if((node = _UsnpFilterNode(pParser, _USN_FILTER_AND)) == _USN_FILTER_NONE)
+    {
+        return _USN_FILTER_NONE;
+    }
+    pParser->Nodes[node].Child = last = left;
+
+    do
+    {
+        DWORD right = _UsnpFilterParseNot(pParser);
+        if(right == _USN_FILTER_NONE)
+        {
+            return _USN_FILTER_NONE;
+        }
+        pParser->Nodes[last].Sibling = right;
+        last = right;
+    }
+    while(_UsnpFilterToken(pParser, L"and") || _UsnpFilterToken(pParser, L"&&"));
+
+    return node;
+}
+
+/*++ not := { not } ( or ) | test ... */
+DWORD
+_UsnpFilterParseNot (
+    __in PUSN_FILTER_PARSER pParser )
+{
+    DWORD node;
+    DWORD child;
+
+    if(_UsnpFilterToken(pParser, L"not") || _UsnpFilterToken(pParser, L"!"))
+    {
+        if( ((child = _UsnpFilterParseNot(pParser)) == _USN_FILTER_NONE) ||
+            ((node = _UsnpFilterNode(pParser, _USN_FILTER_NOT)) == _USN_FILTER_NONE))
+        {
+            return _USN_FILTER_NONE;
+        }
+        pParser->Nodes[node].Child = child;
+        return node;
+    }
+
+    if(_UsnpFilterToken(pParser, L"("))
+    {
+        node = _UsnpFilterParseOr(pParser);
+        if((node == _USN_FILTER_NONE) || (_UsnpFilterToken(pParser, L")") == FALSE))
+        {
+            return _USN_FILTER_NONE;
+        }
+        return node;
+    }
+
+    return _UsnpFilterParseTest(pParser);
+}
+
+/*++ test := field : value | field compare value ... */
+DWORD
+_UsnpFilterParseTest (
+    __in PUSN_FILTER_PARSER pParser )
+{
+    PUSN_FILTER pFilter = pParser->pFilter;
+    PUSN_FILTER_NODE pNode;
+    const wchar_t* value;
+    size_t cchvalue;
+    DWORD code;
+    DWORD node;
+    DWORD mask;
+    LONGLONG number;
+    const wchar_t* start;
+
+    /*++ a test that does not parse is reported from its start ... */
+    _UsnpFilterSkip(pParser);
+    start = pParser->Next;
+
+    if(_UsnpFilterToken(pParser, L"reason"))      code = _USN_FILTER_REASON;
+    else if(_UsnpFilterToken(pParser, L"attr"))   code = _USN_FILTER_ATTRIBUTES;
+    else if(_UsnpFilterToken(pParser, L"usn"))    code = _USN_FILTER_USN;
+    else if(_UsnpFilterToken(pParser, L"time"))   code = _USN_FILTER_TIME;
+    else if(_UsnpFilterToken(pParser, L"frn"))    code = _USN_FILTER_FRN;
+    else if(_UsnpFilterToken(pParser, L"parent")) code = _USN_FILTER_PARENT;
+    else if(_UsnpFilterToken(pParser, L"name"))   code = _USN_FILTER_NAME;
+    else goto bad;
+
+    if((node = _UsnpFilterNode(pParser, code)) == _USN_FILTER_NONE)
+    {
+        goto bad;
+    }
+    pNode = &(pParser->Nodes[node]);
+
+    if((code == _USN_FILTER_USN) || (code == _USN_FILTER_TIME))
+    {
+        DWORD compare;
+
+        /*++ the two character comparisons ahead of the one character ones ... */
+        if(_UsnpFilterToken(pParser, L"<="))      compare = 0;
+        else if(_UsnpFilterToken(pParser, L">=")) compare = 1;
+        else if(_UsnpFilterToken(pParser, L"<"))  compare = 2;
+        else if(_UsnpFilterToken(pParser, L">"))  compare = 3;
+        else if(_UsnpFilterToken(pParser, L"="))  compare = 4;
+        else goto bad;
+
+        _UsnpFilterSkip(pParser);
+        if(_UsnpFilterValue(pParser, &value, &cchvalue) == FALSE)
+        {
+            goto bad;
+        }
+        if( ((code == _USN_FILTER_USN) && (_UsnpFilterNumber(value, cchvalue, (uint64_t*)&number) == FALSE)) ||
+            ((code == _USN_FILTER_TIME) && (_UsnpFilterTime(value, cchvalue, &number) == FALSE)) ||
+            (number < 0))
+        {
+            goto bad;
+        }
+
+        pNode->Test.Low  = 0;
+        pNode->Test.High = INT64_MAX;
+        switch(compare)
+        {
+        case 0: pNode->Test.High = number; break;
+        case 1: pNode->Test.Low = number; break;
+        case 2: pNode->Test.High = number - 1; break;
+        case 3: pNode->Test.Low = ((number < INT64_MAX) ? (number + 1) : number); break;
+        case 4: pNode->Test.Low = pNode->Test.High = number; break;
+        }
+        return node;
+    }
+
+    if(_UsnpFilterToken(pParser, L":") == FALSE)
+    {
+        goto bad;
+    }
+    _UsnpFilterSkip(pParser);
+    if(_UsnpFilterValue(pParser, &value, &cchvalue) == FALSE)
+    {
+        goto bad;
+    }
+
+    switch(code)
+    {
+    case _USN_FILTER_REASON:
+    case _USN_FILTER_ATTRIBUTES:
+        if( _UsnpFilterMask(value, cchvalue, (code == _USN_FILTER_ATTRIBUTES), &mask) == FALSE)
+        {
+            goto bad;
+        }
+        pNode->Test.Low = mask;
+        break;
+
+    case _USN_FILTER_FRN:
+    case _USN_FILTER_PARENT:
+        {
+            PUSN_FILTER_SET pSet = &(pFilter->Sets[pFilter->SetCount]);
+            DWORD count = 1;
+            size_t start = 0;
+
+            for(size_t index=0; index<cchvalue; index++)
+            {
+                count += (value[index] == L',');
+            }
+            pSet->Ids = (FILE_ID_128*)_UsnpAlloc(count * sizeof(FILE_ID_128));
+            if(pSet->Ids == NULL)
+            {
+                goto bad;
+            }
+            pNode->Test.Index = pFilter->SetCount++;
+
+            while(start < cchvalue)
+            {
+                wchar_t frn[40] = {0};
+                size_t length = 0;
+
+                for(; ((start + length) < cchvalue) && (value[start + length] != L','); length++);
+
+                /*++ 0x and up to 32 hex digits, as records show it ... */
+                if( (length < 3) || (length > 34) || (value[start] != L'0') ||
+                    ((value[start + 1] != L'x') && (value[start + 1] != L'X')))
+                {
+                    goto bad;
+                }
+                RtlMoveMemory(frn, value + start + 2, (length - 2) * sizeof(wchar_t));
+                if( _UsnpParseFileId(frn, &(pSet->Ids[pSet->Count])) == FALSE)
+                {
+                    goto bad;
+                }
+                pSet->Count++;
+                start += length + 1;
+            }
+            if(pSet->Count != count)
+            {
+                goto bad;
+            }
+
+            qsort(pSet->Ids, pSet->Count, sizeof(FILE_ID_128), _UsnpCompareFileId);
+            pNode->Cost = 2;
+        }
+        break;
+
+    case _USN_FILTER_NAME:
+        {
+            PUSN_FILTER_PATTERN pPattern = &(pFilter->Patterns[pFilter->PatternCount]);
+
+            /*++ globs between |, or @file for one a line ... */
+            if(value[0] == L'@')
+            {
+                if( _UsnpLoadNameList(value + 1, cchvalue - 1, &(pPattern->Text), &(pPattern->Length)) == FALSE)
+                {
+                    goto bad;
+                }
+            }
+            else
+            {
+                pPattern->Text = (WCHAR*)_UsnpAlloc(cchvalue * sizeof(WCHAR));
+                if(pPattern->Text == NULL)
+                {
+                    goto bad;
+                }
+                for(size_t index=0; index<cchvalue; index++)
+                {
+                    pPattern->Text[index] = _UsnpFoldChar((WCHAR)value[index]);
+                }
+                pPattern->Length = (DWORD)cchvalue;
+            }
+            pNode->Test.Index = pFilter->PatternCount++;
+            pNode->Cost = 4;
+        }
+        break;
+    }
+    return node;
+
+bad:
+    pParser->Next = start;
+    return _USN_FILTER_NONE;
+}
+
+/*++
+ * put the operands of every and and or cheapest first, which changes no
+ * answer; a node costs what its dearest test does ...
+ */
+DWORD
+_UsnpFilterOrder (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD node )
+{
+    PUSN_FILTER_NODE pNode = &(pParser->Nodes[node]);
+    DWORD sorted = _USN_FILTER_NONE;
+    DWORD child;
+    DWORD next;
+
+    switch(pNode->Test.Code)
+    {
+    case _USN_FILTER_NOT:
+        pNode->Cost = _UsnpFilterOrder(pParser, pNode->Child);
+        return pNode->Cost;
+
+    case _USN_FILTER_AND:
+    case _USN_FILTER_OR:
+        if(pNode->Test.Code == _USN_FILTER_OR)
+        {
+            _UsnpFilterMergeNames(pParser, node);
+        }
+
+        pNode->Cost = 0;
+        for(child=pNode->Child; child!=_USN_FILTER_NONE; child=next)
+        {
+            DWORD* pLink = &sorted;
+            DWORD cost = _UsnpFilterOrder(pParser, child);
+
+            next = pParser->Nodes[child].Sibling;
+            if(cost > pNode->Cost)
+            {
+                pNode->Cost = cost;
+            }
+
+            /*++ an insertion, after any of the same cost, so the order is kept ... */
+            while((*pLink != _USN_FILTER_NONE) && (pParser->Nodes[*pLink].Cost <= cost))
+            {
+                pLink = &(pParser->Nodes[*pLink].Sibling);
+            }
+            pParser->Nodes[child].Sibling = *pLink;
+            *pLink = child;
+        }
+        pNode->Child = sorted;
+        return pNode->Cost;
+    }
+    return pNode->Cost;
+}
+
+/*++
+ * lay down the tests for node, going to True when it holds and False when
+ * not, and give the first. an and goes on to its next operand when one
+ * holds and an or when one does not; the last goes where the node does.
+ * operands are laid down last first, so each knows where it goes ...
+ */
+DWORD
+_UsnpFilterEmit (
+    __in PUSN_FILTER_PARSER pParser,
+    __in DWORD node,
+    __in DWORD True,
+    __in DWORD False )
+{
+    PUSN_FILTER_NODE pNode = &(pParser->Nodes[node]);
+    PUSN_FILTER pFilter = pParser->pFilter;
+    DWORD operands[_USN_FILTER_NODES];
+    DWORD count = 0;
+    DWORD next;
+    PUSN_FILTER_OP pOp;
+
+    switch(pNode->Test.Code)
+    {
+    case _USN_FILTER_NOT:
+        return _UsnpFilterEmit(pParser, pNode->Child, False, True);
+
+    case _USN_FILTER_AND:
+    case _USN_FILTER_OR:
+        for(DWORD child=pNode->Child; child!=_USN_FILTER_NONE; child=pParser->Nodes[child].Sibling)
+        {
+            operands[count++] = child;
+        }
+        next = _UsnpFilterEmit(pParser, operands[--count], True, False);
+        while(count > 0)
+        {
+            next = ((pNode->Test.Code == _USN_FILTER_AND) ?
+                     _UsnpFilterEmit(pParser, operands[--count], next, False) :
+                     _UsnpFilterEmit(pParser, operands[--count], True, next));
+        }
+        return next;
+    }
+
+    pOp = &(pFilter->Ops[pFilter->Count]);
+    RtlMoveMemory(pOp, &(pNode->Test), sizeof(USN_FILTER_OP));
+    pOp->True  = True;
+    pOp->False = False;
+    return pFilter->Count++;
+}
+
+/*++ the tree behind a resolver, if it is one ... */
+PUSN_TREE
+_UsnpGetTree (
+    __in PUSN_RESOLVER pResolver )
+{
+    if((pResolver != NULL) && (pResolver->Lookup == _UsnpTreeLookup))
+    {
+        return (PUSN_TREE)pResolver->Context;
+    }
+    return NULL;
+}
+
+/*++
+ * the resolver a walk uses; by-id opens on the volume, or synthetic paths
+ * with -synthpaths, behind the cache unless -cache 0, and behind the
+ * journal's own tree with -tree ...
+ */
+BOOL
+_UsnpOpenResolver (
+    __in HANDLE Volume,
+    __in PUSN_STATS pStats,
+    __out PUSN_RESOLVER pResolver )
+{
+    PUSN_RESOLVER pLower;
+
+    if((pStats == NULL) || (pResolver == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pResolver, sizeof(USN_RESOLVER));
+
+    pLower = (PUSN_RESOLVER)_UsnpAlloc(sizeof(USN_RESOLVER));
+    if(pLower == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pLower->Lookup  = ((g_synthpaths) ? _UsnpSynthLookup : _UsnpVolumeLookup);
+    pLower->Context = Volume;
+
+    if(g_cachesize != 0)
+    {
+        PUSN_RESOLVER pCache = (PUSN_RESOLVER)_UsnpAlloc(sizeof(USN_RESOLVER));
+        if((pCache == NULL) || (_UsnpOpenPathCache(pLower, g_cachesize, g_negttl, pStats, pCache) == FALSE))
+        {
+            /*++ last error set by call ... */
+            _UsnpFree(pCache);
+            _UsnpFree(pLower);
+            return FALSE;
+        }
+        pLower = pCache;
+    }
+
+    if(g_tree)
+    {
+        if( _UsnpOpenTree(pLower, pStats, pResolver) == FALSE)
+        {
+            /*++ last error set by call ... */
+            _UsnpCloseResolver(pLower);
+            _UsnpFree(pLower);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    *pResolver = *pLower;
+    _UsnpFree(pLower);
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpCloseResolver (
+    __in PUSN_RESOLVER pResolver )
+{
+    if((pResolver != NULL) && (pResolver->Close != NULL))
+    {
+        pResolver->Close(pResolver);
+    }
+}
+
+/*++
+ */
+BOOL
+_UsnpVolumeLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    return _UsnpGetFilenameFromFileId((HANDLE)pResolver->Context, pFileId, buffer, cchbuffer);
+}
+
+/*++
+ * stand-in paths for replays off the volume they came from, to exercise
+ * the cache. anything below the first user index is unknown ...
+ */
+BOOL
+_UsnpSynthLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    ULARGE_INTEGER128 fid;
+    uint64_t index;
+    int length;
+
+    UNREFERENCED_PARAMETER(pResolver);
+
+    if((pFileId == NULL) || (buffer == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlMoveMemory(&fid, pFileId, sizeof(fid));
+    index = fid.LowPart & 0x0000FFFFFFFFFFFFULL;
+
+    if((fid.HighPart == 0) && (fid.LowPart == _USN_ROOT_FRN))
+    {
+        length = _snwprintf_s(buffer, cchbuffer, cchbuffer, L"S:\\");
+    }
+    else if((fid.HighPart != 0) || (index < 0x10000))
+    {
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return FALSE;
+    }
+    else
+    {
+        length = _snwprintf_s(buffer, cchbuffer, cchbuffer, L"S:\\%012llX", (unsigned long long)index);
+    }
+
+    if((length < 0) || ((size_t)length >= cchbuffer))
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ * a bounded frn-to-path cache in front of pLower. eviction is clock: the
+ * hand passes over entries referenced since its last visit, clearing the
+ * bit, and takes the first one that was not. new entries start clear, so
+ * a parent seen once does not push out one seen often. failed lookups
+ * are kept for NegativeTtl milliseconds; a deleted directory can come
+ * back under the same frn ...
+ */
+BOOL
+_UsnpOpenPathCache (
+    __in PUSN_RESOLVER pLower,
+    __in DWORD Capacity,
+    __in DWORD NegativeTtl,
+    __in PUSN_STATS pStats,
+    __out PUSN_RESOLVER pResolver )
+{
+    PUSN_PATH_CACHE pCache;
+    DWORD buckets = 1;
+
+    if((pLower == NULL) || (pLower->Lookup == NULL) || (Capacity == 0) || (pResolver == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++ a power of two at or above the capacity; chains stay short ... */
+    while((buckets < Capacity) && (buckets < 0x80000000))
+    {
+        buckets <<= 1;
+    }
+
+    pCache = (PUSN_PATH_CACHE)_UsnpAlloc(sizeof(USN_PATH_CACHE));
+    if(pCache == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    pCache->Entries = (PUSN_PATH_ENTRY)_UsnpAlloc((size_t)Capacity * sizeof(USN_PATH_ENTRY));
+    pCache->Buckets = (DWORD*)_UsnpAlloc((size_t)buckets * sizeof(DWORD));
+    if((pCache->Entries == NULL) || (pCache->Buckets == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(pCache->Entries);
+        _UsnpFree(pCache->Buckets);
+        _UsnpFree(pCache);
+        return FALSE;
+    }
+
+    memset(pCache->Buckets, 0xFF, (size_t)buckets * sizeof(DWORD));
+
+    pCache->pLower      = pLower;
+    pCache->Capacity    = Capacity;
+    pCache->BucketMask  = buckets - 1;
+    pCache->NegativeTtl = (uint64_t)NegativeTtl * 1000;
+    pCache->pStats      = pStats;
+
+    pResolver->Lookup  = _UsnpPathCacheLookup;
+    pResolver->Observe = _UsnpPathCacheObserve;
+    pResolver->Close   = _UsnpPathCacheClose;
+    pResolver->Context = pCache;
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpPathCacheLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    PUSN_PATH_CACHE pCache = (PUSN_PATH_CACHE)pResolver->Context;
+    DWORD bucket;
+    DWORD index;
+    DWORD error;
+
+    if((pFileId == NULL) || (buffer == NULL) || (cchbuffer == 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    index = _UsnpPathCacheFind(pCache, pFileId, &bucket);
+    if(index != _USN_PATH_NONE)
+    {
+        PUSN_PATH_ENTRY pEntry = &(pCache->Entries[index]);
+
+        if(pEntry->Error == 0)
+        {
+            size_t length = wcslen(pEntry->Path);
+            if(length >= cchbuffer)
+            {
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                return FALSE;
+            }
+            RtlMoveMemory(buffer, pEntry->Path, (length + 1) * sizeof(wchar_t));
+            pEntry->Referenced = TRUE;
+            pCache->pStats->PathHits++;
+            return TRUE;
+        }
+
+        if(_UsnpQueryClock() < pEntry->Expires)
+        {
+            pEntry->Referenced = TRUE;
+            pCache->pStats->PathHits++;
+            pCache->pStats->PathNegative++;
+            SetLastError(pEntry->Error);
+            return FALSE;
+        }
+
+        /*++ stale negative; ask again ... */
+        _UsnpPathCacheRemove(pCache, index);
+    }
+
+    pCache->pStats->PathMisses++;
+
+    if( pCache->pLower->Lookup(pCache->pLower, pFileId, buffer, cchbuffer) != FALSE)
+    {
+        _UsnpPathCacheInsert(pCache, pFileId, buffer, 0);
+        return TRUE;
+    }
+
+    /*++ a short buffer says nothing about the frn ... */
+    error = GetLastError();
+    if((error != ERROR_INSUFFICIENT_BUFFER) && (pCache->NegativeTtl != 0))
+    {
+        _UsnpPathCacheInsert(pCache, pFileId, NULL, ((error != 0) ? error : ERROR_FILE_NOT_FOUND));
+    }
+    SetLastError(error);
+    return FALSE;
+}
+
+/*++
+ * keep the cache honest as records go by. a directory rename changes the
+ * path of everything under it, so the whole cache goes; a directory delete
+ * or create drops just that frn, the latter so a negative entry left from
+ * an earlier life does not linger ...
+ */
+void
+_UsnpPathCacheObserve (
+    __in PUSN_RESOLVER pResolver,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    PUSN_PATH_CACHE pCache = (PUSN_PATH_CACHE)pResolver->Context;
+    FILE_ID_128 fid;
+    FILE_ID_128 parent;
+    DWORD attributes;
+    DWORD reason;
+    WCHAR* name;
+    size_t cchname;
+
+    _UsnpObserveRecord(pCache->pLower, pRecord);
+
+    if( _UsnpGetRecordNaming(pRecord, &fid, &parent, &attributes, &reason, &name, &cchname) == FALSE)
+    {
+        return;
+    }
+
+    if((attributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+    {
+        return;
+    }
+
+    if(reason & (USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME))
+    {
+        _UsnpPathCacheInvalidate(pCache, NULL);
+    }
+    else if(reason & (USN_REASON_FILE_DELETE | USN_REASON_FILE_CREATE))
+    {
+        _UsnpPathCacheInvalidate(pCache, &fid);
+    }
+}
+
+/*++ drop one frn, or everything when pFileId is NULL ... */
+void
+_UsnpPathCacheInvalidate (
+    __in PUSN_PATH_CACHE pCache,
+    __in_opt FILE_ID_128* pFileId )
+{
+    DWORD bucket;
+    DWORD index;
+
+    if(pFileId != NULL)
+    {
+        index = _UsnpPathCacheFind(pCache, pFileId, &bucket);
+        if(index != _USN_PATH_NONE)
+        {
+            _UsnpPathCacheRemove(pCache, index);
+        }
+        return;
+    }
+
+    for(index=0; index<pCache->Count; index++)
+    {
+        _UsnpFree(pCache->Entries[index].Path);
+    }
+    RtlZeroMemory(pCache->Entries, (size_t)pCache->Count * sizeof(USN_PATH_ENTRY));
+    memset(pCache->Buckets, 0xFF, ((size_t)pCache->BucketMask + 1) * sizeof(DWORD));
+    pCache->Count = 0;
+    pCache->Hand = 0;
+}
+
+/*++ closes the resolver below as well ... */
+void
+_UsnpPathCacheClose (
+    __in PUSN_RESOLVER pResolver )
+{
+    PUSN_PATH_CACHE pCache = (PUSN_PATH_CACHE)pResolver->Context;
+
+    if(pCache == NULL)
+    {
+        return;
+    }
+
+    for(DWORD index=0; index<pCache->Count; index++)
+    {
+        _UsnpFree(pCache->Entries[index].Path);
+    }
+
+    _UsnpCloseResolver(pCache->pLower);
+    _UsnpFree(pCache->pLower);
+    _UsnpFree(pCache->Entries);
+    _UsnpFree(pCache->Buckets);
+    _UsnpFree(pCache);
+    RtlZeroMemory(pResolver, sizeof(USN_RESOLVER));
+}
+
+/*++ the entry holding pFileId, or _USN_PATH_NONE; pBucket gets its chain ... */
+DWORD
+_UsnpPathCacheFind (
+    __in PUSN_PATH_CACHE pCache,
+    __in FILE_ID_128* pFileId,
+    __out DWORD* pBucket )
+{
+    DWORD index;
+
+    *pBucket = (DWORD)(_UsnpHashFileId(pFileId) >> 32) & pCache->BucketMask;
+
+    for(index=pCache->Buckets[*pBucket]; index!=_USN_PATH_NONE; index=pCache->Entries[index].Next)
+    {
+        if(memcmp(&(pCache->Entries[index].FileId), pFileId, sizeof(FILE_ID_128)) == 0)
+        {
+            return index;
+        }
+    }
+    return _USN_PATH_NONE;
+}
+
+/*++ unlink an entry from its chain and leave the slot free ... */
+void
+_UsnpPathCacheRemove (
+    __in PUSN_PATH_CACHE pCache,
+    __in DWORD Index )
+{
+    PUSN_PATH_ENTRY pEntry = &(pCache->Entries[Index]);
+    DWORD bucket;
+    DWORD* pLink;
+
+    _UsnpPathCacheFind(pCache, &(pEntry->FileId), &bucket);
+
+    for(pLink=&(pCache->Buckets[bucket]); *pLink!=_USN_PATH_NONE; pLink=&(pCache->Entries[*pLink].Next))
+    {
+        if(*pLink == Index)
+        {
+            *pLink = pEntry->Next;
+            break;
+        }
+    }
+
+    _UsnpFree(pEntry->Path);
+    RtlZeroMemory(pEntry, sizeof(USN_PATH_ENTRY));
+}
+
+/*++
+ * add an entry, taking a fresh slot while there are any and then letting
+ * the clock hand pick one. allocation failures just leave it uncached ...
+ */
+void
+_UsnpPathCacheInsert (
+    __in PUSN_PATH_CACHE pCache,
+    __in FILE_ID_128* pFileId,
+    __in_opt const wchar_t* path,
+    __in DWORD Error )
+{
+    PUSN_PATH_ENTRY pEntry;
+    wchar_t* copy = NULL;
+    DWORD bucket;
+    DWORD index;
+
+    if(path != NULL)
+    {
+        size_t length = wcslen(path);
+        copy = (wchar_t*)_UsnpAlloc((length + 1) * sizeof(wchar_t));
+        if(copy == NULL)
+        {
+            return;
+        }
+        RtlMoveMemory(copy, path, (length + 1) * sizeof(wchar_t));
+    }
+
+    if(pCache->Count < pCache->Capacity)
+    {
+        index = pCache->Count++;
+    }
+    else
+    {
+        while(1)
+        {
+            index = pCache->Hand;
+            pCache->Hand = ((pCache->Hand + 1) % pCache->Capacity);
+
+            pEntry = &(pCache->Entries[index]);
+            if(pEntry->Used == FALSE)
+            {
+                break;
+            }
+            if(pEntry->Referenced == FALSE)
+            {
+                _UsnpPathCacheRemove(pCache, index);
+                pCache->pStats->PathEvicted++;
+                break;
+            }
+            pEntry->Referenced = FALSE;
+        }
+    }
+
+    _UsnpPathCacheFind(pCache, pFileId, &bucket);
+
+    pEntry = &(pCache->Entries[index]);
+    RtlMoveMemory(&(pEntry->FileId), pFileId, sizeof(FILE_ID_128));
+    pEntry->Path       = copy;
+    pEntry->Error      = Error;
+    pEntry->Expires    = ((Error != 0) ? (_UsnpQueryClock() + pCache->NegativeTtl) : 0);
+    pEntry->Used       = TRUE;
+    pEntry->Referenced = FALSE;
+    pEntry->Next       = pCache->Buckets[bucket];
+    pCache->Buckets[bucket] = index;
+}
+
+/*++
+ * seed a resolver with every file on the volume, from an mft enumeration,
+ * so paths resolve for directories the journal has not mentioned. the
+ * records come back v2 or v3 like journal records and go in the same way ...
+ */
+BOOL
+_UsnpSeedResolver (
+    __in HANDLE Volume,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __in PUSN_RESOLVER pResolver )
+{
+#if defined(_WIN32)
+    BOOL status = FALSE;
+    uint8_t* buffer;
+    DWORD cbbuffer = 0x10000;
+    DWORD bytes = 0;
+    MFT_ENUM_DATA_V1 EnumData = {0};
+#endif  /* _WIN32 */
+
+    if((Volume == NULL) || (pJournalData == NULL) || (pResolver == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+#if defined(_WIN32)
+    buffer = (uint8_t*)_UsnpAlloc(cbbuffer);
+    if(buffer == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    EnumData.StartFileReferenceNumber = 0;
+    EnumData.LowUsn                   = 0;
+    EnumData.HighUsn                  = pJournalData->NextUsn;
+    EnumData.MinMajorVersion          = 2;
+    EnumData.MaxMajorVersion          = 3;
+
+    while(1)
+    {
+        PUSN_RECORD_COMMON_HEADER pRecord;
+        DWORD remaining;
+
+        if( DeviceIoControl(Volume, FSCTL_ENUM_USN_DATA, &EnumData, sizeof(EnumData), buffer, cbbuffer, &bytes, NULL) == FALSE)
+        {
+            /*++ the end of the mft reads as eof ... */
+            status = (GetLastError() == ERROR_HANDLE_EOF);
+            break;
+        }
+
+        if(bytes <= sizeof(DWORDLONG))
+        {
+            status = TRUE;
+            break;
+        }
+
+        /*++ like a journal read; the next frn, then records ... */
+        pRecord = (PUSN_RECORD_COMMON_HEADER)(buffer + sizeof(DWORDLONG));
+        remaining = bytes - sizeof(DWORDLONG);
+        while((remaining >= sizeof(USN_RECORD_COMMON_HEADER)) && (pRecord->RecordLength >= sizeof(USN_RECORD_COMMON_HEADER)) && (pRecord->RecordLength <= remaining))
+        {
+            _UsnpObserveRecord(pResolver, pRecord);
+            remaining -= pRecord->RecordLength;
+            pRecord = (PUSN_RECORD_COMMON_HEADER)(((uint8_t*)pRecord) + pRecord->RecordLength);
+        }
+
+        EnumData.StartFileReferenceNumber = *(DWORDLONG*)buffer;
+    }
+
+    _UsnpFree(buffer);
+    return status;
+#else
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++ the low part is mostly the mft index; mix in the rest ... */
+uint64_t
+_UsnpHashFileId (
+    __in FILE_ID_128* pFileId )
+{
+    ULARGE_INTEGER128 fid;
+
+    RtlMoveMemory(&fid, pFileId, sizeof(fid));
+    return (fid.LowPart ^ (fid.HighPart * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+}
+
+/*++
+ * a resolver that builds paths from the records themselves. a parent the
+ * journal has named is walked up in memory, and the path is as of the
+ * record, so it still resolves once the directory is gone. where the walk
+ * reaches a frn the journal never named, the root say, pLower is asked
+ * for that much of the path ...
+ */
+BOOL
+_UsnpOpenTree (
+    __in PUSN_RESOLVER pLower,
+    __in PUSN_STATS pStats,
+    __out PUSN_RESOLVER pResolver )
+{
+    PUSN_TREE pTree;
+
+    if((pLower == NULL) || (pStats == NULL) || (pResolver == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pTree = (PUSN_TREE)_UsnpAlloc(sizeof(USN_TREE));
+    if(pTree == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    pTree->Capacity         = 0x10000;
+    pTree->NamesCapacity    = 0x10000;
+    pTree->InternedCapacity = 0x4000;
+    pTree->Entries  = (PUSN_TREE_ENTRY)_UsnpAlloc((size_t)pTree->Capacity * sizeof(USN_TREE_ENTRY));
+    pTree->Names    = (WCHAR*)_UsnpAlloc((size_t)pTree->NamesCapacity * sizeof(WCHAR));
+    pTree->Interned = (DWORD*)_UsnpAlloc((size_t)pTree->InternedCapacity * sizeof(DWORD));
+    if((pTree->Entries == NULL) || (pTree->Names == NULL) || (pTree->Interned == NULL))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(pTree->Entries);
+        _UsnpFree(pTree->Names);
+        _UsnpFree(pTree->Interned);
+        _UsnpFree(pTree);
+        return FALSE;
+    }
+
+    memset(pTree->Interned, 0xFF, (size_t)pTree->InternedCapacity * sizeof(DWORD));
+
+    pTree->pLower = pLower;
+    pTree->pStats = pStats;
+
+    pResolver->Lookup  = _UsnpTreeLookup;
+    pResolver->Observe = _UsnpTreeObserve;
+    pResolver->Close   = _UsnpTreeClose;
+    pResolver->Context = pTree;
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpTreeLookup (
+    __in PUSN_RESOLVER pResolver,
+    __in FILE_ID_128* pFileId,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    PUSN_TREE pTree = (PUSN_TREE)pResolver->Context;
+    PUSN_TREE_ENTRY chain[_USN_TREE_DEPTH];
+    DWORD depth = 0;
+    FILE_ID_128 fid;
+    size_t length;
+
+    if((pFileId == NULL) || (buffer == NULL) || (cchbuffer == 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++ up to the first frn the journal has not named ... */
+    RtlMoveMemory(&fid, pFileId, sizeof(fid));
+    while(1)
+    {
+        PUSN_TREE_ENTRY pEntry = _UsnpTreeFind(pTree, &fid, FALSE);
+        if(pEntry == NULL)
+        {
+            break;
+        }
+        if(depth == _USN_TREE_DEPTH)
+        {
+            /*++ too deep, or a loop from a torn record ... */
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+        }
+        chain[depth++] = pEntry;
+        fid = pEntry->Parent;
+    }
+
+    if(depth == 0)
+    {
+        /*++ nothing known here; it is all the lower resolver's ... */
+        pTree->pStats->TreeMisses++;
+        return _UsnpResolvePath(pTree->pLower, pFileId, buffer, cchbuffer);
+    }
+
+    pTree->pStats->TreeHits++;
+
+    if( _UsnpResolvePath(pTree->pLower, &fid, buffer, cchbuffer) == FALSE)
+    {
+        ULARGE_INTEGER128 unknown;
+        RtlMoveMemory(&unknown, &fid, sizeof(unknown));
+
+        /*++ the root is just a separator; anything else shows its frn ... */
+        if((unknown.HighPart == 0) && (unknown.LowPart == _USN_ROOT_FRN))
+        {
+            buffer[0] = L'\0';
+        }
+        else
+        {
+            _snwprintf_s(buffer, cchbuffer, cchbuffer, L"[%016llX]", (unsigned long long)unknown.LowPart);
+        }
+    }
+
+    length = wcslen(buffer);
+    while(depth > 0)
+    {
+        PUSN_TREE_ENTRY pEntry = chain[--depth];
+        WCHAR* name = &(pTree->Names[pEntry->Name]);
+        size_t cchname;
+
+        /*++ a snapshot is mapped, not parsed; check the offset here ... */
+        if((pEntry->Name >= pTree->NamesLength) || ((pEntry->Name + 1 + (size_t)name[0]) > pTree->NamesLength))
+        {
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+        }
+        cchname = name[0];
+
+        if((length + 1 + cchname + 1) > cchbuffer)
+        {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        if((length == 0) || (buffer[length - 1] != L'\\'))
+        {
+            buffer[length++] = L'\\';
+        }
+        length += _UsnpNameToWide(name + 1, cchname, buffer + length, cchbuffer - length);
+    }
+    return TRUE;
+}
+
+/*++
+ * every record names its directory and parent as of that record, so a
+ * rename needs nothing special. a delete is kept, marked, for the records and
+ * lookups that still refer to it ...
+ */
+void
+_UsnpTreeObserve (
+    __in PUSN_RESOLVER pResolver,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    PUSN_TREE pTree = (PUSN_TREE)pResolver->Context;
+    PUSN_TREE_ENTRY pEntry;
+    FILE_ID_128 fid;
+    FILE_ID_128 parent;
+    DWORD attributes;
+    DWORD reason;
+    WCHAR* name;
+    size_t cchname;
+    DWORD offset;
+
+    _UsnpObserveRecord(pTree->pLower, pRecord);
+
+    if( _UsnpGetRecordNaming(pRecord, &fid, &parent, &attributes, &reason, &name, &cchname) == FALSE)
+    {
+        return;
+    }
+    if((attributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+    {
+        return;
+    }
+
+    offset = _UsnpTreeIntern(pTree, name, cchname);
+    if(offset == _USN_PATH_NONE)
+    {
+        return;
+    }
+
+    pEntry = _UsnpTreeFind(pTree, &fid, TRUE);
+    if(pEntry == NULL)
+    {
+        return;
+    }
+
+    /*++ a new directory, or one with a new parent, changes what is under what ... */
+    if(((pEntry->Flags & _USN_TREE_DIRECTORY) == 0) || (memcmp(&(pEntry->Parent), &parent, sizeof(FILE_ID_128)) != 0))
+    {
+        pTree->Moves++;
+    }
+
+    pEntry->Parent = parent;
+    pEntry->Name   = offset;
+    pEntry->Flags  = (_USN_TREE_USED | _USN_TREE_DIRECTORY);
+    if(reason & USN_REASON_FILE_DELETE)
+    {
+        pEntry->Flags |= _USN_TREE_DELETED;
+    }
+}
+
+/*++ closes the resolver below as well ... */
+void
+_UsnpTreeClose (
+    __in PUSN_RESOLVER pResolver )
+{
+    PUSN_TREE pTree = (PUSN_TREE)pResolver->Context;
+
+    if(pTree == NULL)
+    {
+        return;
+    }
+
+    pTree->pStats->TreeEntries += pTree->Count;
+    pTree->pStats->TreeBytes += ((uint64_t)pTree->Capacity * sizeof(USN_TREE_ENTRY)) +
+                                ((uint64_t)pTree->NamesCapacity * sizeof(WCHAR)) +
+                                ((uint64_t)pTree->InternedCapacity * sizeof(DWORD));
+
+    _UsnpCloseResolver(pTree->pLower);
+    _UsnpFree(pTree->pLower);
+    if( _UsnpIsMapped(&(pTree->Snapshot), pTree->Entries) == FALSE)
+    {
+        _UsnpFree(pTree->Entries);
+    }
+    if( _UsnpIsMapped(&(pTree->Snapshot), pTree->Names) == FALSE)
+    {
+        _UsnpFree(pTree->Names);
+    }
+    if( _UsnpIsMapped(&(pTree->Snapshot), pTree->Interned) == FALSE)
+    {
+        _UsnpFree(pTree->Interned);
+    }
+    _UsnpUnmapFile(&(pTree->Snapshot));
+    _UsnpFree(pTree);
+    RtlZeroMemory(pResolver, sizeof(USN_RESOLVER));
+}
+
+/*++
+ * the entry for pFileId; with Insert, a new one when there is none, the
+ * table growing past 70% full. linear probing, and nothing is ever taken
+ * out, so there are no tombstones ...
+ */
+PUSN_TREE_ENTRY
+_UsnpTreeFind (
+    __in PUSN_TREE pTree,
+    __in FILE_ID_128* pFileId,
+    __in BOOL Insert )
+{
+    DWORD mask;
+    DWORD index;
+
+    if(Insert && (((uint64_t)(pTree->Count + 1) * 10) > ((uint64_t)pTree->Capacity * 7)))
+    {
+        if( _UsnpTreeGrow(pTree) == FALSE)
+        {
+            return NULL;
+        }
+    }
+
+    mask = pTree->Capacity - 1;
+    index = (DWORD)(_UsnpHashFileId(pFileId) >> 32) & mask;
+
+    while(pTree->Entries[index].Flags & _USN_TREE_USED)
+    {
+        if(memcmp(&(pTree->Entries[index].FileId), pFileId, sizeof(FILE_ID_128)) == 0)
+        {
+            return &(pTree->Entries[index]);
+        }
+        index = (index + 1) & mask;
+    }
+
+    if(Insert == FALSE)
+    {
+        return NULL;
+    }
+
+    pTree->Count++;
+    RtlMoveMemory(&(pTree->Entries[index].FileId), pFileId, sizeof(FILE_ID_128));
+    pTree->Entries[index].Flags = _USN_TREE_USED;
+    return &(pTree->Entries[index]);
+}
+
+/*++ double the entry table and rehash ... */
+BOOL
+_UsnpTreeGrow (
+    __in PUSN_TREE pTree )
+{
+    PUSN_TREE_ENTRY entries = pTree->Entries;
+    DWORD capacity = pTree->Capacity;
+
+    if(capacity >= 0x80000000)
+    {
+        SetLastError(ERROR_IMPLEMENTATION_LIMIT);
+        return FALSE;
+    }
+
+    pTree->Entries = (PUSN_TREE_ENTRY)_UsnpAlloc((size_t)capacity * 2 * sizeof(USN_TREE_ENTRY));
+    if(pTree->Entries == NULL)
+    {
+        /*++ last error set by call ... */
+        pTree->Entries = entries;
+        return FALSE;
+    }
+    pTree->Capacity = capacity * 2;
+    pTree->Count = 0;
+
+    for(DWORD index=0; index<capacity; index++)
+    {
+        if(entries[index].Flags & _USN_TREE_USED)
+        {
+            PUSN_TREE_ENTRY pEntry = _UsnpTreeFind(pTree, &(entries[index].FileId), TRUE);
+            *pEntry = entries[index];
+        }
+    }
+
+    if( _UsnpIsMapped(&(pTree->Snapshot), entries) == FALSE)
+    {
+        _UsnpFree(entries);
+    }
+    return TRUE;
+}
+
+/*++
+ * the arena offset of a name, adding it the first time it is seen. the
+ * intern table holds offsets and is probed like the entry table ...
+ */
+DWORD
+_UsnpTreeIntern (
+    __in PUSN_TREE pTree,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname )
+{
+    DWORD mask;
+    DWORD index;
+    DWORD offset;
+
+    /*++ ntfs names stop at 255; and never probe a full table ... */
+    if((cchname > 255) || ((pTree->InternedCount + 1) >= pTree->InternedCapacity))
+    {
+        return _USN_PATH_NONE;
+    }
+
+    mask = pTree->InternedCapacity - 1;
+    for(index=(_UsnpHashName(name, cchname) & mask); pTree->Interned[index]!=_USN_PATH_NONE; index=((index + 1) & mask))
+    {
+        WCHAR* known = &(pTree->Names[pTree->Interned[index]]);
+        if(pTree->Interned[index] >= pTree->NamesLength)
+        {
+            return _USN_PATH_NONE;
+        }
+        if((known[0] == cchname) && (memcmp(known + 1, name, cchname * sizeof(WCHAR)) == 0))
+        {
+            return pTree->Interned[index];
+        }
+    }
+
+    /*++ new; make room in the arena ... */
+    if((pTree->NamesLength + 1 + cchname) > pTree->NamesCapacity)
+    {
+        DWORD capacity = ((pTree->NamesCapacity < 0x8000) ? 0x10000 : (pTree->NamesCapacity * 2));
+        WCHAR* names;
+
+        if(capacity < pTree->NamesCapacity)
+        {
+            return _USN_PATH_NONE;
+        }
+        if( _UsnpIsMapped(&(pTree->Snapshot), pTree->Names))
+        {
+            /*++ the snapshot's arena is exactly full; move it out ... */
+            names = (WCHAR*)_UsnpAlloc((size_t)capacity * sizeof(WCHAR));
+            if(names != NULL)
+            {
+                RtlMoveMemory(names, pTree->Names, (size_t)pTree->NamesLength * sizeof(WCHAR));
+            }
+        }
+        else
+        {
+            names = (WCHAR*)realloc(pTree->Names, (size_t)capacity * sizeof(WCHAR));
+        }
+        if(names == NULL)
+        {
+            return _USN_PATH_NONE;
+        }
+        pTree->Names = names;
+        pTree->NamesCapacity = capacity;
+    }
+
+    offset = pTree->NamesLength;
+    pTree->Names[offset] = (WCHAR)cchname;
+    RtlMoveMemory(&(pTree->Names[offset + 1]), name, cchname * sizeof(WCHAR));
+    pTree->NamesLength += (DWORD)(1 + cchname);
+
+    pTree->Interned[index] = offset;
+    pTree->InternedCount++;
+
+    /*++ and keep the intern table under 70% ... */
+    if(((uint64_t)pTree->InternedCount * 10) > ((uint64_t)pTree->InternedCapacity * 7))
+    {
+        DWORD capacity = pTree->InternedCapacity * 2;
+        DWORD* interned = (DWORD*)_UsnpAlloc((size_t)capacity * sizeof(DWORD));
+
+        if(interned != NULL)
+        {
+            memset(interned, 0xFF, (size_t)capacity * sizeof(DWORD));
+            mask = capacity - 1;
+            for(DWORD kndex=0; kndex<pTree->InternedCapacity; kndex++)
+            {
+                WCHAR* known;
+                DWORD slot;
+
+                if(pTree->Interned[kndex] == _USN_PATH_NONE)
+                {
+                    continue;
+                }
+                known = &(pTree->Names[pTree->Interned[kndex]]);
+                for(slot=(_UsnpHashName(known + 1, known[0]) & mask); interned[slot]!=_USN_PATH_NONE; slot=((slot + 1) & mask))
+                {
+                }
+                interned[slot] = pTree->Interned[kndex];
+            }
+            if( _UsnpIsMapped(&(pTree->Snapshot), pTree->Interned) == FALSE)
+            {
+                _UsnpFree(pTree->Interned);
+            }
+            pTree->Interned = interned;
+            pTree->InternedCapacity = capacity;
+        }
+    }
+    return offset;
+}
+
+/*++ fnv-1a over the utf-16 units ... */
+uint32_t
+_UsnpHashName (
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname )
+{
+    uint32_t hash = 0x811C9DC5;
+
+    for(size_t index=0; index<cchname; index++)
+    {
+        hash = (hash ^ name[index]) * 0x01000193;
+    }
+    return hash;
+}
+
+/*++
+ * map a snapshot in place of the tree's empty tables. it has to be for
+ * this journal, and the journal must still hold everything from ValidUsn
+ * on, or the tail cannot be replayed and the snapshot is no good ...
+ */
+BOOL
+_UsnpLoadTreeSnapshot (
+    __in PUSN_RESOLVER pResolver,
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out USN* pValidUsn )
+{
+    PUSN_TREE pTree;
+    PUSN_TREE_SNAPSHOT pHeader;
+    USN_MAPPING Mapping = {0};
+    uint64_t entries;
+    uint64_t names;
+    uint64_t interned;
+
+    if((pResolver == NULL) || (pResolver->Lookup != _UsnpTreeLookup) || (filename == NULL) || (pJournalData == NULL) || (pValidUsn == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pTree = (PUSN_TREE)pResolver->Context;
+
+    if( _UsnpMapFile(filename, TRUE, &Mapping) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    pHeader = (PUSN_TREE_SNAPSHOT)Mapping.Base;
+    if((Mapping.Size < sizeof(USN_TREE_SNAPSHOT)) ||
+       (pHeader->Signature != _USN_SNAPSHOT_SIGNATURE) ||
+       (pHeader->Version != _USN_SNAPSHOT_VERSION) ||
+       (pHeader->HeaderSize != sizeof(USN_TREE_SNAPSHOT)) ||
+       (pHeader->Capacity == 0) || ((pHeader->Capacity & (pHeader->Capacity - 1)) != 0) ||
+       (pHeader->InternedCapacity == 0) || ((pHeader->InternedCapacity & (pHeader->InternedCapacity - 1)) != 0) ||
+       (pHeader->Count >= pHeader->Capacity) || (pHeader->InternedCount >= pHeader->InternedCapacity))
+    {
+        _UsnpUnmapFile(&Mapping);
+        SetLastError(ERROR_BAD_FORMAT);
+        return FALSE;
+    }
+
+    entries  = (uint64_t)pHeader->Capacity * sizeof(USN_TREE_ENTRY);
+    names    = (uint64_t)pHeader->NamesLength * sizeof(WCHAR);
+    interned = (uint64_t)pHeader->InternedCapacity * sizeof(DWORD);
+    if((pHeader->EntriesOffset > Mapping.Size) || (entries > (Mapping.Size - pHeader->EntriesOffset)) ||
+       (pHeader->NamesOffset > Mapping.Size) || (names > (Mapping.Size - pHeader->NamesOffset)) ||
+       (pHeader->InternedOffset > Mapping.Size) || (interned > (Mapping.Size - pHeader->InternedOffset)) ||
+       ((pHeader->EntriesOffset | pHeader->NamesOffset | pHeader->InternedOffset) & (sizeof(DWORD) - 1)))
+    {
+        _UsnpUnmapFile(&Mapping);
+        SetLastError(ERROR_BAD_FORMAT);
+        return FALSE;
+    }
+
+    if(pHeader->UsnJournalID != pJournalData->UsnJournalID)
+    {
+        /*++ the journal was deleted and recreated since ... */
+        _UsnpUnmapFile(&Mapping);
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    if((pHeader->ValidUsn < pJournalData->LowestValidUsn) || (pHeader->ValidUsn > pJournalData->NextUsn))
+    {
+        /*++ the tail has wrapped away ... */
+        _UsnpUnmapFile(&Mapping);
+        SetLastError(ERROR_JOURNAL_ENTRY_DELETED);
+        return FALSE;
+    }
+
+    /*++ drop the empty tables and use the mapping's ... */
+    _UsnpFree(pTree->Entries);
+    _UsnpFree(pTree->Names);
+    _UsnpFree(pTree->Interned);
+
+    pTree->Entries          = (PUSN_TREE_ENTRY)(Mapping.Base + pHeader->EntriesOffset);
+    pTree->Capacity         = pHeader->Capacity;
+    pTree->Count            = pHeader->Count;
+    pTree->Names            = (WCHAR*)(Mapping.Base + pHeader->NamesOffset);
+    pTree->NamesLength      = pHeader->NamesLength;
+    pTree->NamesCapacity    = pHeader->NamesLength;
+    pTree->Interned         = (DWORD*)(Mapping.Base + pHeader->InternedOffset);
+    pTree->InternedCapacity = pHeader->InternedCapacity;
+    pTree->InternedCount    = pHeader->InternedCount;
+    pTree->Snapshot         = Mapping;
+
+    *pValidUsn = pHeader->ValidUsn;
+    return TRUE;
+}
+
+/*++
+ * write the tree out to filename. the caller renames it into place once
+ * the tree is closed; a mapped file cannot be replaced on windows ...
+ */
+BOOL
+_UsnpSaveTreeSnapshot (
+    __in PUSN_RESOLVER pResolver,
+    __in wchar_t* filename,
+    __in DWORDLONG UsnJournalID,
+    __in USN ValidUsn )
+{
+    PUSN_TREE pTree;
+    USN_TREE_SNAPSHOT Header = {0};
+    FILE* fp;
+    BOOL status;
+
+    if((pResolver == NULL) || (pResolver->Lookup != _UsnpTreeLookup) || (filename == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pTree = (PUSN_TREE)pResolver->Context;
+
+    Header.Signature        = _USN_SNAPSHOT_SIGNATURE;
+    Header.Version          = _USN_SNAPSHOT_VERSION;
+    Header.HeaderSize       = sizeof(USN_TREE_SNAPSHOT);
+    Header.UsnJournalID     = UsnJournalID;
+    Header.ValidUsn         = ValidUsn;
+    Header.Capacity         = pTree->Capacity;
+    Header.Count            = pTree->Count;
+    Header.NamesLength      = pTree->NamesLength;
+    Header.InternedCapacity = pTree->InternedCapacity;
+    Header.InternedCount    = pTree->InternedCount;
+    Header.EntriesOffset    = USN_PAGE_SIZE;
+    Header.NamesOffset      = Header.EntriesOffset + (((uint64_t)pTree->Capacity * sizeof(USN_TREE_ENTRY) + USN_PAGE_SIZE - 1) & ~(uint64_t)(USN_PAGE_SIZE - 1));
+    Header.InternedOffset   = Header.NamesOffset + (((uint64_t)pTree->NamesLength * sizeof(WCHAR) + USN_PAGE_SIZE - 1) & ~(uint64_t)(USN_PAGE_SIZE - 1));
+
+    fp = _UsnpOpenStream(filename, L"wb");
+    if(fp == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    status = (fwrite(&Header, sizeof(Header), 1, fp) == 1) &&
+             _UsnpWritePadding(fp, Header.EntriesOffset) &&
+             (fwrite(pTree->Entries, sizeof(USN_TREE_ENTRY), pTree->Capacity, fp) == pTree->Capacity) &&
+             _UsnpWritePadding(fp, Header.NamesOffset) &&
+             (fwrite(pTree->Names, sizeof(WCHAR), pTree->NamesLength, fp) == pTree->NamesLength) &&
+             _UsnpWritePadding(fp, Header.InternedOffset) &&
+             (fwrite(pTree->Interned, sizeof(DWORD), pTree->InternedCapacity, fp) == pTree->InternedCapacity);
+
+    if(fclose(fp) != 0)
+    {
+        status = FALSE;
+    }
+    if(status == FALSE)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+    }
+    return status;
+}
+
+/*++ zeroes up to offset ... */
+BOOL
+_UsnpWritePadding (
+    __in FILE* fp,
+    __in uint64_t offset )
+{
+    static const uint8_t zero[USN_PAGE_SIZE] = {0};
+    int64_t position = _ftelli64(fp);
+
+    if((position < 0) || ((uint64_t)position > offset))
+    {
+        return FALSE;
+    }
+    while((uint64_t)position < offset)
+    {
+        size_t bytes = (size_t)(((offset - position) < sizeof(zero)) ? (offset - position) : sizeof(zero));
+        if(fwrite(zero, 1, bytes, fp) != bytes)
+        {
+            return FALSE;
+        }
+        position += bytes;
+    }
+    return TRUE;
+}
+
+/*++ TRUE when p points into the mapping ... */
+BOOL
+_UsnpIsMapped (
+    __in PUSN_MAPPING pMapping,
+    __in void* p )
+{
+    return (pMapping->Base != NULL) && ((uint8_t*)p >= pMapping->Base) && ((uint8_t*)p < (pMapping->Base + pMapping->Size));
+}
+
+/*++ rename over an existing file, as near atomically as the os allows ... */
+BOOL
+_UsnpReplaceFile (
+    __in wchar_t* from,
+    __in wchar_t* to )
+{
+    if((from == NULL) || (to == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+#if defined(_WIN32)
+    return MoveFileExW(from, to, (MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+#else
+    {
+        char path[4096];
+        char other[4096];
+
+        if((_UsnpNarrowPath(from, path, sizeof(path)) == FALSE) || (_UsnpNarrowPath(to, other, sizeof(other)) == FALSE))
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        if(rename(path, other) != 0)
+        {
+            SetLastError(_UsnpErrnoToError(errno));
+            return FALSE;
+        }
+        return TRUE;
+    }
+#endif  /* _WIN32 */
+}
+
+/*++
+ * the usn a -checkpoint file says to resume from. anything that does not
+ * hold up, a missing or torn file, a recreated journal, or a usn the
+ * journal has wrapped past, reads as 0 and the whole journal is read ...
+ */
+BOOL
+_UsnpLoadCheckpoint (
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out USN* pStartUsn )
+{
+    USN_CHECKPOINT Checkpoint = {0};
+    FILE* fp;
+    size_t count;
+
+    if((filename == NULL) || (pJournalData == NULL) || (pStartUsn == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    *pStartUsn = 0;
+
+    fp = _UsnpOpenStream(filename, L"rb");
+    if(fp == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    count = fread(&Checkpoint, sizeof(Checkpoint), 1, fp);
+    fclose(fp);
+
+    if((count != 1) || (Checkpoint.Signature != _USN_CHECKPOINT_SIGNATURE) || (Checkpoint.Version != _USN_CHECKPOINT_VERSION))
+    {
+        SetLastError(ERROR_BAD_FORMAT);
+        return FALSE;
+    }
+    if(Checkpoint.UsnJournalID != pJournalData->UsnJournalID)
+    {
+        /*++ the journal was deleted and recreated since ... */
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    if((Checkpoint.NextUsn < pJournalData->LowestValidUsn) || (Checkpoint.NextUsn > pJournalData->NextUsn))
+    {
+        /*++ changes since have wrapped away; they are lost ... */
+        SetLastError(ERROR_JOURNAL_ENTRY_DELETED);
+        return FALSE;
+    }
+
+    *pStartUsn = Checkpoint.NextUsn;
+    return TRUE;
+}
+
+/*++
+ * record where to resume. the file is written beside the old one, flushed
+ * to disk and renamed over it, so a crash leaves one or the other whole ...
+ */
+BOOL
+_UsnpSaveCheckpoint (
+    __in wchar_t* filename,
+    __in DWORDLONG UsnJournalID,
+    __in USN NextUsn )
+{
+    USN_CHECKPOINT Checkpoint = {0};
+    wchar_t temp[MAX_PATH] = {0};
+    FILE* fp;
+    BOOL status;
+
+    if(filename == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    Checkpoint.Signature    = _USN_CHECKPOINT_SIGNATURE;
+    Checkpoint.Version      = _USN_CHECKPOINT_VERSION;
+    Checkpoint.UsnJournalID = UsnJournalID;
+    Checkpoint.NextUsn      = NextUsn;
+
+    _snwprintf_s(temp, _countof(temp), _countof(temp), L"%ls.tmp", filename);
+
+    fp = _UsnpOpenStream(temp, L"wb");
+    if(fp == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    status = (fwrite(&Checkpoint, sizeof(Checkpoint), 1, fp) == 1) && _UsnpFlushStream(fp);
+    if(fclose(fp) != 0)
+    {
+        status = FALSE;
+    }
+    if(status == FALSE)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+    return _UsnpReplaceFile(temp, filename);
+}
+
+/*++ write a stream through to the disk ... */
+BOOL
+_UsnpFlushStream (
+    __in FILE* fp )
+{
+    if(fflush(fp) != 0)
+    {
+        return FALSE;
+    }
+#if defined(_WIN32)
+    return (_commit(_fileno(fp)) == 0);
+#else
+    return (fsync(fileno(fp)) == 0);
+#endif  /* _WIN32 */
+}
+
+/*++
+ * nt timestamps are 100-nanosecond intervals since 1601-01-01. the text is
+ * worked out by _UsnpPutTimestamp, in the -time format, with no calls into
+ * the c-runtime or win32 ...
+ */
+BOOL
+_UsnpFormatTimestamp (
+    __in LARGE_INTEGER* pTimeStamp,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    uint8_t text[40];
+    size_t length;
+
+    if((pTimeStamp == NULL) || (buffer == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    length = _UsnpPutTimestamp(text, pTimeStamp->QuadPart, g_timeformat);
+    if(length == 0)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    if(length >= cchbuffer)
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+
+    /*++ the text is all ascii ... */
+    for(size_t index=0; index<length; index++)
+    {
+        buffer[index] = (wchar_t)text[index];
+    }
+    buffer[length] = L'\0';
+    return TRUE;
+}
+
+/*++
+ * sixteen bytes a line, each line built in place in the output buffer ...
+ */
+BOOL
+_UsnpDump (
+    __in_ecount(buffersize) uint8_t* buffer,
+    __in int buffersize )
+{
+    PUSN_OUTPUT pOut = _UsnpGetOutput();
+
+    if(buffer == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    _USN_EMIT(pOut, "DUMP ");
+    _UsnpEmitDecimal(pOut, (uint64_t)buffersize, 1);
+    _USN_EMIT(pOut, " BYTES AT =A'");
+    _UsnpEmitHex(pOut, (uintptr_t)buffer, sizeof(void*) * 2);
+    _USN_EMIT(pOut, "\nADDRESS   OFFSET     0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F | 0123456789ABCDEF |\n");
+
+    for(int index=0; index<buffersize; index += 16)
+    {
+        uint8_t* p = _UsnpReserveOutput(pOut, 128);
+        if(p == NULL)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+
+        p = _UsnpPutHex(p, (uintptr_t)(buffer + index), sizeof(void*) * 2);
+        *p++ = ' ';
+        *p++ = ' ';
+        p = _UsnpPutHex(p, (uint32_t)index, 8);
+        *p++ = ' ';
+        *p++ = ' ';
+
+        for(int jndex=0; jndex<16; jndex++)
+        {
+            if((index + jndex) < buffersize)
+            {
+                p = _UsnpPutHex(p, buffer[(index + jndex)], 2);
+            }
+            else
+            {
+                *p++ = ' ';
+                *p++ = ' ';
+            }
+            *p++ = ' ';
+        }
+
+        *p++ = '|';
+        *p++ = ' ';
+        for(int kndex=0; kndex<16; kndex++ )
+        {
+            if((index + kndex) < buffersize)
+            {
+                uint8_t ch = buffer[(index + kndex)];
+                *p++ = (((ch < 0x20) || (ch > 0x7F)) ? '.' : ch);
+            }
+            else
+            {
+                *p++ = ' ';
+            }
+        }
+        *p++ = ' ';
+        *p++ = '|';
+        *p++ = '\n';
+
+        pOut->Length = (size_t)(p - pOut->Buffer);
+    }
+    return TRUE;
+}
+
+/*++
+ */
+int
+__wtoi (
+    __in const wchar_t* str )
+{
+    int n = 0;
+    int signum = 0;
+    for(;; str++)
+    {
+        switch(*str)
+        {
+        case L' ':
+        case L'\t': continue;
+        case L'-':  signum++;
+        case L'+':  str++;
+        }
+        break;
+    }
+    while((*str >= L'0') && (*str <= L'9'))
+    {
+        n = n * 10 + *str++ - L'0';
+    }
+    return ((signum != 0) ? -n : n);
+}
+
+/*++
+ */
+int64_t
+__wtoi64 (
+    __in const wchar_t* str )
+{
+    int64_t n = 0;
+    int signum = 0;
+    for(;; str++)
+    {
+        switch(*str)
+        {
+        case L' ':
+        case L'\t': continue;
+        case L'-':  signum++;  /* fall through */
+        case L'+':  str++;
+        }
+        break;
+    }
+    while((*str >= L'0') && (*str <= L'9'))
+    {
+        n = n * 10 + *str++ - L'0';
+    }
+    return ((signum != 0) ? -n : n);
+}
+
+/*++
+ */
+BOOL
+_UsnpVolumeQuery (
+    __in PUSN_SOURCE pSource,
+    __out PUSN_JOURNAL_DATA pJournalData )
+{
+#if defined(_WIN32)
+    DWORD bytes = 0;
+
+    /*++
+     * this code expects to build against _NTDDI_WIN8 and above because there
+     * are three versions of USN_JOURNAL_DATA,
+     * 
+     *   USN_JOURNAL_DATA_V0
+     *   USN_JOURNAL_DATA_V1
+     *   USN_JOURNAL_DATA_V2
+     * 
+     * the V1 and V2 structures both contain supported usn versions,
+     * 
+     *   MinSupportedMajorVersion
+     *   MaxSupportedMajorVersion
+     *
+     * these values are needed when getting the usn records.
+     */
+
+    return DeviceIoControl(
+     pSource->Volume,
+     FSCTL_QUERY_USN_JOURNAL,
+     NULL,
+     0,
+     pJournalData,
+     sizeof(USN_JOURNAL_DATA),
+     &bytes,
+     NULL
+     );
+#else
+    UNREFERENCED_PARAMETER(pSource);
+    UNREFERENCED_PARAMETER(pJournalData);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++
+ */
+BOOL
+_UsnpVolumeRead (
+    __in PUSN_SOURCE pSource,
+    __in PREAD_USN_JOURNAL_DATA pReadData,
+    __out_bcount(cbbuffer) void* buffer,
+    __in DWORD cbbuffer,
+    __out DWORD* pbytes )
+{
+#if defined(_WIN32)
+    return DeviceIoControl (    
+     pSource->Volume,
+     FSCTL_READ_USN_JOURNAL,
+     pReadData,
+     sizeof(READ_USN_JOURNAL_DATA),
+     buffer,
+     cbbuffer,
+     pbytes,
+     NULL
+     );
+#else
+    UNREFERENCED_PARAMETER(pSource);
+    UNREFERENCED_PARAMETER(pReadData);
+    UNREFERENCED_PARAMETER(buffer);
+    UNREFERENCED_PARAMETER(cbbuffer);
+    UNREFERENCED_PARAMETER(pbytes);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++
+ * start a read on a second handle to the volume, opened for overlapped
+ * i/o the first time; the ioctl comes back at once and the kernel fills
+ * the buffer behind it ...
+ */
+BOOL
+_UsnpVolumeSubmit (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead )
+{
+#if defined(_WIN32)
+    if(pSource->Async == NULL)
+    {
+        HANDLE handle = CreateFileW(
+         pSource->Name,
+         (GENERIC_READ | GENERIC_WRITE),
+         (FILE_SHARE_READ | FILE_SHARE_WRITE),
+         NULL,
+         OPEN_EXISTING,
+         FILE_FLAG_OVERLAPPED,
+         NULL
+         );
+
+        if(handle == INVALID_HANDLE_VALUE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        pSource->Async = handle;
+    }
+
+    if(pRead->Overlapped.hEvent == NULL)
+    {
+        pRead->Overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if(pRead->Overlapped.hEvent == NULL)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+    }
+
+    pRead->Bytes = 0;
+    pRead->Status = ERROR_SUCCESS;
+    pRead->Overlapped.Offset = pRead->Overlapped.OffsetHigh = 0;
+
+    if( DeviceIoControl(
+         pSource->Async,
+         FSCTL_READ_USN_JOURNAL,
+         &(pRead->ReadData),
+         sizeof(READ_USN_JOURNAL_DATA),
+         pRead->Buffer,
+         pRead->Size,
+         NULL,
+         &(pRead->Overlapped)
+         ) == FALSE)
+    {
+        if(GetLastError() != ERROR_IO_PENDING)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+    }
+    return TRUE;
+#else
+    UNREFERENCED_PARAMETER(pSource);
+    UNREFERENCED_PARAMETER(pRead);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++
+ */
+BOOL
+_UsnpVolumeComplete (
+    __in PUSN_SOURCE pSource,
+    __inout PUSN_READ pRead )
+{
+#if defined(_WIN32)
+    return GetOverlappedResult(pSource->Async, &(pRead->Overlapped), &(pRead->Bytes), TRUE);
+#else
+    UNREFERENCED_PARAMETER(pSource);
+    UNREFERENCED_PARAMETER(pRead);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++
+ */
+void
+_UsnpVolumeClose (
+    __in PUSN_SOURCE pSource )
+{
+#if defined(_WIN32)
+    if((pSource->Volume != NULL) && (pSource->Volume != INVALID_HANDLE_VALUE))
+    {
+        CloseHandle(pSource->Volume);
+    }
+    if(pSource->Async != NULL)
+    {
+        CloseHandle(pSource->Async);
+    }
+#endif  /* _WIN32 */
+    pSource->Volume = NULL;
+    pSource->Async = NULL;
+}
+
+/*++
+ */
+BOOL
+_UsnpOpenVolumeSource (
+    __in wchar_t* pathname,
+    __out PUSN_SOURCE pSource )
+{
+    if((pathname == NULL) || (pSource == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pSource, sizeof(USN_SOURCE));
+    _snwprintf_s(pSource->Name, _countof(pSource->Name), _countof(pSource->Name), L"\\\\.\\%lc:", (wint_t)*pathname);
+
+#if defined(_WIN32)
+    pSource->Volume = CreateFileW(
+     pSource->Name,
+     (GENERIC_READ | GENERIC_WRITE),
+     (FILE_SHARE_READ | FILE_SHARE_WRITE),
+     NULL,
+     OPEN_EXISTING,
+     0,
+     NULL
+     );
+
+    if(pSource->Volume == INVALID_HANDLE_VALUE)
+    {
+        /*++ last error set by call ... */
+        pSource->Volume = NULL;
+        return FALSE;
+    }
+
+    pSource->Query    = _UsnpVolumeQuery;
+    pSource->Read     = _UsnpVolumeRead;
+    pSource->Close    = _UsnpVolumeClose;
+    pSource->Submit   = _UsnpVolumeSubmit;
+    pSource->Complete = _UsnpVolumeComplete;
+    return TRUE;
+#else
+    /*++ there are no volume journals to read here; use -replay ... */
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif  /* _WIN32 */
+}
+
+/*++
+ */
+BOOL
+_UsnpReplayQuery (
+    __in PUSN_SOURCE pSource,
+    __out PUSN_JOURNAL_DATA pJournalData )
+{
+    PUSN_REPLAY pReplay = (PUSN_REPLAY)pSource->Context;
+
+    RtlMoveMemory(pJournalData, &(pReplay->Header.JournalData), sizeof(USN_JOURNAL_DATA));
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpReplayLoad (
+    __in PUSN_REPLAY pReplay,
+    __in size_t index )
+{
+    PUSN_REPLAY_CHUNK pChunk = &(pReplay->Chunks[index]);
+
+    if(pReplay->Loaded == index)
+    {
+        return TRUE;
+    }
+
+    if(pChunk->Length > pReplay->BufferSize)
+    {
+        uint8_t* buffer = (uint8_t*)_UsnpAlloc(pChunk->Length);
+        if(buffer == NULL)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        _UsnpFree(pReplay->Buffer);
+        pReplay->Buffer = buffer;
+        pReplay->BufferSize = pChunk->Length;
+    }
+
+    if( (_fseeki64(pReplay->fp, pChunk->Offset, SEEK_SET) != 0) ||
+        (fread(pReplay->Buffer, 1, pChunk->Length, pReplay->fp) != pChunk->Length))
+    {
+        pReplay->Loaded = pReplay->ChunkCount;
+        SetLastError(ERROR_READ_FAULT);
+        return FALSE;
+    }
+
+    pReplay->Loaded = index;
+    return TRUE;
+}
+
+/*++
+ * the replay answers a read the way the ioctl does; records at or past the
+ * start usn that match the reason mask and version range are packed into
+ * the caller's buffer behind the usn to ask for next. captured chunks need
+ * not match the caller's buffer size ...
+ */
+BOOL
+_UsnpReplayRead (
+    __in PUSN_SOURCE pSource,
+    __in PREAD_USN_JOURNAL_DATA pReadData,
+    __out_bcount(cbbuffer) void* buffer,
+    __in DWORD cbbuffer,
+    __out DWORD* pbytes )
+{
+    PUSN_REPLAY pReplay = (PUSN_REPLAY)pSource->Context;
+    DWORD used = sizeof(USN);
+    USN next = pReadData->StartUsn;
+    size_t lo = 0;
+    size_t hi = pReplay->ChunkCount;
+
+    if((buffer == NULL) || (pbytes == NULL) || (cbbuffer < sizeof(USN)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++ first chunk holding anything at or past the start usn ... */
+    while(lo < hi)
+    {
+        size_t mid = lo + ((hi - lo) / 2);
+        if(pReplay->Chunks[mid].NextUsn > pReadData->StartUsn)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    for(; lo < pReplay->ChunkCount; lo++)
+    {
+        PUSN_REPLAY_CHUNK pChunk = &(pReplay->Chunks[lo]);
+        DWORD offset = sizeof(USN);
+
+        if( _UsnpReplayLoad(pReplay, lo) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+
+        while(offset < pChunk->Length)
+        {
+            PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(pReplay->Buffer + offset);
+
+            if((pRecord->RecordLength < sizeof(USN_RECORD_COMMON_HEADER)) || (pRecord->RecordLength > (pChunk->Length - offset)))
+            {
+                SetLastError(ERROR_INVALID_DATA);
+                return FALSE;
+            }
+
+            if( _UsnpIsRecordRequested(pRecord, pReadData))
+            {
+                if((used + pRecord->RecordLength) > cbbuffer)
+                {
+                    if(used == sizeof(USN))
+                    {
+                        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                        return FALSE;
+                    }
+                    next = _UsnpGetRecordUsn(pRecord);
+                    goto done;
+                }
+                RtlMoveMemory(((uint8_t*)buffer) + used, pRecord, pRecord->RecordLength);
+                used += pRecord->RecordLength;
+            }
+            offset += pRecord->RecordLength;
+        }
+
+        if(pChunk->NextUsn > next)
+        {
+            next = pChunk->NextUsn;
+        }
+
+        if(used > sizeof(USN))
+        {
+            break;
+        }
+    }
+
+done:
+    RtlMoveMemory(buffer, &next, sizeof(USN));
+    *pbytes = used;
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpReplayClose (
+    __in PUSN_SOURCE pSource )
+{
+    PUSN_REPLAY pReplay = (PUSN_REPLAY)pSource->Context;
+
+    if(pReplay != NULL)
+    {
+        if(pReplay->fp != NULL)
+        {
+            fclose(pReplay->fp);
+        }
+        _UsnpFree(pReplay->Chunks);
+        _UsnpFree(pReplay->Buffer);
+        _UsnpFree(pReplay);
+    }
+    pSource->Context = NULL;
+}
+
+/*++
+ */
+BOOL
+_UsnpOpenReplaySource (
+    __in wchar_t* filename,
+    __out PUSN_SOURCE pSource )
+{
+    PUSN_REPLAY pReplay = NULL;
+    size_t capacity = 0;
+    LONGLONG offset;
+
+    if((filename == NULL) || (pSource == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pSource, sizeof(USN_SOURCE));
+    _snwprintf_s(pSource->Name, _countof(pSource->Name), _countof(pSource->Name), L"%ls", filename);
+    pSource->Query = _UsnpReplayQuery;
+    pSource->Read  = _UsnpReplayRead;
+    pSource->Close = _UsnpReplayClose;
+
+    pReplay = (PUSN_REPLAY)_UsnpAlloc(sizeof(USN_REPLAY));
+    if(pReplay == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pSource->Context = pReplay;
+
+    pReplay->fp = _UsnpOpenStream(filename, L"rb");
+    if(pReplay->fp == NULL)
+    {
+        /*++ last error set by call ... */
+        _UsnpReplayClose(pSource);
+        return FALSE;
+    }
+
+    if( (fread(&(pReplay->Header), sizeof(USN_REPLAY_HEADER), 1, pReplay->fp) != 1) ||
+        (pReplay->Header.Signature != _USN_REPLAY_SIGNATURE) ||
+        (pReplay->Header.Version != _USN_REPLAY_VERSION) ||
+        (pReplay->Header.HeaderSize != sizeof(USN_REPLAY_HEADER)))
+    {
+        _UsnpReplayClose(pSource);
+        SetLastError(ERROR_BAD_FORMAT);
+        return FALSE;
+    }
+
+    /*++
+     * index the chunks up front; the leading usn of each and the usn of its
+     * first record are enough to find where any start usn lands ...
+     */
+    offset = sizeof(USN_REPLAY_HEADER);
+    while(1)
+    {
+        DWORD length = 0;
+        uint8_t head[sizeof(USN) + sizeof(USN_RECORD_V3)] = {0};
+        size_t cbhead;
+        PUSN_REPLAY_CHUNK pChunk;
+
+        if(fread(&length, sizeof(DWORD), 1, pReplay->fp) != 1)
+        {
+            break;
+        }
+        offset += sizeof(DWORD);
+
+        if(length < sizeof(USN))
+        {
+            _UsnpReplayClose(pSource);
+            SetLastError(ERROR_BAD_FORMAT);
+            return FALSE;
+        }
+
+        cbhead = ((length < sizeof(head)) ? length : sizeof(head));
+        if(fread(head, 1, cbhead, pReplay->fp) != cbhead)
+        {
+            _UsnpReplayClose(pSource);
+            SetLastError(ERROR_BAD_FORMAT);
+            return FALSE;
+        }
+
+        if(pReplay->ChunkCount == capacity)
+        {
+            PUSN_REPLAY_CHUNK chunks;
+            capacity = ((capacity == 0) ? 256 : (capacity * 2));
+            chunks = (PUSN_REPLAY_CHUNK)realloc(pReplay->Chunks, capacity * sizeof(USN_REPLAY_CHUNK));
+            if(chunks == NULL)
+            {
+                _UsnpReplayClose(pSource);
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+            }
+            pReplay->Chunks = chunks;
+        }
+
+        pChunk = &(pReplay->Chunks[pReplay->ChunkCount++]);
+        pChunk->Offset = offset;
+        pChunk->Length = length;
+        RtlMoveMemory(&(pChunk->NextUsn), head, sizeof(USN));
+        pChunk->FirstUsn = pChunk->NextUsn;
+        if(cbhead >= (sizeof(USN) + sizeof(USN_RECORD_V2)))
+        {
+            pChunk->FirstUsn = _UsnpGetRecordUsn((PUSN_RECORD_COMMON_HEADER)(head + sizeof(USN)));
+        }
+
+        offset += length;
+        if(_fseeki64(pReplay->fp, offset, SEEK_SET) != 0)
+        {
+            _UsnpReplayClose(pSource);
+            SetLastError(ERROR_READ_FAULT);
+            return FALSE;
+        }
+    }
+
+    pReplay->Loaded = pReplay->ChunkCount;
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpCreateReplayFile (
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out FILE** pfp )
+{
+    USN_REPLAY_HEADER Header = {0};
+    FILE* fp;
+
+    if((filename == NULL) || (pJournalData == NULL) || (pfp == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    fp = _UsnpOpenStream(filename, L"wb");
+    if(fp == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    Header.Signature  = _USN_REPLAY_SIGNATURE;
+    Header.Version    = _USN_REPLAY_VERSION;
+    Header.HeaderSize = sizeof(USN_REPLAY_HEADER);
+    RtlMoveMemory(&(Header.JournalData), pJournalData, sizeof(USN_JOURNAL_DATA));
+
+    if(fwrite(&Header, sizeof(Header), 1, fp) != 1)
+    {
+        fclose(fp);
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+
+    *pfp = fp;
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpWriteReplayChunk (
+    __in FILE* fp,
+    __in_bcount(bytes) void* buffer,
+    __in DWORD bytes )
+{
+    if((fp == NULL) || (buffer == NULL) || (bytes < sizeof(USN)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if( (fwrite(&bytes, sizeof(DWORD), 1, fp) != 1) ||
+        (fwrite(buffer, 1, bytes, fp) != bytes))
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ * close a replay file; journal data, if given, replaces what the header was
+ * created with (the synthetic writer only knows NextUsn at the end) ...
+ */
+BOOL
+_UsnpCloseReplayFile (
+    __in FILE* fp,
+    __in_opt PUSN_JOURNAL_DATA pJournalData )
+{
+    BOOL status = TRUE;
+
+    if(fp == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if(pJournalData != NULL)
+    {
+        if( (_fseeki64(fp, (LONGLONG)offsetof(USN_REPLAY_HEADER, JournalData), SEEK_SET) != 0) ||
+            (fwrite(pJournalData, sizeof(USN_JOURNAL_DATA), 1, fp) != 1))
+        {
+            status = FALSE;
+        }
+    }
+
+    if(fclose(fp) != 0)
+    {
+        status = FALSE;
+    }
+
+    if(status == FALSE)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+    }
+    return status;
+}
+
+/*++ xorshift64*, repeatable across runs and platforms ... */
+uint64_t
+_UsnpSynthRandom (
+    __in PUSN_SYNTH pSynth )
+{
+    pSynth->Seed ^= pSynth->Seed >> 12;
+    pSynth->Seed ^= pSynth->Seed << 25;
+    pSynth->Seed ^= pSynth->Seed >> 27;
+    return pSynth->Seed * 0x2545F4914F6CDD1DULL;
+}
+
+/*++
+ * synthetic names; a spread of extensions plus the office lock files and
+ * compiler temporaries seen on real build servers. directory names have
+ * the high bit set in their id ...
+ */
+int
+_UsnpSynthName (
+    __in DWORD id,
+    __out_ecount(cchbuffer) char* buffer,
+    __in size_t cchbuffer )
+{
+    static const char* extensions[] = {
+        ".txt", ".dll", ".config", ".log", ".tmp", ".exe", ".json", ".obj",
+        ".pdb", ".cs", ".h", ".c", ".xml", ".dat", ".ini", ".docx"
+    };
+
+    if(id & 0x80000000)
+    {
+        return snprintf(buffer, cchbuffer, "dir%u", (unsigned)(id & 0x7FFFFFFF));
+    }
+    if((id % 23) == 0)
+    {
+        return snprintf(buffer, cchbuffer, "~$report%u.docx", (unsigned)id);
+    }
+    return snprintf(buffer, cchbuffer, "file%u%s", (unsigned)id, extensions[(id / 3) % _countof(extensions)]);
+}
+
+/*++
+ */
+BOOL
+_UsnpSynthEmit (
+    __in PUSN_SYNTH pSynth,
+    __in uint64_t frn,
+    __in uint64_t parent,
+    __in DWORD reason,
+    __in DWORD attributes,
+    __in const char* name )
+{
+    uint64_t storage[(sizeof(USN_RECORD_V3) + (256 * sizeof(WCHAR))) / sizeof(uint64_t)] = {0};
+    USN_RECORD_V3* pRecord = (USN_RECORD_V3*)storage;
+    ULARGE_INTEGER128 st_fid = {0};
+    WCHAR* filename;
+    size_t cchname = strlen(name);
+    DWORD length;
+
+    if(cchname > 255)
+    {
+        cchname = 255;
+    }
+
+    length = (DWORD)((offsetof(USN_RECORD_V3, FileName) + (cchname * sizeof(WCHAR)) + 7) & ~(size_t)7);
+
+    /*++ records never straddle a page; the rest of a page is zero fill ... */
+    if(((pSynth->Usn % USN_PAGE_SIZE) + length) > USN_PAGE_SIZE)
+    {
+        pSynth->Usn = (pSynth->Usn + USN_PAGE_SIZE) & ~(USN)(USN_PAGE_SIZE - 1);
+    }
+
+    pRecord->RecordLength   = length;
+    pRecord->MajorVersion   = 3;
+    pRecord->MinorVersion   = 0;
+    st_fid.LowPart = frn;
+    RtlMoveMemory(&(pRecord->FileReferenceNumber), &st_fid, sizeof(FILE_ID_128));
+    st_fid.LowPart = parent;
+    RtlMoveMemory(&(pRecord->ParentFileReferenceNumber), &st_fid, sizeof(FILE_ID_128));
+    pRecord->Usn            = pSynth->Usn;
+    pRecord->TimeStamp.QuadPart = pSynth->TimeStamp;
+    pRecord->Reason         = reason;
+    pRecord->FileAttributes = attributes;
+    pRecord->FileNameLength = (WORD)(cchname * sizeof(WCHAR));
+    pRecord->FileNameOffset = (WORD)offsetof(USN_RECORD_V3, FileName);
+
+    filename = (WCHAR*)((uint8_t*)pRecord + pRecord->FileNameOffset);
+    for(size_t index=0; index<cchname; index++)
+    {
+        filename[index] = (WCHAR)(uint8_t)name[index];
+    }
+
+    pSynth->Usn += length;
+    pSynth->TimeStamp += (LONGLONG)(_UsnpSynthRandom(pSynth) % 1000);
+
+    return pSynth->Sink(pSynth->Context, pRecord);
+}
+
+/*++
+ * generate count records (give or take the tail of one operation) of the
+ * kind a busy volume produces: a directory tree, then creates, writes,
+ * renames and deletes, each operation ending with a close ...
+ */
+BOOL
+_UsnpSynthesize (
+    __in PUSN_SYNTH pSynth,
+    __in uint64_t count )
+{
+    uint64_t emitted = 0;
+    DWORD directories;
+    char name[64];
+    char other[64];
+    BOOL status = TRUE;
+
+    if((pSynth == NULL) || (pSynth->Sink == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if(pSynth->Seed == 0)
+    {
+        pSynth->Seed = 0x9E3779B97F4A7C15ULL;
+    }
+    if(pSynth->TimeStamp == 0)
+    {
+        /*++ 2020-06-06 23:50:43, from the readme's example record ... */
+        pSynth->TimeStamp = 0x01D63C5D4ABBA32BLL;
+    }
+    if(pSynth->NextIndex == 0)
+    {
+        pSynth->NextIndex = 0x10000;
+    }
+    if(pSynth->FileLimit == 0)
+    {
+        pSynth->FileLimit = 65536;
+    }
+
+    directories = (DWORD)(16 + (count / 512));
+    if(directories > 65536)
+    {
+        directories = 65536;
+    }
+
+    pSynth->Directories = (uint64_t*)_UsnpAlloc(directories * sizeof(uint64_t));
+    pSynth->Files = (PUSN_SYNTH_FILE)_UsnpAlloc(pSynth->FileLimit * sizeof(USN_SYNTH_FILE));
+    if((pSynth->Directories == NULL) || (pSynth->Files == NULL))
+    {
+        _UsnpFree(pSynth->Directories);
+        _UsnpFree(pSynth->Files);
+        pSynth->Directories = NULL;
+        pSynth->Files = NULL;
+        return FALSE;
+    }
+
+    /*++ the tree; the first few directories hang off the root ... */
+    for(DWORD index=0; (index<directories) && (status != FALSE); index++)
+    {
+        uint64_t frn = (1ULL << 48) | pSynth->NextIndex++;
+        uint64_t parent = ((index < 8) ? _USN_ROOT_FRN : pSynth->Directories[_UsnpSynthRandom(pSynth) % index]);
+
+        _UsnpSynthName((0x80000000 | index), name, sizeof(name));
+        status = _UsnpSynthEmit(pSynth, frn, parent, USN_REASON_FILE_CREATE, FILE_ATTRIBUTE_DIRECTORY, name);
+        if(status != FALSE)
+        {
+            status = _UsnpSynthEmit(pSynth, frn, parent, (USN_REASON_FILE_CREATE | USN_REASON_CLOSE), FILE_ATTRIBUTE_DIRECTORY, name);
+        }
+        pSynth->Directories[index] = frn;
+        pSynth->DirectoryCount++;
+        emitted += 2;
+    }
+
+    while((emitted < count) && (status != FALSE))
+    {
+        uint64_t r = _UsnpSynthRandom(pSynth) % 100;
+        PUSN_SYNTH_FILE pFile = NULL;
+
+        pSynth->TimeStamp += (LONGLONG)(_UsnpSynthRandom(pSynth) % 200000);
+
+        if(pSynth->FileCount > 0)
+        {
+            pFile = &(pSynth->Files[_UsnpSynthRandom(pSynth) % pSynth->FileCount]);
+        }
+
+        if((r < 20) || (pFile == NULL))
+        {
+            /*++ create and write a new file ... */
+            uint64_t frn = ((1ULL + (_UsnpSynthRandom(pSynth) % 4)) << 48) | pSynth->NextIndex++;
+            uint64_t parent = pSynth->Directories[_UsnpSynthRandom(pSynth) % pSynth->DirectoryCount];
+            DWORD id = (DWORD)(pSynth->NextIndex & 0x7FFFFFFF);
+
+            _UsnpSynthName(id, name, sizeof(name));
+            status = _UsnpSynthEmit(pSynth, frn, parent, USN_REASON_FILE_CREATE, FILE_ATTRIBUTE_ARCHIVE, name) &&
+                     _UsnpSynthEmit(pSynth, frn, parent, (USN_REASON_FILE_CREATE | USN_REASON_DATA_EXTEND), FILE_ATTRIBUTE_ARCHIVE, name) &&
+                     _UsnpSynthEmit(pSynth, frn, parent, (USN_REASON_FILE_CREATE | USN_REASON_DATA_EXTEND | USN_REASON_CLOSE), FILE_ATTRIBUTE_ARCHIVE, name);
+            emitted += 3;
+
+            if(pSynth->FileCount < pSynth->FileLimit)
+            {
+                pFile = &(pSynth->Files[pSynth->FileCount++]);
+            }
+            else
+            {
+                pFile = &(pSynth->Files[_UsnpSynthRandom(pSynth) % pSynth->FileCount]);
+            }
+            pFile->Frn = frn;
+            pFile->Parent = parent;
+            pFile->Name = id;
+        }
+        else if(r < 45)
+        {
+            /*++ rewrite an existing file ... */
+            _UsnpSynthName(pFile->Name, name, sizeof(name));
+            status = _UsnpSynthEmit(pSynth, pFile->Frn, pFile->Parent, USN_REASON_DATA_OVERWRITE, FILE_ATTRIBUTE_ARCHIVE, name) &&
+                     _UsnpSynthEmit(pSynth, pFile->Frn, pFile->Parent, (USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND), FILE_ATTRIBUTE_ARCHIVE, name) &&
+                     _UsnpSynthEmit(pSynth, pFile->Frn, pFile->Parent, (USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND | USN_REASON_CLOSE), FILE_ATTRIBUTE_ARCHIVE, name);
+            emitted += 3;
+        }
+        else if(r < 65)
+        {
+            /*++ a compiler temporary, created and deleted in one open ... */
+            uint64_t frn = (1ULL << 48) | pSynth->NextIndex++;
+            uint64_t parent = pSynth->Directories[_UsnpSynthRandom(pSynth) % pSynth->DirectoryCount];
+            DWORD attributes = (FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_TEMPORARY);
+
+            snprintf(name, sizeof(name), "_CL_%08x%s", (unsigned)_UsnpSynthRandom(pSynth), (((r & 1) != 0) ? "in" : "ex"));
+            status = _UsnpSynthEmit(pSynth, frn, parent, USN_REASON_FILE_CREATE, attributes, name) &&
+                     _UsnpSynthEmit(pSynth, frn, parent, (USN_REASON_FILE_CREATE | USN_REASON_DATA_EXTEND), attributes, name) &&
+                     _UsnpSynthEmit(pSynth, frn, parent, (USN_REASON_FILE_CREATE | USN_REASON_DATA_EXTEND | USN_REASON_FILE_DELETE | USN_REASON_CLOSE), attributes, name);
+            emitted += 3;
+        }
+        else if(r < 75)
+        {
+            /*++ rename, sometimes into another directory ... */
+            uint64_t parent = pFile->Parent;
+            DWORD id = (DWORD)(pSynth->NextIndex++ & 0x7FFFFFFF);
+
+            if((r & 1) != 0)
+            {
+                parent = pSynth->Directories[_UsnpSynthRandom(pSynth) % pSynth->DirectoryCount];
+            }
+
+            _UsnpSynthName(pFile->Name, name, sizeof(name));
+            _UsnpSynthName(id, other, sizeof(other));
+            status = _UsnpSynthEmit(pSynth, pFile->Frn, pFile->Parent, USN_REASON_RENAME_OLD_NAME, FILE_ATTRIBUTE_ARCHIVE, name) &&
+                     _UsnpSynthEmit(pSynth, pFile->Frn, parent, USN_REASON_RENAME_NEW_NAME, FILE_ATTRIBUTE_ARCHIVE, other) &&
+                     _UsnpSynthEmit(pSynth, pFile->Frn, parent, (USN_REASON_RENAME_NEW_NAME | USN_REASON_CLOSE), FILE_ATTRIBUTE_ARCHIVE, other);
+            emitted += 3;
+            pFile->Parent = parent;
+            pFile->Name = id;
+        }
+        else if(r < 85)
+        {
+            /*++ delete; the slot goes to the last file ... */
+            _UsnpSynthName(pFile->Name, name, sizeof(name));
+            status = _UsnpSynthEmit(pSynth, pFile->Frn, pFile->Parent, (USN_REASON_FILE_DELETE | USN_REASON_CLOSE), FILE_ATTRIBUTE_ARCHIVE, name);
+            emitted += 1;
+            *pFile = pSynth->Files[--pSynth->FileCount];
+        }
+        else
+        {
+            /*++ attribute and security churn ... */
+            DWORD reason = (((r & 1) != 0) ? USN_REASON_BASIC_INFO_CHANGE : USN_REASON_SECURITY_CHANGE);
+
+            _UsnpSynthName(pFile->Name, name, sizeof(name));
+            status = _UsnpSynthEmit(pSynth, pFile->Frn, pFile->Parent, reason, FILE_ATTRIBUTE_ARCHIVE, name) &&
+                     _UsnpSynthEmit(pSynth, pFile->Frn, pFile->Parent, (reason | USN_REASON_CLOSE), FILE_ATTRIBUTE_ARCHIVE, name);
+            emitted += 2;
+        }
+    }
+
+    _UsnpFree(pSynth->Directories);
+    _UsnpFree(pSynth->Files);
+    pSynth->Directories = NULL;
+    pSynth->Files = NULL;
+    pSynth->DirectoryCount = 0;
+    pSynth->FileCount = 0;
+    return status;
+}
+
+/*++ replay sink; packs records into read-sized chunks ... */
+typedef struct _USN_SYNTH_REPLAY
+{
+    FILE* fp;
+    DWORD Used;
+    uint8_t Chunk[_USN_BUFFER_SIZE];
+} USN_SYNTH_REPLAY, *PUSN_SYNTH_REPLAY;
+
+/*++
+ */
+BOOL
+_UsnpSynthReplaySink (
+    __in void* Context,
+    __in USN_RECORD_V3* pRecord )
+{
+    PUSN_SYNTH_REPLAY pReplay = (PUSN_SYNTH_REPLAY)Context;
+
+    if((pReplay->Used + pRecord->RecordLength) > sizeof(pReplay->Chunk))
+    {
+        /*++ the record that did not fit is where the next read starts ... */
+        RtlMoveMemory(pReplay->Chunk, &(pRecord->Usn), sizeof(USN));
+        if( _UsnpWriteReplayChunk(pReplay->fp, pReplay->Chunk, pReplay->Used) == FALSE)
+        {
+            return FALSE;
+        }
+        pReplay->Used = sizeof(USN);
+    }
+
+    RtlMoveMemory(pReplay->Chunk + pReplay->Used, pRecord, pRecord->RecordLength);
+    pReplay->Used += pRecord->RecordLength;
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpSynthesizeReplay (
+    __in wchar_t* filename,
+    __in uint64_t count )
+{
+    USN_SYNTH Synth = {0};
+    USN_JOURNAL_DATA JournalData = {0};
+    PUSN_SYNTH_REPLAY pReplay;
+    BOOL status;
+
+    pReplay = (PUSN_SYNTH_REPLAY)_UsnpAlloc(sizeof(USN_SYNTH_REPLAY));
+    if(pReplay == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pReplay->Used = sizeof(USN);
+
+    JournalData.UsnJournalID             = 0x01D63C5D00000001ULL;
+    JournalData.MaxUsn                   = 0x7FFFFFFFFFFF0000LL;
+    JournalData.MaximumSize              = 0x0000000002000000ULL;
+    JournalData.AllocationDelta          = 0x0000000000800000ULL;
+    JournalData.MinSupportedMajorVersion = 2;
+    JournalData.MaxSupportedMajorVersion = 3;
+
+    if( _UsnpCreateReplayFile(filename, &JournalData, &(pReplay->fp)) == FALSE)
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(pReplay);
+        return FALSE;
+    }
+
+    Synth.Sink = _UsnpSynthReplaySink;
+    Synth.Context = pReplay;
+
+    status = _UsnpSynthesize(&Synth, count);
+    if((status != FALSE) && (pReplay->Used > sizeof(USN)))
+    {
+        RtlMoveMemory(pReplay->Chunk, &(Synth.Usn), sizeof(USN));
+        status = _UsnpWriteReplayChunk(pReplay->fp, pReplay->Chunk, pReplay->Used);
+    }
+
+    JournalData.NextUsn = Synth.Usn;
+    if( _UsnpCloseReplayFile(pReplay->fp, &JournalData) == FALSE)
+    {
+        status = FALSE;
+    }
+
+    _UsnpFree(pReplay);
+    return status;
+}
+
+/*++ $J sink; records land at their usn, the gaps are zero ... */
+typedef struct _USN_SYNTH_STREAM
+{
+    FILE* fp;
+    uint64_t Position;
+} USN_SYNTH_STREAM, *PUSN_SYNTH_STREAM;
+
+/*++
+ */
+BOOL
+_UsnpSynthStreamFill (
+    __in PUSN_SYNTH_STREAM pStream,
+    __in uint64_t Offset )
+{
+    static const uint8_t zeroes[USN_PAGE_SIZE] = {0};
+
+    while(pStream->Position < Offset)
+    {
+        size_t bytes = (size_t)(((Offset - pStream->Position) < sizeof(zeroes)) ? (Offset - pStream->Position) : sizeof(zeroes));
+        if(fwrite(zeroes, 1, bytes, pStream->fp) != bytes)
+        {
+            SetLastError(ERROR_WRITE_FAULT);
+            return FALSE;
+        }
+        pStream->Position += bytes;
+    }
+    return TRUE;
+}
+
+/*++
+ */
+BOOL
+_UsnpSynthStreamSink (
+    __in void* Context,
+    __in USN_RECORD_V3* pRecord )
+{
+    PUSN_SYNTH_STREAM pStream = (PUSN_SYNTH_STREAM)Context;
+
+    if( _UsnpSynthStreamFill(pStream, (uint64_t)pRecord->Usn) == FALSE)
+    {
+        return FALSE;
+    }
+    if(fwrite(pRecord, 1, pRecord->RecordLength, pStream->fp) != pRecord->RecordLength)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+    pStream->Position += pRecord->RecordLength;
+    return TRUE;
+}
+
+/*++
+ * a raw $J stream as pulled off an image; the first records sit well into
+ * the file behind a sparse, zero-reading region ...
+ */
+BOOL
+_UsnpSynthesizeStream (
+    __in wchar_t* filename,
+    __in uint64_t count )
+{
+    USN_SYNTH Synth = {0};
+    USN_SYNTH_STREAM Stream = {0};
+    BOOL status;
+
+    Stream.fp = _UsnpOpenStream(filename, L"wb");
+    if(Stream.fp == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    /*++ seeking past the end leaves a hole where the filesystem allows ... */
+    Synth.Usn = (USN)(32 * 1024 * 1024);
+    Stream.Position = (uint64_t)Synth.Usn;
+    if(_fseeki64(Stream.fp, Synth.Usn, SEEK_SET) != 0)
+    {
+        fclose(Stream.fp);
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+
+    Synth.Sink = _UsnpSynthStreamSink;
+    Synth.Context = &Stream;
+
+    status = _UsnpSynthesize(&Synth, count);
+    if(status != FALSE)
+    {
+        status = _UsnpSynthStreamFill(&Stream, (Stream.Position + USN_PAGE_SIZE - 1) & ~(uint64_t)(USN_PAGE_SIZE - 1));
+    }
+
+    if(fclose(Stream.fp) != 0)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        status = FALSE;
+    }
+    return status;
+}
+
+/*++ memory sink; the live source and the benchmarks work from these ... */
+BOOL
+_UsnpSynthMemorySink (
+    __in void* Context,
+    __in USN_RECORD_V3* pRecord )
+{
+    PUSN_SYNTH_MEMORY pMemory = (PUSN_SYNTH_MEMORY)Context;
+
+    if((pMemory->Length + pRecord->RecordLength) > pMemory->Capacity)
+    {
+        size_t capacity = ((pMemory->Capacity == 0) ? (1024 * 1024) : (pMemory->Capacity * 2));
+        uint8_t* records = (uint8_t*)realloc(pMemory->Records, capacity);
+        if(records == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+        pMemory->Records = records;
+        pMemory->Capacity = capacity;
+    }
+
+    if(pMemory->Count == pMemory->OffsetCapacity)
+    {
+        uint64_t capacity = ((pMemory->OffsetCapacity == 0) ? 4096 : (pMemory->OffsetCapacity * 2));
+        size_t* offsets = (size_t*)realloc(pMemory->Offsets, (size_t)capacity * sizeof(size_t));
+        if(offsets == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+        pMemory->Offsets = offsets;
+        pMemory->OffsetCapacity = capacity;
+    }
+
+    RtlMoveMemory(pMemory->Records + pMemory->Length, pRecord, pRecord->RecordLength);
+    pMemory->Offsets[pMemory->Count++] = pMemory->Length;
+    pMemory->Length += pRecord->RecordLength;
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpFreeSynthMemory (
+    __inout PUSN_SYNTH_MEMORY pMemory )
+{
+    _UsnpFree(pMemory->Records);
+    _UsnpFree(pMemory->Offsets);
+    RtlZeroMemory(pMemory, sizeof(USN_SYNTH_MEMORY));
+}
+
+/*++ records out so far; record i comes out (i + 1) / Rate seconds after open ... */
+uint64_t
+_UsnpLiveReleased (
+    __in PUSN_LIVE pLive )
+{
+    uint64_t released = ((_UsnpQueryClock() - pLive->Start) * pLive->Rate) / 1000000ULL;
+
+    return ((released < pLive->Memory.Count) ? released : pLive->Memory.Count);
+}
+
+/*++ usn of record index, or the usn past the last record ... */
+USN
+_UsnpLiveUsn (
+    __in PUSN_LIVE pLive,
+    __in uint64_t index )
+{
+    if(index >= pLive->Memory.Count)
+    {
+        return pLive->EndUsn;
+    }
+    return ((USN_RECORD_V3*)(pLive->Memory.Records + pLive->Memory.Offsets[index]))->Usn;
+}
+
+/*++
+ */
+BOOL
+_UsnpLiveQuery (
+    __in PUSN_SOURCE pSource,
+    __out PUSN_JOURNAL_DATA pJournalData )
+{
+    PUSN_LIVE pLive = (PUSN_LIVE)pSource->Context;
+
+    RtlZeroMemory(pJournalData, sizeof(USN_JOURNAL_DATA));
+    pJournalData->UsnJournalID             = 0x01D63C5D00000001ULL;
+    pJournalData->FirstUsn                 = _UsnpLiveUsn(pLive, 0);
+    pJournalData->NextUsn                  = _UsnpLiveUsn(pLive, _UsnpLiveReleased(pLive));
+    pJournalData->MaxUsn                   = 0x7FFFFFFFFFFF0000LL;
+    pJournalData->MaximumSize              = 0x0000000002000000ULL;
+    pJournalData->AllocationDelta          = 0x0000000000800000ULL;
+    pJournalData->MinSupportedMajorVersion = 2;
+    pJournalData->MaxSupportedMajorVersion = 3;
+    return TRUE;
+}
+
+/*++
+ * the live source answers a read the way the ioctl does on a volume that
+ * is still being written. with BytesToWaitFor set the read waits until
+ * that many bytes of journal are past the start usn, or Timeout (100ns
+ * units, 0 for none) runs out. once every record is out the journal goes
+ * quiet, and a read just waits out its timeout. records go out stamped
+ * with the time they were released, so a reader can time their delivery ...
+ */
+BOOL
+_UsnpLiveRead (
+    __in PUSN_SOURCE pSource,
+    __in PREAD_USN_JOURNAL_DATA pReadData,
+    __out_bcount(cbbuffer) void* buffer,
+    __in DWORD cbbuffer,
+    __out DWORD* pbytes )
+{
+    PUSN_LIVE pLive = (PUSN_LIVE)pSource->Context;
+    DWORD used = sizeof(USN);
+    uint64_t deadline = 0;
+    uint64_t released;
+    uint64_t index;
+    USN next;
+
+    if((buffer == NULL) || (pbytes == NULL) || (cbbuffer < sizeof(USN)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if(pReadData->Timeout != 0)
+    {
+        deadline = _UsnpQueryClock() + (pReadData->Timeout / 10);
+    }
+
+    while(1)
+    {
+        uint64_t now;
+        uint64_t due;
+
+        released = _UsnpLiveReleased(pLive);
+        if( (pReadData->BytesToWaitFor == 0) ||
+            (_UsnpLiveUsn(pLive, released) >= (pReadData->StartUsn + (USN)pReadData->BytesToWaitFor)))
+        {
+            break;
+        }
+
+        now = _UsnpQueryClock();
+        if(released == pLive->Memory.Count)
+        {
+            if(deadline > now)
+            {
+                _UsnpSleep(deadline - now);
+            }
+            break;
+        }
+
+        if((deadline != 0) && (now >= deadline))
+        {
+            break;
+        }
+
+        /*++ sleep until the next record is out, or the timeout ... */
+        due = pLive->Start + ((((released + 1) * 1000000ULL) + pLive->Rate - 1) / pLive->Rate);
+        if((deadline != 0) && (due > deadline))
+        {
+            due = deadline;
+        }
+        if(due > now)
+        {
+            _UsnpSleep(due - now);
+        }
+    }
+
+    /*++ first record at or past the start usn ... */
+    {
+        uint64_t lo = 0;
+        uint64_t hi = pLive->Memory.Count;
+
+        while(lo < hi)
+        {
+            uint64_t mid = lo + ((hi - lo) / 2);
+            if(_UsnpLiveUsn(pLive, mid) < pReadData->StartUsn)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        index = lo;
+    }
+
+    for(; index < released; index++)
+    {
+        PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(pLive->Memory.Records + pLive->Memory.Offsets[index]);
+        USN_RECORD_V3* pCopy;
+
+        if( _UsnpIsRecordRequested(pRecord, pReadData) == FALSE)
+        {
+            continue;
+        }
+
+        if((used + pRecord->RecordLength) > cbbuffer)
+        {
+            if(used == sizeof(USN))
+            {
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                return FALSE;
+            }
+            break;
+        }
+
+        pCopy = (USN_RECORD_V3*)(((uint8_t*)buffer) + used);
+        RtlMoveMemory(pCopy, pRecord, pRecord->RecordLength);
+        pCopy->TimeStamp.QuadPart = pLive->StartTime + (LONGLONG)(((index + 1) * 10000000ULL) / pLive->Rate);
+        used += pRecord->RecordLength;
+    }
+
+    next = _UsnpLiveUsn(pLive, ((index < released) ? index : released));
+    if(next < pReadData->StartUsn)
+    {
+        next = pReadData->StartUsn;
+    }
+
+    RtlMoveMemory(buffer, &next, sizeof(USN));
+    *pbytes = used;
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpLiveClose (
+    __in PUSN_SOURCE pSource )
+{
+    PUSN_LIVE pLive = (PUSN_LIVE)pSource->Context;
+
+    if(pLive != NULL)
+    {
+        _UsnpFreeSynthMemory(&(pLive->Memory));
+        _UsnpFree(pLive);
+    }
+    pSource->Context = NULL;
+}
+
+/*++
+ * a simulated live journal; count synthetic records, made up front and
+ * let out rate a second from the time the source is opened ...
+ */
+BOOL
+_UsnpOpenLiveSource (
+    __in uint64_t count,
+    __in uint64_t rate,
+    __out PUSN_SOURCE pSource )
+{
+    USN_SYNTH Synth = {0};
+    PUSN_LIVE pLive;
+
+    if((pSource == NULL) || (rate == 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pSource, sizeof(USN_SOURCE));
+    _snwprintf_s(pSource->Name, _countof(pSource->Name), _countof(pSource->Name), L"simlive(%llu at %llu/s)", (unsigned long long)count, (unsigned long long)rate);
+    pSource->Query = _UsnpLiveQuery;
+    pSource->Read  = _UsnpLiveRead;
+    pSource->Close = _UsnpLiveClose;
+
+    pLive = (PUSN_LIVE)_UsnpAlloc(sizeof(USN_LIVE));
+    if(pLive == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pSource->Context = pLive;
+
+    Synth.Sink = _UsnpSynthMemorySink;
+    Synth.Context = &(pLive->Memory);
+
+    if( _UsnpSynthesize(&Synth, count) == FALSE)
+    {
+        /*++ last error set by call ... */
+        _UsnpLiveClose(pSource);
+        return FALSE;
+    }
+
+    pLive->EndUsn    = Synth.Usn;
+    pLive->Rate      = rate;
+    pLive->Start     = _UsnpQueryClock();
+    pLive->StartTime = _UsnpQuerySystemTime();
+    return TRUE;
+}
+
+/*++ value as a little-endian base-128 varint, 10 bytes at most; returns the end ... */
+uint8_t*
+_UsnpPutVarint (
+    __out_bcount(10) uint8_t* p,
+    __in uint64_t value )
+{
+    while(value >= 0x80)
+    {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+/*++ a varint at *pp, which is moved past it. FALSE if it runs past end ... */
+BOOL
+_UsnpGetVarint (
+    __inout const uint8_t** pp,
+    __in const uint8_t* end,
+    __out uint64_t* pValue )
+{
+    const uint8_t* p = *pp;
+    uint64_t value = 0;
+
+    for(DWORD shift=0; (shift < 64) && (p < end); shift += 7)
+    {
+        uint8_t byte = *p++;
+
+        value |= ((uint64_t)(byte & 0x7F) << shift);
+        if((byte & 0x80) == 0)
+        {
+            *pp = p;
+            *pValue = value;
+            return TRUE;
+        }
+    }
+
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+}
+
+/*++ an archive's header, and the size of the file ... */
+BOOL
+_UsnpReadArchiveHeader (
+    __in FILE* fp,
+    __out PUSN_ARCHIVE_HEADER pHeader,
+    __out LONGLONG* pSize )
+{
+    LONGLONG size;
+
+    if( (_fseeki64(fp, 0, SEEK_END) != 0) ||
+        ((size = _ftelli64(fp)) < 0) ||
+        (_fseeki64(fp, 0, SEEK_SET) != 0))
+    {
+        SetLastError(ERROR_READ_FAULT);
+        return FALSE;
+    }
+
+    if( (fread(pHeader, sizeof(USN_ARCHIVE_HEADER), 1, fp) != 1) ||
+        (pHeader->Signature != _USN_ARCHIVE_SIGNATURE) ||
+        (pHeader->Version != _USN_ARCHIVE_VERSION) ||
+        (pHeader->HeaderSize != sizeof(USN_ARCHIVE_HEADER)) ||
+        (pHeader->BlockSize != sizeof(USN_ARCHIVE_BLOCK)))
+    {
+        SetLastError(ERROR_BAD_FORMAT);
+        return FALSE;
+    }
+
+    *pSize = size;
+    return TRUE;
+}
+
+/*++ the block header at offset, if a whole block is there ... */
+BOOL
+_UsnpReadArchiveBlock (
+    __in FILE* fp,
+    __in LONGLONG offset,
+    __in LONGLONG size,
+    __out PUSN_ARCHIVE_BLOCK pBlock )
+{
+    if( (offset < (LONGLONG)sizeof(USN_ARCHIVE_HEADER)) ||
+        ((size - offset) < (LONGLONG)sizeof(USN_ARCHIVE_BLOCK)) ||
+        (_fseeki64(fp, offset, SEEK_SET) != 0) ||
+        (fread(pBlock, sizeof(USN_ARCHIVE_BLOCK), 1, fp) != 1) ||
+        (pBlock->Signature != _USN_ARCHIVE_BLOCK_SIGNATURE) ||
+        (pBlock->Records == 0) ||
+        (pBlock->Records > _USN_ARCHIVE_RECORDS) ||
+        ((LONGLONG)pBlock->Length > (size - offset - (LONGLONG)sizeof(USN_ARCHIVE_BLOCK))))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ * read an archive's header and find its blocks. a block cut short, by a
+ * crash during a write say, ends the archive; pEnd is where the whole
+ * blocks end and the next one would go ...
+ */
+BOOL
+_UsnpIndexArchive (
+    __in FILE* fp,
+    __out PUSN_ARCHIVE_HEADER pHeader,
+    __out PUSN_ARCHIVE_INDEX* ppBlocks,
+    __out size_t* pCount,
+    __out LONGLONG* pEnd,
+    __out LONGLONG* pSize )
+{
+    PUSN_ARCHIVE_INDEX blocks = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    LONGLONG offset;
+    LONGLONG size;
+    USN_ARCHIVE_BLOCK Block;
+
+    if( _UsnpReadArchiveHeader(fp, pHeader, &size) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    offset = sizeof(USN_ARCHIVE_HEADER);
+    while( _UsnpReadArchiveBlock(fp, offset, size, &Block))
+    {
+        if(count == capacity)
+        {
+            PUSN_ARCHIVE_INDEX grown;
+            capacity = ((capacity == 0) ? 256 : (capacity * 2));
+            grown = (PUSN_ARCHIVE_INDEX)realloc(blocks, capacity * sizeof(USN_ARCHIVE_INDEX));
+            if(grown == NULL)
+            {
+                _UsnpFree(blocks);
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+            }
+            blocks = grown;
+        }
+
+        blocks[count].Offset = offset + (LONGLONG)sizeof(Block);
+        RtlMoveMemory(&(blocks[count].Block), &Block, sizeof(Block));
+        count++;
+
+        offset += (LONGLONG)sizeof(Block) + Block.Length;
+    }
+
+    *ppBlocks = blocks;
+    *pCount = count;
+    *pEnd = offset;
+    *pSize = size;
+    return TRUE;
+}
+
+/*++ dictionary index of a reason or attribute word, added if new ... */
+DWORD
+_UsnpArchiveWord (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in DWORD value )
+{
+    DWORD mask = (DWORD)(_countof(pWriter->WordSlots) - 1);
+    DWORD slot = ((value * 0x9E3779B1U) >> 16) & mask;
+
+    while(pWriter->WordSlots[slot] != 0)
+    {
+        DWORD index = pWriter->WordSlots[slot] - 1;
+        if(pWriter->Words[index] == value)
+        {
+            return index;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    pWriter->Words[pWriter->Block.Words] = value;
+    pWriter->WordSlots[slot] = ++pWriter->Block.Words;
+    return (pWriter->Block.Words - 1);
+}
+
+/*++ dictionary index of a name, added if new ... */
+BOOL
+_UsnpArchiveName (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in_ecount(cchname) const WCHAR* name,
+    __in DWORD cchname,
+    __out DWORD* pIndex )
+{
+    DWORD mask = (DWORD)(_countof(pWriter->NameSlots) - 1);
+    DWORD slot = _UsnpHashName(name, cchname) & mask;
+    uint8_t* p;
+
+    while(pWriter->NameSlots[slot] != 0)
+    {
+        DWORD index = pWriter->NameSlots[slot] - 1;
+        if( (pWriter->NameLengths[index] == cchname) &&
+            (memcmp(pWriter->Names.Buffer + (pWriter->NameOffsets[index] * sizeof(WCHAR)), name, cchname * sizeof(WCHAR)) == 0))
+        {
+            *pIndex = index;
+            return TRUE;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    p = _UsnpReserveOutput(&(pWriter->Names), cchname * sizeof(WCHAR));
+    if(p == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    RtlMoveMemory(p, name, cchname * sizeof(WCHAR));
+
+    *pIndex = pWriter->Block.Names;
+    pWriter->NameOffsets[*pIndex] = (DWORD)(pWriter->Names.Length / sizeof(WCHAR));
+    pWriter->NameLengths[*pIndex] = (WORD)cchname;
+    pWriter->Names.Length += cchname * sizeof(WCHAR);
+    pWriter->NameSlots[slot] = ++pWriter->Block.Names;
+    return TRUE;
+}
+
+/*++
+ * code one record into the block. a v2 or v3 record laid out the usual way
+ * (the name right after the fixed part, the length rounded to 8) is a kind
+ * byte and then varints: the usn against where the last record ended, the
+ * time and both frns against the last record's, dictionary indexes for the
+ * reason, the attributes and the name, and the rarely set fields only if
+ * any are. anything else, a v4 record say, goes in as it is ...
+ */
+BOOL
+_UsnpArchiveRecord (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    PUSN_ARCHIVE_BLOCK pBlock = &(pWriter->Block);
+    PUSN_ARCHIVE_STATE pState = &(pWriter->State);
+    USN_RECORD_UNION* pUnion = (USN_RECORD_UNION*)pRecord;
+    USN usn = _UsnpGetRecordUsn(pRecord);
+    LONGLONG timestamp = _UsnpGetRecordTimeStamp(pRecord);
+    ULARGE_INTEGER128 frn = {0};
+    ULARGE_INTEGER128 parent = {0};
+    uint64_t field[12] = {0};
+    DWORD fields = 9;
+    DWORD kind = _USN_ARCHIVE_RAW;
+    const WCHAR* name = NULL;
+    DWORD cchname = 0;
+    DWORD attributes = 0;
+    uint8_t* p;
+
+    /*++ a run resumed from a checkpoint reads its last buffer again ... */
+    if(pWriter->Archived && (usn <= pWriter->LastUsn))
+    {
+        return TRUE;
+    }
+
+    if(pBlock->Records == _USN_ARCHIVE_RECORDS)
+    {
+        if( _UsnpFlushArchive(pWriter, usn) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+    }
+
+    if(pBlock->Records == 0)
+    {
+        pBlock->FirstUsn = usn;
+        pState->Usn = usn;
+    }
+
+    if( (pRecord->MajorVersion == 2) &&
+        (pRecord->RecordLength >= offsetof(USN_RECORD_V2, FileName)) &&
+        (pUnion->V2.FileNameOffset == offsetof(USN_RECORD_V2, FileName)) &&
+        (pRecord->RecordLength == _USN_ARCHIVE_LENGTH(offsetof(USN_RECORD_V2, FileName), pUnion->V2.FileNameLength)))
+    {
+        kind = 2;
+        frn.LowPart = pUnion->V2.FileReferenceNumber;
+        parent.LowPart = pUnion->V2.ParentFileReferenceNumber;
+        field[6] = pUnion->V2.Reason;
+        attributes = pUnion->V2.FileAttributes;
+        field[10] = pUnion->V2.SourceInfo;
+        field[11] = pUnion->V2.SecurityId;
+        name = pUnion->V2.FileName;
+        cchname = pUnion->V2.FileNameLength / sizeof(WCHAR);
+    }
+    else if( (pRecord->MajorVersion == 3) &&
+             (pRecord->RecordLength >= offsetof(USN_RECORD_V3, FileName)) &&
+             (pUnion->V3.FileNameOffset == offsetof(USN_RECORD_V3, FileName)) &&
+             (pRecord->RecordLength == _USN_ARCHIVE_LENGTH(offsetof(USN_RECORD_V3, FileName), pUnion->V3.FileNameLength)))
+    {
+        kind = 3;
+        RtlMoveMemory(&frn, &(pUnion->V3.FileReferenceNumber), sizeof(frn));
+        RtlMoveMemory(&parent, &(pUnion->V3.ParentFileReferenceNumber), sizeof(parent));
+        field[6] = pUnion->V3.Reason;
+        attributes = pUnion->V3.FileAttributes;
+        field[10] = pUnion->V3.SourceInfo;
+        field[11] = pUnion->V3.SecurityId;
+        name = pUnion->V3.FileName;
+        cchname = pUnion->V3.FileNameLength / sizeof(WCHAR);
+    }
+
+    /*++ room for the widest record the kind byte and varints can make ... */
+    p = _UsnpReserveOutput(&(pWriter->Records), 1 + (_countof(field) * 10) + 10 + pRecord->RecordLength);
+    if(p == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    if(kind == _USN_ARCHIVE_RAW)
+    {
+        *p++ = _USN_ARCHIVE_RAW;
+        p = _UsnpPutVarint(p, pRecord->RecordLength);
+        RtlMoveMemory(p, pRecord, pRecord->RecordLength);
+        p += pRecord->RecordLength;
+    }
+    else
+    {
+        DWORD entry = 0;
+
+        if( _UsnpArchiveName(pWriter, name, cchname, &entry) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+
+        field[0] = _USN_ZIGZAG(usn - (pState->Usn + pState->Length));
+        field[1] = _USN_ZIGZAG(timestamp - pState->TimeStamp);
+        field[2] = _USN_ZIGZAG(frn.LowPart - pState->Frn.LowPart);
+        field[3] = frn.HighPart ^ pState->Frn.HighPart;
+        field[4] = _USN_ZIGZAG(parent.LowPart - pState->Parent.LowPart);
+        field[5] = parent.HighPart ^ pState->Parent.HighPart;
+        field[6] = _UsnpArchiveWord(pWriter, (DWORD)field[6]);
+        field[7] = _UsnpArchiveWord(pWriter, attributes);
+        field[8] = entry;
+        field[9] = pRecord->MinorVersion;
+
+        if((field[9] | field[10] | field[11]) != 0)
+        {
+            kind |= _USN_ARCHIVE_EXTRA;
+            fields = _countof(field);
+        }
+
+        *p++ = (uint8_t)kind;
+        for(DWORD index=0; index<fields; index++)
+        {
+            p = _UsnpPutVarint(p, field[index]);
+        }
+
+        pState->TimeStamp = timestamp;
+        pState->Frn = frn;
+        pState->Parent = parent;
+    }
+
+    pWriter->Records.Length = (size_t)(p - pWriter->Records.Buffer);
+    pState->Usn = usn;
+    pState->Length = pRecord->RecordLength;
+
+    pBlock->Records++;
+    pBlock->LastUsn = usn;
+    pBlock->Reasons |= _UsnpGetRecordReason(pRecord);
+    if(timestamp != 0)
+    {
+        if((pBlock->FirstTime == 0) || (timestamp < pBlock->FirstTime))
+        {
+            pBlock->FirstTime = timestamp;
+        }
+        if(timestamp > pBlock->LastTime)
+        {
+            pBlock->LastTime = timestamp;
+        }
+    }
+
+    pWriter->RecordBytes += pRecord->RecordLength;
+    return TRUE;
+}
+
+/*++
+ * write out the block being filled, if it holds anything, with NextUsn as
+ * where a read past it starts. the words go as varints and the names as a
+ * varint length and then a varint a utf-16 unit, a byte each for ascii ...
+ */
+BOOL
+_UsnpFlushArchive (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in USN NextUsn )
+{
+    PUSN_ARCHIVE_BLOCK pBlock = &(pWriter->Block);
+    PUSN_OUTPUT pDictionary = &(pWriter->Dictionary);
+    const WCHAR* names = (const WCHAR*)pWriter->Names.Buffer;
+    uint8_t* p;
+
+    if(pBlock->Records == 0)
+    {
+        return TRUE;
+    }
+
+    pDictionary->Length = 0;
+    p = _UsnpReserveOutput(pDictionary, (size_t)pBlock->Words * 10);
+    if(p == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    for(DWORD index=0; index<pBlock->Words; index++)
+    {
+        p = _UsnpPutVarint(p, pWriter->Words[index]);
+    }
+    pDictionary->Length = (size_t)(p - pDictionary->Buffer);
+
+    for(DWORD index=0; index<pBlock->Names; index++)
+    {
+        const WCHAR* name = names + pWriter->NameOffsets[index];
+        DWORD cchname = pWriter->NameLengths[index];
+
+        p = _UsnpReserveOutput(pDictionary, 10 + ((size_t)cchname * 3));
+        if(p == NULL)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        p = _UsnpPutVarint(p, cchname);
+        for(DWORD ch=0; ch<cchname; ch++)
+        {
+            p = _UsnpPutVarint(p, name[ch]);
+        }
+        pDictionary->Length = (size_t)(p - pDictionary->Buffer);
+    }
+
+    if(NextUsn < (pWriter->State.Usn + pWriter->State.Length))
+    {
+        NextUsn = pWriter->State.Usn + pWriter->State.Length;
+    }
+
+    pBlock->Signature = _USN_ARCHIVE_BLOCK_SIGNATURE;
+    pBlock->Length    = (DWORD)(pDictionary->Length + pWriter->Records.Length);
+    pBlock->NextUsn   = NextUsn;
+
+    if( (fwrite(pBlock, sizeof(USN_ARCHIVE_BLOCK), 1, pWriter->fp) != 1) ||
+        (fwrite(pDictionary->Buffer, 1, pDictionary->Length, pWriter->fp) != pDictionary->Length) ||
+        (fwrite(pWriter->Records.Buffer, 1, pWriter->Records.Length, pWriter->fp) != pWriter->Records.Length) ||
+        (fflush(pWriter->fp) != 0))
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+
+    pWriter->LastUsn = pBlock->LastUsn;
+    pWriter->Archived = TRUE;
+    pWriter->TotalRecords += pBlock->Records;
+    pWriter->TotalBlocks++;
+    pWriter->BlockBytes += sizeof(USN_ARCHIVE_BLOCK) + pBlock->Length;
+
+    pWriter->Records.Length = 0;
+    pWriter->Names.Length = 0;
+    RtlZeroMemory(pBlock, sizeof(USN_ARCHIVE_BLOCK));
+    RtlZeroMemory(&(pWriter->State), sizeof(USN_ARCHIVE_STATE));
+    RtlZeroMemory(pWriter->WordSlots, sizeof(pWriter->WordSlots));
+    RtlZeroMemory(pWriter->NameSlots, sizeof(pWriter->NameSlots));
+    return TRUE;
+}
+
+/*++ the records in a buffer as FSCTL_READ_USN_JOURNAL returned it ... */
+BOOL
+_UsnpArchiveChunk (
+    __inout PUSN_ARCHIVE_WRITER pWriter,
+    __in_bcount(bytes) void* buffer,
+    __in DWORD bytes )
+{
+    uint8_t* data = (uint8_t*)buffer;
+    DWORD offset = sizeof(USN);
+    USN next;
+
+    if((pWriter == NULL) || (buffer == NULL) || (bytes < sizeof(USN)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    while((bytes - offset) >= sizeof(USN_RECORD_COMMON_HEADER))
+    {
+        PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(data + offset);
+
+        if((pRecord->RecordLength < sizeof(USN_RECORD_COMMON_HEADER)) || (pRecord->RecordLength > (bytes - offset)))
+        {
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+        }
+
+        if( _UsnpArchiveRecord(pWriter, pRecord) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        offset += pRecord->RecordLength;
+    }
+
+    RtlMoveMemory(&next, data, sizeof(USN));
+    if(next > pWriter->NextUsn)
+    {
+        pWriter->NextUsn = next;
+    }
+    return TRUE;
+}
+
+/*++
+ * open an archive to add to, or create it. the blocks go on after the last
+ * whole one, and records already in the archive are not added again. an
+ * archive holds one journal; one for a different UsnJournalID is refused
+ * with ERROR_INVALID_DATA ...
+ */
+BOOL
+_UsnpOpenArchiveWriter (
+    __in wchar_t* filename,
+    __in PUSN_JOURNAL_DATA pJournalData,
+    __out PUSN_ARCHIVE_WRITER* ppWriter )
+{
+    PUSN_ARCHIVE_WRITER pWriter;
+    USN_ARCHIVE_HEADER Header = {0};
+
+    if((filename == NULL) || (pJournalData == NULL) || (ppWriter == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pWriter = (PUSN_ARCHIVE_WRITER)_UsnpAlloc(sizeof(USN_ARCHIVE_WRITER));
+    if(pWriter == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    _snwprintf_s(pWriter->Name, _countof(pWriter->Name), _countof(pWriter->Name), L"%ls", filename);
+    pWriter->Records.File = -1;
+    pWriter->Names.File = -1;
+    pWriter->Dictionary.File = -1;
+
+    pWriter->fp = _UsnpOpenStream(filename, L"r+b");
+    if(pWriter->fp != NULL)
+    {
+        PUSN_ARCHIVE_INDEX blocks = NULL;
+        size_t count = 0;
+        LONGLONG end = 0;
+        LONGLONG size = 0;
+
+        if( _UsnpIndexArchive(pWriter->fp, &Header, &blocks, &count, &end, &size) == FALSE)
+        {
+            /*++ last error set by call ... */
+            fclose(pWriter->fp);
+            _UsnpFree(pWriter);
+            return FALSE;
+        }
+
+        if(Header.JournalData.UsnJournalID != pJournalData->UsnJournalID)
+        {
+            _UsnpFree(blocks);
+            fclose(pWriter->fp);
+            _UsnpFree(pWriter);
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+        }
+
+        if(count > 0)
+        {
+            pWriter->LastUsn = blocks[count - 1].Block.LastUsn;
+            pWriter->NextUsn = blocks[count - 1].Block.NextUsn;
+            pWriter->Archived = TRUE;
+        }
+        _UsnpFree(blocks);
+
+        if(_fseeki64(pWriter->fp, end, SEEK_SET) != 0)
+        {
+            fclose(pWriter->fp);
+            _UsnpFree(pWriter);
+            SetLastError(ERROR_WRITE_FAULT);
+            return FALSE;
+        }
+        RtlMoveMemory(&(pWriter->JournalData), &(Header.JournalData), sizeof(USN_JOURNAL_DATA));
+    }
+    else if(GetLastError() == ERROR_FILE_NOT_FOUND)
+    {
+        pWriter->fp = _UsnpOpenStream(filename, L"w+b");
+        if(pWriter->fp == NULL)
+        {
+            /*++ last error set by call ... */
+            _UsnpFree(pWriter);
+            return FALSE;
+        }
+
+        Header.Signature  = _USN_ARCHIVE_SIGNATURE;
+        Header.Version    = _USN_ARCHIVE_VERSION;
+        Header.HeaderSize = sizeof(USN_ARCHIVE_HEADER);
+        Header.BlockSize  = sizeof(USN_ARCHIVE_BLOCK);
+        RtlMoveMemory(&(Header.JournalData), pJournalData, sizeof(USN_JOURNAL_DATA));
+
+        if(fwrite(&Header, sizeof(Header), 1, pWriter->fp) != 1)
+        {
+            fclose(pWriter->fp);
+            _UsnpFree(pWriter);
+            SetLastError(ERROR_WRITE_FAULT);
+            return FALSE;
+        }
+        RtlMoveMemory(&(pWriter->JournalData), pJournalData, sizeof(USN_JOURNAL_DATA));
+    }
+    else
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(pWriter);
+        return FALSE;
+    }
+
+    *ppWriter = pWriter;
+    return TRUE;
+}
+
+/*++
+ * write out the last block and close. the header's NextUsn is moved up to
+ * where the archive now ends, which is where a reader of it stops ...
+ */
+BOOL
+_UsnpCloseArchiveWriter (
+    __in PUSN_ARCHIVE_WRITER pWriter )
+{
+    BOOL status;
+
+    if(pWriter == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    status = _UsnpFlushArchive(pWriter, pWriter->NextUsn);
+    if(status != FALSE)
+    {
+        if(pWriter->NextUsn > pWriter->JournalData.NextUsn)
+        {
+            pWriter->JournalData.NextUsn = pWriter->NextUsn;
+        }
+        if( (_fseeki64(pWriter->fp, (LONGLONG)offsetof(USN_ARCHIVE_HEADER, JournalData), SEEK_SET) != 0) ||
+            (fwrite(&(pWriter->JournalData), sizeof(USN_JOURNAL_DATA), 1, pWriter->fp) != 1))
+        {
+            SetLastError(ERROR_WRITE_FAULT);
+            status = FALSE;
+        }
+    }
+
+    if(fclose(pWriter->fp) != 0)
+    {
+        SetLastError(ERROR_WRITE_FAULT);
+        status = FALSE;
+    }
+
+    if(status != FALSE)
+    {
+        fwprintf(g_info, L"archive(%ls), %llu records in %llu blocks, %llu bytes for %llu read\n",
+         pWriter->Name,
+         (unsigned long long)pWriter->TotalRecords,
+         (unsigned long long)pWriter->TotalBlocks,
+         (unsigned long long)pWriter->BlockBytes,
+         (unsigned long long)pWriter->RecordBytes);
+    }
+
+    _UsnpFreeOutput(&(pWriter->Records));
+    _UsnpFreeOutput(&(pWriter->Names));
+    _UsnpFreeOutput(&(pWriter->Dictionary));
+    _UsnpFree(pWriter);
+    return status;
+}
+
+/*++ room for count entries in a reader's table; grows, never shrinks ... */
+BOOL
+_UsnpArchiveGrow (
+    __inout void** pp,
+    __in size_t count,
+    __in size_t size )
+{
+    void* p = realloc(*pp, ((count == 0) ? 1 : count) * size);
+    if(p == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    *pp = p;
+    return TRUE;
+}
+
+/*++
+ * decode block index into Memory, records laid out exactly as they were
+ * read. every index and length is checked; a block that does not decode
+ * whole is ERROR_INVALID_DATA ...
+ */
+BOOL
+_UsnpArchiveLoad (
+    __inout PUSN_ARCHIVE pArchive,
+    __in size_t index )
+{
+    PUSN_ARCHIVE_INDEX pIndex = &(pArchive->Blocks[index]);
+    PUSN_ARCHIVE_BLOCK pBlock = &(pIndex->Block);
+    USN_ARCHIVE_STATE State = {0};
+    const uint8_t* p;
+    const uint8_t* end;
+    size_t text = 0;
+    uint64_t value;
+
+    if(pArchive->Loaded == index)
+    {
+        return TRUE;
+    }
+    pArchive->Loaded = pArchive->BlockCount;
+
+    if( ((pBlock->Length > pArchive->PayloadSize) && (_UsnpArchiveGrow((void**)&(pArchive->Payload), pBlock->Length, 1) == FALSE)) ||
+        ((pBlock->Words > pArchive->WordCapacity) && (_UsnpArchiveGrow((void**)&(pArchive->Words), pBlock->Words, sizeof(DWORD)) == FALSE)) ||
+        ((pBlock->Names > pArchive->NameCapacity) && (
+            (_UsnpArchiveGrow((void**)&(pArchive->NameOffsets), pBlock->Names, sizeof(DWORD)) == FALSE) ||
+            (_UsnpArchiveGrow((void**)&(pArchive->NameLengths), pBlock->Names, sizeof(WORD)) == FALSE))) ||
+        ((pBlock->Length > pArchive->TextCapacity) && (_UsnpArchiveGrow((void**)&(pArchive->NameText), pBlock->Length, sizeof(WCHAR)) == FALSE)))
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pArchive->PayloadSize  = ((pBlock->Length > pArchive->PayloadSize) ? pBlock->Length : pArchive->PayloadSize);
+    pArchive->WordCapacity = ((pBlock->Words > pArchive->WordCapacity) ? pBlock->Words : pArchive->WordCapacity);
+    pArchive->NameCapacity = ((pBlock->Names > pArchive->NameCapacity) ? pBlock->Names : pArchive->NameCapacity);
+    pArchive->TextCapacity = ((pBlock->Length > pArchive->TextCapacity) ? pBlock->Length : pArchive->TextCapacity);
+
+    if( (_fseeki64(pArchive->fp, pIndex->Offset, SEEK_SET) != 0) ||
+        (fread(pArchive->Payload, 1, pBlock->Length, pArchive->fp) != pBlock->Length))
+    {
+        SetLastError(ERROR_READ_FAULT);
+        return FALSE;
+    }
+
+    p = pArchive->Payload;
+    end = p + pBlock->Length;
+
+    for(DWORD word=0; word<pBlock->Words; word++)
+    {
+        if((_UsnpGetVarint(&p, end, &value) == FALSE) || (value > 0xFFFFFFFF))
+        {
+            goto corrupt;
+        }
+        pArchive->Words[word] = (DWORD)value;
+    }
+
+    /*++ a unit is a byte at least, so the text fits in as many WCHARs as the block has bytes ... */
+    for(DWORD name=0; name<pBlock->Names; name++)
+    {
+        if((_UsnpGetVarint(&p, end, &value) == FALSE) || (value > 0x7FFF) || (value > (uint64_t)(end - p)))
+        {
+            goto corrupt;
+        }
+        pArchive->NameOffsets[name] = (DWORD)text;
+        pArchive->NameLengths[name] = (WORD)value;
+
+        for(DWORD ch=pArchive->NameLengths[name]; ch>0; ch--)
+        {
+            if((_UsnpGetVarint(&p, end, &value) == FALSE) || (value > 0xFFFF))
+            {
+                goto corrupt;
+            }
+            pArchive->NameText[text++] = (WCHAR)value;
+        }
+    }
+
+    pArchive->Memory.Length = 0;
+    pArchive->Memory.Count = 0;
+    State.Usn = pBlock->FirstUsn;
+
+    for(DWORD record=0; record<pBlock->Records; record++)
+    {
+        PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)pArchive->Record;
+        USN_RECORD_UNION* pUnion = (USN_RECORD_UNION*)pArchive->Record;
+        uint64_t field[12] = {0};
+        DWORD kind;
+
+        if(p >= end)
+        {
+            goto corrupt;
+        }
+        kind = *p++;
+
+        if(kind == _USN_ARCHIVE_RAW)
+        {
+            if( (_UsnpGetVarint(&p, end, &value) == FALSE) ||
+                (value < sizeof(USN_RECORD_COMMON_HEADER)) ||
+                (value > sizeof(pArchive->Record)) ||
+                (value > (uint64_t)(end - p)))
+            {
+                goto corrupt;
+            }
+            RtlMoveMemory(pArchive->Record, p, (size_t)value);
+            p += value;
+            if(pRecord->RecordLength != value)
+            {
+                goto corrupt;
+            }
+        }
+        else
+        {
+            DWORD major = (kind & ~_USN_ARCHIVE_EXTRA);
+            DWORD fields = (((kind & _USN_ARCHIVE_EXTRA) != 0) ? _countof(field) : 9);
+            ULARGE_INTEGER128 frn;
+            ULARGE_INTEGER128 parent;
+            const WCHAR* name;
+            DWORD cchname;
+            DWORD offset;
+
+            for(DWORD index=0; index<fields; index++)
+            {
+                if( _UsnpGetVarint(&p, end, &(field[index])) == FALSE)
+                {
+                    goto corrupt;
+                }
+            }
+            if( ((major != 2) && (major != 3)) ||
+                (field[6] >= pBlock->Words) || (field[7] >= pBlock->Words) ||
+                (field[8] >= pBlock->Names) ||
+                (field[9] > 0xFFFF) || (field[10] > 0xFFFFFFFF) || (field[11] > 0xFFFFFFFF))
+            {
+                goto corrupt;
+            }
+
+            frn.LowPart     = State.Frn.LowPart + (uint64_t)_USN_UNZIGZAG(field[2]);
+            frn.HighPart    = State.Frn.HighPart ^ field[3];
+            parent.LowPart  = State.Parent.LowPart + (uint64_t)_USN_UNZIGZAG(field[4]);
+            parent.HighPart = State.Parent.HighPart ^ field[5];
+            name = pArchive->NameText + pArchive->NameOffsets[field[8]];
+            cchname = pArchive->NameLengths[field[8]];
+
+            offset = (DWORD)((major == 2) ? offsetof(USN_RECORD_V2, FileName) : offsetof(USN_RECORD_V3, FileName));
+            RtlZeroMemory(pArchive->Record, _USN_ARCHIVE_LENGTH(offset, cchname * sizeof(WCHAR)));
+            pRecord->RecordLength = _USN_ARCHIVE_LENGTH(offset, cchname * sizeof(WCHAR));
+            pRecord->MajorVersion = (WORD)major;
+            pRecord->MinorVersion = (WORD)field[9];
+
+            if(major == 2)
+            {
+                /*++ a v2 frn is 64 bits ... */
+                if((frn.HighPart != 0) || (parent.HighPart != 0))
+                {
+                    goto corrupt;
+                }
+                pUnion->V2.FileReferenceNumber       = frn.LowPart;
+                pUnion->V2.ParentFileReferenceNumber = parent.LowPart;
+                pUnion->V2.Usn                = State.Usn + State.Length + _USN_UNZIGZAG(field[0]);
+                pUnion->V2.TimeStamp.QuadPart = State.TimeStamp + _USN_UNZIGZAG(field[1]);
+                pUnion->V2.Reason             = pArchive->Words[field[6]];
+                pUnion->V2.FileAttributes     = pArchive->Words[field[7]];
+                pUnion->V2.SourceInfo         = (DWORD)field[10];
+                pUnion->V2.SecurityId         = (DWORD)field[11];
+                pUnion->V2.FileNameLength     = (WORD)(cchname * sizeof(WCHAR));
+                pUnion->V2.FileNameOffset     = (WORD)offset;
+                State.TimeStamp = pUnion->V2.TimeStamp.QuadPart;
+            }
+            else
+            {
+                RtlMoveMemory(&(pUnion->V3.FileReferenceNumber), &frn, sizeof(FILE_ID_128));
+                RtlMoveMemory(&(pUnion->V3.ParentFileReferenceNumber), &parent, sizeof(FILE_ID_128));
+                pUnion->V3.Usn                = State.Usn + State.Length + _USN_UNZIGZAG(field[0]);
+                pUnion->V3.TimeStamp.QuadPart = State.TimeStamp + _USN_UNZIGZAG(field[1]);
+                pUnion->V3.Reason             = pArchive->Words[field[6]];
+                pUnion->V3.FileAttributes     = pArchive->Words[field[7]];
+                pUnion->V3.SourceInfo         = (DWORD)field[10];
+                pUnion->V3.SecurityId         = (DWORD)field[11];
+                pUnion->V3.FileNameLength     = (WORD)(cchname * sizeof(WCHAR));
+                pUnion->V3.FileNameOffset     = (WORD)offset;
+                State.TimeStamp = pUnion->V3.TimeStamp.QuadPart;
+            }
+            RtlMoveMemory(((uint8_t*)pRecord) + offset, name, cchname * sizeof(WCHAR));
+
+            State.Frn = frn;
+            State.Parent = parent;
+        }
+
+        State.Usn = _UsnpGetRecordUsn(pRecord);
+        State.Length = pRecord->RecordLength;
+
+        if( _UsnpSynthMemorySink(&(pArchive->Memory), (USN_RECORD_V3*)pRecord) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+    }
+
+    if(p != end)
+    {
+        goto corrupt;
+    }
+
+    pArchive->Loaded = index;
+    pArchive->Decoded++;
+    return TRUE;
+
+corrupt:
+    SetLastError(ERROR_INVALID_DATA);
+    return FALSE;
+}
+
+/*++
+ */
+BOOL
+_UsnpArchiveQuery (
+    __in PUSN_SOURCE pSource,
+    __out PUSN_JOURNAL_DATA pJournalData )
+{
+    PUSN_ARCHIVE pArchive = (PUSN_ARCHIVE)pSource->Context;
+
+    RtlMoveMemory(pJournalData, &(pArchive->Header.JournalData), sizeof(USN_JOURNAL_DATA));
+    return TRUE;
+}
+
+/*++
+ * the archive answers a read the way the ioctl does, as the replay does.
+ * blocks wholly before the start usn are found by their headers and never
+ * read, and a block with none of the reasons asked for is passed over
+ * without being decoded. with a history query only its records are
+ * handed back ...
+ */
+BOOL
+_UsnpArchiveRead (
+    __in PUSN_SOURCE pSource,
+    __in PREAD_USN_JOURNAL_DATA pReadData,
+    __out_bcount(cbbuffer) void* buffer,
+    __in DWORD cbbuffer,
+    __out DWORD* pbytes )
+{
+    PUSN_ARCHIVE pArchive = (PUSN_ARCHIVE)pSource->Context;
+    DWORD used = sizeof(USN);
+    USN next = pReadData->StartUsn;
+    size_t lo = 0;
+    size_t hi = pArchive->BlockCount;
+
+    if((buffer == NULL) || (pbytes == NULL) || (cbbuffer < sizeof(USN)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /*++ first block holding anything at or past the start usn ... */
+    while(lo < hi)
+    {
+        size_t mid = lo + ((hi - lo) / 2);
+        if(pArchive->Blocks[mid].Block.LastUsn >= pReadData->StartUsn)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    for(; lo < pArchive->BlockCount; lo++)
+    {
+        PUSN_ARCHIVE_BLOCK pBlock = &(pArchive->Blocks[lo].Block);
+
+        if((pBlock->Reasons & pReadData->ReasonMask) != 0)
+        {
+            if( _UsnpArchiveLoad(pArchive, lo) == FALSE)
+            {
+                /*++ last error set by call ... */
+                return FALSE;
+            }
+
+            for(uint64_t index=0; index<pArchive->Memory.Count; index++)
+            {
+                PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(pArchive->Memory.Records + pArchive->Memory.Offsets[index]);
+
+                if( (_UsnpIsRecordRequested(pRecord, pReadData) == FALSE) ||
+                    ((pArchive->Query.Match != 0) && (_UsnpIsHistoryMatch(&(pArchive->Query), pRecord) == FALSE)))
+                {
+                    continue;
+                }
+
+                if((used + pRecord->RecordLength) > cbbuffer)
+                {
+                    if(used == sizeof(USN))
+                    {
+                        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                        return FALSE;
+                    }
+                    next = _UsnpGetRecordUsn(pRecord);
+                    goto done;
+                }
+                RtlMoveMemory(((uint8_t*)buffer) + used, pRecord, pRecord->RecordLength);
+                used += pRecord->RecordLength;
+            }
+        }
+
+        if(pBlock->NextUsn > next)
+        {
+            next = pBlock->NextUsn;
+        }
+
+        if(used > sizeof(USN))
+        {
+            break;
+        }
+    }
+
+done:
+    RtlMoveMemory(buffer, &next, sizeof(USN));
+    *pbytes = used;
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpArchiveClose (
+    __in PUSN_SOURCE pSource )
+{
+    PUSN_ARCHIVE pArchive = (PUSN_ARCHIVE)pSource->Context;
+
+    if(pArchive != NULL)
+    {
+        if(pArchive->fp != NULL)
+        {
+            fclose(pArchive->fp);
+        }
+        _UsnpFree(pArchive->Blocks);
+        _UsnpFree(pArchive->Payload);
+        _UsnpFree(pArchive->Words);
+        _UsnpFree(pArchive->NameText);
+        _UsnpFree(pArchive->NameOffsets);
+        _UsnpFree(pArchive->NameLengths);
+        _UsnpFreeSynthMemory(&(pArchive->Memory));
+        _UsnpFree(pArchive);
+    }
+    pSource->Context = NULL;
+}
+
+/*++
+ * an archive as a journal source; all of it, or with a query only the
+ * blocks the history index says hold the records asked for ...
+ */
+BOOL
+_UsnpOpenArchiveSource (
+    __in wchar_t* filename,
+    __in_opt PUSN_HISTORY_QUERY pQuery,
+    __out PUSN_SOURCE pSource )
+{
+    PUSN_ARCHIVE pArchive = NULL;
+    LONGLONG end = 0;
+
+    if((filename == NULL) || (pSource == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    RtlZeroMemory(pSource, sizeof(USN_SOURCE));
+    _snwprintf_s(pSource->Name, _countof(pSource->Name), _countof(pSource->Name), L"%ls", filename);
+    pSource->Query = _UsnpArchiveQuery;
+    pSource->Read  = _UsnpArchiveRead;
+    pSource->Close = _UsnpArchiveClose;
+
+    pArchive = (PUSN_ARCHIVE)_UsnpAlloc(sizeof(USN_ARCHIVE));
+    if(pArchive == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pSource->Context = pArchive;
+
+    pArchive->fp = _UsnpOpenStream(filename, L"rb");
+    if(pArchive->fp == NULL)
+    {
+        /*++ last error set by call ... */
+        _UsnpArchiveClose(pSource);
+        return FALSE;
+    }
+
+    if((pQuery != NULL) && (pQuery->Match != 0))
+    {
+        RtlMoveMemory(&(pArchive->Query), pQuery, sizeof(USN_HISTORY_QUERY));
+        if( (_UsnpReadArchiveHeader(pArchive->fp, &(pArchive->Header), &(pArchive->Size)) == FALSE) ||
+            (_UsnpQueryHistoryIndex(pArchive, filename) == FALSE))
+        {
+            /*++ last error set by call ... */
+            _UsnpArchiveClose(pSource);
+            return FALSE;
+        }
+    }
+    else if( _UsnpIndexArchive(pArchive->fp, &(pArchive->Header), &(pArchive->Blocks), &(pArchive->BlockCount), &end, &(pArchive->Size)) == FALSE)
+    {
+        /*++ last error set by call ... */
+        _UsnpArchiveClose(pSource);
+        return FALSE;
+    }
+
+    pArchive->Loaded = pArchive->BlockCount;
+    return TRUE;
+}
+
+/*++ frns in key order; the high part first ... */
+int
+_UsnpCompareHistoryKey (
+    __in const ULARGE_INTEGER128* pKey1,
+    __in const ULARGE_INTEGER128* pKey2 )
+{
+    if(pKey1->HighPart != pKey2->HighPart)
+    {
+        return ((pKey1->HighPart < pKey2->HighPart) ? -1 : 1);
+    }
+    if(pKey1->LowPart != pKey2->LowPart)
+    {
+        return ((pKey1->LowPart < pKey2->LowPart) ? -1 : 1);
+    }
+    return 0;
+}
+
+/*++ qsort order for pairs; by frn, then by block ... */
+int
+_UsnpCompareHistoryPair (
+    __in const void* p1,
+    __in const void* p2 )
+{
+    const USN_HISTORY_PAIR* pPair1 = (const USN_HISTORY_PAIR*)p1;
+    const USN_HISTORY_PAIR* pPair2 = (const USN_HISTORY_PAIR*)p2;
+    int order = _UsnpCompareHistoryKey(&(pPair1->Frn), &(pPair2->Frn));
+
+    if(order == 0)
+    {
+        order = ((pPair1->Offset < pPair2->Offset) ? -1 : ((pPair1->Offset > pPair2->Offset) ? 1 : 0));
+    }
+    return order;
+}
+
+/*++
+ * write one table; the keys, each with its run of postings, and then the
+ * postings. pairs are sorted ...
+ */
+BOOL
+_UsnpWriteHistoryTable (
+    __in FILE* fp,
+    __in PUSN_HISTORY_TABLE pTable,
+    __in_ecount(count) PUSN_HISTORY_PAIR pairs,
+    __in size_t count )
+{
+    USN_HISTORY_KEY Key = {0};
+
+    if( _UsnpWritePadding(fp, pTable->KeysOffset) == FALSE)
+    {
+        return FALSE;
+    }
+    for(size_t index=0; index<count; index++)
+    {
+        if((index > 0) && (_UsnpCompareHistoryKey(&(pairs[index].Frn), &(Key.Frn)) != 0))
+        {
+            if(fwrite(&Key, sizeof(Key), 1, fp) != 1)
+            {
+                return FALSE;
+            }
+            Key.First = (DWORD)index;
+            Key.Count = 0;
+        }
+        Key.Frn = pairs[index].Frn;
+        Key.Count++;
+    }
+    if((count > 0) && (fwrite(&Key, sizeof(Key), 1, fp) != 1))
+    {
+        return FALSE;
+    }
+
+    if( _UsnpWritePadding(fp, pTable->PostingsOffset) == FALSE)
+    {
+        return FALSE;
+    }
+    for(size_t index=0; index<count; index++)
+    {
+        if(fwrite(&(pairs[index].Offset), sizeof(uint64_t), 1, fp) != 1)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*++
+ * decode every block of an archive once and write its history index to
+ * filename; a frn seen many times in a block is one posting. written
+ * beside and renamed over, as the snapshot is ...
+ */
+BOOL
+_UsnpBuildHistoryIndex (
+    __in wchar_t* archivename,
+    __in wchar_t* filename )
+{
+    USN_SOURCE Source = {0};
+    PUSN_ARCHIVE pArchive;
+    USN_HISTORY_HEADER Header = {0};
+    PUSN_HISTORY_PAIR pairs[2] = {NULL, NULL};
+    size_t counts[2] = {0, 0};
+    size_t capacities[2] = {0, 0};
+    PUSN_HISTORY_PAIR block = NULL;
+    wchar_t temp[MAX_PATH] = {0};
+    uint64_t offset = USN_PAGE_SIZE;
+    FILE* fp;
+    BOOL status = TRUE;
+
+    if( _UsnpOpenArchiveSource(archivename, NULL, &Source) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pArchive = (PUSN_ARCHIVE)Source.Context;
+
+    block = (PUSN_HISTORY_PAIR)_UsnpAlloc(_USN_ARCHIVE_RECORDS * sizeof(USN_HISTORY_PAIR));
+    if(block == NULL)
+    {
+        /*++ last error set by call ... */
+        Source.Close(&Source);
+        return FALSE;
+    }
+
+    for(size_t index=0; (index<pArchive->BlockCount) && (status != FALSE); index++)
+    {
+        uint64_t at = (uint64_t)(pArchive->Blocks[index].Offset - sizeof(USN_ARCHIVE_BLOCK));
+
+        status = _UsnpArchiveLoad(pArchive, index);
+        for(DWORD table=0; (table<_countof(pairs)) && (status != FALSE); table++)
+        {
+            size_t count = 0;
+
+            for(uint64_t record=0; record<pArchive->Memory.Count; record++)
+            {
+                FILE_ID_128 FileId;
+                FILE_ID_128 Parent;
+
+                if( _UsnpGetRecordFileIds((PUSN_RECORD_COMMON_HEADER)(pArchive->Memory.Records + pArchive->Memory.Offsets[record]), &FileId, &Parent))
+                {
+                    RtlMoveMemory(&(block[count].Frn), ((table == _USN_HISTORY_FILES) ? &FileId : &Parent), sizeof(FILE_ID_128));
+                    block[count].Offset = at;
+                    count++;
+                }
+            }
+            qsort(block, count, sizeof(USN_HISTORY_PAIR), _UsnpCompareHistoryPair);
+
+            if((counts[table] + count) > capacities[table])
+            {
+                size_t capacity = ((capacities[table] == 0) ? 65536 : capacities[table]);
+                PUSN_HISTORY_PAIR grown;
+
+                while(capacity < (counts[table] + count))
+                {
+                    capacity *= 2;
+                }
+                grown = (PUSN_HISTORY_PAIR)realloc(pairs[table], capacity * sizeof(USN_HISTORY_PAIR));
+                if(grown == NULL)
+                {
+                    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                    status = FALSE;
+                    break;
+                }
+                pairs[table] = grown;
+                capacities[table] = capacity;
+            }
+
+            for(size_t entry=0; entry<count; entry++)
+            {
+                if((entry == 0) || (_UsnpCompareHistoryKey(&(block[entry].Frn), &(block[entry - 1].Frn)) != 0))
+                {
+                    pairs[table][counts[table]++] = block[entry];
+                }
+            }
+        }
+    }
+
+    if(status != FALSE)
+    {
+        Header.Signature    = _USN_HISTORY_SIGNATURE;
+        Header.Version      = _USN_HISTORY_VERSION;
+        Header.HeaderSize   = sizeof(USN_HISTORY_HEADER);
+        Header.UsnJournalID = pArchive->Header.JournalData.UsnJournalID;
+        Header.ArchiveSize  = (uint64_t)pArchive->Size;
+        Header.Blocks       = pArchive->BlockCount;
+
+        /*++ postings are already in block order within a key; sorting keeps them so ... */
+        for(DWORD table=0; table<_countof(pairs); table++)
+        {
+            PUSN_HISTORY_TABLE pTable = &(Header.Tables[table]);
+            uint64_t keys = 0;
+
+            qsort(pairs[table], counts[table], sizeof(USN_HISTORY_PAIR), _UsnpCompareHistoryPair);
+            for(size_t index=0; index<counts[table]; index++)
+            {
+                if((index == 0) || (_UsnpCompareHistoryKey(&(pairs[table][index].Frn), &(pairs[table][index - 1].Frn)) != 0))
+                {
+                    keys++;
+                }
+            }
+
+            pTable->Keys           = keys;
+            pTable->KeysOffset     = offset;
+            pTable->Postings       = counts[table];
+            pTable->PostingsOffset = offset + ((keys * sizeof(USN_HISTORY_KEY) + USN_PAGE_SIZE - 1) & ~(uint64_t)(USN_PAGE_SIZE - 1));
+            offset = pTable->PostingsOffset + ((counts[table] * sizeof(uint64_t) + USN_PAGE_SIZE - 1) & ~(uint64_t)(USN_PAGE_SIZE - 1));
+        }
+
+        _snwprintf_s(temp, _countof(temp), _countof(temp), L"%ls.tmp", filename);
+        fp = _UsnpOpenStream(temp, L"wb");
+        if(fp == NULL)
+        {
+            /*++ last error set by call ... */
+            status = FALSE;
+        }
+        else
+        {
+            status = (fwrite(&Header, sizeof(Header), 1, fp) == 1) &&
+                     _UsnpWriteHistoryTable(fp, &(Header.Tables[_USN_HISTORY_FILES]), pairs[_USN_HISTORY_FILES], counts[_USN_HISTORY_FILES]) &&
+                     _UsnpWriteHistoryTable(fp, &(Header.Tables[_USN_HISTORY_CHILDREN]), pairs[_USN_HISTORY_CHILDREN], counts[_USN_HISTORY_CHILDREN]);
+
+            if(fclose(fp) != 0)
+            {
+                status = FALSE;
+            }
+            if(status == FALSE)
+            {
+                SetLastError(ERROR_WRITE_FAULT);
+            }
+            else
+            {
+                status = _UsnpReplaceFile(temp, filename);
+            }
+        }
+    }
+
+    _UsnpFree(pairs[0]);
+    _UsnpFree(pairs[1]);
+    _UsnpFree(block);
+    Source.Close(&Source);
+    return status;
+}
+
+/*++
+ * map a history index. it has to be for this archive as it is now; one
+ * built before the archive last grew is ERROR_INVALID_DATA, and is built
+ * again ...
+ */
+BOOL
+_UsnpLoadHistoryIndex (
+    __in wchar_t* filename,
+    __in PUSN_ARCHIVE pArchive,
+    __out PUSN_MAPPING pMapping )
+{
+    PUSN_HISTORY_HEADER pHeader;
+
+    if( _UsnpMapFile(filename, FALSE, pMapping) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    pHeader = (PUSN_HISTORY_HEADER)pMapping->Base;
+    if((pMapping->Size < sizeof(USN_HISTORY_HEADER)) ||
+       (pHeader->Signature != _USN_HISTORY_SIGNATURE) ||
+       (pHeader->Version != _USN_HISTORY_VERSION) ||
+       (pHeader->HeaderSize != sizeof(USN_HISTORY_HEADER)))
+    {
+        _UsnpUnmapFile(pMapping);
+        SetLastError(ERROR_BAD_FORMAT);
+        return FALSE;
+    }
+
+    for(DWORD table=0; table<_countof(pHeader->Tables); table++)
+    {
+        PUSN_HISTORY_TABLE pTable = &(pHeader->Tables[table]);
+
+        if((pTable->KeysOffset > pMapping->Size) || (pTable->Keys > ((pMapping->Size - pTable->KeysOffset) / sizeof(USN_HISTORY_KEY))) ||
+           (pTable->PostingsOffset > pMapping->Size) || (pTable->Postings > ((pMapping->Size - pTable->PostingsOffset) / sizeof(uint64_t))) ||
+           ((pTable->KeysOffset | pTable->PostingsOffset) & (sizeof(uint64_t) - 1)))
+        {
+            _UsnpUnmapFile(pMapping);
+            SetLastError(ERROR_BAD_FORMAT);
+            return FALSE;
+        }
+    }
+
+    if((pHeader->UsnJournalID != pArchive->Header.JournalData.UsnJournalID) || (pHeader->ArchiveSize != (uint64_t)pArchive->Size))
+    {
+        /*++ the archive has grown, or was replaced, since ... */
+        _UsnpUnmapFile(pMapping);
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++ the block offsets key is in, in file order; 0 if it is in none ... */
+DWORD
+_UsnpHistoryLookup (
+    __in PUSN_MAPPING pMapping,
+    __in DWORD table,
+    __in FILE_ID_128* pKey,
+    __out const uint64_t** ppPostings )
+{
+    PUSN_HISTORY_HEADER pHeader = (PUSN_HISTORY_HEADER)pMapping->Base;
+    PUSN_HISTORY_TABLE pTable = &(pHeader->Tables[table]);
+    const USN_HISTORY_KEY* keys = (const USN_HISTORY_KEY*)(pMapping->Base + pTable->KeysOffset);
+    ULARGE_INTEGER128 key;
+    uint64_t lo = 0;
+    uint64_t hi = pTable->Keys;
+
+    RtlMoveMemory(&key, pKey, sizeof(key));
+    while(lo < hi)
+    {
+        uint64_t mid = lo + ((hi - lo) / 2);
+        int order = _UsnpCompareHistoryKey(&(keys[mid].Frn), &key);
+
+        if(order == 0)
+        {
+            if((uint64_t)keys[mid].First + keys[mid].Count > pTable->Postings)
+            {
+                break;
+            }
+            *ppPostings = (const uint64_t*)(pMapping->Base + pTable->PostingsOffset) + keys[mid].First;
+            return keys[mid].Count;
+        }
+        if(order < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    *ppPostings = NULL;
+    return 0;
+}
+
+/*++
+ * narrow an archive to the blocks the query's frns are in, from the index
+ * beside it, built first if it is missing or out of date. only those
+ * blocks' headers are read; the rest of the archive is never touched ...
+ */
+BOOL
+_UsnpQueryHistoryIndex (
+    __inout PUSN_ARCHIVE pArchive,
+    __in wchar_t* filename )
+{
+    wchar_t indexname[MAX_PATH] = {0};
+    USN_MAPPING Mapping = {0};
+    const uint64_t* postings[2] = {NULL, NULL};
+    DWORD counts[2] = {0, 0};
+    DWORD at[2] = {0, 0};
+
+    _snwprintf_s(indexname, _countof(indexname), _countof(indexname), L"%ls.idx", filename);
+
+    if( _UsnpLoadHistoryIndex(indexname, pArchive, &Mapping) == FALSE)
+    {
+        if( (_UsnpBuildHistoryIndex(filename, indexname) == FALSE) ||
+            (_UsnpLoadHistoryIndex(indexname, pArchive, &Mapping) == FALSE))
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        fwprintf(g_info, L"history index(%ls), built\n", indexname);
+    }
+
+    for(DWORD table=0; table<_countof(postings); table++)
+    {
+        if((pArchive->Query.Match & (1 << table)) != 0)
+        {
+            counts[table] = _UsnpHistoryLookup(&Mapping, table, ((table == _USN_HISTORY_FILES) ? &(pArchive->Query.File) : &(pArchive->Query.Parent)), &(postings[table]));
+        }
+    }
+
+    pArchive->Blocks = (PUSN_ARCHIVE_INDEX)_UsnpAlloc(((size_t)counts[0] + counts[1] + 1) * sizeof(USN_ARCHIVE_INDEX));
+    if(pArchive->Blocks == NULL)
+    {
+        /*++ last error set by call ... */
+        _UsnpUnmapFile(&Mapping);
+        return FALSE;
+    }
+
+    /*++ both runs are in file order; merge them, a block in both once ... */
+    while((at[0] < counts[0]) || (at[1] < counts[1]))
+    {
+        PUSN_ARCHIVE_INDEX pIndex = &(pArchive->Blocks[pArchive->BlockCount]);
+        uint64_t offset;
+
+        if((at[1] == counts[1]) || ((at[0] < counts[0]) && (postings[0][at[0]] <= postings[1][at[1]])))
+        {
+            offset = postings[0][at[0]++];
+        }
+        else
+        {
+            offset = postings[1][at[1]++];
+        }
+
+        if((pArchive->BlockCount > 0) && ((uint64_t)(pIndex[-1].Offset - sizeof(USN_ARCHIVE_BLOCK)) == offset))
+        {
+            continue;
+        }
+
+        if( _UsnpReadArchiveBlock(pArchive->fp, (LONGLONG)offset, pArchive->Size, &(pIndex->Block)) == FALSE)
+        {
+            /*++ last error set by call ... */
+            _UsnpUnmapFile(&Mapping);
+            return FALSE;
+        }
+        pIndex->Offset = (LONGLONG)offset + (LONGLONG)sizeof(USN_ARCHIVE_BLOCK);
+        pArchive->BlockCount++;
+    }
+
+    _UsnpUnmapFile(&Mapping);
+    return TRUE;
+}
+
+/*++ is the record one the query asked for ... */
+BOOL
+_UsnpIsHistoryMatch (
+    __in PUSN_HISTORY_QUERY pQuery,
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    FILE_ID_128 FileId;
+    FILE_ID_128 Parent;
+
+    if( _UsnpGetRecordFileIds(pRecord, &FileId, &Parent) == FALSE)
+    {
+        return FALSE;
+    }
+    return ( (((pQuery->Match & (1 << _USN_HISTORY_FILES)) != 0) && _UsnpIsEqualFileReference(&FileId, &(pQuery->File))) ||
+             (((pQuery->Match & (1 << _USN_HISTORY_CHILDREN)) != 0) && _UsnpIsEqualFileReference(&Parent, &(pQuery->Parent))) );
+}
+
+/*++
+ * a record printed the way it used to be, one swprintf for the record and
+ * one a byte for the dump; the benchmark's yardstick ...
+ */
+size_t
+_UsnpBenchPrintfRecord (
+    __in PUSN_RESOLVER pResolver,
+    __in USN_RECORD_V3* pRecord,
+    __out_ecount(cchtext) wchar_t* text,
+    __in size_t cchtext )
+{
+    wchar_t buffer[MAX_PATH] = {0};
+    wchar_t timestamp[MAX_PATH] = {0};
+    wchar_t filename[MAX_PATH] = {0};
+    size_t cchfilename;
+    ULARGE_INTEGER128* refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
+    ULARGE_INTEGER128* parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+    size_t length;
+
+    cchfilename = _UsnpNameToWide (
+     (WCHAR*)((char*)pRecord + pRecord->FileNameOffset),
+     (pRecord->FileNameLength / sizeof(WCHAR)),
+     filename,
+     _countof(filename)
+     );
+
+    if( _UsnpFormatTimestamp(&(pRecord->TimeStamp), timestamp, _countof(timestamp)) == FALSE)
+    {
+        _snwprintf_s(timestamp, _countof(timestamp), _countof(timestamp), L"[error(%X)]", GetLastError());
+    }
+
+    if( _UsnpResolvePath(pResolver, &(pRecord->ParentFileReferenceNumber), buffer, _countof(buffer)) == FALSE)
+    {
+        _snwprintf_s(buffer, _countof(buffer), _countof(buffer), L"[error(%X)]", GetLastError());
+    }
+
+    length = (size_t)_snwprintf_s (
+     text,
+     cchtext,
+     cchtext,
+     L">>>>>>>>\n"
+     L"  FRN                 %016llX%016llX\n"
+     L"  Parent FRN          %016llX%016llX - %ls\n"
+     L"  USN                 %016llX\n"
+     L"  Reason              %08X\n"
+     L"  Attributes          %08X\n"
+     L"  FileName            %.*ls\n"
+     L"  TimeStamp           %016llX - %ls\n",
+     (unsigned long long)refnum->HighPart, (unsigned long long)refnum->LowPart,
+     (unsigned long long)parent->HighPart, (unsigned long long)parent->LowPart,
+     buffer,
+     pRecord->Usn,
+     pRecord->Reason,
+     pRecord->FileAttributes,
+     (int)cchfilename,
+     filename,
+     pRecord->TimeStamp.QuadPart,
+     timestamp
+     );
+
+    if(g_dump)
+    {
+        uint8_t* bytes = (uint8_t*)pRecord;
+        for(DWORD index=0; (index<pRecord->RecordLength) && ((length + 128) < cchtext); index += 16)
+        {
+            length += (size_t)_snwprintf_s(text + length, cchtext - length, cchtext - length, L"%p  %08X  ", (void*)(bytes + index), index);
+            for(DWORD jndex=0; jndex<16; jndex++)
+            {
+                if((index + jndex) < pRecord->RecordLength)
+                {
+                    length += (size_t)_snwprintf_s(text + length, cchtext - length, cchtext - length, L"%02X ", bytes[(index + jndex)]);
+                }
+                else
+                {
+                    length += (size_t)_snwprintf_s(text + length, cchtext - length, cchtext - length, L"%*C ", 2, ' ');
+                }
+            }
+            length += (size_t)_snwprintf_s(text + length, cchtext - length, cchtext - length, L"| ");
+            for(DWORD kndex=0; kndex<16; kndex++)
+            {
+                uint8_t ch = (((index + kndex) < pRecord->RecordLength) ? bytes[(index + kndex)] : ' ');
+                length += (size_t)_snwprintf_s(text + length, cchtext - length, cchtext - length, L"%C", (((ch < 0x20) || (ch > 0x7F)) ? '.' : ch));
+            }
+            length += (size_t)_snwprintf_s(text + length, cchtext - length, cchtext - length, L" |\n");
+        }
+    }
+    return length;
+}
+
+/*++
+ * -bench format n. n synthetic records go through the record view, in
+ * the -format given, into an output buffer that is emptied instead of
+ * written, then through the old swprintf path for comparison; -d adds the
+ * dump to both and -synthpaths gives them parent paths ...
+ */
+BOOL
+_UsnpBenchFormat (
+    __in uint64_t count )
+{
+    USN_SYNTH Synth = {0};
+    USN_SYNTH_MEMORY Memory = {0};
+    USN_STATS Stats = {0};
+    USN_RESOLVER Resolver = {0};
+    USN_OUTPUT Output = {0};
+    wchar_t* text = NULL;
+    size_t cchtext = 16384;
+    uint64_t bytes = 0;
+    uint64_t buffered;
+    uint64_t printed;
+    uint64_t start;
+
+    Synth.Sink = _UsnpSynthMemorySink;
+    Synth.Context = &Memory;
+
+    text = (wchar_t*)_UsnpAlloc(cchtext * sizeof(wchar_t));
+    if((text == NULL) || (_UsnpSynthesize(&Synth, count) == FALSE))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(text);
+        _UsnpFreeSynthMemory(&Memory);
+        return FALSE;
+    }
+
+    /*++ each pass gets a cold resolver of its own ... */
+    Output.File = -1;
+    _UsnpOpenResolver(NULL, &Stats, &Resolver);
+    g_output = &Output;
+    start = _UsnpQueryClock();
+    for(uint64_t index=0; index<Memory.Count; index++)
+    {
+        _UsnpFormatRecord(&Resolver, (USN_RECORD_UNION*)(Memory.Records + Memory.Offsets[index]));
+        if(Output.Length >= _USN_OUTPUT_SIZE)
+        {
+            bytes += Output.Length;
+            Output.Length = 0;
+        }
+    }
+    bytes += Output.Length;
+    buffered = _UsnpQueryClock() - start;
+    g_output = NULL;
+    _UsnpCloseResolver(&Resolver);
+
+    _UsnpOpenResolver(NULL, &Stats, &Resolver);
+    start = _UsnpQueryClock();
+    for(uint64_t index=0; index<Memory.Count; index++)
+    {
+        _UsnpBenchPrintfRecord(&Resolver, (USN_RECORD_V3*)(Memory.Records + Memory.Offsets[index]), text, cchtext);
+    }
+    printed = _UsnpQueryClock() - start;
+    _UsnpCloseResolver(&Resolver);
+
+    if(buffered == 0)
+    {
+        buffered = 1;
+    }
+    if(printed == 0)
+    {
+        printed = 1;
+    }
+
+    fwprintf(stdout,
+     L"BENCH FORMAT %ls%ls\n"
+     L"  Records             %llu\n"
+     L"  Output              %llu bytes\n"
+     L"  Buffered            %.3f s, %.0f records/s, %.1f MB/s\n"
+     L"  swprintf            %.3f s, %.0f records/s\n"
+     L"  Speedup             %.1fx\n",
+     ((g_format == _USN_FORMAT_JSON) ? L"JSON" : ((g_format == _USN_FORMAT_CSV) ? L"CSV" : L"TEXT")),
+     (((g_dump) && (g_format == _USN_FORMAT_TEXT)) ? L", WITH DUMP" : L""),
+     (unsigned long long)Memory.Count,
+     (unsigned long long)bytes,
+     (double)buffered / 1000000.0,
+     ((double)Memory.Count * 1000000.0) / (double)buffered,
+     ((double)bytes / (1024.0 * 1024.0)) / ((double)buffered / 1000000.0),
+     (double)printed / 1000000.0,
+     ((double)Memory.Count * 1000000.0) / (double)printed,
+     (double)printed / (double)buffered
+     );
+
+    _UsnpFreeOutput(&Output);
+    _UsnpFree(text);
+    _UsnpFreeSynthMemory(&Memory);
+    return TRUE;
+}
+
+/*++
+ * a timestamp the way it used to be done, FileTimeToSystemTime and then
+ * swprintf; the yardstick and the check for -bench time ...
+ */
+BOOL
+_UsnpBenchReferenceTimestamp (
+    __in LONGLONG ticks,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    FILETIME rectime = {0};
+    SYSTEMTIME systime = {0};
+
+    rectime.dwLowDateTime  = (DWORD)ticks;
+    rectime.dwHighDateTime = (DWORD)((uint64_t)ticks >> 32);
+
+    if( FileTimeToSystemTime(&rectime, &systime) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    _snwprintf_s (
+     buffer,
+     cchbuffer,
+     cchbuffer,
+     L"%u-%02u-%02u %02u:%02u:%02u.%03u",
+     systime.wYear, systime.wMonth, systime.wDay,
+     systime.wHour, systime.wMinute, systime.wSecond, systime.wMilliseconds
+     );
+    return TRUE;
+}
+
+/*++
+ * -bench time n. n timestamps a fraction of a millisecond apart, the way
+ * records arrive, and then n scattered over nine centuries so that each
+ * is a new second; every one through the cached formatter and the old
+ * path, and the two checked against each other ...
+ */
+BOOL
+_UsnpBenchTime (
+    __in uint64_t count )
+{
+    LONGLONG* stamps;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t mismatches = 0;
+    uint64_t checksum = 0;
+    uint64_t cached[2] = {0};
+    uint64_t reference[2] = {0};
+    uint8_t text[40];
+    wchar_t expected[64];
+
+    if(count == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    stamps = (LONGLONG*)_UsnpAlloc((size_t)count * sizeof(LONGLONG));
+    if(stamps == NULL)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    for(int pass=0; pass<2; pass++)
+    {
+        LONGLONG ticks = 0x01D63C5D4ABBA32BLL;
+        uint64_t start;
+
+        for(uint64_t index=0; index<count; index++)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            if(pass == 0)
+            {
+                ticks += (LONGLONG)(seed % 10000);
+            }
+            else
+            {
+                ticks = (LONGLONG)(seed % 0x0400000000000000ULL);
+            }
+            stamps[index] = ticks;
+        }
+
+        start = _UsnpQueryClock();
+        for(uint64_t index=0; index<count; index++)
+        {
+            checksum += _UsnpPutTimestamp(text, stamps[index], _USN_TIME_NT);
+        }
+        cached[pass] = _UsnpQueryClock() - start;
+
+        start = _UsnpQueryClock();
+        for(uint64_t index=0; index<count; index++)
+        {
+            _UsnpBenchReferenceTimestamp(stamps[index], expected, _countof(expected));
+        }
+        reference[pass] = _UsnpQueryClock() - start;
+
+        for(uint64_t index=0; index<count; index++)
+        {
+            size_t length = _UsnpPutTimestamp(text, stamps[index], _USN_TIME_NT);
+            size_t position = 0;
+
+            _UsnpBenchReferenceTimestamp(stamps[index], expected, _countof(expected));
+            while((position < length) && (expected[position] == (wchar_t)text[position]))
+            {
+                position++;
+            }
+            if((position != length) || (expected[position] != L'\0'))
+            {
+                mismatches++;
+            }
+        }
+    }
+
+    fwprintf(stdout,
+     L"BENCH TIME\n"
+     L"  Timestamps          %llu\n"
+     L"  Burst               %.3f s, old %.3f s, %.1fx\n"
+     L"  Scattered           %.3f s, old %.3f s, %.1fx\n"
+     L"  Mismatches          %llu\n",
+     (unsigned long long)count,
+     (double)cached[0] / 1000000.0, (double)reference[0] / 1000000.0, (double)reference[0] / (double)((cached[0] != 0) ? cached[0] : 1),
+     (double)cached[1] / 1000000.0, (double)reference[1] / 1000000.0, (double)reference[1] / (double)((cached[1] != 0) ? cached[1] : 1),
+     (unsigned long long)mismatches
+     );
+
+    _UsnpFree(stamps);
+    return ((checksum != 0) && (mismatches == 0));
+}
+
+/*++ read a source to the end the way the record reader does; records seen ... */
+BOOL
+_UsnpBenchDrain (
+    __in PUSN_SOURCE pSource,
+    __out uint64_t* pRecords )
+{
+    char buffer[_USN_BUFFER_SIZE];
+    READ_USN_JOURNAL_DATA ReadData = {0};
+    DWORD bytes = 0;
+
+    ReadData.ReasonMask      = _USN_REASON_ALL;
+    ReadData.MinMajorVersion = 2;
+    ReadData.MaxMajorVersion = 4;
+    *pRecords = 0;
+
+    while(1)
+    {
+        DWORD offset = sizeof(USN);
+
+        if( pSource->Read(pSource, &ReadData, buffer, sizeof(buffer), &bytes) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        if(bytes <= sizeof(USN))
+        {
+            return TRUE;
+        }
+        while(offset < bytes)
+        {
+            offset += ((PUSN_RECORD_COMMON_HEADER)(buffer + offset))->RecordLength;
+            (*pRecords)++;
+        }
+        RtlMoveMemory(&(ReadData.StartUsn), buffer, sizeof(USN));
+    }
+}
+
+/*++
+ * -bench history <n> on the archive given with -fromarchive; the history
+ * of n files spread through it, once through the index and once by
+ * decoding the whole archive, checking the two find the same records ...
+ */
+BOOL
+_UsnpBenchHistory (
+    __in uint64_t count )
+{
+    USN_SOURCE Scan = {0};
+    PUSN_ARCHIVE pScan;
+    USN_MAPPING Mapping = {0};
+    PUSN_HISTORY_HEADER pHeader;
+    const USN_HISTORY_KEY* keys;
+    wchar_t indexname[MAX_PATH] = {0};
+    uint64_t records = 0;
+    uint64_t found = 0;
+    uint64_t mismatches = 0;
+    uint64_t indexed = 0;
+    uint64_t scanned = 0;
+    uint64_t indexedblocks = 0;
+    uint64_t scannedblocks = 0;
+    uint64_t built;
+    uint64_t start;
+    BOOL status = TRUE;
+
+    if((count == 0) || (g_fromarchive == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    _snwprintf_s(indexname, _countof(indexname), _countof(indexname), L"%ls.idx", g_fromarchive);
+
+    start = _UsnpQueryClock();
+    if( _UsnpBuildHistoryIndex(g_fromarchive, indexname) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    built = _UsnpQueryClock() - start;
+
+    if( _UsnpOpenArchiveSource(g_fromarchive, NULL, &Scan) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+    pScan = (PUSN_ARCHIVE)Scan.Context;
+    for(size_t index=0; index<pScan->BlockCount; index++)
+    {
+        records += pScan->Blocks[index].Block.Records;
+    }
+
+    if( _UsnpLoadHistoryIndex(indexname, pScan, &Mapping) == FALSE)
+    {
+        /*++ last error set by call ... */
+        Scan.Close(&Scan);
+        return FALSE;
+    }
+    pHeader = (PUSN_HISTORY_HEADER)Mapping.Base;
+    keys = (const USN_HISTORY_KEY*)(Mapping.Base + pHeader->Tables[_USN_HISTORY_FILES].KeysOffset);
+    if(count > pHeader->Tables[_USN_HISTORY_FILES].Keys)
+    {
+        count = pHeader->Tables[_USN_HISTORY_FILES].Keys;
+    }
+
+    for(uint64_t lookup=0; (lookup<count) && (status != FALSE); lookup++)
+    {
+        USN_HISTORY_QUERY Query = {0};
+        USN_SOURCE Source = {0};
+        uint64_t hits = 0;
+        uint64_t expected = 0;
+
+        Query.Match = (1 << _USN_HISTORY_FILES);
+        RtlMoveMemory(&(Query.File), &(keys[(lookup * pHeader->Tables[_USN_HISTORY_FILES].Keys) / count].Frn), sizeof(FILE_ID_128));
+
+        start = _UsnpQueryClock();
+        status = _UsnpOpenArchiveSource(g_fromarchive, &Query, &Source);
+        if(status != FALSE)
+        {
+            status = _UsnpBenchDrain(&Source, &hits);
+            indexedblocks += ((PUSN_ARCHIVE)Source.Context)->Decoded;
+            Source.Close(&Source);
+        }
+        indexed += _UsnpQueryClock() - start;
+
+        if(status != FALSE)
+        {
+            start = _UsnpQueryClock();
+            pScan->Decoded = 0;
+            pScan->Query = Query;
+            status = _UsnpBenchDrain(&Scan, &expected);
+            scannedblocks += pScan->Decoded;
+            scanned += _UsnpQueryClock() - start;
+        }
+
+        found += hits;
+        if(hits != expected)
+        {
+            mismatches++;
+        }
+    }
+
+    if(status != FALSE)
+    {
+        fwprintf(stdout,
+         L"BENCH HISTORY %ls\n"
+         L"  Records             %llu in %llu blocks\n"
+         L"  Index               %.3f s, %llu files, %llu parents\n"
+         L"  Lookups             %llu, %llu records found\n"
+         L"  Indexed             %.3f ms a lookup, %.1f blocks decoded\n"
+         L"  Scanned             %.3f ms a lookup, %.1f blocks decoded, %.1fx\n"
+         L"  Mismatches          %llu\n",
+         g_fromarchive,
+         (unsigned long long)records, (unsigned long long)pScan->BlockCount,
+         (double)built / 1000000.0,
+         (unsigned long long)pHeader->Tables[_USN_HISTORY_FILES].Keys,
+         (unsigned long long)pHeader->Tables[_USN_HISTORY_CHILDREN].Keys,
+         (unsigned long long)count, (unsigned long long)found,
+         (double)indexed / 1000.0 / (double)count, (double)indexedblocks / (double)count,
+         (double)scanned / 1000.0 / (double)count, (double)scannedblocks / (double)count,
+         (double)scanned / (double)((indexed != 0) ? indexed : 1),
+         (unsigned long long)mismatches
+         );
+    }
+
+    _UsnpUnmapFile(&Mapping);
+    Scan.Close(&Scan);
+    return ((status != FALSE) && (mismatches == 0));
+}
+
+/*++
+ * -bench prefilter <n>. n synthetic records, cut into buffers the size a
+ * read fills, walked for closes and -filter, or without one for archive
+ * files in two of the directories; a record at a time and then batched
+ * with each select routine the processor has, the best of a few rounds
+ * each, checking they all keep the same records. -q is implied ...
+ */
+BOOL
+_UsnpBenchPrefilter (
+    __in uint64_t count )
+{
+    const wchar_t* names[] = { L"Per record", L"Scalar", L"SSE2", L"AVX2" };
+    const DWORD modes[] = { _USN_SIMD_OFF, _USN_SIMD_SCALAR, _USN_SIMD_SSE2, _USN_SIMD_AVX2 };
+    USN_SYNTH Synth = {0};
+    USN_SYNTH_MEMORY Memory = {0};
+    USN_FILTER Filter = {0};
+    PUSN_FILTER pFilter = &g_filter;
+    USN_STATS Expected = {0};
+    PUSN_SELECT_ROUTINE select = g_select;
+    int quiet = g_quiet;
+    wchar_t text[128] = L"WITH FILTER";
+    size_t* cuts = NULL;
+    size_t cutcount = 0;
+    uint64_t elapsed[4] = {0};
+    uint64_t mismatches = 0;
+
+    Synth.Sink = _UsnpSynthMemorySink;
+    Synth.Context = &Memory;
+
+    if((count == 0) || (_UsnpSynthesize(&Synth, count) == FALSE))
+    {
+        /*++ last error set by call ... */
+        _UsnpFreeSynthMemory(&Memory);
+        return FALSE;
+    }
+
+    if(g_filter.Ops == NULL)
+    {
+        ULARGE_INTEGER128 first;
+        ULARGE_INTEGER128 middle;
+
+        RtlMoveMemory(&first, &(((USN_RECORD_V3*)(Memory.Records + Memory.Offsets[0]))->ParentFileReferenceNumber), sizeof(first));
+        RtlMoveMemory(&middle, &(((USN_RECORD_V3*)(Memory.Records + Memory.Offsets[Memory.Count / 2]))->ParentFileReferenceNumber), sizeof(middle));
+        _snwprintf_s(text, _countof(text), _countof(text), L"attr:0x20 and parent:0x%016llX%016llX,0x%016llX%016llX",
+                     (unsigned long long)first.HighPart, (unsigned long long)first.LowPart,
+                     (unsigned long long)middle.HighPart, (unsigned long long)middle.LowPart);
+        if( _UsnpCompileFilter(text, &Filter) == FALSE)
+        {
+            /*++ last error set by call ... */
+            _UsnpFreeSynthMemory(&Memory);
+            return FALSE;
+        }
+        pFilter = &Filter;
+    }
+
+    cuts = (size_t*)_UsnpAlloc((size_t)(Memory.Count + 1) * sizeof(size_t));
+    if(cuts == NULL)
+    {
+        /*++ last error set by call ... */
+        _UsnpFreeFilter(&Filter);
+        _UsnpFreeSynthMemory(&Memory);
+        return FALSE;
+    }
+    for(uint64_t index=0; index<Memory.Count; index++)
+    {
+        if((cutcount == 0) || ((Memory.Offsets[index] + ((PUSN_RECORD_COMMON_HEADER)(Memory.Records + Memory.Offsets[index]))->RecordLength - cuts[cutcount - 1]) > _USN_BUFFER_SIZE))
+        {
+            cuts[cutcount++] = Memory.Offsets[index];
+        }
+    }
+    cuts[cutcount] = Memory.Length;
+
+    g_quiet = 1;
+    for(DWORD pass=0; pass<_countof(modes); pass++)
+    {
+        g_select = ((modes[pass] == _USN_SIMD_OFF) ? NULL : _UsnpGetSelectRoutine(modes[pass]));
+        if((modes[pass] != _USN_SIMD_OFF) && (g_select == NULL))
+        {
+            continue;
+        }
+
+        for(DWORD round=0; round<5; round++)
+        {
+            USN_WALK Walk = {0};
+            USN_PREFILTER Prefilter;
+            USN_STATS Stats = {0};
+            USN_RESOLVER Resolver = {0};
+            uint64_t start;
+
+            /*++ a resolver as any run has, watching the journal go by ... */
+            _UsnpOpenResolver(NULL, &Stats, &Resolver);
+            Walk.pResolver  = &Resolver;
+            Walk.pFilter    = pFilter;
+            Walk.ReasonMask = USN_REASON_CLOSE;
+            Walk.pStats     = &Stats;
+            _UsnpOpenPrefilter(&Walk, &Prefilter);
+
+            start = _UsnpQueryClock();
+            for(size_t cut=0; cut<cutcount; cut++)
+            {
+                _UsnpWalkRecords(&Walk, Memory.Records + cuts[cut], cuts[cut + 1] - cuts[cut]);
+            }
+            start = _UsnpQueryClock() - start;
+            _UsnpCloseResolver(&Resolver);
+
+            if((elapsed[pass] == 0) || (start < elapsed[pass]))
+            {
+                elapsed[pass] = ((start != 0) ? start : 1);
+            }
+
+            if((pass == 0) && (round == 0))
+            {
+                Expected = Stats;
+            }
+            else if((Stats.Records != Expected.Records) || (Stats.Bytes != Expected.Bytes) || (Stats.LastUsn != Expected.LastUsn))
+            {
+                mismatches++;
+            }
+        }
+    }
+    g_quiet = quiet;
+    g_select = select;
+
+    fwprintf(stdout,
+     L"BENCH PREFILTER %ls\n"
+     L"  Records             %llu in %llu buffers\n"
+     L"  Kept                %llu\n",
+     text,
+     (unsigned long long)Memory.Count, (unsigned long long)cutcount,
+     (unsigned long long)Expected.Records
+     );
+    for(DWORD pass=0; pass<_countof(modes); pass++)
+    {
+        if(elapsed[pass] == 0)
+        {
+            fwprintf(stdout, L"  %-19ls not here\n", names[pass]);
+            continue;
+        }
+        fwprintf(stdout,
+         L"  %-19ls %.3f s, %.0f records/s, %.1fx\n",
+         names[pass],
+         (double)elapsed[pass] / 1000000.0,
+         ((double)Memory.Count * 1000000.0) / (double)elapsed[pass],
+         (double)elapsed[0] / (double)elapsed[pass]
+         );
+    }
+    fwprintf(stdout, L"  Mismatches          %llu\n", (unsigned long long)mismatches);
+
+    _UsnpFree(cuts);
+    _UsnpFreeFilter(&Filter);
+    _UsnpFreeSynthMemory(&Memory);
+    return (mismatches == 0);
+}
+
+/*++
+ * -bench walk <n>. n synthetic records, cut into buffers the size a read
+ * fills, walked for every reason with the walk routines and then a record
+ * at a time, quiet and in each -format, the best of three rounds each
+ * after one that checks the two agree on the records counted and the
+ * bytes put out ...
+ */
+BOOL
+_UsnpBenchWalk (
+    __in uint64_t count )
+{
+    const wchar_t* names[] = { L"Text", L"JSON", L"CSV", L"Quiet" };
+    USN_SYNTH Synth = {0};
+    USN_SYNTH_MEMORY Memory = {0};
+    USN_OUTPUT Output = {0};
+    int quiet = g_quiet;
+    DWORD format = g_format;
+    size_t* cuts = NULL;
+    size_t cutcount = 0;
+    uint64_t mismatches = 0;
+
+    Synth.Sink = _UsnpSynthMemorySink;
+    Synth.Context = &Memory;
+
+    if((count == 0) || (_UsnpSynthesize(&Synth, count) == FALSE))
+    {
+        /*++ last error set by call ... */
+        _UsnpFreeSynthMemory(&Memory);
+        return FALSE;
+    }
+
+    cuts = (size_t*)_UsnpAlloc((size_t)(Memory.Count + 1) * sizeof(size_t));
+    if(cuts == NULL)
+    {
+        /*++ last error set by call ... */
+        _UsnpFreeSynthMemory(&Memory);
+        return FALSE;
+    }
+    for(uint64_t index=0; index<Memory.Count; index++)
+    {
+        if((cutcount == 0) || ((Memory.Offsets[index] + ((PUSN_RECORD_COMMON_HEADER)(Memory.Records + Memory.Offsets[index]))->RecordLength - cuts[cutcount - 1]) > _USN_BUFFER_SIZE))
+        {
+            cuts[cutcount++] = Memory.Offsets[index];
+        }
+    }
+    cuts[cutcount] = Memory.Length;
+
+    fwprintf(stdout,
+     L"BENCH WALK\n"
+     L"  Records             %llu in %llu buffers\n"
+     L"                      routines                  a record at a time\n",
+     (unsigned long long)Memory.Count, (unsigned long long)cutcount
+     );
+
+    /*++ the output is only counted, and hashed the first round, then emptied ... */
+    Output.File = -1;
+    g_output = &Output;
+    for(DWORD mode=0; mode<_countof(names); mode++)
+    {
+        uint64_t elapsed[2] = {0};
+        uint64_t hash[2] = {0};
+        USN_STATS Expected = {0};
+
+        g_quiet = ((mode == _USN_FORMAT_QUIET) ? 1 : 0);
+        g_format = ((mode == _USN_FORMAT_QUIET) ? _USN_FORMAT_TEXT : mode);
+
+        for(DWORD pass=0; pass<2; pass++)
+        {
+            for(DWORD round=0; round<4; round++)
+            {
+                USN_WALK Walk = {0};
+                USN_STATS Stats = {0};
+                USN_RESOLVER Resolver = {0};
+                uint64_t fnv = 0xCBF29CE484222325ULL;
+                uint64_t start;
+
+                _UsnpOpenResolver(NULL, &Stats, &Resolver);
+                Walk.pResolver  = &Resolver;
+                Walk.ReasonMask = _USN_REASON_ALL;
+                Walk.Generic    = (pass != 0);
+                Walk.pStats     = &Stats;
+
+                start = _UsnpQueryClock();
+                for(size_t cut=0; cut<cutcount; cut++)
+                {
+                    _UsnpWalkRecords(&Walk, Memory.Records + cuts[cut], cuts[cut + 1] - cuts[cut]);
+                    if(round == 0)
+                    {
+                        for(size_t index=0; index<Output.Length; index++)
+                        {
+                            fnv = (fnv ^ Output.Buffer[index]) * 0x100000001B3ULL;
+                        }
+                    }
+                    Output.Length = 0;
+                }
+                start = _UsnpQueryClock() - start;
+                _UsnpCloseResolver(&Resolver);
+
+                if(round == 0)
+                {
+                    hash[pass] = fnv;
+                    if(pass == 0)
+                    {
+                        Expected = Stats;
+                    }
+                    else if( (Stats.Records != Expected.Records) || (Stats.Bytes != Expected.Bytes) ||
+                             (Stats.FirstUsn != Expected.FirstUsn) || (Stats.LastUsn != Expected.LastUsn) ||
+                             (hash[1] != hash[0]))
+                    {
+                        mismatches++;
+                    }
+                }
+                else if((elapsed[pass] == 0) || (start < elapsed[pass]))
+                {
+                    elapsed[pass] = ((start != 0) ? start : 1);
+                }
+            }
+        }
+
+        fwprintf(stdout,
+         L"  %-19ls %.3f s, %.0f records/s  %.3f s, %.0f records/s, %.2fx\n",
+         names[mode],
+         (double)elapsed[0] / 1000000.0,
+         ((double)Memory.Count * 1000000.0) / (double)elapsed[0],
+         (double)elapsed[1] / 1000000.0,
+         ((double)Memory.Count * 1000000.0) / (double)elapsed[1],
+         (double)elapsed[1] / (double)elapsed[0]
+         );
+    }
+    g_output = NULL;
+    g_quiet = quiet;
+    g_format = format;
+    fwprintf(stdout, L"  Mismatches          %llu\n", (unsigned long long)mismatches);
+
+    _UsnpFreeOutput(&Output);
+    _UsnpFree(cuts);
+    _UsnpFreeSynthMemory(&Memory);
+    return (mismatches == 0);
+}
+
+/*++
+ * -bench names <n>. the names of n synthetic records against 8 globs and
+ * then 512, one set matched once a name and each glob matched in turn,
+ * checking the two agree. the set's time should hardly move with the
+ * count; the globs' grows with it ...
+ */
+BOOL
+_UsnpBenchNames (
+    __in uint64_t count )
+{
+    const wchar_t* common[] = { L"*.TMP", L"~$*", L"*.C", L"FILE1?.DAT", L"*CACHE*", L"DIR1", L"_CL_*", L"*.DLL" };
+    const DWORD sizes[] = { 8, 512 };
+    USN_SYNTH Synth = {0};
+    USN_SYNTH_MEMORY Memory = {0};
+    WCHAR* text = NULL;
+    BOOL status = TRUE;
+
+    Synth.Sink = _UsnpSynthMemorySink;
+    Synth.Context = &Memory;
+
+    text = (WCHAR*)_UsnpAlloc(512 * 16 * sizeof(WCHAR));
+    if((text == NULL) || (count == 0) || (_UsnpSynthesize(&Synth, count) == FALSE))
+    {
+        /*++ last error set by call ... */
+        _UsnpFree(text);
+        _UsnpFreeSynthMemory(&Memory);
+        return FALSE;
+    }
+
+    fwprintf(stdout, L"BENCH NAMES\n  Names               %llu\n", (unsigned long long)Memory.Count);
+
+    for(DWORD size=0; (size<_countof(sizes)) && (status != FALSE); size++)
+    {
+        USN_NAMESET Set;
+        USN_NAME_GLOB* globs;
+        DWORD length = 0;
+        uint64_t matched = 0;
+        uint64_t expected = 0;
+        uint64_t mismatches = 0;
+        uint64_t one;
+        uint64_t each;
+        uint64_t start;
+
+        /*++ the common ones, then made-up extensions, prefixes, names and fragments ... */
+        for(DWORD glob=0; glob<sizes[size]; glob++)
+        {
+            wchar_t made[16] = {0};
+            const wchar_t* source = ((glob < _countof(common)) ? common[glob] : made);
+
+            switch(glob % 4)
+            {
+            case 0: _snwprintf_s(made, _countof(made), _countof(made), L"*.X%u", glob); break;
+            case 1: _snwprintf_s(made, _countof(made), _countof(made), L"P%u_*", glob); break;
+            case 2: _snwprintf_s(made, _countof(made), _countof(made), L"NAME%u.TXT", glob); break;
+            case 3: _snwprintf_s(made, _countof(made), _countof(made), L"*Q%uQ*", glob); break;
+            }
+            if(length > 0)
+            {
+                text[length++] = L'|';
+            }
+            for(; *source; source++)
+            {
+                text[length++] = (WCHAR)*source;
+            }
+        }
+
+        if( _UsnpBuildNameSet(&Set, text, length) == FALSE)
+        {
+            /*++ last error set by call ... */
+            status = FALSE;
+            break;
+        }
+
+        /*++ the globs one by one, from the same text ... */
+        globs = (USN_NAME_GLOB*)_UsnpAlloc((size_t)sizes[size] * sizeof(USN_NAME_GLOB));
+        if(globs == NULL)
+        {
+            _UsnpFreeNameSet(&Set);
+            status = FALSE;
+            break;
+        }
+        for(DWORD glob=0, at=0; glob<sizes[size]; glob++)
+        {
+            globs[glob].Text = text + at;
+            for(; (at < length) && (text[at] != L'|'); at++);
+            globs[glob].Length = (DWORD)((text + at) - globs[glob].Text);
+            at++;
+        }
+
+        start = _UsnpQueryClock();
+        for(uint64_t index=0; index<Memory.Count; index++)
+        {
+            USN_RECORD_V3* pRecord = (USN_RECORD_V3*)(Memory.Records + Memory.Offsets[index]);
+            matched += _UsnpMatchNameSet(&Set, (WCHAR*)(((uint8_t*)pRecord) + pRecord->FileNameOffset), pRecord->FileNameLength / sizeof(WCHAR));
+        }
+        one = _UsnpQueryClock() - start;
+
+        start = _UsnpQueryClock();
+        for(uint64_t index=0; index<Memory.Count; index++)
+        {
+            USN_RECORD_V3* pRecord = (USN_RECORD_V3*)(Memory.Records + Memory.Offsets[index]);
+            WCHAR* name = (WCHAR*)(((uint8_t*)pRecord) + pRecord->FileNameOffset);
+            size_t cchname = pRecord->FileNameLength / sizeof(WCHAR);
+            BOOL hit = FALSE;
+
+            for(DWORD glob=0; (glob<sizes[size]) && (hit == FALSE); glob++)
+            {
+                hit = _UsnpMatchGlob(globs[glob].Text, globs[glob].Length, name, cchname);
+            }
+            expected += hit;
+        }
+        each = _UsnpQueryClock() - start;
+
+        /*++ and name by name, untimed ... */
+        for(uint64_t index=0; index<Memory.Count; index++)
+        {
+            USN_RECORD_V3* pRecord = (USN_RECORD_V3*)(Memory.Records + Memory.Offsets[index]);
+            WCHAR* name = (WCHAR*)(((uint8_t*)pRecord) + pRecord->FileNameOffset);
+            size_t cchname = pRecord->FileNameLength / sizeof(WCHAR);
+            BOOL hit = FALSE;
+
+            for(DWORD glob=0; (glob<sizes[size]) && (hit == FALSE); glob++)
+            {
+                hit = _UsnpMatchGlob(globs[glob].Text, globs[glob].Length, name, cchname);
+            }
+            if(hit != _UsnpMatchNameSet(&Set, name, cchname))
+            {
+                mismatches++;
+            }
+        }
+
+        fwprintf(stdout,
+         L"  %-4u globs          %llu matched, %u nodes\n"
+         L"    Set               %.3f s, %.0f names/s\n"
+         L"    Each glob         %.3f s, %.0f names/s, %.1fx\n"
+         L"    Mismatches        %llu\n",
+         sizes[size], (unsigned long long)matched, Set.NodeCount,
+         (double)one / 1000000.0, ((double)Memory.Count * 1000000.0) / (double)((one != 0) ? one : 1),
+         (double)each / 1000000.0, ((double)Memory.Count * 1000000.0) / (double)((each != 0) ? each : 1),
+         (double)each / (double)((one != 0) ? one : 1),
+         (unsigned long long)mismatches
+         );
+
+        if((mismatches != 0) || (matched != expected))
+        {
+            status = FALSE;
+        }
+        _UsnpFree(globs);
+        _UsnpFreeNameSet(&Set);
+    }
+
+    _UsnpFree(text);
+    _UsnpFreeSynthMemory(&Memory);
+    return status;
+}
+
+/*++
+ * -bench reads <n>; n synthetic records read to the end through a
+ * simulated journal with every record out, once for each buffer size.
+ * a read there stands for one FSCTL_READ_USN_JOURNAL, the same seek and
+ * copy, so reads a million records is syscalls a million records ...
+ */
+BOOL
+_UsnpBenchReads (
+    __in uint64_t count )
+{
+    static const DWORD sizes[] = { _USN_BUFFER_SIZE, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, _USN_READ_SIZE_MAX };
+    USN_SOURCE Source = {0};
+    uint64_t* buffer;
+    BOOL status = TRUE;
+
+    if(count == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    if( _UsnpOpenLiveSource(count, count, &Source) == FALSE)
+    {
+        /*++ last error set by call ... */
+        return FALSE;
+    }
+
+    /*++ as if opened a second ago, when all of it was out ... */
+    ((PUSN_LIVE)Source.Context)->Start -= 1000000;
+
+    buffer = (uint64_t*)_UsnpAlloc(_USN_READ_SIZE_MAX);
+    if(buffer == NULL)
+    {
+        /*++ last error set by call ... */
+        Source.Close(&Source);
+        return FALSE;
+    }
+
+    fwprintf(stdout,
+     L"BENCH READS %llu records\n"
+     L"  Buffer       Reads  Reads/M rec        MB/s\n",
+     (unsigned long long)count
+     );
+
+    for(size_t size=0; (size<_countof(sizes)) && (status != FALSE); size++)
+    {
+        READ_USN_JOURNAL_DATA ReadData = {0};
+        uint64_t records = 0;
+        uint64_t total = 0;
+        uint64_t reads = 0;
+        uint64_t start;
+        uint64_t elapsed;
+        DWORD bytes = 0;
+
+        ReadData.ReasonMask      = _USN_REASON_ALL;
+        ReadData.MinMajorVersion = 2;
+        ReadData.MaxMajorVersion = 4;
+
+        start = _UsnpQueryClock();
+        while(1)
+        {
+            DWORD offset = sizeof(USN);
+
+            status = Source.Read(&Source, &ReadData, buffer, sizes[size], &bytes);
+            if(status == FALSE)
+            {
+                /*++ last error set by call ... */
+                break;
+            }
+            reads++;
+            total += bytes;
+
+            if(bytes <= sizeof(USN))
+            {
+                break;
+            }
+            while(offset < bytes)
+            {
+                offset += ((PUSN_RECORD_COMMON_HEADER)(((uint8_t*)buffer) + offset))->RecordLength;
+                records++;
+            }
+            ReadData.StartUsn = *(USN*)buffer;
+        }
+        elapsed = _UsnpQueryClock() - start;
+
+        if(status != FALSE)
+        {
+            fwprintf(stdout,
+             L"  %5luKB %11llu %12.1f %11.1f\n",
+             (unsigned long)(sizes[size] / 1024),
+             (unsigned long long)reads,
+             ((double)reads * 1000000.0) / (double)((records != 0) ? records : 1),
+             ((double)total / (1024.0 * 1024.0)) / ((double)((elapsed != 0) ? elapsed : 1) / 1000000.0)
+             );
+        }
+    }
+
+    _UsnpFree(buffer);
+    Source.Close(&Source);
+    return status;
+}
+
+/*++
+ * -bench decode <n>. n synthetic records made into v2 records, and into
+ * v4 records of a few extents each on the same files. the v2 records are
+ * widened back and checked against the v3 they came from; the extents are
+ * merged into a range set, which is checked to cover each of them with
+ * ranges in order and apart. then every record is decoded again with a
+ * few bytes changed at random, past its length; what is not turned away
+ * has to stay inside the record ...
+ */
+BOOL
+_UsnpBenchDecode (
+    __in uint64_t count )
+{
+    USN_SYNTH Synth = {0};
+    USN_SYNTH_MEMORY Memory = {0};
+    USN_SYNTH_MEMORY V2 = {0};
+    USN_SYNTH_MEMORY V4 = {0};
+    USN_RANGES Ranges = {0};
+    USN_RANGES Fuzzed = {0};
+    uint64_t storage[_USN_RECORD_V3_STORAGE];
+    uint64_t scratch[_USN_RECORD_V3_STORAGE];
+    uint64_t upconverted = 0;
+    uint64_t merged = 0;
+    uint64_t mismatches = 0;
+    uint64_t uncovered = 0;
+    uint64_t rejected = 0;
+    uint64_t escaped = 0;
+    uint64_t extents = 0;
+    uint64_t ranges = 0;
+    uint64_t start;
+    BOOL status = TRUE;
+
+    Synth.Sink = _UsnpSynthMemorySink;
+    Synth.Context = &Memory;
+
+    if((count == 0) || (_UsnpSynthesize(&Synth, count) == FALSE))
+    {
+        /*++ last error set by call ... */
+        _UsnpFreeSynthMemory(&Memory);
+        return FALSE;
+    }
+
+    /*++ each record as v2, and a v4 record of one to four extents in the file's first megabyte ... */
+    for(uint64_t index=0; (index<Memory.Count) && (status != FALSE); index++)
+    {
+        USN_RECORD_V3* pRecord = (USN_RECORD_V3*)(Memory.Records + Memory.Offsets[index]);
+        USN_RECORD_V2* pV2 = (USN_RECORD_V2*)storage;
+        USN_RECORD_V4* pV4 = (USN_RECORD_V4*)storage;
+        ULARGE_INTEGER128 fid;
+        WORD number = (WORD)(1 + (_UsnpSynthRandom(&Synth) % 4));
+
+        RtlZeroMemory(storage, sizeof(storage));
+        pV2->RecordLength = (DWORD)((offsetof(USN_RECORD_V2, FileName) + pRecord->FileNameLength + 7) & ~(size_t)7);
+        pV2->MajorVersion = 2;
+        RtlMoveMemory(&fid, &(pRecord->FileReferenceNumber), sizeof(fid));
+        pV2->FileReferenceNumber = fid.LowPart;
+        RtlMoveMemory(&fid, &(pRecord->ParentFileReferenceNumber), sizeof(fid));
+        pV2->ParentFileReferenceNumber = fid.LowPart;
+        pV2->Usn            = pRecord->Usn;
+        pV2->TimeStamp      = pRecord->TimeStamp;
+        pV2->Reason         = pRecord->Reason;
+        pV2->SourceInfo     = pRecord->SourceInfo;
+        pV2->SecurityId     = pRecord->SecurityId;
+        pV2->FileAttributes = pRecord->FileAttributes;
+        pV2->FileNameLength = pRecord->FileNameLength;
+        pV2->FileNameOffset = (WORD)offsetof(USN_RECORD_V2, FileName);
+        RtlMoveMemory(pV2->FileName, ((uint8_t*)pRecord) + pRecord->FileNameOffset, pRecord->FileNameLength);
+        status = _UsnpSynthMemorySink(&V2, (USN_RECORD_V3*)pV2);
+
+        RtlZeroMemory(storage, sizeof(storage));
+        pV4->Header.RecordLength = (DWORD)(offsetof(USN_RECORD_V4, Extents) + (number * sizeof(USN_RECORD_EXTENT)));
+        pV4->Header.MajorVersion = 4;
+        RtlMoveMemory(&(pV4->FileReferenceNumber), &(pRecord->FileReferenceNumber), sizeof(FILE_ID_128));
+        RtlMoveMemory(&(pV4->ParentFileReferenceNumber), &(pRecord->ParentFileReferenceNumber), sizeof(FILE_ID_128));
+        pV4->Usn             = pRecord->Usn;
+        pV4->Reason          = USN_REASON_DATA_OVERWRITE;
+        pV4->NumberOfExtents = number;
+        pV4->ExtentSize      = sizeof(USN_RECORD_EXTENT);
+        for(WORD extent=0; extent<number; extent++)
+        {
+            pV4->Extents[extent].Offset = (LONGLONG)(_UsnpSynthRandom(&Synth) % 256) * 4096;
+            pV4->Extents[extent].Length = (LONGLONG)(1 + (_UsnpSynthRandom(&Synth) % 16)) * 4096;
+        }
+        status = status && _UsnpSynthMemorySink(&V4, (USN_RECORD_V3*)pV4);
+    }
+
+    start = _UsnpQueryClock();
+    for(uint64_t index=0; (index<V2.Count) && (status != FALSE); index++)
+    {
+        USN_RECORD_V3* pV3 = (USN_RECORD_V3*)storage;
+
+        status = _UsnpUpconvertRecordV2((USN_RECORD_V2*)(V2.Records + V2.Offsets[index]), pV3, sizeof(storage));
+        if((status != FALSE) && (memcmp(pV3, Memory.Records + Memory.Offsets[index], pV3->RecordLength) != 0))
+        {
+            mismatches++;
+        }
+    }
+    upconverted = _UsnpQueryClock() - start;
+
+    start = _UsnpQueryClock();
+    for(uint64_t index=0; (index<V4.Count) && (status != FALSE); index++)
+    {
+        status = _UsnpAddRecordRanges(&Ranges, (USN_RECORD_V4*)(V4.Records + V4.Offsets[index]));
+    }
+    merged = _UsnpQueryClock() - start;
+
+    /*++ every extent inside one range, and the ranges in order with gaps between ... */
+    for(uint64_t index=0; (index<V4.Count) && (status != FALSE); index++)
+    {
+        USN_RECORD_V4* pV4 = (USN_RECORD_V4*)(V4.Records + V4.Offsets[index]);
+        PUSN_RANGE_FILE pFile = _UsnpFindRangeFile(&Ranges, (FILE_ID_128*)&(pV4->FileReferenceNumber), FALSE);
+
+        for(WORD extent=0; extent<pV4->NumberOfExtents; extent++)
+        {
+            LONGLONG offset = pV4->Extents[extent].Offset;
+            LONGLONG end = offset + pV4->Extents[extent].Length;
+            DWORD range = 0;
+
+            while((pFile != NULL) && (range < pFile->Count) && (pFile->Ranges[range].End < end))
+            {
+                range++;
+            }
+            if((pFile == NULL) || (range == pFile->Count) || (pFile->Ranges[range].Start > offset))
+            {
+                uncovered++;
+            }
+            extents++;
+        }
+    }
+    for(DWORD slot=0; slot<Ranges.Capacity; slot++)
+    {
+        PUSN_RANGE_FILE pFile = &(Ranges.Files[slot]);
+
+        for(DWORD range=0; range<pFile->Count; range++)
+        {
+            if( (pFile->Ranges[range].Start >= pFile->Ranges[range].End) ||
+                (((range + 1) < pFile->Count) && (pFile->Ranges[range].End >= pFile->Ranges[range + 1].Start)))
+            {
+                uncovered++;
+            }
+        }
+        ranges += pFile->Count;
+    }
+
+    /*++ the fuzzing; the length stays, as the walk has checked it against the buffer ... */
+    for(uint64_t index=0; (index<(V2.Count + V4.Count)) && (status != FALSE); index++)
+    {
+        PUSN_SYNTH_MEMORY pMemory = (((index & 1) == 0) ? &V2 : &V4);
+        PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(pMemory->Records + pMemory->Offsets[(index / 2) % pMemory->Count]);
+        uint8_t* bytes = (uint8_t*)scratch;
+        DWORD changes = (DWORD)(1 + (_UsnpSynthRandom(&Synth) % 4));
+
+        if(pRecord->RecordLength > sizeof(scratch))
+        {
+            continue;
+        }
+        RtlMoveMemory(scratch, pRecord, pRecord->RecordLength);
+        for(DWORD change=0; change<changes; change++)
+        {
+            uint64_t r = _UsnpSynthRandom(&Synth);
+            bytes[sizeof(DWORD) + (r % (pRecord->RecordLength - sizeof(DWORD)))] = (uint8_t)(r >> 32);
+        }
+
+        if(pRecord->MajorVersion == 2)
+        {
+            USN_RECORD_V2* pV2 = (USN_RECORD_V2*)scratch;
+
+            if( _UsnpUpconvertRecordV2(pV2, (USN_RECORD_V3*)storage, sizeof(storage)) == FALSE)
+            {
+                rejected++;
+            }
+            else if((pV2->FileNameOffset < offsetof(USN_RECORD_V2, FileName)) || (((DWORD)pV2->FileNameOffset + pV2->FileNameLength) > pV2->RecordLength))
+            {
+                escaped++;
+            }
+        }
+        else
+        {
+            USN_RECORD_V4* pV4 = (USN_RECORD_V4*)scratch;
+
+            if( _UsnpCheckRecordV4(pV4) == FALSE)
+            {
+                rejected++;
+            }
+            else if( ((pV4->NumberOfExtents != 0) && (pV4->ExtentSize < sizeof(USN_RECORD_EXTENT))) ||
+                     ((offsetof(USN_RECORD_V4, Extents) + ((size_t)pV4->NumberOfExtents * pV4->ExtentSize)) > pV4->Header.RecordLength))
+            {
+                escaped++;
+            }
+            else
+            {
+                status = _UsnpAddRecordRanges(&Fuzzed, pV4);
+            }
+        }
+    }
+
+    if(status != FALSE)
+    {
+        fwprintf(stdout,
+         L"BENCH DECODE %llu records\n"
+         L"  V2 to V3            %.0f records/s, %llu mismatches\n"
+         L"  V4 extents          %.0f records/s, %llu extents in %llu ranges of %u files, %llu not covered\n"
+         L"  Fuzzed              %llu records, %llu turned away, %llu escaped\n",
+         (unsigned long long)Memory.Count,
+         ((double)V2.Count * 1000000.0) / (double)((upconverted != 0) ? upconverted : 1), (unsigned long long)mismatches,
+         ((double)V4.Count * 1000000.0) / (double)((merged != 0) ? merged : 1),
+         (unsigned long long)extents, (unsigned long long)ranges, Ranges.Count, (unsigned long long)uncovered,
+         (unsigned long long)(V2.Count + V4.Count), (unsigned long long)rejected, (unsigned long long)escaped
+         );
+    }
+
+    _UsnpFreeRanges(&Ranges);
+    _UsnpFreeRanges(&Fuzzed);
+    _UsnpFreeSynthMemory(&V4);
+    _UsnpFreeSynthMemory(&V2);
+    _UsnpFreeSynthMemory(&Memory);
+    return status;
+}
+
+/*++ -bench <name> <n>; timings on n synthetic records ... */
+BOOL
+_UsnpBenchmark (
+    __in const wchar_t* name,
+    __in uint64_t count )
+{
+    if(_wcsicmp(name, L"format") == 0)
+    {
+        return _UsnpBenchFormat(count);
+    }
+    if(_wcsicmp(name, L"time") == 0)
+    {
+        return _UsnpBenchTime(count);
+    }
+    if(_wcsicmp(name, L"history") == 0)
+    {
+        return _UsnpBenchHistory(count);
+    }
+    if(_wcsicmp(name, L"prefilter") == 0)
+    {
+        return _UsnpBenchPrefilter(count);
+    }
+    if(_wcsicmp(name, L"names") == 0)
+    {
+        return _UsnpBenchNames(count);
+    }
+    if(_wcsicmp(name, L"reads") == 0)
+    {
+        return _UsnpBenchReads(count);
+    }
+    if(_wcsicmp(name, L"decode") == 0)
+    {
+        return _UsnpBenchDecode(count);
+    }
+    if(_wcsicmp(name, L"walk") == 0)
+    {
+        return _UsnpBenchWalk(count);
+    }
+
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+/*++
+ */
+USN
+_UsnpGetRecordUsn (
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    switch(pRecord->MajorVersion)
+    {
+    case 2: return ((USN_RECORD_UNION*)pRecord)->V2.Usn;
+    case 3: return ((USN_RECORD_UNION*)pRecord)->V3.Usn;
+    case 4: return ((USN_RECORD_UNION*)pRecord)->V4.Usn;
+    }
+    return 0;
+}
+
+/*++
+ */
+DWORD
+_UsnpGetRecordReason (
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    switch(pRecord->MajorVersion)
+    {
+    case 2: return ((USN_RECORD_UNION*)pRecord)->V2.Reason;
+    case 3: return ((USN_RECORD_UNION*)pRecord)->V3.Reason;
+    case 4: return ((USN_RECORD_UNION*)pRecord)->V4.Reason;
+    }
+    return 0;
+}
+
+/*++
+ */
+void
+_UsnpSetRecordReason (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __in DWORD Reason )
+{
+    switch(pRecord->MajorVersion)
+    {
+    case 2: ((USN_RECORD_UNION*)pRecord)->V2.Reason = Reason; break;
+    case 3: ((USN_RECORD_UNION*)pRecord)->V3.Reason = Reason; break;
+    case 4: ((USN_RECORD_UNION*)pRecord)->V4.Reason = Reason; break;
+    }
+}
+
+/*++ v4 records have no attributes and give 0 ... */
+DWORD
+_UsnpGetRecordAttributes (
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    switch(pRecord->MajorVersion)
+    {
+    case 2: return ((USN_RECORD_UNION*)pRecord)->V2.FileAttributes;
+    case 3: return ((USN_RECORD_UNION*)pRecord)->V3.FileAttributes;
+    }
+    return 0;
+}
+
+/*++ nt time of the change; v4 records have none and give 0 ... */
+LONGLONG
+_UsnpGetRecordTimeStamp (
+    __in PUSN_RECORD_COMMON_HEADER pRecord )
+{
+    switch(pRecord->MajorVersion)
+    {
+    case 2: return ((USN_RECORD_UNION*)pRecord)->V2.TimeStamp.QuadPart;
+    case 3: return ((USN_RECORD_UNION*)pRecord)->V3.TimeStamp.QuadPart;
+    }
+    return 0;
+}
+
+/*++ the file and parent frns of a record, any version; v2 frns widened ... */
+BOOL
+_UsnpGetRecordFileIds (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __out FILE_ID_128* pFileId,
+    __out FILE_ID_128* pParent )
+{
+    USN_RECORD_UNION* pUnion = (USN_RECORD_UNION*)pRecord;
+
+    RtlZeroMemory(pFileId, sizeof(FILE_ID_128));
+    RtlZeroMemory(pParent, sizeof(FILE_ID_128));
+
+    switch(pRecord->MajorVersion)
+    {
+    case 2:
+        RtlMoveMemory(pFileId, &(pUnion->V2.FileReferenceNumber), sizeof(DWORDLONG));
+        RtlMoveMemory(pParent, &(pUnion->V2.ParentFileReferenceNumber), sizeof(DWORDLONG));
+        return TRUE;
+    case 3:
+        RtlMoveMemory(pFileId, &(pUnion->V3.FileReferenceNumber), sizeof(FILE_ID_128));
+        RtlMoveMemory(pParent, &(pUnion->V3.ParentFileReferenceNumber), sizeof(FILE_ID_128));
+        return TRUE;
+    case 4:
+        RtlMoveMemory(pFileId, &(pUnion->V4.FileReferenceNumber), sizeof(FILE_ID_128));
+        RtlMoveMemory(pParent, &(pUnion->V4.ParentFileReferenceNumber), sizeof(FILE_ID_128));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*++
+ * would FSCTL_READ_USN_JOURNAL hand this record back for this request;
+ * at or past the start usn, in the reason mask, a close if only closes
+ * were asked for, and within the version range ...
+ */
+BOOL
+_UsnpIsRecordRequested (
+    __in PUSN_RECORD_COMMON_HEADER pRecord,
+    __in PREAD_USN_JOURNAL_DATA pReadData )
+{
+    DWORD reason = _UsnpGetRecordReason(pRecord);
+
+    return ( (_UsnpGetRecordUsn(pRecord) >= pReadData->StartUsn) &&
+             ((reason & pReadData->ReasonMask) != 0) &&
+             ((pReadData->ReturnOnlyOnClose == 0) || ((reason & USN_REASON_CLOSE) != 0)) &&
+             (pRecord->MajorVersion >= pReadData->MinMajorVersion) &&
+             ((pReadData->MaxMajorVersion == 0) || (pRecord->MajorVersion <= pReadData->MaxMajorVersion)) );
+}
+
+/*++
+ * the usn of the first record at or after Since, by bisecting
+ * [FirstUsn, NextUsn). a read from any usn hands back the first record at
+ * or past it, so each probe is one small read and the whole seek is a
+ * log of the journal's size of them. v4 records carry no time and are
+ * left out of the probes. journal time only goes forward as far as the
+ * clock does; a clock set back makes the answer one of the places the
+ * time is crossed ...
+ */
+BOOL
+_UsnpSeekJournalTime (
+    __in PUSN_SOURCE pSource,
+    __in USN_JOURNAL_DATA* pJournalData,
+    __in LONGLONG Since,
+    __out USN* pUsn,
+    __out_opt DWORD* pProbes )
+{
+    uint64_t buffer[USN_PAGE_SIZE / sizeof(uint64_t)];
+    PUSN_RECORD_COMMON_HEADER pRecord = (PUSN_RECORD_COMMON_HEADER)(((uint8_t*)buffer) + sizeof(USN));
+    READ_USN_JOURNAL_DATA ReadData = {0};
+    USN lo;
+    USN hi;
+    USN found;
+    DWORD bytes = 0;
+    DWORD probes = 0;
+
+    if((pSource == NULL) || (pJournalData == NULL) || (pUsn == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    ReadData.UsnJournalID    = pJournalData->UsnJournalID;
+    ReadData.ReasonMask      = _USN_REASON_ALL;
+    ReadData.MinMajorVersion = pJournalData->MinSupportedMajorVersion;
+    ReadData.MaxMajorVersion = ((pJournalData->MaxSupportedMajorVersion < 3) ? pJournalData->MaxSupportedMajorVersion : 3);
+
+    lo = pJournalData->FirstUsn;
+    hi = pJournalData->NextUsn;
+    found = hi;
+
+    while(lo < hi)
+    {
+        ReadData.StartUsn = lo + ((hi - lo) / 2);
+
+        if( pSource->Read(pSource, &ReadData, buffer, sizeof(buffer), &bytes) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+        probes++;
+
+        /*++ nothing past the probe, or already late enough; the answer is at or before it ... */
+        if((bytes <= sizeof(USN)) || (_UsnpGetRecordTimeStamp(pRecord) >= Since))
+        {
+            hi = ReadData.StartUsn;
+            found = ((bytes <= sizeof(USN)) ? pJournalData->NextUsn : _UsnpGetRecordUsn(pRecord));
+        }
+        else
+        {
+            lo = _UsnpGetRecordUsn(pRecord) + 1;
+        }
+    }
+
+    /*++ hi is only where the last late probe started; the record it found is the answer ... */
+    *pUsn = found;
+    if(pProbes != NULL)
+    {
+        *pProbes = probes;
+    }
+    return TRUE;
+}
+
+/*++
+ * copy a record name into a wchar_t buffer, null-terminated. on windows
+ * the two are the same; elsewhere wchar_t is utf-32 and surrogate pairs
+ * are combined. returns the characters written ...
+ */
+size_t
+_UsnpNameToWide (
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname,
+    __out_ecount(cchbuffer) wchar_t* buffer,
+    __in size_t cchbuffer )
+{
+    size_t length = 0;
+
+    if((name == NULL) || (buffer == NULL) || (cchbuffer == 0))
+    {
+        return 0;
+    }
+
+#if defined(_WIN32)
+    length = ((cchname < cchbuffer) ? cchname : (cchbuffer - 1));
+    RtlMoveMemory(buffer, name, length * sizeof(wchar_t));
+#else
+    for(size_t index=0; (index<cchname) && (length<(cchbuffer - 1)); index++)
+    {
+        uint32_t ch = name[index];
+        if((ch >= 0xD800) && (ch <= 0xDBFF) && ((index + 1) < cchname) &&
+           (name[index + 1] >= 0xDC00) && (name[index + 1] <= 0xDFFF))
+        {
+            ch = 0x10000 + ((ch - 0xD800) << 10) + (name[++index] - 0xDC00);
+        }
+        buffer[length++] = (wchar_t)ch;
+    }
+#endif  /* _WIN32 */
+    buffer[length] = L'\0';
+    return length;
+}
+
+/*++
+ */
+FILE*
+_UsnpOpenStream (
+    __in const wchar_t* filename,
+    __in const wchar_t* mode )
+{
+    FILE* fp = NULL;
+
+    if((filename == NULL) || (mode == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+#if defined(_WIN32)
+    fp = _wfopen(filename, mode);
+    if(fp == NULL)
+    {
+        SetLastError(((errno == ENOENT) ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_DENIED));
+    }
+#else
+    {
+        char path[4096];
+        char narrow[8] = {0};
+
+        if( _UsnpNarrowPath(filename, path, sizeof(path)) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return NULL;
+        }
+        for(size_t index=0; (index<(sizeof(narrow) - 1)) && (mode[index] != L'\0'); index++)
+        {
+            narrow[index] = (char)mode[index];
+        }
+        fp = fopen(path, narrow);
+        if(fp == NULL)
+        {
+            SetLastError(_UsnpErrnoToError(errno));
+        }
+    }
+#endif  /* _WIN32 */
+    return fp;
+}
+
+#if !defined(_WIN32)
+/*++
+ */
+BOOL
+_UsnpNarrowPath (
+    __in const wchar_t* filename,
+    __out_ecount(cchbuffer) char* buffer,
+    __in size_t cchbuffer )
+{
+    size_t length = wcstombs(buffer, filename, cchbuffer);
+    if((length == (size_t)-1) || (length >= cchbuffer))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*++
+ */
+DWORD
+_UsnpErrnoToError (
+    __in int error )
+{
+    switch(error)
+    {
+    case ENOENT: return ERROR_FILE_NOT_FOUND;
+    case EACCES: return ERROR_ACCESS_DENIED;
+    case EPERM:  return ERROR_ACCESS_DENIED;
+    case ENOMEM: return ERROR_NOT_ENOUGH_MEMORY;
+    case EIO:    return ERROR_READ_FAULT;
+    case ENOSPC: return ERROR_WRITE_FAULT;
+    }
+    return ERROR_INVALID_PARAMETER;
+}
+#endif  /* !_WIN32 */
+
+/*++
+ * map a whole file read-only. an empty file maps to nothing and succeeds.
+ * on x86 the view has to fit in the address space ...
+ */
+BOOL
+_UsnpMapFile (
+    __in wchar_t* filename,
+    __in BOOL CopyOnWrite,
+    __out PUSN_MAPPING pMapping )
+{
+    if((filename == NULL) || (pMapping == NULL))
+    {
         SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
 
-    diskname[4] = *pathname;
+    RtlZeroMemory(pMapping, sizeof(USN_MAPPING));
+
+#if defined(_WIN32)
+    {
+        LARGE_INTEGER size = {0};
+
+        pMapping->File = CreateFileW(
+         filename,
+         GENERIC_READ,
+         (FILE_SHARE_READ | FILE_SHARE_WRITE),
+         NULL,
+         OPEN_EXISTING,
+         ((CopyOnWrite) ? FILE_ATTRIBUTE_NORMAL : FILE_FLAG_SEQUENTIAL_SCAN),
+         NULL
+         );
+
+        if(pMapping->File == INVALID_HANDLE_VALUE)
+        {
+            /*++ last error set by call ... */
+            pMapping->File = NULL;
+            return FALSE;
+        }
+
+        if( GetFileSizeEx(pMapping->File, &size) == FALSE)
+        {
+            /*++ last error set by call ... */
+            _UsnpUnmapFile(pMapping);
+            return FALSE;
+        }
+
+        pMapping->Size = (uint64_t)size.QuadPart;
+        if(pMapping->Size == 0)
+        {
+            return TRUE;
+        }
+
+        if(pMapping->Size > (uint64_t)SIZE_MAX)
+        {
+            _UsnpUnmapFile(pMapping);
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+
+        pMapping->Section = CreateFileMappingW(pMapping->File, NULL, ((CopyOnWrite) ? PAGE_WRITECOPY : PAGE_READONLY), 0, 0, NULL);
+        if(pMapping->Section == NULL)
+        {
+            /*++ last error set by call ... */
+            _UsnpUnmapFile(pMapping);
+            return FALSE;
+        }
+
+        pMapping->Base = (uint8_t*)MapViewOfFile(pMapping->Section, ((CopyOnWrite) ? FILE_MAP_COPY : FILE_MAP_READ), 0, 0, 0);
+        if(pMapping->Base == NULL)
+        {
+            /*++ last error set by call ... */
+            _UsnpUnmapFile(pMapping);
+            return FALSE;
+        }
+    }
+#else
+    {
+        char path[4096];
+        struct stat st;
+        int fd;
+
+        if( _UsnpNarrowPath(filename, path, sizeof(path)) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return FALSE;
+        }
+
+        fd = open(path, O_RDONLY);
+        if(fd < 0)
+        {
+            SetLastError(_UsnpErrnoToError(errno));
+            return FALSE;
+        }
+
+        if(fstat(fd, &st) != 0)
+        {
+            SetLastError(_UsnpErrnoToError(errno));
+            close(fd);
+            return FALSE;
+        }
+
+        pMapping->Size = (uint64_t)st.st_size;
+        if(pMapping->Size == 0)
+        {
+            close(fd);
+            return TRUE;
+        }
+
+        pMapping->Base = (uint8_t*)mmap(NULL, (size_t)pMapping->Size, ((CopyOnWrite) ? (PROT_READ | PROT_WRITE) : PROT_READ), MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(pMapping->Base == (uint8_t*)MAP_FAILED)
+        {
+            pMapping->Base = NULL;
+            SetLastError(_UsnpErrnoToError(errno));
+            return FALSE;
+        }
+
+        /*++ a journal walk is front to back; let the kernel read ahead ... */
+        if(CopyOnWrite == FALSE)
+        {
+            madvise(pMapping->Base, (size_t)pMapping->Size, MADV_SEQUENTIAL);
+        }
+    }
+#endif  /* _WIN32 */
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpUnmapFile (
+    __in PUSN_MAPPING pMapping )
+{
+    if(pMapping == NULL)
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    if(pMapping->Base != NULL)
+    {
+        UnmapViewOfFile(pMapping->Base);
+    }
+    if(pMapping->Section != NULL)
+    {
+        CloseHandle(pMapping->Section);
+    }
+    if(pMapping->File != NULL)
+    {
+        CloseHandle(pMapping->File);
+    }
+#else
+    if(pMapping->Base != NULL)
+    {
+        munmap(pMapping->Base, (size_t)pMapping->Size);
+    }
+#endif  /* _WIN32 */
+    RtlZeroMemory(pMapping, sizeof(USN_MAPPING));
+}
+
+/*++ zeroed allocation; sets last error on failure ... */
+void*
+_UsnpAlloc (
+    __in size_t size )
+{
+    void* p = calloc(1, size);
+    if(p == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    }
+    return p;
+}
+
+/*++
+ */
+void
+_UsnpFree (
+    __in void* p )
+{
+    free(p);
+}
+
+/*++ hex digits a byte at a time, "00" to "FF" ... */
+static const char g_hexpairs[513] =
+ "000102030405060708090A0B0C0D0E0F"
+ "101112131415161718191A1B1C1D1E1F"
+ "202122232425262728292A2B2C2D2E2F"
+ "303132333435363738393A3B3C3D3E3F"
+ "404142434445464748494A4B4C4D4E4F"
+ "505152535455565758595A5B5C5D5E5F"
+ "606162636465666768696A6B6C6D6E6F"
+ "707172737475767778797A7B7C7D7E7F"
+ "808182838485868788898A8B8C8D8E8F"
+ "909192939495969798999A9B9C9D9E9F"
+ "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+ "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+ "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+ "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+ "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+ "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/*++ decimal digits two at a time, "00" to "99" ... */
+static const char g_decimalpairs[201] =
+ "00010203040506070809"
+ "10111213141516171819"
+ "20212223242526272829"
+ "30313233343536373839"
+ "40414243444546474849"
+ "50515253545556575859"
+ "60616263646566676869"
+ "70717273747576777879"
+ "80818283848586878889"
+ "90919293949596979899";
+
+/*++ where records go; the calling worker's slice, or the console ... */
+PUSN_OUTPUT
+_UsnpGetOutput (
+    void )
+{
+    return ((g_output != NULL) ? g_output : &g_stdout);
+}
+
+/*++
+ * room for bytes more at the end of the buffer. a buffer with a file is
+ * written out to make room; one without grows. NULL, and Failed set, if
+ * neither works ...
+ */
+uint8_t*
+_UsnpReserveOutput (
+    __inout PUSN_OUTPUT pOut,
+    __in size_t bytes )
+{
+    if((pOut->Capacity - pOut->Length) >= bytes)
+    {
+        return (pOut->Buffer + pOut->Length);
+    }
+
+    if((pOut->File >= 0) && (pOut->Length > 0))
+    {
+        if( _UsnpFlushOutput(pOut) == FALSE)
+        {
+            /*++ last error set by call ... */
+            return NULL;
+        }
+    }
+
+    if((pOut->Capacity - pOut->Length) < bytes)
+    {
+        size_t capacity = ((pOut->Capacity == 0) ? _USN_OUTPUT_SIZE : pOut->Capacity);
+        uint8_t* buffer;
+
+        while((capacity - pOut->Length) < bytes)
+        {
+            capacity *= 2;
+        }
+
+        buffer = (uint8_t*)realloc(pOut->Buffer, capacity);
+        if(buffer == NULL)
+        {
+            pOut->Failed = TRUE;
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return NULL;
+        }
+        pOut->Buffer = buffer;
+        pOut->Capacity = capacity;
+    }
+    return (pOut->Buffer + pOut->Length);
+}
+
+/*++ one write of everything buffered; anything printed through stdio goes first ... */
+BOOL
+_UsnpFlushOutput (
+    __inout PUSN_OUTPUT pOut )
+{
+    BOOL status = TRUE;
+
+    if(pOut->File < 0)
+    {
+        return TRUE;
+    }
+
+    fflush(stdout);
+    if(pOut->Length == 0)
+    {
+        return TRUE;
+    }
+
+    status = _UsnpWriteFile(pOut->File, pOut->Buffer, pOut->Length);
+    if(status == FALSE)
+    {
+        /*++ last error set by call ... */
+        pOut->Failed = TRUE;
+    }
+    pOut->Length = 0;
+    return status;
+}
+
+/*++
+ */
+void
+_UsnpFreeOutput (
+    __inout PUSN_OUTPUT pOut )
+{
+    _UsnpFree(pOut->Buffer);
+    pOut->Buffer = NULL;
+    pOut->Length = 0;
+    pOut->Capacity = 0;
+}
+
+/*++
+ * write utf-8 to a descriptor. a windows console takes utf-16, so it is
+ * converted for one; files and pipes get the bytes as they are ...
+ */
+BOOL
+_UsnpWriteFile (
+    __in int file,
+    __in_bcount(bytes) const uint8_t* data,
+    __in size_t bytes )
+{
+#if defined(_WIN32)
+    HANDLE handle = (HANDLE)_get_osfhandle(file);
+    DWORD mode = 0;
+
+    if(GetConsoleMode(handle, &mode))
+    {
+        while(bytes > 0)
+        {
+            wchar_t wide[4096];
+            int cb = (int)((bytes < _countof(wide)) ? bytes : _countof(wide));
+            int cch;
+            DWORD written = 0;
+
+            /*++ never split a sequence between two calls ... */
+            while(((size_t)cb < bytes) && (cb > 0) && ((data[cb] & 0xC0) == 0x80))
+            {
+                cb--;
+            }
+
+            cch = MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)data, cb, wide, _countof(wide));
+            if( WriteConsoleW(handle, wide, (DWORD)cch, &written, NULL) == FALSE)
+            {
+                /*++ last error set by call ... */
+                return FALSE;
+            }
+            data += cb;
+            bytes -= (size_t)cb;
+        }
+        return TRUE;
+    }
+#endif  /* _WIN32 */
+
+    while(bytes > 0)
+    {
+        unsigned int chunk = (unsigned int)((bytes < 0x40000000) ? bytes : 0x40000000);
+#if defined(_WIN32)
+        int written = _write(file, data, chunk);
+#else
+        ssize_t written = write(file, data, chunk);
+#endif  /* _WIN32 */
+        if(written <= 0)
+        {
+            SetLastError(ERROR_WRITE_FAULT);
+            return FALSE;
+        }
+        data += written;
+        bytes -= (size_t)written;
+    }
+    return TRUE;
+}
+
+/*++
+ */
+void
+_UsnpEmitText (
+    __inout PUSN_OUTPUT pOut,
+    __in_bcount(length) const char* text,
+    __in size_t length )
+{
+    uint8_t* p = _UsnpReserveOutput(pOut, length);
+    if(p != NULL)
+    {
+        RtlMoveMemory(p, text, length);
+        pOut->Length += length;
+    }
+}
+
+/*++ value as digits (even, 16 at most) uppercase hex digits; returns the end ... */
+uint8_t*
+_UsnpPutHex (
+    __out_bcount(digits) uint8_t* p,
+    __in uint64_t value,
+    __in DWORD digits )
+{
+    for(DWORD index=digits; index>0; index -= 2)
+    {
+        RtlMoveMemory(p + index - 2, &g_hexpairs[(value & 0xFF) * 2], 2);
+        value >>= 8;
+    }
+    return (p + digits);
+}
 
-    osh = CreateFileW(
-     diskname,
-     (GENERIC_READ | GENERIC_WRITE),
-     (FILE_SHARE_READ | FILE_SHARE_WRITE),
-     NULL,
-     OPEN_EXISTING,
-     0,
-     NULL
-     );
+/*++ value in decimal, zero-filled to width; returns the end ... */
+uint8_t*
+_UsnpPutDecimal (
+    __out_bcount(20) uint8_t* p,
+    __in uint64_t value,
+    __in DWORD width )
+{
+    char digits[20];
+    size_t position = sizeof(digits);
+    size_t length;
 
-    if(osh == INVALID_HANDLE_VALUE)
+    while(value >= 100)
     {
-        /*++ last error set by call ... */
-        fwprintf(stderr, L"open failed, status(%X)\n", GetLastError());
-        return FALSE;
+        position -= 2;
+        RtlMoveMemory(digits + position, &g_decimalpairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if(value >= 10)
+    {
+        position -= 2;
+        RtlMoveMemory(digits + position, &g_decimalpairs[value * 2], 2);
+    }
+    else
+    {
+        digits[--position] = (char)('0' + value);
+    }
+    while(((sizeof(digits) - position) < width) && (position > 0))
+    {
+        digits[--position] = '0';
     }
 
-    /*++
-     * this code expects to build against _NTDDI_WIN8 and above because there
-     * are three versions of USN_JOURNAL_DATA,
-     * 
-     *   USN_JOURNAL_DATA_V0
-     *   USN_JOURNAL_DATA_V1
-     *   USN_JOURNAL_DATA_V2
-     * 
-     * the V1 and V2 structures both contain supported usn versions,
-     * 
-     *   MinSupportedMajorVersion
-     *   MaxSupportedMajorVersion
-     *
-     * these values are needed when getting the usn records.
-     */
+    length = sizeof(digits) - position;
+    RtlMoveMemory(p, digits + position, length);
+    return (p + length);
+}
 
-    status = DeviceIoControl(
-     osh,
-     FSCTL_QUERY_USN_JOURNAL,
-     NULL,
-     0,
-     &JournalData,
-     sizeof(USN_JOURNAL_DATA),
-     &bytes,
-     NULL
-     );
-                            
-    if(status == FALSE)
+/*++ one code point as utf-8; returns the end ... */
+uint8_t*
+_UsnpPutUtf8 (
+    __out_bcount(4) uint8_t* p,
+    __in uint32_t ch )
+{
+    if(ch < 0x80)
     {
-        /*++ last error set by call. might be ERROR_JOURNAL_NOT_ACTIVE ... */
-        fwprintf(stderr, L"ioctl failed, status(%X)\n", GetLastError());
-        return FALSE;
+        *p++ = (uint8_t)ch;
     }
-
-    status = _UsnpFormatJournalData(diskname, &JournalData);
-    if(status == FALSE)
+    else if(ch < 0x800)
     {
-        /*++ last error set by call ... */
-        fwprintf(stderr, L"format journal data failed, status(%X)\n", GetLastError());
-        CloseHandle(osh);
-        return FALSE;
+        *p++ = (uint8_t)(0xC0 | (ch >> 6));
+        *p++ = (uint8_t)(0x80 | (ch & 0x3F));
     }
-
-    /*++ 
-     * using start usn of zero; always start at beginning ... a useful thing to
-     * do would be to save the last usn read for a given run and then use that
-     * value as the starting point of a subsequent run ...
-     */
-    status = _UsnpReadJournalRecords(osh, &JournalData, 0LL, Reason);
-    if(status == FALSE)
+    else if(ch < 0x10000)
     {
-        /*++ last error set by call ... */
-        fwprintf(stderr, L"read journal records failed, status(%X)\n", GetLastError());
-        CloseHandle(osh);
-        return FALSE;
+        *p++ = (uint8_t)(0xE0 | (ch >> 12));
+        *p++ = (uint8_t)(0x80 | ((ch >> 6) & 0x3F));
+        *p++ = (uint8_t)(0x80 | (ch & 0x3F));
     }
-
-    CloseHandle(osh);
-    return TRUE;
+    else
+    {
+        *p++ = (uint8_t)(0xF0 | (ch >> 18));
+        *p++ = (uint8_t)(0x80 | ((ch >> 12) & 0x3F));
+        *p++ = (uint8_t)(0x80 | ((ch >> 6) & 0x3F));
+        *p++ = (uint8_t)(0x80 | (ch & 0x3F));
+    }
+    return p;
 }
 
 /*++
  */
-BOOL
-_UsnpReadJournalRecords (
-    __in HANDLE osh,
-    __in USN_JOURNAL_DATA* pJournalData,
-    __in USN StartUsn,
-    __in DWORD Reason )
+void
+_UsnpEmitHex (
+    __inout PUSN_OUTPUT pOut,
+    __in uint64_t value,
+    __in DWORD digits )
 {
-    int count = 0;
-    BOOL status;
-    char buffer[_USN_BUFFER_SIZE] = {0};
-    DWORD bytes = 0;
-    PUSN_RECORD_COMMON_HEADER pRecord = NULL;
-    READ_USN_JOURNAL_DATA ReadData = {0};
+    uint8_t* p = _UsnpReserveOutput(pOut, digits);
+    if(p != NULL)
+    {
+        pOut->Length = (size_t)(_UsnpPutHex(p, value, digits) - pOut->Buffer);
+    }
+}
 
-    /*++ check ptr ... */
-    if(pJournalData == NULL)
+/*++
+ */
+void
+_UsnpEmitDecimal (
+    __inout PUSN_OUTPUT pOut,
+    __in uint64_t value,
+    __in DWORD width )
+{
+    uint8_t* p = _UsnpReserveOutput(pOut, 20);
+    if(p != NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        pOut->Length = (size_t)(_UsnpPutDecimal(p, value, width) - pOut->Buffer);
     }
+}
 
-    ReadData.UsnJournalID    = pJournalData->UsnJournalID;
-    ReadData.StartUsn        = StartUsn;
-    ReadData.ReasonMask      = Reason;
+/*++
+ * the leading run of a utf-16 name that can be copied as is, a byte a
+ * character; ascii, and with nothing in it the escape would change. with
+ * sse2 eight characters are checked and narrowed at once, which covers
+ * nearly every name on a volume. returns the characters copied ...
+ */
+size_t
+_UsnpPutAsciiRun (
+    __out_ecount(cchname) uint8_t* p,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname,
+    __in DWORD escape )
+{
+    WCHAR other = ((escape == _USN_ESCAPE_JSON) ? L'\\' : L'"');
+    size_t index = 0;
 
-    /*++ these values require NTDDI_WIN8 and above ... */
-    ReadData.MinMajorVersion = pJournalData->MinSupportedMajorVersion;
-    ReadData.MaxMajorVersion = pJournalData->MaxSupportedMajorVersion;
+#if defined(_USN_SSE2)
+    const __m128i high = _mm_set1_epi16((short)0xFF80);
+    const __m128i control = _mm_set1_epi16(0x20);
+    const __m128i quote = _mm_set1_epi16('"');
+    const __m128i backslash = _mm_set1_epi16((short)other);
 
-    while(1)
+    for(; (index + 8) <= cchname; index += 8)
     {
-        RtlZeroMemory(buffer, sizeof(buffer));
-
-        status = DeviceIoControl (    
-         osh,
-         FSCTL_READ_USN_JOURNAL,
-         &ReadData,
-         sizeof(ReadData),
-         buffer,
-         sizeof(buffer),
-         &bytes,
-         NULL
-         );
+        __m128i chars = _mm_loadu_si128((const __m128i*)(name + index));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chars, high), _mm_setzero_si128()));
 
-        if(status == FALSE)
+        if(escape == _USN_ESCAPE_JSON)
         {
-            /*++ last error set by call ... */
-            return FALSE;
+            __m128i special = _mm_or_si128(_mm_cmplt_epi16(chars, control),
+                                           _mm_or_si128(_mm_cmpeq_epi16(chars, quote), _mm_cmpeq_epi16(chars, backslash)));
+            mask &= ~_mm_movemask_epi8(special);
         }
-
-        bytes -= sizeof(USN);
-
-        /*++ 
-         * the returned buffer starts with the next usn after those in
-         * the buffer. after looping on this buffer, set the startusn
-         * to the value at the beginning of this buffer and ask more ...
-         */
-        pRecord = (PUSN_RECORD_COMMON_HEADER)(((uint8_t*)buffer) + sizeof(USN));
-
-        while(bytes > 0)
+        else if(escape == _USN_ESCAPE_CSV)
         {
-            if( _UsnpFormatRecord(osh, (USN_RECORD_UNION*)pRecord) == FALSE)
-            {
-                fwprintf(stderr, L"format usn record failed, status(%X)\n", GetLastError());
-                /*++return FALSE;*/
-            }
-
-            /*++LIMITLIMIT: ... */
-            if(count++ > g_count)
-            {
-                SetLastError(ERROR_IMPLEMENTATION_LIMIT);
-                return TRUE;
-            }
-            /*++LIMITLIMIT: ... */
+            mask &= ~_mm_movemask_epi8(_mm_cmpeq_epi16(chars, quote));
+        }
 
-            bytes -= pRecord->RecordLength;
+        if(mask != 0xFFFF)
+        {
+            break;
+        }
+        _mm_storel_epi64((__m128i*)(p + index), _mm_packus_epi16(chars, chars));
+    }
+#endif  /* _USN_SSE2 */
 
-            pRecord = (PUSN_RECORD_COMMON_HEADER)(((uint8_t*)pRecord) + pRecord->RecordLength);
+    for(; index < cchname; index++)
+    {
+        WCHAR ch = name[index];
+        if(ch >= 0x80)
+        {
+            break;
         }
-        /*++ get the next starting usn ... */
-        ReadData.StartUsn = *(USN*)&buffer;
+        if((escape == _USN_ESCAPE_JSON) && ((ch < 0x20) || (ch == L'"') || (ch == L'\\')))
+        {
+            break;
+        }
+        if((escape == _USN_ESCAPE_CSV) && (ch == L'"'))
+        {
+            break;
+        }
+        p[index] = (uint8_t)ch;
     }
-    return TRUE;
+    return index;
 }
 
 /*++
+ * one character that the escape changes, or an ascii one that it does not;
+ * json gets \" \\ and \n-style or \u00XX escapes for control characters,
+ * csv gets its quotes doubled. returns the end ...
  */
-BOOL
-_UsnpFormatJournalData (
-    __in wchar_t* pathname,
-    __in PUSN_JOURNAL_DATA pJournalData )
+uint8_t*
+_UsnpPutEscaped (
+    __out_bcount(6) uint8_t* p,
+    __in uint32_t ch,
+    __in DWORD escape )
 {
-    if((pathname == NULL) || (pJournalData == NULL))
+    if(escape == _USN_ESCAPE_JSON)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        switch(ch)
+        {
+        case L'"':  *p++ = '\\'; *p++ = '"';  return p;
+        case L'\\': *p++ = '\\'; *p++ = '\\'; return p;
+        case L'\n': *p++ = '\\'; *p++ = 'n';  return p;
+        case L'\r': *p++ = '\\'; *p++ = 'r';  return p;
+        case L'\t': *p++ = '\\'; *p++ = 't';  return p;
+        }
+        if(ch < 0x20)
+        {
+            RtlMoveMemory(p, "\\u00", 4);
+            return _UsnpPutHex(p + 4, ch, 2);
+        }
+    }
+    else if((escape == _USN_ESCAPE_CSV) && (ch == L'"'))
+    {
+        *p++ = '"';
+        *p++ = '"';
+        return p;
     }
 
-    fwprintf(stdout,
-     L"JOURNAL DATA PATH(%s)\n"
-     L"  UsnJournalID        %016I64X\n"
-     L"  FirstUsn            %016I64X\n"
-     L"  NextUsn             %016I64X\n"
-     L"  LowestValidUsn      %016I64X\n"
-     L"  MaxUsn              %016I64X\n"
-     L"  MaximumSize         %016I64X\n"
-     L"  AllocationDelta     %016I64X\n"
-     L"  Supported Versions  %u.x - %u.x\n",
-     pathname,
-     pJournalData->UsnJournalID,
-     pJournalData->FirstUsn,
-     pJournalData->NextUsn,
-     pJournalData->LowestValidUsn,
-     pJournalData->MaxUsn,
-     pJournalData->MaximumSize,
-     pJournalData->AllocationDelta,
-     pJournalData->MinSupportedMajorVersion,
-     pJournalData->MaxSupportedMajorVersion
-     );
-    return TRUE;
+    *p++ = (uint8_t)ch;
+    return p;
 }
 
 /*++
+ * a utf-16 name, straight from a record, as utf-8 and escaped for the
+ * output format. plain runs go through _UsnpPutAsciiRun; surrogate pairs
+ * are combined and a surrogate left on its own comes out as U+FFFD ...
  */
-BOOL
-_UsnpFormatRecord (
-    __in HANDLE osh,
-    __in USN_RECORD_UNION* pRecord )
+void
+_UsnpEmitName (
+    __inout PUSN_OUTPUT pOut,
+    __in_ecount(cchname) const WCHAR* name,
+    __in size_t cchname,
+    __in DWORD escape )
 {
-    /*++ check ptr ... */
-    if(pRecord == NULL)
+    uint8_t* p = _UsnpReserveOutput(pOut, cchname * 6);
+    size_t index = 0;
+
+    if(p == NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        return;
     }
 
-    switch(pRecord->Header.MajorVersion)
+    while(1)
     {
-    case 2: return _UsnpFormatRecordV2(osh, &(pRecord->V2));
-    case 3: return _UsnpFormatRecordV3(osh, &(pRecord->V3));
-    case 4: return _UsnpFormatRecordV4(osh, &(pRecord->V4));
+        uint32_t ch;
+        size_t run = _UsnpPutAsciiRun(p, name + index, cchname - index, escape);
+
+        p += run;
+        index += run;
+        if(index >= cchname)
+        {
+            break;
+        }
+
+        ch = name[index++];
+        if(ch < 0x80)
+        {
+            p = _UsnpPutEscaped(p, ch, escape);
+            continue;
+        }
+        if((ch >= 0xD800) && (ch <= 0xDFFF))
+        {
+            if((ch <= 0xDBFF) && (index < cchname) &&
+               (name[index] >= 0xDC00) && (name[index] <= 0xDFFF))
+            {
+                ch = 0x10000 + ((ch - 0xD800) << 10) + (name[index++] - 0xDC00);
+            }
+            else
+            {
+                ch = 0xFFFD;
+            }
+        }
+        p = _UsnpPutUtf8(p, ch);
     }
+    pOut->Length = (size_t)(p - pOut->Buffer);
+}
 
-    SetLastError(ERROR_INVALID_DATA);
-    return FALSE;
+/*++ a wchar_t string, utf-16 on windows and utf-32 elsewhere, as utf-8 ... */
+void
+_UsnpEmitWide (
+    __inout PUSN_OUTPUT pOut,
+    __in_ecount(cchtext) const wchar_t* text,
+    __in size_t cchtext,
+    __in DWORD escape )
+{
+#if defined(_WIN32)
+    _UsnpEmitName(pOut, (const WCHAR*)text, cchtext, escape);
+#else
+    uint8_t* p = _UsnpReserveOutput(pOut, cchtext * 6);
+    if(p == NULL)
+    {
+        return;
+    }
+
+    for(size_t index=0; index<cchtext; index++)
+    {
+        uint32_t ch = (uint32_t)text[index];
+        if(ch < 0x80)
+        {
+            p = _UsnpPutEscaped(p, ch, escape);
+            continue;
+        }
+        if(((ch >= 0xD800) && (ch <= 0xDFFF)) || (ch > 0x10FFFF))
+        {
+            ch = 0xFFFD;
+        }
+        p = _UsnpPutUtf8(p, ch);
+    }
+    pOut->Length = (size_t)(p - pOut->Buffer);
+#endif  /* _WIN32 */
 }
 
 /*++
+ * days since 1970-01-01 to a proleptic gregorian date, by arithmetic on
+ * 400-year eras (146097 days each) with march as the first month, so the
+ * leap day falls at the end of the year ...
  */
-BOOL
-_UsnpFormatRecordV2 (
-    __in HANDLE osh,
-    __in USN_RECORD_V2* pRecord )
+void
+_UsnpCivilFromDays (
+    __in int64_t days,
+    __out int64_t* pYear,
+    __out DWORD* pMonth,
+    __out DWORD* pDay )
 {
-    /*++ check ptr ... */
-    if(pRecord == NULL)
-    {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
-    }
+    int64_t era;
+    DWORD doe;
+    DWORD yoe;
+    DWORD doy;
+    DWORD mp;
 
-    UNREFERENCED_PARAMETER(osh);
-    SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
-    return FALSE;
+    days += 719468;
+    era = ((days >= 0) ? days : (days - 146096)) / 146097;
+    doe = (DWORD)(days - (era * 146097));
+    yoe = (doe - (doe / 1460) + (doe / 36524) - (doe / 146096)) / 365;
+    doy = doe - ((365 * yoe) + (yoe / 4) - (yoe / 100));
+    mp = ((5 * doy) + 2) / 153;
+
+    *pDay = doy - (((153 * mp) + 2) / 5) + 1;
+    *pMonth = ((mp < 10) ? (mp + 3) : (mp - 9));
+    *pYear = (int64_t)yoe + (era * 400) + ((*pMonth <= 2) ? 1 : 0);
 }
 
 /*++
+ * an nt timestamp as text in one of the -time formats. everything down to
+ * the second is kept per thread, and while the second stays the same, as
+ * it does through a burst of records, only the fraction is redone. returns
+ * the bytes written, 40 at most, or 0 for a time before 1601 ...
  */
-BOOL
-_UsnpFormatRecordV3 (
-    __in HANDLE osh,
-    __in USN_RECORD_V3* pRecord )
+size_t
+_UsnpPutTimestamp (
+    __out_bcount(40) uint8_t* buffer,
+    __in LONGLONG ticks,
+    __in DWORD format )
 {
-    wchar_t buffer[MAX_PATH] = {0};
-    size_t cchbuffer;
-    wchar_t timestamp[MAX_PATH] = {0};
-    size_t cchtimestamp;
-    wchar_t* filename = NULL;
-    WORD cchfilename = 0;
-    ULARGE_INTEGER128* refnum = NULL;
-    ULARGE_INTEGER128* parent = NULL;
+    PUSN_TIME_CACHE pCache = &g_timecache;
+    uint64_t fraction;
+    DWORD digits;
+    LONGLONG key;
+    uint8_t* p;
 
-    /*++ check ptr ... */
-    if(pRecord == NULL)
+    if(ticks < 0)
     {
         SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        return 0;
     }
 
-    /*++
-     * filtering could be done here using the file index of the parent ...
-     */
-    if( _UsnpIsEqualFileReference(&(pRecord->ParentFileReferenceNumber), &monitor_fid) == FALSE)
+    if(format == _USN_TIME_UNIX)
     {
-        /*++ fid's don't match ... */
+        /*++ seconds and milliseconds since 1970, signed ... */
+        LONGLONG milliseconds = (ticks / 10000) - 11644473600000LL;
+        uint64_t magnitude = (uint64_t)((milliseconds < 0) ? -milliseconds : milliseconds);
+
+        key = ((milliseconds < 0) ? (-(LONGLONG)(magnitude / 1000) - 1) : (LONGLONG)(magnitude / 1000));
+        if((pCache->Second != key) || (pCache->Format != format))
+        {
+            p = pCache->Prefix;
+            if(milliseconds < 0)
+            {
+                *p++ = '-';
+            }
+            p = _UsnpPutDecimal(p, magnitude / 1000, 1);
+            *p++ = '.';
+            pCache->Length = (size_t)(p - pCache->Prefix);
+        }
+        fraction = magnitude % 1000;
+        digits = 3;
     }
+    else
+    {
+        key = ticks / 10000000;
+        if((pCache->Second != key) || (pCache->Format != format))
+        {
+            LONGLONG seconds = key - 11644473600LL;
+            int64_t days = seconds / 86400;
+            LONGLONG daytime = seconds % 86400;
+            int64_t year;
+            DWORD month;
+            DWORD day;
 
-    refnum = (ULARGE_INTEGER128*)&(pRecord->FileReferenceNumber);
-    parent = (ULARGE_INTEGER128*)&(pRecord->ParentFileReferenceNumber);
+            if(daytime < 0)
+            {
+                daytime += 86400;
+                days--;
+            }
+            _UsnpCivilFromDays(days, &year, &month, &day);
+
+            p = pCache->Prefix;
+            p = _UsnpPutDecimal(p, (uint64_t)year, 4);
+            *p++ = '-';
+            p = _UsnpPutDecimal(p, month, 2);
+            *p++ = '-';
+            p = _UsnpPutDecimal(p, day, 2);
+            *p++ = ((format == _USN_TIME_ISO) ? 'T' : ' ');
+            p = _UsnpPutDecimal(p, (uint64_t)(daytime / 3600), 2);
+            *p++ = ':';
+            p = _UsnpPutDecimal(p, (uint64_t)((daytime / 60) % 60), 2);
+            *p++ = ':';
+            p = _UsnpPutDecimal(p, (uint64_t)(daytime % 60), 2);
+            *p++ = '.';
+            pCache->Length = (size_t)(p - pCache->Prefix);
+        }
 
-    filename = (wchar_t*)((char*)pRecord + pRecord->FileNameOffset);
-    cchfilename = (pRecord->FileNameLength / sizeof(wchar_t));
+        /*++ iso carries the full 100ns; the nt view, milliseconds ... */
+        if(format == _USN_TIME_ISO)
+        {
+            fraction = (uint64_t)(ticks % 10000000);
+            digits = 7;
+        }
+        else
+        {
+            fraction = (uint64_t)((ticks / 10000) % 1000);
+            digits = 3;
+        }
+    }
+
+    pCache->Second = key;
+    pCache->Format = format;
+
+    RtlMoveMemory(buffer, pCache->Prefix, pCache->Length);
+    p = _UsnpPutDecimal(buffer + pCache->Length, fraction, digits);
+    if(format == _USN_TIME_ISO)
+    {
+        *p++ = 'Z';
+    }
+    return (size_t)(p - buffer);
+}
+
+/*++
+ */
+BOOL
+_UsnpEmitTimestamp (
+    __inout PUSN_OUTPUT pOut,
+    __in LONGLONG ticks,
+    __in DWORD format )
+{
+    uint8_t* p = _UsnpReserveOutput(pOut, 40);
+    size_t length;
 
-    cchtimestamp = _countof(timestamp);
-    if( _UsnpFormatTimestamp(&(pRecord->TimeStamp), timestamp, cchtimestamp) == FALSE)
+    if(p == NULL)
     {
-        _snwprintf_s(timestamp, cchtimestamp, cchtimestamp, L"[error(%X)]", GetLastError());
+        /*++ last error set by call ... */
+        return FALSE;
     }
 
-    cchbuffer = _countof(buffer);
-    if( _UsnpGetFilenameFromFileId(osh, &(pRecord->ParentFileReferenceNumber), buffer, cchbuffer) == FALSE)
+    length = _UsnpPutTimestamp(p, ticks, format);
+    if(length == 0)
     {
-        _snwprintf_s(buffer, cchbuffer, cchbuffer, L"[error(%X)]", GetLastError());
+        /*++ last error set by call ... */
+        return FALSE;
     }
+    pOut->Length += length;
+    return TRUE;
+}
 
-    wprintf (
-     L">>>>>>>>\n"
-     L"  FRN                 %016I64X%016I64X\n"
-     L"  Parent FRN          %016I64X%016I64X - %s\n"
-     L"  USN                 %016I64X\n"
-     L"  Reason              %08X\n"
-     L"  Attributes          %08X\n"
-     L"  FileName            %.*s\n"
-     L"  TimeStamp           %016I64X - %s\n",
-     refnum->HighPart, refnum->LowPart,
-     parent->HighPart, parent->LowPart,
-     buffer,
-     pRecord->Usn,
-     pRecord->Reason,
-     pRecord->FileAttributes,
-     cchfilename,
-     filename,
-     pRecord->TimeStamp.QuadPart,
-     timestamp
-     );
+/*++ "[error(%X)]", the way a field that could not be had is shown ... */
+void
+_UsnpEmitError (
+    __inout PUSN_OUTPUT pOut,
+    __in DWORD error )
+{
+    uint8_t digits[8];
+    DWORD skip = 0;
 
-    if(g_dump)
+    _UsnpPutHex(digits, error, 8);
+    while((skip < 7) && (digits[skip] == '0'))
     {
-        /*++ hex-dump record, if desired ... */
-        _UsnpDump((uint8_t*)pRecord, pRecord->RecordLength);
+        skip++;
     }
 
-    return TRUE;
+    _USN_EMIT(pOut, "[error(");
+    _UsnpEmitText(pOut, (const char*)(digits + skip), sizeof(digits) - skip);
+    _USN_EMIT(pOut, ")]");
+}
+
+#if defined(_WIN32)
+DWORD WINAPI
+_UsnpThreadStart (
+    LPVOID Parameter )
+{
+    PUSN_THREAD pThread = (PUSN_THREAD)Parameter;
+    return pThread->Routine(pThread->Context);
 }
+#else
+void*
+_UsnpThreadStart (
+    void* Parameter )
+{
+    PUSN_THREAD pThread = (PUSN_THREAD)Parameter;
+    return (void*)(uintptr_t)pThread->Routine(pThread->Context);
+}
+#endif  /* _WIN32 */
 
 /*++
  */
 BOOL
-_UsnpFormatRecordV4 (
-    __in HANDLE osh,
-    __in USN_RECORD_V4* pRecord )
+_UsnpCreateThread (
+    __in PUSN_THREAD_ROUTINE Routine,
+    __in void* Context,
+    __out PUSN_THREAD pThread )
 {
-    /*++ check ptr ... */
-    if(pRecord == NULL)
+    if((Routine == NULL) || (pThread == NULL))
     {
         SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
 
-    UNREFERENCED_PARAMETER(osh);
-    SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
-    return FALSE;
-}
+    pThread->Routine = Routine;
+    pThread->Context = Context;
 
-/*++
- */
-BOOL
-_UsnpIsEqualFileReference (
-    FILE_ID_128* pfid1,
-    FILE_ID_128* pfid2 )
-{
-    if((pfid1 == NULL) || (pfid2 == NULL))
+#if defined(_WIN32)
+    pThread->Handle = CreateThread(NULL, 0, _UsnpThreadStart, pThread, 0, NULL);
+    if(pThread->Handle == NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
+        /*++ last error set by call ... */
         return FALSE;
     }
-    if(memcmp((void*)pfid1, (void*)pfid2, sizeof(FILE_ID_128)) == 0)
+#else
     {
-        return TRUE;
+        int error = pthread_create(&(pThread->Thread), NULL, _UsnpThreadStart, pThread);
+        if(error != 0)
+        {
+            SetLastError(_UsnpErrnoToError(error));
+            return FALSE;
+        }
     }
-    return FALSE;
+#endif  /* _WIN32 */
+    return TRUE;
+}
+
+/*++ wait for a thread and return its exit code ... */
+DWORD
+_UsnpJoinThread (
+    __in PUSN_THREAD pThread )
+{
+    DWORD code = 0;
+
+#if defined(_WIN32)
+    WaitForSingleObject(pThread->Handle, INFINITE);
+    GetExitCodeThread(pThread->Handle, &code);
+    CloseHandle(pThread->Handle);
+    pThread->Handle = NULL;
+#else
+    void* result = NULL;
+    pthread_join(pThread->Thread, &result);
+    code = (DWORD)(uintptr_t)result;
+#endif  /* _WIN32 */
+    return code;
 }
 
 /*++
  */
-BOOL
-_UsnpGetFileIdFromFilename (
-    __in wchar_t* filename,
-    __out FILE_ID_128* pFileId )
+void
+_UsnpInitLock (
+    __out PUSN_LOCK pLock,
+    __out_opt PUSN_COND pCond )
 {
-    BOOL status = FALSE;
-    HANDLE osfh = NULL;
-
-    if((filename == NULL) || (pFileId == NULL))
+#if defined(_WIN32)
+    InitializeSRWLock(pLock);
+    if(pCond != NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        InitializeConditionVariable(pCond);
     }
-
-    osfh = CreateFileW(
-     filename, 
-     (GENERIC_READ | SYNCHRONIZE | FILE_READ_ATTRIBUTES),
-     (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE),
-     NULL, 
-     OPEN_EXISTING, 
-     (FILE_FLAG_NO_BUFFERING | FILE_FLAG_BACKUP_SEMANTICS),
-     NULL
-     );
-
-    if(osfh != NULL)
+#else
+    pthread_mutex_init(pLock, NULL);
+    if(pCond != NULL)
     {
-        status = _UsnpGetFileIdFromHandle(osfh, pFileId);
-        CloseHandle(osfh);
+        pthread_cond_init(pCond, NULL);
     }
-    return status;
+#endif  /* _WIN32 */
 }
 
 /*++
  */
-BOOL
-_UsnpGetFileIdFromHandle (
-    __in HANDLE osfh,
-    __out FILE_ID_128* pFileId )
+void
+_UsnpDeleteLock (
+    __in PUSN_LOCK pLock,
+    __in_opt PUSN_COND pCond )
 {
-    BY_HANDLE_FILE_INFORMATION FileInfo = {0};
-
-    if((osfh == NULL) || (pFileId == NULL))
+#if defined(_WIN32)
+    /*++ nothing to release for slim locks ... */
+    UNREFERENCED_PARAMETER(pLock);
+    UNREFERENCED_PARAMETER(pCond);
+#else
+    if(pCond != NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        pthread_cond_destroy(pCond);
     }
+    pthread_mutex_destroy(pLock);
+#endif  /* _WIN32 */
+}
 
-    if( GetFileInformationByHandle(osfh, &FileInfo) == FALSE)
-    {
-        /*++ last error set by call ... */
-        return FALSE;
-    }
+/*++
+ */
+void
+_UsnpAcquireLock (
+    __in PUSN_LOCK pLock )
+{
+#if defined(_WIN32)
+    AcquireSRWLockExclusive(pLock);
+#else
+    pthread_mutex_lock(pLock);
+#endif  /* _WIN32 */
+}
 
-    LARGE_INTEGER st_index = {0};
-    st_index.LowPart = FileInfo.nFileIndexLow;
-    st_index.HighPart = FileInfo.nFileIndexHigh;
+/*++
+ */
+void
+_UsnpReleaseLock (
+    __in PUSN_LOCK pLock )
+{
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive(pLock);
+#else
+    pthread_mutex_unlock(pLock);
+#endif  /* _WIN32 */
+}
 
-    LARGE_INTEGER128 st_fid = {0};
-    st_fid.LowPart = st_index.QuadPart;
+/*++
+ */
+void
+_UsnpWaitCond (
+    __in PUSN_COND pCond,
+    __in PUSN_LOCK pLock )
+{
+#if defined(_WIN32)
+    SleepConditionVariableSRW(pCond, pLock, INFINITE, 0);
+#else
+    pthread_cond_wait(pCond, pLock);
+#endif  /* _WIN32 */
+}
 
-    RtlMoveMemory(pFileId, &st_fid, sizeof(LARGE_INTEGER128));
+/*++
+ */
+void
+_UsnpWakeCond (
+    __in PUSN_COND pCond )
+{
+#if defined(_WIN32)
+    WakeAllConditionVariable(pCond);
+#else
+    pthread_cond_broadcast(pCond);
+#endif  /* _WIN32 */
+}
 
-    return TRUE;
+/*++ a load that later loads and stores are not moved ahead of ... */
+int64_t
+_UsnpLoadAcquire (
+    __in volatile int64_t* pValue )
+{
+#if defined(_WIN32)
+    return InterlockedCompareExchange64((volatile LONG64*)pValue, 0, 0);
+#else
+    return __atomic_load_n(pValue, __ATOMIC_ACQUIRE);
+#endif  /* _WIN32 */
+}
+
+/*++ a store that earlier loads and stores are not moved past ... */
+void
+_UsnpStoreRelease (
+    __out volatile int64_t* pValue,
+    __in int64_t Value )
+{
+#if defined(_WIN32)
+    InterlockedExchange64((volatile LONG64*)pValue, Value);
+#else
+    __atomic_store_n(pValue, Value, __ATOMIC_RELEASE);
+#endif  /* _WIN32 */
 }
 
 /*++
  */
-BOOL
-_UsnpGetFilenameFromFileId (
-    __in HANDLE osh,
-    __in FILE_ID_128* pFileId,
-    __out_ecount(cchbuffer) wchar_t* buffer,
-    __in size_t cchbuffer )
+DWORD
+_UsnpGetProcessorCount (
+    void )
 {
-    DWORD length;
-    HANDLE osfh;
-    FILE_ID_DESCRIPTOR id = {0};
+#if defined(_WIN32)
+    SYSTEM_INFO info = {0};
+    GetSystemInfo(&info);
+    return ((info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1);
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return ((count > 0) ? (DWORD)count : 1);
+#endif  /* _WIN32 */
+}
 
-    /*++ check ptr and buffer ... */
-    if((pFileId == NULL) || (buffer == NULL))
+/*++ monotonic clock, microseconds ... */
+uint64_t
+_UsnpQueryClock (
+    void )
+{
+#if defined(_WIN32)
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER counter;
+
+    if(frequency.QuadPart == 0)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        QueryPerformanceFrequency(&frequency);
     }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((counter.QuadPart / frequency.QuadPart) * 1000000LL) +
+           (uint64_t)(((counter.QuadPart % frequency.QuadPart) * 1000000LL) / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000ULL);
+#endif  /* _WIN32 */
+}
 
-    id.dwSize = sizeof(id);
-    id.Type = ExtendedFileIdType;
-    RtlMoveMemory(&(id.ExtendedFileId), pFileId, sizeof(FILE_ID_128));
-
-    osfh = OpenFileById (
-     osh,
-     &id,
-     0,
-     (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE),
-     NULL,
-     (FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT)
-     );
+/*++ wall clock as nt time, 100ns units since 1601 ... */
+LONGLONG
+_UsnpQuerySystemTime (
+    void )
+{
+#if defined(_WIN32)
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return (LONGLONG)(((DWORDLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (((LONGLONG)ts.tv_sec + 11644473600LL) * 10000000LL) + (LONGLONG)(ts.tv_nsec / 100);
+#endif  /* _WIN32 */
+}
 
-    if(osfh == NULL)
-    {
-        /*++ last error set by call ... */
-        return FALSE;
-    }
+/*++
+ */
+void
+_UsnpSleep (
+    __in uint64_t microseconds )
+{
+#if defined(_WIN32)
+    Sleep((DWORD)((microseconds + 999) / 1000));
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t)(microseconds / 1000000ULL);
+    ts.tv_nsec = (long)((microseconds % 1000000ULL) * 1000ULL);
+    nanosleep(&ts, NULL);
+#endif  /* _WIN32 */
+}
 
-    length = GetFinalPathNameByHandleW(osfh, buffer, (DWORD)cchbuffer, (FILE_NAME_NORMALIZED | VOLUME_NAME_DOS));
+/*++ give up the rest of the time slice to any thread ready to run ... */
+void
+_UsnpYield (
+    void )
+{
+#if defined(_WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif  /* _WIN32 */
+}
 
-    CloseHandle(osfh);
-    
-    if((length == 0) || (length > cchbuffer))
-    {
-        SetLastError(ERROR_INSUFFICIENT_BUFFER);
-        return FALSE;
-    }
-    return TRUE;
+/*++ SIGINT while following; the reader stops after the read in progress ... */
+void
+_UsnpStopSignal (
+    __in int number )
+{
+    UNREFERENCED_PARAMETER(number);
+    g_stop = 1;
 }
 
 /*++
  */
 BOOL
-_UsnpFormatTimestamp (
-    __in LARGE_INTEGER* pTimeStamp,
-    __out_ecount(cchbuffer) wchar_t* buffer,
-    __in size_t cchbuffer )
+_UsnpFormatStats (
+    __in PUSN_STATS pStats )
 {
-    int length;
-    FILETIME rectime = {0};
-    SYSTEMTIME systime = {0};
-
-    /*++
-     * nt timestamps are 100-nanosecond intervals since 1601-01-01. this
-     * code formats such a time in the typical way. if desired, the time
-     * can be converted to a unix epoch and formatted using a c-runtime
-     * function such as ctime() ...
-     */
+    double seconds;
 
-    if((pTimeStamp == NULL) || (buffer == NULL))
+    if(pStats == NULL)
     {
         SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
 
-    rectime.dwLowDateTime  = pTimeStamp->LowPart;
-    rectime.dwHighDateTime = pTimeStamp->HighPart;
-
-    if( FileTimeToSystemTime(&rectime, &systime) == FALSE)
+    seconds = (double)(_UsnpQueryClock() - pStats->Start) / 1000000.0;
+    if(seconds <= 0.0)
     {
-        /*++ last error set by call ... */
-        return FALSE;
+        seconds = 0.000001;
     }
 
-    length = _snwprintf_s (
-     buffer,
-     cchbuffer,
-     cchbuffer,
-     L"%u-%02u-%02u %02u:%02u:%02u.%03u",
-     systime.wYear, systime.wMonth, systime.wDay,
-     systime.wHour, systime.wMinute, systime.wSecond, systime.wMilliseconds
+    fwprintf(stderr,
+     L"STATS\n"
+     L"  Records             %llu\n"
+     L"  Bytes               %llu\n"
+     L"  Reads               %llu\n"
+     L"  Skipped             %llu\n"
+     L"  Corrupt Pages       %llu\n"
+     L"  Unwatched           %llu\n"
+     L"  Filtered            %llu\n"
+     L"  Prefiltered         %llu\n"
+     L"  Coalesced           %llu (%llu evicted, %llu still open)\n"
+     L"  Moves               %llu (%llu unpaired)\n"
+     L"  Path Hits           %llu (%llu negative)\n"
+     L"  Path Misses         %llu\n"
+     L"  Path Evictions      %llu\n"
+     L"  Tree Hits           %llu\n"
+     L"  Tree Misses         %llu\n"
+     L"  Tree Entries        %llu (%llu bytes)\n"
+     L"  First USN           %016llX\n"
+     L"  Last USN            %016llX\n"
+     L"  Elapsed             %.3f s\n"
+     L"  Records/s           %.0f\n"
+     L"  MB/s                %.1f\n",
+     (unsigned long long)pStats->Records,
+     (unsigned long long)pStats->Bytes,
+     (unsigned long long)pStats->Reads,
+     (unsigned long long)pStats->Skipped,
+     (unsigned long long)pStats->Corrupt,
+     (unsigned long long)pStats->Unwatched,
+     (unsigned long long)pStats->Filtered,
+     (unsigned long long)pStats->Prefiltered,
+     (unsigned long long)pStats->Coalesced,
+     (unsigned long long)pStats->CoalesceEvicted,
+     (unsigned long long)pStats->CoalescePending,
+     (unsigned long long)pStats->Moves,
+     (unsigned long long)pStats->MovesUnpaired,
+     (unsigned long long)pStats->PathHits,
+     (unsigned long long)pStats->PathNegative,
+     (unsigned long long)pStats->PathMisses,
+     (unsigned long long)pStats->PathEvicted,
+     (unsigned long long)pStats->TreeHits,
+     (unsigned long long)pStats->TreeMisses,
+     (unsigned long long)pStats->TreeEntries,
+     (unsigned long long)pStats->TreeBytes,
+     pStats->FirstUsn,
+     pStats->LastUsn,
+     seconds,
+     (double)pStats->Records / seconds,
+     ((double)pStats->Bytes / (1024.0 * 1024.0)) / seconds
      );
 
-    if((size_t)length >= cchbuffer)
+    if(pStats->PipeSlots > 0)
     {
-        /*++ the call null-term's at buf[cch-1] ... */
-        SetLastError(ERROR_INSUFFICIENT_BUFFER);
-        return FALSE;
+        fwprintf(stderr,
+         L"  Pipeline            %llu slots; waits reader %llu, walk %llu, writer %llu\n",
+         (unsigned long long)pStats->PipeSlots,
+         (unsigned long long)pStats->PipeWaits[0],
+         (unsigned long long)pStats->PipeWaits[1],
+         (unsigned long long)pStats->PipeWaits[2]
+         );
+    }
+
+    if(pStats->LatencyRecords > 0)
+    {
+        fwprintf(stderr,
+         L"  Latency             %.3f ms average, %.3f ms max\n",
+         ((double)pStats->LatencyTotal / (double)pStats->LatencyRecords) / 1000.0,
+         (double)pStats->LatencyMax / 1000.0
+         );
     }
     return TRUE;
 }
 
+#if !defined(_WIN32)
 /*++
+ * off-windows entry point; arguments arrive in the locale's multibyte
+ * encoding and are widened for wmain ...
  */
-BOOL
-_UsnpDump (
-    __in_ecount(buffersize) uint8_t* buffer,
-    __in int buffersize )
+int
+main (
+    int argc,
+    char** argv )
 {
-    if(buffer == NULL)
+    wchar_t** wargv;
+
+    setlocale(LC_ALL, "");
+    if(MB_CUR_MAX == 1)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        /*++ names are unicode; the "C" locale cannot print them ... */
+        setlocale(LC_CTYPE, "C.UTF-8");
     }
 
-    fwprintf(stdout, L"DUMP %d BYTES AT =A'%p\n", buffersize, buffer);
-    fwprintf(stdout, L"ADDRESS   OFFSET     0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F | 0123456789ABCDEF |\n");
-
-    for(int index=0; index<buffersize; index += 16)
+    wargv = (wchar_t**)_UsnpAlloc((argc + 1) * sizeof(wchar_t*));
+    if(wargv == NULL)
     {
-        fwprintf(stdout, L"%p  %08X  ", (buffer + index), index);
-        for(int jndex=0; jndex<16; jndex++)
-        {
-            if((index + jndex) < buffersize)
-            {
-                fwprintf(stdout, L"%02X ", (uint8_t)buffer[(index + jndex)]);
-            }
-            else
-            {
-                fwprintf(stdout, L"%*C ", (int)(sizeof(uint8_t) * 2), ' ');
-            }
-        }
-
-        fwprintf(stdout, L"| ");
-        for(int kndex=0; kndex<16; kndex++ )
-        {
-            uint8_t ch = buffer[(index + kndex)];
-            if((index + kndex) < buffersize)
-            {
-                fwprintf(stdout, L"%C", (((ch < 0x20) || (ch > 0x7F)) ? '.' : ch));
-            }
-            else
-            {
-                fwprintf(stdout, L" ");
-            }
-        }
-        fwprintf(stdout, L" |\n");
+        return 1;
     }
-    return TRUE;
-}
 
-/*++
- */
-int
-__wtoi (
-    __in const wchar_t* str )
-{
-    int n = 0;
-    int signum = 0;
-    for(;; str++)
+    for(int index=0; index<argc; index++)
     {
-        switch(*str)
+        size_t length = mbstowcs(NULL, argv[index], 0);
+        if(length == (size_t)-1)
         {
-        case L' ':
-        case L'\t': continue;
-        case L'-':  signum++;
-        case L'+':  str++;
+            fprintf(stderr, "invalid argument %d\n", index);
+            return 1;
         }
-        break;
-    }
-    while((*str >= L'0') && (*str <= L'9'))
-    {
-        n = n * 10 + *str++ - L'0';
+        wargv[index] = (wchar_t*)_UsnpAlloc((length + 1) * sizeof(wchar_t));
+        if(wargv[index] == NULL)
+        {
+            return 1;
+        }
+        mbstowcs(wargv[index], argv[index], length + 1);
     }
-    return ((signum != 0) ? -n : n);
+    return wmain(argc, wargv);
 }
+#endif  /* !_WIN32 */